@@ -46,6 +46,9 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "CAPE.h"
 #include "Debugger.h"
 #include "YaraHarness.h"
+#include "PEScan.h"
+#include "XorScan.h"
+#include "DumpStream.h"
 #include "..\alloc.h"
 #include "..\pipe.h"
 #include "..\config.h"
@@ -878,79 +881,115 @@ double GetEntropy(PUCHAR Buffer)
 int DumpXorPE(LPBYTE Buffer, unsigned int Size)
 //**************************************************************************************
 {
-	LONG e_lfanew;
-	DWORD NT_Signature;
-	unsigned int i, j, k;
-	BYTE* DecryptedBuffer = NULL;
+	PIMAGE_DOS_HEADER pDosHeader;
+	PIMAGE_NT_HEADERS pNtHeader;
+	BYTE Header[PE_HEADER_LIMIT + sizeof(IMAGE_NT_HEADERS)];
+	BYTE *Headers, *DecryptedBuffer = NULL;
+	XORSCAN_KEY Key;
+	size_t Offset = 0, HeaderSize, HeadersEnd;
+	BOOL Valid;
+	int RetVal = FALSE;
 
-	for (i=0; i<=0xFF; i++)
+	// The key is derived from known DOS header plaintext at each offset, so a
+	// single pass covers every single-byte key and 2, 4 or 8 byte rolling keys
+	while (1)
 	{
-		// check for the DOS signature a.k.a MZ header
-		if ((*Buffer^(BYTE)i) == 'M' && (*(Buffer+1)^(BYTE)i) == 'Z')
+		__try
 		{
-			DebugOutput("MZ header found with bytewise XOR key 0x%.2x\n", i);
-
-			e_lfanew = (LONG)*(DWORD*)(Buffer+0x3c);
-
-			DebugOutput("Encrypted e_lfanew: 0x%x", e_lfanew);
-
-			for (j=0; j<sizeof(LONG); j++)
-				*((BYTE*)&e_lfanew+j) = *((BYTE*)&e_lfanew+j)^i;
-
-			DebugOutput("Decrypted e_lfanew: 0x%x", e_lfanew);
+			if (!XorScanFindPE(Buffer, Size, Offset, &Offset, &Key))
+				break;
+		}
+		__except(EXCEPTION_EXECUTE_HANDLER)
+		{
+			DebugOutput("DumpXorPE: Exception occurred scanning buffer at 0x%p\n", Buffer);
+			break;
+		}
 
-			if ((unsigned int)e_lfanew > PE_HEADER_LIMIT)
-			{
-				DebugOutput("The pointer to the PE header seems a tad large: 0x%x", e_lfanew);
-				//return FALSE;
-			}
+		if (Key.Length == 1)
+			DebugOutput("DumpXorPE: MZ header found at offset 0x%x with bytewise XOR key 0x%.2x\n", Offset, Key.Bytes[0]);
+		else
+		{
+			char KeyString[2 * XORSCAN_MAX_KEY + 1];
+			for (unsigned int i = 0; i < Key.Length; i++)
+				sprintf(KeyString + 2 * i, "%.2x", Key.Bytes[i]);
+			DebugOutput("DumpXorPE: MZ header found at offset 0x%x with %d-byte XOR key 0x%s\n", Offset, Key.Length, KeyString);
+		}
 
-			// let's get the NT signature a.k.a PE header
-			memcpy(&NT_Signature, Buffer+e_lfanew, 4);
+		// Only the headers are decoded to test the candidate, the DOS and NT
+		// headers first, then the section table if it runs past them
+		HeaderSize = min(sizeof(Header), Size - Offset);
+		Valid = FALSE;
 
-			DebugOutput("Encrypted NT_Signature: 0x%x", NT_Signature);
+		__try
+		{
+			XorScanDecode(Header, Buffer + Offset, HeaderSize, &Key);
+		}
+		__except(EXCEPTION_EXECUTE_HANDLER)
+		{
+			DebugOutput("DumpXorPE: Exception occurred decrypting buffer at 0x%p\n", Buffer + Offset);
+			return FALSE;
+		}
 
-			// let's try decrypting it with the key
-			for (k=0; k<4; k++)
-				*((BYTE*)&NT_Signature+k) = *((BYTE*)&NT_Signature+k)^i;
+		pDosHeader = (PIMAGE_DOS_HEADER)Header;
 
-			DebugOutput("Encrypted NT_Signature: 0x%x", NT_Signature);
+		if (HeaderSize >= sizeof(IMAGE_DOS_HEADER) && pDosHeader->e_lfanew && (ULONG)pDosHeader->e_lfanew < PE_HEADER_LIMIT && ((ULONG)pDosHeader->e_lfanew & 3) == 0
+			&& (ULONG)pDosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS) <= HeaderSize)
+		{
+			pNtHeader = (PIMAGE_NT_HEADERS)(Header + pDosHeader->e_lfanew);
+			HeadersEnd = (ULONG)pDosHeader->e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) + pNtHeader->FileHeader.SizeOfOptionalHeader
+				+ (size_t)pNtHeader->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
 
-			// does it check out?
-			if (NT_Signature == IMAGE_NT_SIGNATURE)
+			if (HeadersEnd <= HeaderSize)
+				Valid = TestPERequirements(pNtHeader);
+			else if (HeadersEnd <= Size - Offset && (Headers = (BYTE*)malloc(HeadersEnd)) != NULL)
 			{
-				DebugOutput("Xor-encrypted PE detected, about to dump.\n");
-
-				DecryptedBuffer = (BYTE*)malloc(Size);
-
-				if (DecryptedBuffer == NULL)
+				__try
+				{
+					XorScanDecode(Headers, Buffer + Offset, HeadersEnd, &Key);
+					Valid = TestPERequirements((PIMAGE_NT_HEADERS)(Headers + pDosHeader->e_lfanew));
+				}
+				__except(EXCEPTION_EXECUTE_HANDLER)
 				{
-					ErrorOutput("Error allocating memory for decrypted PE binary");
-					return FALSE;
+					DebugOutput("DumpXorPE: Exception occurred decrypting buffer at 0x%p\n", Buffer + Offset);
 				}
+				free(Headers);
+			}
+		}
 
-				memcpy(DecryptedBuffer, Buffer, Size);
+		if (Valid)
+		{
+			DebugOutput("Xor-encrypted PE detected, about to dump.\n");
 
-				for (k=0; k<Size; k++)
-					*(DecryptedBuffer+k) = *(DecryptedBuffer+k)^i;
+			DecryptedBuffer = (BYTE*)malloc(Size - Offset);
 
-				CapeMetaData->Address = DecryptedBuffer;
-				DumpImageInCurrentProcess(DecryptedBuffer);
+			if (DecryptedBuffer == NULL)
+			{
+				ErrorOutput("Error allocating memory for decrypted PE binary");
+				return FALSE;
+			}
 
-				free(DecryptedBuffer);
-				return i;
+			__try
+			{
+				XorScanDecode(DecryptedBuffer, Buffer + Offset, Size - Offset, &Key);
 			}
-			else
+			__except(EXCEPTION_EXECUTE_HANDLER)
 			{
-				DebugOutput("PE signature invalid, looks like a false positive.\n");
+				DebugOutput("DumpXorPE: Exception occurred decrypting buffer at 0x%p\n", Buffer + Offset);
+				free(DecryptedBuffer);
 				return FALSE;
 			}
+
+			CapeMetaData->Address = DecryptedBuffer;
+			if (DumpImageInCurrentProcess(DecryptedBuffer))
+				RetVal = TRUE;
+
+			free(DecryptedBuffer);
+			return RetVal;
 		}
-	}
 
-	// We free can free DecryptedBuffer as it's no longer needed
-	if(DecryptedBuffer)
-		free(DecryptedBuffer);
+		DebugOutput("PE signature invalid, looks like a false positive.\n");
+		Offset++;
+	}
 
 	return FALSE;
 }
@@ -1006,12 +1045,17 @@ SIZE_T ScanForAccess(PVOID Buffer, SIZE_T Size)
 		return 0;
 	}
 
+	if (!SystemInfo.dwPageSize)
+		GetSystemInfo(&SystemInfo);
+
+	// access is page-granular, so touch one byte per page
 	__try
 	{
-		for (p=0; p<Size; p++)
+		for (p=0; p<Size; p = (SIZE_T)GetPageAddress((char*)Buffer+p) + SystemInfo.dwPageSize - (SIZE_T)Buffer)
 		{
-			char c = *((char*)Buffer+p);
+			volatile char c = *((char*)Buffer+p);
 		}
+		p = Size;
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
@@ -1120,13 +1164,29 @@ PVOID GetPageAddress(PVOID Address)
 
 }
 
+//**************************************************************************************
+static int ValidatePECandidate(const unsigned char *Candidate, void *Context)
+//**************************************************************************************
+{
+	// PEScanFindCandidate has already matched 'MZ' and the 'PE' signature
+	PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)(Candidate + (ULONG)((PIMAGE_DOS_HEADER)Candidate)->e_lfanew);
+
+	if ((pNtHeader->FileHeader.Machine == 0) || (pNtHeader->FileHeader.SizeOfOptionalHeader == 0 || pNtHeader->OptionalHeader.SizeOfHeaders == 0))
+	{
+		// Basic requirements
+		DebugOutput("ScanForPE: Basic requirements failure.\n");
+		return 0;
+	}
+
+	return 1;
+}
+
 //**************************************************************************************
 int ScanForPE(PVOID Buffer, SIZE_T Size, PVOID* Offset)
 //**************************************************************************************
 {
-	SIZE_T p;
-	PIMAGE_DOS_HEADER pDosHeader;
-	PIMAGE_NT_HEADERS pNtHeader;
+	size_t p = 0;
+	int RetVal;
 
 	if (!Buffer || !Size)
 	{
@@ -1134,48 +1194,24 @@ int ScanForPE(PVOID Buffer, SIZE_T Size, PVOID* Offset)
 		return 0;
 	}
 
-	for (p=0; p<Size-1; p++)
+	__try
 	{
-		__try
-		{
-			if (*((char*)Buffer+p) == 'M' && *((char*)Buffer+p+1) == 'Z')
-			{
-				pDosHeader = (PIMAGE_DOS_HEADER)((char*)Buffer+p);
-
-				if ((ULONG)pDosHeader->e_lfanew == 0)
-					// e_lfanew is zero
-					continue;
-
-				if ((ULONG)pDosHeader->e_lfanew > Size-p)
-					// e_lfanew points beyond end of region
-					continue;
-
-				pNtHeader = (PIMAGE_NT_HEADERS)((PUCHAR)pDosHeader + (ULONG)pDosHeader->e_lfanew);
-
-				if (pNtHeader->Signature != IMAGE_NT_SIGNATURE)
-					// No 'PE' header
-					continue;
-
-				if ((pNtHeader->FileHeader.Machine == 0) || (pNtHeader->FileHeader.SizeOfOptionalHeader == 0 || pNtHeader->OptionalHeader.SizeOfHeaders == 0))
-				{
-					// Basic requirements
-					DebugOutput("ScanForPE: Basic requirements failure.\n");
-					continue;
-				}
+		RetVal = PEScanFindCandidate((const unsigned char*)Buffer, Size, Size-1, PESCAN_MODE_MZ, ValidatePECandidate, NULL, &p);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		DebugOutput("ScanForPE: Exception occurred scanning memory at 0x%p\n", Buffer);
+		return 0;
+	}
 
-				if (Offset)
-					*Offset = (PVOID)((char*)Buffer+p);
+	if (RetVal > 0)
+	{
+		if (Offset)
+			*Offset = (PVOID)((char*)Buffer+p);
 
-				//DebugOutput("ScanForPE: PE image located at: 0x%x\n", (DWORD_PTR)((char*)Buffer+p));
+		//DebugOutput("ScanForPE: PE image located at: 0x%x\n", (DWORD_PTR)((char*)Buffer+p));
 
-				return 1;
-			}
-		}
-		__except(EXCEPTION_EXECUTE_HANDLER)
-		{
-			DebugOutput("ScanForPE: Exception occurred reading memory address 0x%p\n", (DWORD_PTR)((char*)Buffer+p));
-			return 0;
-		}
+		return 1;
 	}
 
 	DebugOutput("ScanForPE: No PE image located at 0x%x.\n", Buffer);
@@ -1341,12 +1377,19 @@ int IsDisguisedPEHeader(PVOID Buffer)
 	return 0;
 }
 
+//**************************************************************************************
+static int ValidateDisguisedPECandidate(const unsigned char *Candidate, void *Context)
+//**************************************************************************************
+{
+	return IsDisguisedPEHeader((PVOID)Candidate);
+}
+
 //**************************************************************************************
 int ScanForDisguisedPE(PVOID Buffer, SIZE_T Size, PVOID* Offset)
 //**************************************************************************************
 {
-	SIZE_T p, AccessibleSize;
-	BOOL PEDetected;
+	SIZE_T AccessibleSize;
+	size_t p = 0;
 	int RetVal;
 
 	if (Size == 0)
@@ -1370,26 +1413,35 @@ int ScanForDisguisedPE(PVOID Buffer, SIZE_T Size, PVOID* Offset)
 		return 0;
 	}
 
-	PEDetected = FALSE;
-
 	AccessibleSize = ScanForAccess(Buffer, Size);
 	if (Size > AccessibleSize)
 		Size = AccessibleSize;
 
-	// we want to stop short of the max look-ahead in IsDisguisedPEHeader
-	for (p=0; p < Size - SystemInfo.dwPageSize; p++)
+	if (Size <= SystemInfo.dwPageSize)
 	{
-		RetVal = IsDisguisedPEHeader((PVOID)((BYTE*)Buffer+p));
+		DebugOutput("ScanForDisguisedPE: Accessible size too small.\n");
+		return 0;
+	}
 
-		if (!RetVal)
-			continue;
-		else if (RetVal == -1)
-		{
-			DebugOutput("ScanForDisguisedPE: Exception occurred scanning buffer at 0x%x\n", (BYTE*)Buffer+p);
-			GetMemoryInfo((BYTE*)Buffer+p);
-			return 0;
-		}
+	// we want to stop short of the max look-ahead in IsDisguisedPEHeader, and
+	// only offsets passing the candidate filter get the full validation
+	__try
+	{
+		RetVal = PEScanFindCandidate((const unsigned char*)Buffer, Size, Size - SystemInfo.dwPageSize, PESCAN_MODE_DISGUISED, ValidateDisguisedPECandidate, NULL, &p);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		RetVal = -1;
+	}
 
+	if (RetVal == -1)
+	{
+		DebugOutput("ScanForDisguisedPE: Exception occurred scanning buffer at 0x%x\n", (BYTE*)Buffer+p);
+		GetMemoryInfo((BYTE*)Buffer+p);
+		return 0;
+	}
+	else if (RetVal)
+	{
 		if (Offset)
 			*Offset = (PVOID)((BYTE*)Buffer+p);
 
@@ -1534,36 +1586,55 @@ BOOL DumpPEsInRange(PVOID Buffer, SIZE_T Size)
 	return FALSE;
 }
 
-//**************************************************************************************
-int DumpMemoryRaw(PVOID Buffer, SIZE_T Size)
-//**************************************************************************************
+static int DumpStreamRead(void *Context, size_t Offset, unsigned char *Out, size_t Length)
 {
-	DWORD dwBytesWritten;
-	HANDLE hOutputFile;
-	PVOID BufferCopy = NULL;
-	char *FullPathName = NULL;
-	int ret = 0;
-
-	BufferCopy = (PVOID)((BYTE*)malloc(Size));
-
-	if (BufferCopy == NULL)
-	{
-		DebugOutput("DumpMemory: Failed to allocate 0x%x bytes for buffer copy.\n", Size);
-		goto end;
-	}
-
 	__try
 	{
-		memcpy(BufferCopy, Buffer, Size);
+		memcpy(Out, (PUCHAR)Context + Offset, Length);
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
-		DebugOutput("DumpMemory: Exception occurred reading memory address 0x%p\n", Buffer);
-		goto end;
+		return 0;
 	}
 
+	return 1;
+}
+
+static int DumpStreamWrite(void *Context, const unsigned char *Data, size_t Length)
+{
+	DWORD dwBytesWritten;
+
+	while (Length)
+	{
+		if (!WriteFile((HANDLE)Context, Data, (DWORD)Length, &dwBytesWritten, NULL) || !dwBytesWritten)
+			return 0;
+		Data += dwBytesWritten;
+		Length -= dwBytesWritten;
+	}
+
+	return 1;
+}
+
+// Staging buffer shared by dumps; a dump that finds it in use allocates its own
+static BYTE DumpStreamBuffer[DUMP_STREAM_BUFFER_SIZE];
+static volatile LONG DumpStreamBufferBusy;
+
+//**************************************************************************************
+int DumpMemoryRaw(PVOID Buffer, SIZE_T Size)
+//**************************************************************************************
+{
+	HANDLE hOutputFile;
+	PBYTE StagingBuffer;
+	DUMP_STREAM_RESULT Result;
+	char *FullPathName = NULL;
+	BOOL SharedBuffer = FALSE;
+	int ret = 0;
+
 	FullPathName = GetName();
 
+	if (!FullPathName)
+		return 0;
+
 	hOutputFile = CreateFile(FullPathName, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if (hOutputFile == INVALID_HANDLE_VALUE)
@@ -1572,22 +1643,45 @@ int DumpMemoryRaw(PVOID Buffer, SIZE_T Size)
 			DebugOutput("DumpMemory: Payload name exists already: %s", FullPathName);
 		else
 			ErrorOutput("DumpMemory: Could not create Payload");
+		free(FullPathName);
+		return 0;
+	}
+
+	if (!InterlockedExchange(&DumpStreamBufferBusy, 1))
+	{
+		StagingBuffer = DumpStreamBuffer;
+		SharedBuffer = TRUE;
+	}
+	else
+		StagingBuffer = (PBYTE)malloc(DUMP_STREAM_BUFFER_SIZE);
+
+	if (StagingBuffer == NULL)
+	{
+		DebugOutput("DumpMemory: Failed to allocate 0x%x bytes for staging buffer.\n", DUMP_STREAM_BUFFER_SIZE);
 		goto end;
 	}
 
-	dwBytesWritten = 0;
+	// unreadable pages are zero-filled so that offsets in the dump still match the region
+	ret = DumpStream(Size, (DWORD_PTR)Buffer & (DUMP_STREAM_PAGE - 1), DUMP_STREAM_ZERO_FILL, StagingBuffer, DUMP_STREAM_BUFFER_SIZE, DumpStreamRead, Buffer, DumpStreamWrite, hOutputFile, &Result);
 
-	if (FALSE == WriteFile(hOutputFile, BufferCopy, (DWORD)Size, &dwBytesWritten, NULL))
+	if (SharedBuffer)
+		InterlockedExchange(&DumpStreamBufferBusy, 0);
+	else
+		free(StagingBuffer);
+
+	if (!ret)
 	{
-		ErrorOutput("DumpMemory: WriteFile error on Payload");
+		if (Result.Written < Size)
+			ErrorOutput("DumpMemory: WriteFile error on Payload");
+		else
+			DebugOutput("DumpMemory: Exception occurred reading memory address 0x%p\n", Buffer);
 		goto end;
 	}
 
-	ret = 1;
+	if (Result.FaultPages)
+		DebugOutput("DumpMemory: %d unreadable page(s) zero-filled in dump of 0x%p.\n", Result.FaultPages, Buffer);
 
 end:
-	if (BufferCopy)
-		free(BufferCopy);
 	CloseHandle(hOutputFile);
 
 	if (ret)
@@ -1595,11 +1689,12 @@ end:
 		CapeMetaData->Address = Buffer;
 		CapeMetaData->Size = Size;
 		CapeOutputFile(FullPathName);
-		DebugOutput("DumpMemory: Payload successfully created: %s (size %d bytes)", FullPathName, Size);
+		DebugOutput("DumpMemory: Payload successfully created: %s (size %d bytes, hash 0x%016I64x, entropy %.2f)", FullPathName, Size, Result.Hash, Result.Entropy);
 	}
+	else
+		DeleteFile(FullPathName);
 
-	if (FullPathName)
-		free(FullPathName);
+	free(FullPathName);
 
 	return ret;
 }
@@ -0,0 +1,200 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2020-2021 Kevin O'Reilly (kevoreilly@gmail.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <math.h>
+#include "DumpStream.h"
+
+#define HASH_SEED		0x9e3779b97f4a7c15ULL
+#define HASH_MULTIPLIER	0xff51afd7ed558ccdULL
+
+// Incremental form of a word-at-a-time multiply/xorshift hash; bytes are
+// carried between chunks so the result does not depend on how the output
+// was split up.
+typedef struct _STREAM_HASH
+{
+	uint64_t		Hash;
+	uint64_t		Length;
+	unsigned char	Pending[8];
+	unsigned int	PendingLength;
+} STREAM_HASH;
+
+static void HashInit(STREAM_HASH *State)
+{
+	memset(State, 0, sizeof(*State));
+	State->Hash = HASH_SEED;
+}
+
+static void HashWord(STREAM_HASH *State, const unsigned char *p)
+{
+	uint64_t Word;
+
+	memcpy(&Word, p, 8);
+	State->Hash = (State->Hash ^ Word) * HASH_MULTIPLIER;
+	State->Hash ^= State->Hash >> 29;
+}
+
+static void HashUpdate(STREAM_HASH *State, const unsigned char *p, size_t Size)
+{
+	State->Length += Size;
+
+	if (State->PendingLength)
+	{
+		while (Size && State->PendingLength < 8)
+		{
+			State->Pending[State->PendingLength++] = *p++;
+			Size--;
+		}
+
+		if (State->PendingLength < 8)
+			return;
+
+		HashWord(State, State->Pending);
+		State->PendingLength = 0;
+	}
+
+	while (Size >= 8)
+	{
+		HashWord(State, p);
+		p += 8;
+		Size -= 8;
+	}
+
+	memcpy(State->Pending, p, Size);
+	State->PendingLength = (unsigned int)Size;
+}
+
+static uint64_t HashFinal(STREAM_HASH *State)
+{
+	uint64_t Word = 0;
+
+	memcpy(&Word, State->Pending, State->PendingLength);
+	State->Hash = (State->Hash ^ Word ^ State->Length) * HASH_MULTIPLIER;
+	State->Hash ^= State->Hash >> 32;
+
+	return State->Hash;
+}
+
+uint64_t DumpStreamHash(const void *Buffer, size_t Size)
+{
+	STREAM_HASH State;
+
+	HashInit(&State);
+	HashUpdate(&State, (const unsigned char*)Buffer, Size);
+
+	return HashFinal(&State);
+}
+
+static double Entropy(const uint64_t *Counts, uint64_t Total)
+{
+	double Result = 0, p;
+	unsigned int i;
+
+	if (!Total)
+		return 0;
+
+	for (i = 0; i < 256; i++)
+	{
+		if (!Counts[i])
+			continue;
+		p = (double)Counts[i] / (double)Total;
+		Result -= p * log(p) / log(2.0);
+	}
+
+	return Result;
+}
+
+int DumpStream(size_t Size, size_t Phase, DUMP_STREAM_FAULT Fault, unsigned char *Buffer, size_t BufferSize,
+	DUMP_STREAM_READ Read, void *ReadContext, DUMP_STREAM_WRITE Write, void *WriteContext, DUMP_STREAM_RESULT *Result)
+{
+	uint64_t Counts[256];
+	STREAM_HASH Hash;
+	size_t Offset = 0, Fill = 0, Readable = 0, i;
+
+	memset(Result, 0, sizeof(*Result));
+
+	BufferSize -= BufferSize % DUMP_STREAM_PAGE;
+	if (!Buffer || !BufferSize || !Read || !Write)
+		return 0;
+
+	memset(Counts, 0, sizeof(Counts));
+	HashInit(&Hash);
+
+	while (Offset < Size)
+	{
+		size_t Run = BufferSize - Fill;
+
+		if (Run > Size - Offset)
+			Run = Size - Offset;
+
+		if (Read(ReadContext, Offset, Buffer + Fill, Run))
+		{
+			Fill += Run;
+			Readable += Run;
+		}
+		else
+		{
+			// retry the run a page at a time to isolate the fault
+			size_t Done = 0;
+
+			while (Done < Run)
+			{
+				size_t Piece = DUMP_STREAM_PAGE - (Phase + Offset + Done) % DUMP_STREAM_PAGE;
+
+				if (Piece > Run - Done)
+					Piece = Run - Done;
+
+				if (Read(ReadContext, Offset + Done, Buffer + Fill, Piece))
+				{
+					Fill += Piece;
+					Readable += Piece;
+				}
+				else
+				{
+					Result->FaultPages++;
+					if (Fault == DUMP_STREAM_ZERO_FILL)
+					{
+						memset(Buffer + Fill, 0, Piece);
+						Fill += Piece;
+					}
+				}
+
+				Done += Piece;
+			}
+		}
+
+		Offset += Run;
+
+		if (Fill == BufferSize || (Offset == Size && Fill))
+		{
+			for (i = 0; i < Fill; i++)
+				Counts[Buffer[i]]++;
+			HashUpdate(&Hash, Buffer, Fill);
+
+			if (!Write(WriteContext, Buffer, Fill))
+				return 0;
+
+			Result->Written += Fill;
+			Fill = 0;
+		}
+	}
+
+	Result->Hash = HashFinal(&Hash);
+	Result->Entropy = Entropy(Counts, Result->Written);
+
+	return Readable != 0;
+}
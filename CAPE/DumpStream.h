@@ -0,0 +1,62 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2020-2021 Kevin O'Reilly (kevoreilly@gmail.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Chunked writer for raw memory dumps: copies the source a run of pages at
+// a time through one staging buffer, so a dump never needs a second copy of
+// the whole region, and a page that faults costs that page rather than the
+// dump. No Windows dependencies so it can be tested on the build host; the
+// caller supplies the (exception-safe) page reader and the file writer.
+
+#define DUMP_STREAM_PAGE			0x1000
+#define DUMP_STREAM_BUFFER_SIZE		0x10000
+
+// Copies Length bytes from Offset in the source into Out. Returns nonzero on
+// success and 0 if any of the bytes could not be read.
+typedef int (*DUMP_STREAM_READ)(void *Context, size_t Offset, unsigned char *Out, size_t Length);
+
+// Writes Length bytes to the output. Returns nonzero on success.
+typedef int (*DUMP_STREAM_WRITE)(void *Context, const unsigned char *Data, size_t Length);
+
+typedef enum _DUMP_STREAM_FAULT
+{
+	DUMP_STREAM_ZERO_FILL,		// unreadable pages are written as zeros, keeping offsets
+	DUMP_STREAM_SKIP			// unreadable pages are left out of the output
+} DUMP_STREAM_FAULT;
+
+typedef struct _DUMP_STREAM_RESULT
+{
+	size_t		Written;		// bytes handed to the writer
+	size_t		FaultPages;		// pages that could not be read
+	uint64_t	Hash;			// DumpStreamHash of the bytes written
+	double		Entropy;		// Shannon entropy of the bytes written, bits per byte
+} DUMP_STREAM_RESULT;
+
+// Streams Size bytes of the source to the writer through Buffer (BufferSize
+// bytes, rounded down to whole pages; at least one page). Phase is the offset
+// of the source's first byte within its page, so that a faulting run is
+// retried on real page boundaries. Returns 1 on success, 0 if the writer
+// failed or nothing at all could be read.
+int DumpStream(size_t Size, size_t Phase, DUMP_STREAM_FAULT Fault, unsigned char *Buffer, size_t BufferSize,
+	DUMP_STREAM_READ Read, void *ReadContext, DUMP_STREAM_WRITE Write, void *WriteContext, DUMP_STREAM_RESULT *Result);
+
+// The content hash DumpStream reports, for comparison against a buffer
+// already in memory.
+uint64_t DumpStreamHash(const void *Buffer, size_t Size);
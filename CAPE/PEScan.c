@@ -0,0 +1,248 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "PEScan.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PESCAN_SSE2
+#endif
+
+#define IMAGE_NT_SIGNATURE_BYTES	"PE\0\0"
+#define NUMBER_OF_SECTIONS_OFFSET	0x06	// IMAGE_NT_HEADERS.FileHeader.NumberOfSections
+#define SIZE_OF_IMAGE_OFFSET		0x50	// IMAGE_NT_HEADERS.OptionalHeader.SizeOfImage (32 & 64-bit)
+
+static unsigned int Read16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int Read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+//**************************************************************************************
+size_t PEScanFindPair(const unsigned char *Buffer, size_t From, size_t To, unsigned char First, unsigned char Second0, unsigned char Second1)
+//**************************************************************************************
+{
+	size_t p = From;
+
+#ifdef PESCAN_SSE2
+	__m128i v0 = _mm_set1_epi8((char)First), v1 = _mm_set1_epi8((char)Second0), v2 = _mm_set1_epi8((char)Second1);
+
+	// the second load reads one byte past the block, so stop one short of To
+	while (To > 16 && p < To - 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(Buffer + p));
+		__m128i b = _mm_loadu_si128((const __m128i*)(Buffer + p + 1));
+		__m128i Match = _mm_and_si128(_mm_cmpeq_epi8(a, v0), _mm_or_si128(_mm_cmpeq_epi8(b, v1), _mm_cmpeq_epi8(b, v2)));
+		unsigned int Mask = (unsigned int)_mm_movemask_epi8(Match);
+
+		if (Mask)
+		{
+			unsigned int Bit = 0;
+			while (!(Mask & 1))
+			{
+				Mask >>= 1;
+				Bit++;
+			}
+			return p + Bit;
+		}
+
+		p += 16;
+	}
+#else
+	while (p < To)
+	{
+		const unsigned char *Hit = (const unsigned char*)memchr(Buffer + p, First, To - p);
+
+		if (!Hit)
+			return To;
+
+		p = (size_t)(Hit - Buffer);
+
+		if (Buffer[p+1] == Second0 || Buffer[p+1] == Second1)
+			return p;
+
+		p++;
+	}
+#endif
+
+	for (; p < To; p++)
+		if (Buffer[p] == First && (Buffer[p+1] == Second0 || Buffer[p+1] == Second1))
+			return p;
+
+	return To;
+}
+
+//**************************************************************************************
+static int ScanMZ(const unsigned char *Buffer, size_t Size, size_t Limit, PESCAN_VALIDATE Validate, void *Context, size_t *Offset)
+//**************************************************************************************
+{
+	size_t p = 0, e_lfanew;
+
+	if (Size < PESCAN_LFANEW_OFFSET + 4)
+		return 0;
+
+	// the DOS header must fit so that e_lfanew can be read
+	if (Limit > Size - (PESCAN_LFANEW_OFFSET + 4) + 1)
+		Limit = Size - (PESCAN_LFANEW_OFFSET + 4) + 1;
+
+	while (1)
+	{
+		int RetVal;
+
+		p = PEScanFindPair(Buffer, p, Limit, 'M', 'Z', 'Z');
+
+		if (p >= Limit)
+			return 0;
+
+		e_lfanew = Read32(Buffer + p + PESCAN_LFANEW_OFFSET);
+
+		if (!e_lfanew || e_lfanew > Size - p || Size - p - e_lfanew < 4 || memcmp(Buffer + p + e_lfanew, IMAGE_NT_SIGNATURE_BYTES, 4))
+		{
+			p++;
+			continue;
+		}
+
+		RetVal = Validate ? Validate(Buffer + p, Context) : 1;
+
+		if (RetVal)
+		{
+			*Offset = p;
+			return RetVal;
+		}
+
+		p++;
+	}
+}
+
+//**************************************************************************************
+static int ScanDisguised(const unsigned char *Buffer, size_t Size, size_t Limit, PESCAN_VALIDATE Validate, void *Context, size_t *Offset)
+//**************************************************************************************
+{
+	// Rather than testing e_lfanew at every offset we look for the optional
+	// header magic (0x10b/0x20b) and work backwards: each hit at m implies an
+	// NT header at m - 0x18, and a DOS header at p only if the dword at
+	// p + 0x3c equals the distance from p to that NT header. As candidates from
+	// successive hits overlap, keep going until no later hit can beat the best.
+	size_t m = PESCAN_MAGIC_OFFSET + 4, Best = Limit, Fault = Limit;
+
+	if (Size < 2)
+		return 0;
+
+	while (1)
+	{
+		size_t NtHeader, e_lfanew;
+
+		m = PEScanFindPair(Buffer, m, Size - 1, 0x0b, 0x01, 0x02);
+
+		if (m >= Size - 1)
+			break;
+
+		NtHeader = m - PESCAN_MAGIC_OFFSET;
+
+		// the lowest DOS header this hit can yield
+		if (NtHeader >= PESCAN_HEADER_LIMIT - 4 && NtHeader - (PESCAN_HEADER_LIMIT - 4) >= (Best < Fault ? Best : Fault))
+			break;
+
+		// cheap pre-checks on the NT header, where they are within the buffer
+		if (NtHeader + NUMBER_OF_SECTIONS_OFFSET + 2 <= Size && !Read16(Buffer + NtHeader + NUMBER_OF_SECTIONS_OFFSET))
+		{
+			m++;
+			continue;
+		}
+
+		if (NtHeader + SIZE_OF_IMAGE_OFFSET + 4 <= Size && !Read32(Buffer + NtHeader + SIZE_OF_IMAGE_OFFSET))
+		{
+			m++;
+			continue;
+		}
+
+		// largest e_lfanew first gives ascending candidate offsets
+		for (e_lfanew = PESCAN_HEADER_LIMIT - 4; e_lfanew >= 4; e_lfanew -= 4)
+		{
+			size_t p;
+			int RetVal;
+
+			if (e_lfanew > NtHeader)
+				continue;
+
+			p = NtHeader - e_lfanew;
+
+			if (p >= Best || p >= Fault)
+				break;
+
+			if (p + PESCAN_LFANEW_OFFSET + 4 > Size || Read32(Buffer + p + PESCAN_LFANEW_OFFSET) != e_lfanew)
+				continue;
+
+			RetVal = Validate ? Validate(Buffer + p, Context) : 1;
+
+			if (RetVal > 0)
+			{
+				Best = p;
+				break;
+			}
+			else if (RetVal < 0)
+			{
+				Fault = p;
+				break;
+			}
+		}
+
+		m++;
+	}
+
+	if (Best < Limit && Best < Fault)
+	{
+		*Offset = Best;
+		return 1;
+	}
+
+	if (Fault < Limit)
+	{
+		*Offset = Fault;
+		return -1;
+	}
+
+	return 0;
+}
+
+//**************************************************************************************
+int PEScanFindCandidate(const unsigned char *Buffer, size_t Size, size_t Limit, int Mode, PESCAN_VALIDATE Validate, void *Context, size_t *Offset)
+//**************************************************************************************
+{
+	size_t Dummy;
+
+	if (!Buffer || !Size)
+		return 0;
+
+	if (!Offset)
+		Offset = &Dummy;
+
+	if (Limit > Size)
+		Limit = Size;
+
+	if (Mode == PESCAN_MODE_MZ)
+		return ScanMZ(Buffer, Size, Limit, Validate, Context, Offset);
+	else if (Mode == PESCAN_MODE_DISGUISED)
+		return ScanDisguised(Buffer, Size, Limit, Validate, Context, Offset);
+
+	return 0;
+}
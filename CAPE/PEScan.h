@@ -0,0 +1,42 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+
+// Candidate filter for the PE scanners in CAPE.c. This file has no Windows
+// dependencies so that it can be built and tested on the build host.
+
+#define PESCAN_HEADER_LIMIT		0x200	// keep in step with PE_HEADER_LIMIT in CAPE.h
+#define PESCAN_LFANEW_OFFSET	0x3c	// IMAGE_DOS_HEADER.e_lfanew
+#define PESCAN_MAGIC_OFFSET		0x18	// IMAGE_NT_HEADERS.OptionalHeader.Magic
+
+#define PESCAN_MODE_MZ			1		// "MZ" with e_lfanew -> "PE\0\0" (ScanForPE)
+#define PESCAN_MODE_DISGUISED	2		// e_lfanew -> optional header magic, no signatures (ScanForDisguisedPE)
+
+// Full validation run on each surviving candidate: returns 1 for a PE
+// header, 0 to reject, -1 if the candidate could not be read.
+typedef int (*PESCAN_VALIDATE)(const unsigned char *Candidate, void *Context);
+
+// Returns 1 and sets *Offset to the lowest offset below Limit accepted by
+// Validate, 0 if there is none, or -1 (with *Offset set to the faulting
+// candidate) if Validate failed on a candidate below any accepted one.
+int PEScanFindCandidate(const unsigned char *Buffer, size_t Size, size_t Limit, int Mode, PESCAN_VALIDATE Validate, void *Context, size_t *Offset);
+
+// Vectorised search for the first offset in [From, To) holding First followed
+// by Second0 or Second1. Returns To if there is none.
+size_t PEScanFindPair(const unsigned char *Buffer, size_t From, size_t To, unsigned char First, unsigned char Second0, unsigned char Second1);
@@ -0,0 +1,131 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2020-2021 Kevin O'Reilly (kevoreilly@gmail.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "ScanCache.h"
+
+#define HASH_MULTIPLIER 0xff51afd7ed558ccdULL
+
+void ScanCacheInit(SCAN_CACHE *Cache)
+{
+	memset(Cache, 0, sizeof(*Cache));
+}
+
+// Not cryptographic: it only has to tell a rewritten region from an
+// untouched one, and it must be far cheaper than the scan it saves.
+uint64_t ScanCacheHash(const void *Buffer, size_t Size)
+{
+	const unsigned char *p = (const unsigned char*)Buffer;
+	uint64_t Hash = 0x9e3779b97f4a7c15ULL ^ Size, Word;
+
+	while (Size >= 8)
+	{
+		memcpy(&Word, p, 8);
+		Hash = (Hash ^ Word) * HASH_MULTIPLIER;
+		Hash ^= Hash >> 29;
+		p += 8;
+		Size -= 8;
+	}
+
+	Word = 0;
+	memcpy(&Word, p, Size);
+	Hash = (Hash ^ Word) * HASH_MULTIPLIER;
+	Hash ^= Hash >> 32;
+
+	return Hash;
+}
+
+SCAN_CACHE_ENTRY *ScanCacheLookup(SCAN_CACHE *Cache, uintptr_t Base, size_t Size, uint64_t Hash)
+{
+	unsigned int i;
+
+	for (i = 0; i < SCAN_CACHE_ENTRIES; i++)
+	{
+		SCAN_CACHE_ENTRY *Entry = &Cache->Entries[i];
+
+		if (Entry->Size && Entry->Base == Base && Entry->Size == Size)
+		{
+			if (Entry->Hash != Hash)
+				break;
+
+			Entry->LastUsed = ++Cache->Clock;
+			Cache->Hits++;
+			return Entry;
+		}
+	}
+
+	Cache->Misses++;
+	return NULL;
+}
+
+SCAN_CACHE_ENTRY *ScanCacheStore(SCAN_CACHE *Cache, uintptr_t Base, size_t Size, uint64_t Hash)
+{
+	SCAN_CACHE_ENTRY *Entry = NULL;
+	unsigned int i;
+
+	if (!Size)
+		return NULL;
+
+	// reuse the slot for this region if there is one, else the least recently used
+	for (i = 0; i < SCAN_CACHE_ENTRIES; i++)
+	{
+		SCAN_CACHE_ENTRY *Candidate = &Cache->Entries[i];
+
+		if (Candidate->Size && Candidate->Base == Base && Candidate->Size == Size)
+		{
+			Entry = Candidate;
+			break;
+		}
+
+		if (!Entry || Candidate->LastUsed < Entry->LastUsed)
+			Entry = Candidate;
+	}
+
+	Entry->Base = Base;
+	Entry->Size = Size;
+	Entry->Hash = Hash;
+	Entry->LastUsed = ++Cache->Clock;
+
+	return Entry;
+}
+
+// Drops every entry overlapping [Address, Address + Size).
+unsigned int ScanCacheInvalidate(SCAN_CACHE *Cache, uintptr_t Address, size_t Size)
+{
+	unsigned int i, Dropped = 0;
+
+	if (!Size)
+		Size = 1;
+
+	for (i = 0; i < SCAN_CACHE_ENTRIES; i++)
+	{
+		SCAN_CACHE_ENTRY *Entry = &Cache->Entries[i];
+
+		if (!Entry->Size)
+			continue;
+
+		if (Address < Entry->Base + Entry->Size && Entry->Base < Address + Size)
+		{
+			memset(Entry, 0, sizeof(*Entry));
+			Dropped++;
+		}
+	}
+
+	Cache->Invalidations += Dropped;
+
+	return Dropped;
+}
@@ -0,0 +1,49 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2020-2021 Kevin O'Reilly (kevoreilly@gmail.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-process memory of regions that scanned clean, keyed by (base, size,
+// content hash). No Windows dependencies so it can be tested on the build
+// host; callers provide their own locking.
+
+#define SCAN_CACHE_ENTRIES		64
+
+typedef struct _SCAN_CACHE_ENTRY
+{
+	uintptr_t	Base;
+	size_t		Size;
+	uint64_t	Hash;
+	uint64_t	LastUsed;
+} SCAN_CACHE_ENTRY;
+
+typedef struct _SCAN_CACHE
+{
+	uint64_t	Clock;
+	unsigned int	Hits;
+	unsigned int	Misses;
+	unsigned int	Invalidations;
+	SCAN_CACHE_ENTRY	Entries[SCAN_CACHE_ENTRIES];
+} SCAN_CACHE;
+
+void ScanCacheInit(SCAN_CACHE *Cache);
+uint64_t ScanCacheHash(const void *Buffer, size_t Size);
+SCAN_CACHE_ENTRY *ScanCacheLookup(SCAN_CACHE *Cache, uintptr_t Base, size_t Size, uint64_t Hash);
+SCAN_CACHE_ENTRY *ScanCacheStore(SCAN_CACHE *Cache, uintptr_t Base, size_t Size, uint64_t Hash);
+unsigned int ScanCacheInvalidate(SCAN_CACHE *Cache, uintptr_t Address, size_t Size);
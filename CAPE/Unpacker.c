@@ -130,6 +130,7 @@ extern int is_stack_pivoted(void);
 extern BOOL is_in_dll_range(ULONG_PTR addr);
 
 extern PVOID GetReturnAddress(hook_info_t *hookinfo);
+extern void YaraInvalidate(PVOID Address, SIZE_T Size);
 extern BOOL DumpPEsInRange(PVOID Buffer, SIZE_T Size);
 extern int DumpMemory(PVOID Buffer, SIZE_T Size);
 extern int ScanForPE(PVOID Buffer, SIZE_T Size, PVOID* Offset);
@@ -1584,6 +1585,8 @@ BOOL UnpackerGuardPageHandler(struct _EXCEPTION_POINTERS* ExceptionInfo)
 
 			TrackedRegion->WriteDetected = TRUE;
 
+			YaraInvalidate(AccessAddress, 1);
+
 			TrackedRegion->LastWriteAddress = AccessAddress;
 
 			TrackedRegion->LastWrittenBy = FaultingAddress;
@@ -0,0 +1,192 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "XorScan.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define XORSCAN_SSE2
+#endif
+
+// Rather than decoding the buffer under every possible key, the key is read
+// off the ciphertext using bytes whose plaintext is known:
+//  - 'M','Z' at 0 and 1: for a single-byte key B[0]^B[1] == 'M'^'Z', and the
+//	key is B[0]^'M'.
+//  - the reserved fields 0x1c-0x3b of the DOS header (e_res, e_oemid,
+//	e_oeminfo, e_res2) are zero in practice, so there the ciphertext is the
+//	key itself, repeated. 0x20 is a multiple of 2, 4 and 8 so a rolling key
+//	of those lengths starts afresh there, giving B[0]^B[0x20] == 'M' and
+//	B[1]^B[0x21] == 'Z' whatever the key.
+// Only offsets passing one of these tests have e_lfanew decoded and the
+// 'PE\0\0' signature checked under the derived key.
+#define MZ_XOR				('M' ^ 'Z')
+#define RESERVED_START		0x1c
+#define RESERVED_KEY_PHASE	0x20
+#define LFANEW_OFFSET		0x3c
+#define DOS_HEADER_SIZE		0x40
+
+static const unsigned char NtSignature[4] = {'P', 'E', 0, 0};
+
+void XorScanDecode(unsigned char *Out, const unsigned char *In, size_t Size, const XORSCAN_KEY *Key)
+{
+	size_t i;
+
+	if (Key->Length == 1)
+	{
+		for (i = 0; i < Size; i++)
+			Out[i] = In[i] ^ Key->Bytes[0];
+		return;
+	}
+
+	for (i = 0; i < Size; i++)
+		Out[i] = In[i] ^ Key->Bytes[i % Key->Length];
+}
+
+static int CheckSignature(const unsigned char *Image, size_t Available, const XORSCAN_KEY *Key)
+{
+	size_t e_lfanew = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		e_lfanew |= (size_t)(Image[LFANEW_OFFSET+i] ^ Key->Bytes[(LFANEW_OFFSET+i) % Key->Length]) << (8*i);
+
+	if (!e_lfanew || e_lfanew > Available || Available - e_lfanew < 4)
+		return 0;
+
+	for (i = 0; i < 4; i++)
+		if ((Image[e_lfanew+i] ^ Key->Bytes[(e_lfanew+i) % Key->Length]) != NtSignature[i])
+			return 0;
+
+	return 1;
+}
+
+static int TrySingleByte(const unsigned char *Image, size_t Available, XORSCAN_KEY *Key)
+{
+	if (Available < DOS_HEADER_SIZE || Image[0] == 'M')
+		return 0;
+
+	Key->Length = 1;
+	Key->Bytes[0] = Image[0] ^ 'M';
+
+	return CheckSignature(Image, Available, Key);
+}
+
+static int TryRollingKey(const unsigned char *Image, size_t Available, XORSCAN_KEY *Key)
+{
+	unsigned int Length, x, Period;
+
+	if (Available < DOS_HEADER_SIZE)
+		return 0;
+
+	for (Length = 2; Length <= XORSCAN_MAX_KEY; Length *= 2)
+	{
+		// the key repeats with this period over the reserved fields
+		for (x = RESERVED_START; x + Length < LFANEW_OFFSET; x++)
+			if (Image[x] != Image[x+Length])
+				break;
+
+		if (x + Length < LFANEW_OFFSET)
+			continue;
+
+		Key->Length = Length;
+		memcpy(Key->Bytes, Image + RESERVED_KEY_PHASE, Length);
+
+		// report the shortest form of the key
+		for (Period = 1; Period < Length; Period *= 2)
+			if (!memcmp(Key->Bytes, Key->Bytes + Period, Length - Period))
+				break;
+		Key->Length = Period;
+
+		for (x = 0; x < Key->Length; x++)
+			if (Key->Bytes[x])
+				break;
+
+		if (x == Key->Length)
+			return 0;
+
+		return CheckSignature(Image, Available, Key);
+	}
+
+	return 0;
+}
+
+static int TryOffset(const unsigned char *Buffer, size_t Size, size_t p, XORSCAN_KEY *Key)
+{
+	const unsigned char *Image = Buffer + p;
+	size_t Available = Size - p;
+
+	if (Available < DOS_HEADER_SIZE)
+		return 0;
+
+	if ((Image[0] ^ Image[1]) == MZ_XOR && TrySingleByte(Image, Available, Key))
+		return 1;
+
+	if ((Image[0] ^ Image[RESERVED_KEY_PHASE]) == 'M' && (Image[1] ^ Image[RESERVED_KEY_PHASE+1]) == 'Z' && TryRollingKey(Image, Available, Key))
+		return 1;
+
+	return 0;
+}
+
+int XorScanFindPE(const unsigned char *Buffer, size_t Size, size_t From, size_t *Offset, XORSCAN_KEY *Key)
+{
+	size_t p = From;
+
+	if (!Buffer || Size < DOS_HEADER_SIZE)
+		return 0;
+
+#ifdef XORSCAN_SSE2
+	{
+		__m128i MZ = _mm_set1_epi8(MZ_XOR), M = _mm_set1_epi8('M'), Z = _mm_set1_epi8('Z');
+
+		while (p + RESERVED_KEY_PHASE + 1 + 16 <= Size)
+		{
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(Buffer + p));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(Buffer + p + 1));
+			__m128i k0 = _mm_loadu_si128((const __m128i*)(Buffer + p + RESERVED_KEY_PHASE));
+			__m128i k1 = _mm_loadu_si128((const __m128i*)(Buffer + p + RESERVED_KEY_PHASE + 1));
+			__m128i Single = _mm_cmpeq_epi8(_mm_xor_si128(b0, b1), MZ);
+			__m128i Rolling = _mm_and_si128(_mm_cmpeq_epi8(_mm_xor_si128(b0, k0), M), _mm_cmpeq_epi8(_mm_xor_si128(b1, k1), Z));
+			unsigned int Mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(Single, Rolling)), Bit = 0;
+
+			while (Mask)
+			{
+				if ((Mask & 1) && TryOffset(Buffer, Size, p + Bit, Key))
+				{
+					*Offset = p + Bit;
+					return 1;
+				}
+				Mask >>= 1;
+				Bit++;
+			}
+
+			p += 16;
+		}
+	}
+#endif
+
+	for (; p + DOS_HEADER_SIZE <= Size; p++)
+	{
+		if (TryOffset(Buffer, Size, p, Key))
+		{
+			*Offset = p;
+			return 1;
+		}
+	}
+
+	return 0;
+}
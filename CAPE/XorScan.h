@@ -0,0 +1,40 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+
+// Known-plaintext detection of XOR-encoded PE images for DumpXorPE. No
+// Windows dependencies so that it can be built and tested on the build host.
+
+#define XORSCAN_MAX_KEY 8
+
+// Key bytes in order from the first byte of the encoded image
+typedef struct _XORSCAN_KEY
+{
+	unsigned char	Bytes[XORSCAN_MAX_KEY];
+	unsigned int	Length;
+} XORSCAN_KEY;
+
+// Finds the lowest offset at or after From holding a PE image encoded with a
+// single-byte key or a rolling key of 2, 4 or 8 bytes. Returns 1 and sets
+// *Offset and *Key, or 0 if there is none. Plain (zero key) images are not
+// reported.
+int XorScanFindPE(const unsigned char *Buffer, size_t Size, size_t From, size_t *Offset, XORSCAN_KEY *Key);
+
+// Decodes Size bytes, with key phase 0 at In[0]. In and Out may be the same.
+void XorScanDecode(unsigned char *Out, const unsigned char *In, size_t Size, const XORSCAN_KEY *Key);
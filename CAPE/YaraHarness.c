@@ -21,6 +21,7 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "Shlwapi.h"
 #include "CAPE.h"
 #include "YaraHarness.h"
+#include "ScanCache.h"
 #include "..\config.h"
 
 extern void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
@@ -40,6 +41,30 @@ extern PVOID LdrpInvertedFunctionTableSRWLock;
 
 static char NewLine[MAX_PATH];
 
+// Regions are rescanned from caller_dispatch, the unpacker and the dump paths;
+// identical content at the same address that matched nothing last time is
+// answered from this cache. Regions that matched are always rescanned, so a
+// rule's actions (breakpoints, dumps, cape_options) run every time as before
+static SCAN_CACHE YaraCache;
+static CRITICAL_SECTION YaraCacheLock;
+static BOOL YaraCacheReady;
+
+// A rule file being compiled, with the first error it gave, if any
+typedef struct _YARA_RULE_FILE
+{
+	char Path[MAX_PATH];
+	BOOL Compiled;
+	int Errors;
+	int ErrorLine;
+	char ErrorMessage[256];
+} YARA_RULE_FILE;
+
+typedef struct _YARA_SCAN
+{
+	PVOID Address;
+	unsigned int Count;
+} YARA_SCAN;
+
 char InternalYara[] =
 	"rule RtlInsertInvertedFunctionTable"
 	"{strings:$10_0_19041_662 = {48 8D 0D [4] E8 [4] [7] 8B 44 24 ?? 44 8B CB 4C 8B 44 24 ?? 48 8B D7 89 44 24 ?? E8}"
@@ -101,9 +126,12 @@ int YaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_data, void
 			YR_STRING* String;
 			YR_META* Meta;
 			YR_RULE* Rule = (YR_RULE*)message_data;
+			YARA_SCAN* Scan = (YARA_SCAN*)user_data;
 
 			DebugOutput("YaraScan hit: %s\n", Rule->identifier);
 
+			Scan->Count++;
+
 			// Process cape_options metadata
 			yr_rule_metas_foreach(Rule, Meta)
 			{
@@ -151,12 +179,12 @@ int YaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_data, void
 			}
 
 			if (SetBreakpoints)
-				SetInitialBreakpoints(user_data);
+				SetInitialBreakpoints(Scan->Address);
 
 			if (DoDumpRegion)
 			{
-				DebugOutput("YaraScan: Dump of region at 0x%p triggered by Yara.", user_data);
-				DumpRegion(user_data);
+				DebugOutput("YaraScan: Dump of region at 0x%p triggered by Yara.", Scan->Address);
+				DumpRegion(Scan->Address);
 			}
 
 			return CALLBACK_CONTINUE;
@@ -246,6 +274,9 @@ void YaraScan(PVOID Address, SIZE_T Size)
 		return;
 
 	int Flags = 0, Timeout = 1, Result = ERROR_SUCCESS;
+	SCAN_CACHE_ENTRY *Cached = NULL;
+	YARA_SCAN Scan;
+	uint64_t Hash;
 
 	if (!Size)
 		return;
@@ -266,11 +297,37 @@ void YaraScan(PVOID Address, SIZE_T Size)
 		return;
 	}
 
+	__try
+	{
+		Hash = ScanCacheHash(Address, Size);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		DebugOutput("YaraScan: Unable to hash 0x%p\n", Address);
+		return;
+	}
+
+	if (YaraCacheReady)
+	{
+		EnterCriticalSection(&YaraCacheLock);
+		Cached = ScanCacheLookup(&YaraCache, (uintptr_t)Address, Size, Hash);
+		LeaveCriticalSection(&YaraCacheLock);
+	}
+
+	if (Cached)
+	{
+		DebugOutput("YaraScan: 0x%p, size 0x%x unchanged since a scan without hits\n", Address, Size);
+		return;
+	}
+
 	DebugOutput("YaraScan: Scanning 0x%p, size 0x%x\n", Address, Size);
 
+	memset(&Scan, 0, sizeof(Scan));
+	Scan.Address = Address;
+
 	__try
 	{
-		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, YaraCallback, Address, Timeout);
+		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, YaraCallback, &Scan, Timeout);
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
@@ -279,10 +336,30 @@ void YaraScan(PVOID Address, SIZE_T Size)
 	}
 	if (Result != ERROR_SUCCESS)
 		ScannerError(Result);
-#ifdef DEBUG_COMMENTS
 	else
+	{
+#ifdef DEBUG_COMMENTS
 		DebugOutput("YaraScan: successfully scanned 0x%p\n", Address);
 #endif
+		// only clean scans are remembered: timed out or failed ones prove
+		// nothing, and a hit has actions to run again
+		if (YaraCacheReady && !Scan.Count)
+		{
+			EnterCriticalSection(&YaraCacheLock);
+			ScanCacheStore(&YaraCache, (uintptr_t)Address, Size, Hash);
+			LeaveCriticalSection(&YaraCacheLock);
+		}
+	}
+}
+
+void YaraInvalidate(PVOID Address, SIZE_T Size)
+{
+	if (!YaraCacheReady)
+		return;
+
+	EnterCriticalSection(&YaraCacheLock);
+	ScanCacheInvalidate(&YaraCache, (uintptr_t)Address, Size);
+	LeaveCriticalSection(&YaraCacheLock);
 }
 
 void InternalYaraScan(PVOID Address, SIZE_T Size)
@@ -330,12 +407,120 @@ void InternalYaraScan(PVOID Address, SIZE_T Size)
 #endif
 }
 
+void YaraCompilerCallback(int error_level, const char* file_name, int line_number, const YR_RULE* rule, const char* message, void* user_data)
+{
+	YARA_RULE_FILE** Current = (YARA_RULE_FILE**)user_data;
+
+	if (error_level != YARA_ERROR_LEVEL_ERROR || !*Current || (*Current)->ErrorLine)
+		return;
+
+	(*Current)->ErrorLine = line_number;
+	strncpy((*Current)->ErrorMessage, message, sizeof((*Current)->ErrorMessage)-1);
+}
+
+static YARA_RULE_FILE* CurrentFile;
+
+static BOOL YaraCreateCompiler(YR_COMPILER** Compiler)
+{
+	if (yr_compiler_create(Compiler) != ERROR_SUCCESS)
+	{
+		*Compiler = NULL;
+		return FALSE;
+	}
+
+	yr_compiler_set_callback(*Compiler, YaraCompilerCallback, &CurrentFile);
+
+	return TRUE;
+}
+
+static BOOL YaraAddFile(YR_COMPILER* Compiler, YARA_RULE_FILE* File)
+{
+	FILE* rule_file = fopen(File->Path, "r");
+
+	if (!rule_file)
+	{
+		File->Errors = ERROR_COULD_NOT_OPEN_FILE;
+		return FALSE;
+	}
+
+	CurrentFile = File;
+	File->Errors = yr_compiler_add_file(Compiler, rule_file, NULL, File->Path);
+	CurrentFile = NULL;
+
+	fclose(rule_file);
+
+	return !File->Errors;
+}
+
+// Compiles the files into one rule set. A compiler can't be used again once
+// it has reported an error, so a file that fails is left out and the
+// compiler started afresh with the files already accepted, rather than the
+// one bad file losing the whole set. Runs on the thread calling YaraInit,
+// which is under the loader lock, so no worker threads
+static int YaraCompileFiles(YARA_RULE_FILE* Files, unsigned int Count, unsigned int* Compiled)
+{
+	YR_COMPILER* Compiler;
+	int Result;
+
+	*Compiled = 0;
+
+	if (!YaraCreateCompiler(&Compiler))
+		return ERROR_INSUFICIENT_MEMORY;
+
+	for (unsigned int i = 0; i < Count; i++)
+	{
+		if (YaraAddFile(Compiler, &Files[i]))
+		{
+			Files[i].Compiled = TRUE;
+			(*Compiled)++;
+			continue;
+		}
+
+		if (Files[i].Errors == ERROR_COULD_NOT_OPEN_FILE)
+		{
+			DebugOutput("YaraInit: Unable to open file %s\n", Files[i].Path);
+			continue;
+		}
+
+		DebugOutput("YaraInit: Failed to compile %s (line %d): %s\n", Files[i].Path, Files[i].ErrorLine, Files[i].ErrorMessage);
+
+		yr_compiler_destroy(Compiler);
+		*Compiled = 0;
+
+		if (!YaraCreateCompiler(&Compiler))
+			return ERROR_INSUFICIENT_MEMORY;
+
+		for (unsigned int j = 0; j < i; j++)
+		{
+			if (!Files[j].Compiled)
+				continue;
+
+			if (!YaraAddFile(Compiler, &Files[j]))
+			{
+				yr_compiler_destroy(Compiler);
+				return ERROR_COULD_NOT_OPEN_FILE;
+			}
+			(*Compiled)++;
+		}
+	}
+
+	// Add 'internal' yara
+	if (yr_compiler_add_string(Compiler, InternalYara, NULL) != 0)
+		DebugOutput("YaraInit: Failed to add internal yara rules.\n");
+
+	Result = yr_compiler_get_rules(Compiler, &Rules);
+
+	yr_compiler_destroy(Compiler);
+
+	return Result;
+}
+
 BOOL YaraInit()
 {
-	YR_COMPILER* Compiler = NULL;
 	char analyzer_path[MAX_PATH], yara_dir[MAX_PATH], file_name[MAX_PATH], compiled_rules[MAX_PATH];
-	BOOL Result = FALSE, RulesCompiled = FALSE;
-	int flags = 0;
+	YARA_RULE_FILE* Files = NULL;
+	unsigned int FileCount = 0, FileMax = 0, Count = 0;
+	int Result = ERROR_SUCCESS;
 
 	strncpy(analyzer_path, our_dll_path, strlen(our_dll_path));
 	if (!g_config.standalone)
@@ -363,12 +548,6 @@ BOOL YaraInit()
 	}
 	else
 	{
-		if (yr_compiler_create(&Compiler) != ERROR_SUCCESS)
-		{
-			DebugOutput("YaraInit: yr_compiler_create failure\n");
-			goto exit;
-		}
-
 		char FindString[MAX_PATH];
 		WIN32_FIND_DATA FindFileData;
 		sprintf(FindString, "%s\\*.yar*", yara_dir);
@@ -378,48 +557,35 @@ BOOL YaraInit()
 		HANDLE hFind = FindFirstFile(FindString, &FindFileData);
 		if (hFind != INVALID_HANDLE_VALUE)
 		{
-			unsigned int count = 0;
 			do
 			{
-				snprintf(file_name, sizeof(file_name), "%s\\%s", yara_dir, FindFileData.cFileName);
+				if (FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+					continue;
 
-				if (!(FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				if (FileCount == FileMax)
 				{
-					rule_file = fopen(file_name, "r");
-
-					if (rule_file)
-					{
-						int errors = yr_compiler_add_file(Compiler, rule_file, NULL, file_name);
-
-						if (errors == ERROR_COULD_NOT_OPEN_FILE)
-							DebugOutput("YaraInit: Unable to open file %s\n", file_name);
-						else if (errors)
-							ScannerError(errors);
-						else
-						{
-							count++;
-#ifdef DEBUG_COMMENTS
-							DebugOutput("YaraInit: Compiled rule file %s\n", file_name);
-#endif
-						}
-
-						fclose(rule_file);
-					}
+					YARA_RULE_FILE* NewFiles = (YARA_RULE_FILE*)realloc(Files, (FileMax + 64) * sizeof(YARA_RULE_FILE));
+					if (!NewFiles)
+						break;
+					Files = NewFiles;
+					FileMax += 64;
 				}
+
+				snprintf(file_name, sizeof(file_name), "%s\\%s", yara_dir, FindFileData.cFileName);
+				memset(&Files[FileCount], 0, sizeof(YARA_RULE_FILE));
+				strncpy(Files[FileCount].Path, file_name, MAX_PATH-1);
+				FileCount++;
 			}
 			while (FindNextFile(hFind, &FindFileData));
 
 			FindClose(hFind);
-
-			DebugOutput("YaraInit: Compiled %d rule files\n", count);
 		}
 
-		// Add 'internal' yara
-		if (yr_compiler_add_string(Compiler, InternalYara, NULL) != 0)
-		{
-			DebugOutput("YaraInit: Failed to add internal yara rules.\n", compiled_rules);
-		}
-		Result = yr_compiler_get_rules(Compiler, &Rules);
+		Result = YaraCompileFiles(Files, FileCount, &Count);
+
+		free(Files);
+
+		DebugOutput("YaraInit: Compiled %d rule files\n", Count);
 
 		if (Result != ERROR_SUCCESS)
 		{
@@ -433,14 +599,14 @@ BOOL YaraInit()
 			ScannerError(Result);
 		else
 			DebugOutput("YaraInit: Compiled rules saved to file %s\n", compiled_rules);
-
-		yr_compiler_destroy(Compiler);
 	}
 
-	Compiler = NULL;
-
 	YaraActivated = TRUE;
 
+	ScanCacheInit(&YaraCache);
+	InitializeCriticalSection(&YaraCacheLock);
+	YaraCacheReady = TRUE;
+
 	OSVERSIONINFO OSVersion;
 	OSVersion.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
 
@@ -459,11 +625,9 @@ BOOL YaraInit()
 
 	return TRUE;
 exit:
-	if (Compiler != NULL)
-		yr_compiler_destroy(Compiler);
-
 	if (Rules != NULL)
 		yr_rules_destroy(Rules);
+	Rules = NULL;
 
 	yr_finalize();
 
@@ -474,10 +638,17 @@ void YaraShutdown()
 {
 	YaraActivated = FALSE;
 
+	if (YaraCacheReady)
+	{
+		YaraCacheReady = FALSE;
+		DeleteCriticalSection(&YaraCacheLock);
+	}
+
 	if (Rules != NULL)
 		yr_rules_destroy(Rules);
+	Rules = NULL;
 
 	yr_finalize();
 
 	return;
-}
\ No newline at end of file
+}
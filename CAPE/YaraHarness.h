@@ -6,4 +6,5 @@
 
 BOOL YaraInit();
 void YaraScan(PVOID Address, SIZE_T Size);
+void YaraInvalidate(PVOID Address, SIZE_T Size);
 void YaraShutdown();
\ No newline at end of file
@@ -0,0 +1,52 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "addr_cache.h"
+
+// return addresses differ mostly in their low bits, but not the lowest two
+// or three, which a multiplicative hash spreads over the slots
+static unsigned int slot_of(size_t addr)
+{
+	unsigned long long x = (unsigned long long)addr * 0x9e3779b97f4a7c15ULL;
+
+	return (unsigned int)(x >> 48) & (ADDR_CACHE_SLOTS - 1);
+}
+
+unsigned int addr_cache_classify(addr_cache_t *c, size_t addr, unsigned int generation, addr_classify_t classify, void *ctx)
+{
+	addr_cache_entry_t *e;
+
+	if (c->generation != generation) {
+		memset(c->entries, 0, sizeof(c->entries));
+		c->generation = generation;
+	}
+
+	e = &c->entries[slot_of(addr)];
+	if (e->used && e->addr == addr) {
+		c->hits++;
+		return e->flags;
+	}
+
+	c->misses++;
+	e->addr = addr;
+	e->flags = classify(ctx, addr);
+	e->used = 1;
+	return e->flags;
+}
@@ -0,0 +1,50 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Remembers how return addresses met walking the stack were classified
+// (inside our hooks, in a loaded module's range, ...), as the same few
+// addresses come up on nearly every hooked call and classifying one means
+// scanning every hook and module range. Direct mapped: an address evicts
+// whatever shared its slot. Every entry belongs to a generation, which the
+// caller bumps whenever a classification may have changed (a module loaded
+// or unloaded, hooks installed); a lookup under a new generation empties
+// the cache first. One cache per thread, so nothing here is atomic; no
+// Windows dependencies.
+
+#define ADDR_CACHE_SLOTS 512
+
+typedef unsigned int (*addr_classify_t)(void *ctx, size_t addr);
+
+typedef struct _addr_cache_entry_t {
+	size_t addr;
+	unsigned int flags;		// its classification
+	unsigned int used;		// 0 for an empty slot
+} addr_cache_entry_t;
+
+typedef struct _addr_cache_t {
+	unsigned int generation;
+	unsigned int hits;
+	unsigned int misses;
+	addr_cache_entry_t entries[ADDR_CACHE_SLOTS];
+} addr_cache_t;
+
+// the classification of addr, from the cache or by calling classify
+unsigned int addr_cache_classify(addr_cache_t *c, size_t addr, unsigned int generation, addr_classify_t classify, void *ctx);
@@ -0,0 +1,154 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "blob_store.h"
+
+#define BLOB_INITIAL_SLOTS 1024
+
+static unsigned long long rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long read64(const unsigned char *p)
+{
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// eight bytes a step, as the buffers are large; not meant to withstand
+// crafted collisions, only to tell buffers apart
+unsigned long long blob_hash(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned long long h1 = 0x9e3779b97f4a7c15ULL ^ len, h2 = 0xc2b2ae3d27d4eb4fULL;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		h1 = rotl64(h1 ^ (read64(p + i) * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+		h2 = rotl64(h2 ^ (read64(p + i + 8) * 0x4cf5ad432745937fULL), 33) * 0x87c37b91114253d5ULL;
+	}
+	for (; i < len; i++)
+		h1 = (h1 ^ p[i]) * 0x100000001b3ULL;
+
+	h1 ^= rotl64(h2, 29);
+	h1 ^= h1 >> 33;
+	h1 *= 0xff51afd7ed558ccdULL;
+	h1 ^= h1 >> 33;
+	h1 *= 0xc4ceb9fe1a85ec53ULL;
+	h1 ^= h1 >> 33;
+	return h1;
+}
+
+int blob_store_init(blob_store_t *s, unsigned long long limit, blob_write_t write, void *ctx)
+{
+	memset(s, 0, sizeof(*s));
+	s->slots = calloc(BLOB_INITIAL_SLOTS, sizeof(blob_ref_t));
+	if (s->slots == NULL)
+		return 0;
+	s->nslots = BLOB_INITIAL_SLOTS;
+	s->limit = limit;
+	s->write = write;
+	s->ctx = ctx;
+	return 1;
+}
+
+void blob_store_free(blob_store_t *s)
+{
+	free(s->slots);
+	s->slots = NULL;
+	s->nslots = 0;
+}
+
+static blob_ref_t *find_slot(blob_ref_t *slots, unsigned int nslots, unsigned long long hash, unsigned int length)
+{
+	unsigned int i = (unsigned int)hash & (nslots - 1);
+
+	while (slots[i].length && (slots[i].hash != hash || slots[i].length != length))
+		i = (i + 1) & (nslots - 1);
+	return &slots[i];
+}
+
+// keeps the index under three quarters full; a failed grow only means
+// more probing
+static void grow(blob_store_t *s)
+{
+	unsigned int i, nslots = s->nslots * 2;
+	blob_ref_t *slots = calloc(nslots, sizeof(blob_ref_t));
+
+	if (slots == NULL)
+		return;
+	for (i = 0; i < s->nslots; i++)
+		if (s->slots[i].length)
+			*find_slot(slots, nslots, s->slots[i].hash, s->slots[i].length) = s->slots[i];
+	free(s->slots);
+	s->slots = slots;
+	s->nslots = nslots;
+}
+
+int blob_store_put(blob_store_t *s, const void *data, size_t len, blob_ref_t *ref)
+{
+	return blob_store_put_hashed(s, data, len, blob_hash(data, len), ref);
+}
+
+int blob_store_put_hashed(blob_store_t *s, const void *data, size_t len, unsigned long long hash, blob_ref_t *ref)
+{
+	unsigned char header[BLOB_HEADER_SIZE];
+	blob_ref_t *slot;
+	int i;
+
+	if (s->slots == NULL || s->failed || len == 0 || len > 0xffffffff)
+		return -1;
+
+	slot = find_slot(s->slots, s->nslots, hash, (unsigned int)len);
+	if (slot->length) {
+		*ref = *slot;
+		s->duplicates++;
+		s->saved += len;
+		return 0;
+	}
+	if (s->count + 1 > s->nslots / 4 * 3)
+		return -1;
+	if (s->size + BLOB_HEADER_SIZE + len > s->limit)
+		return -1;
+
+	for (i = 0; i < 8; i++)
+		header[i] = (unsigned char)(hash >> (i * 8));
+	for (i = 0; i < 4; i++)
+		header[8 + i] = (unsigned char)(len >> (i * 8));
+	if (!s->write(s->ctx, header, BLOB_HEADER_SIZE) || !s->write(s->ctx, data, len)) {
+		s->failed = 1;
+		return -1;
+	}
+
+	slot->hash = hash;
+	slot->length = (unsigned int)len;
+	slot->offset = s->size + BLOB_HEADER_SIZE;
+	s->size += BLOB_HEADER_SIZE + len;
+	s->count++;
+	s->written++;
+	*ref = *slot;
+
+	if (s->count >= s->nslots / 2)
+		grow(s);
+	return 1;
+}
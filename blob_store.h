@@ -0,0 +1,68 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Large logged buffers go out of band: each distinct buffer is appended
+// once to a separate blob stream and the log record carries only its hash,
+// length and offset. In the stream each blob is a BLOB_HEADER_SIZE header
+// (the 8 byte hash, then the 4 byte length, both little endian) followed by
+// its bytes; the offset is that of the bytes. Buffers already in the stream
+// are recognised by hash and length and not written again. No Windows
+// dependencies; the caller serialises every call and supplies the write,
+// which writes all it is given or fails.
+
+#define BLOB_HEADER_SIZE 12
+
+typedef int (*blob_write_t)(void *ctx, const void *data, size_t len);
+
+typedef struct _blob_ref_t {
+	unsigned long long hash;
+	unsigned long long offset;
+	unsigned int length;
+} blob_ref_t;
+
+typedef struct _blob_store_t {
+	blob_ref_t *slots;			// open addressing on the hash, length 0 free
+	unsigned int nslots;
+	unsigned int count;
+	unsigned long long size;	// of the stream so far
+	unsigned long long limit;	// that it may grow to
+	blob_write_t write;
+	void *ctx;
+	int failed;					// a write failed, the stream is unusable
+	unsigned int written;
+	unsigned int duplicates;
+	unsigned long long saved;	// bytes not written for duplicates
+} blob_store_t;
+
+unsigned long long blob_hash(const void *data, size_t len);
+
+// returns 0 if the index couldn't be allocated
+int blob_store_init(blob_store_t *s, unsigned long long limit, blob_write_t write, void *ctx);
+void blob_store_free(blob_store_t *s);
+
+// fills in ref for the len bytes at data, appending them to the stream if
+// they aren't there yet; returns 1 if they were appended, 0 if they already
+// were in the stream, or -1 if they can't be (nothing to store, the stream
+// would pass its limit or has failed)
+int blob_store_put(blob_store_t *s, const void *data, size_t len, blob_ref_t *ref);
+
+// blob_store_put given the blob_hash of the bytes, worked out beforehand
+int blob_store_put_hashed(blob_store_t *s, const void *data, size_t len, unsigned long long hash, blob_ref_t *ref);
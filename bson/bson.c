@@ -641,6 +641,48 @@ int bson_init_size( bson *b, int size ) {
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_init_arena( bson *b, bson_arena *arena ) {
+    if ( arena->data == NULL ) {
+        if ( arena->size < initialBufferSize )
+            arena->size = initialBufferSize;
+        arena->data = ( char * ) bson_malloc( arena->size );
+        if ( arena->data == NULL ) {
+            arena->size = 0;
+            return BSON_ERROR;
+        }
+    }
+    _bson_zero( b );
+    b->data = arena->data;
+    b->dataSize = arena->size;
+    b->ownsData = 1;
+    b->cur = b->data + 4;
+    // the object may move the block, so it isn't the arena's while in use
+    arena->data = NULL;
+    return BSON_OK;
+}
+
+MONGO_EXPORT void bson_arena_release( bson *b, bson_arena *arena ) {
+    if ( b->ownsData && b->data != NULL ) {
+        if ( arena->limit && b->dataSize > arena->limit ) {
+            bson_free( b->data );
+            arena->spills++;
+        }
+        else {
+            arena->data = b->data;
+            arena->size = b->dataSize;
+        }
+        b->ownsData = 0;
+    }
+    bson_destroy( b );
+}
+
+MONGO_EXPORT void bson_arena_destroy( bson_arena *arena ) {
+    if ( arena->data != NULL )
+        bson_free( arena->data );
+    arena->data = NULL;
+    arena->size = 0;
+}
+
 int bson_init_unfinished_data( bson *b, char *data, int dataSize, bson_bool_t ownsData ) {
     _bson_zero( b );
     b->data = data;
@@ -948,6 +990,22 @@ MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const
     return BSON_OK;
 }
 
+MONGO_EXPORT char *bson_append_binary_begin( bson *b, const char *name, char type, size_t max_len ) {
+    if ( type == BSON_BIN_BINARY_OLD )
+        return NULL;
+    if ( bson_append_estart( b, BSON_BINDATA, name, 4+1+max_len ) == BSON_ERROR )
+        return NULL;
+    bson_append32_as_int( b, 0 );
+    bson_append_byte( b, type );
+    return b->cur;
+}
+
+MONGO_EXPORT void bson_append_binary_end( bson *b, size_t len ) {
+    int i = ( int )len;
+    bson_little_endian32( b->cur - 5, &i );
+    b->cur += len;
+}
+
 MONGO_EXPORT int bson_append_oid( bson *b, const char *name, const bson_oid_t *oid ) {
     if ( bson_append_estart( b, BSON_OID, name, 12 ) == BSON_ERROR )
         return BSON_ERROR;
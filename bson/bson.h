@@ -149,6 +149,17 @@ typedef struct {
                                Must be at end of bson struct so _bson_zero does not clear. */
 } bson;
 
+/**
+ * A data block handed from one BSON object to the next, so that building
+ * many objects in a row doesn't allocate each one from scratch.
+ */
+typedef struct {
+    char *data;           /**< The block, or NULL while an object is using it. */
+    int size;             /**< Its size, the largest object built so far up to limit. */
+    int limit;            /**< Blocks grown beyond this are freed once the object is done. */
+    int spills;           /**< How many objects outgrew limit. */
+} bson_arena;
+
 #pragma pack(1)
 typedef union {
     char bytes[12];
@@ -735,6 +746,33 @@ MONGO_EXPORT int bson_finish( bson *b );
  */
 MONGO_EXPORT void bson_destroy( bson *b );
 
+/**
+ * Initialize a BSON object for building in the arena's block, allocating it
+ * on first use. The object owns the block until bson_arena_release( ), and
+ * bson_ensure_space( ) grows it as usual.
+ *
+ * @param b the BSON object to initialize.
+ * @param arena the arena, zeroed before first use apart from limit.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_EXPORT int bson_init_arena( bson *b, bson_arena *arena );
+
+/**
+ * Destroy a BSON object started with bson_init_arena( ), handing its block
+ * back to the arena, grown if need be, unless it grew past the arena's
+ * limit: such a block is freed and the arena starts over at its old size.
+ *
+ * @param b the bson object to destroy.
+ * @param arena the arena it was started from.
+ */
+MONGO_EXPORT void bson_arena_release( bson *b, bson_arena *arena );
+
+/**
+ * Free the arena's block.
+ */
+MONGO_EXPORT void bson_arena_destroy( bson_arena *arena );
+
 /**
  * Initialize a BSON object to an emoty object with a shared, static data
  * buffer.
@@ -930,6 +968,28 @@ MONGO_EXPORT int bson_append_code_w_scope_n( bson *b, const char *name, const ch
  */
 MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const char *str, size_t len );
 
+/**
+ * Start a binary field whose contents the caller writes in place, saving a
+ * copy when the data is produced by an encoder. Nothing else may be
+ * appended until bson_append_binary_end( ) gives the actual length.
+ *
+ * @param b the bson to append to.
+ * @param name the key for the data.
+ * @param type the binary data type (not BSON_BIN_BINARY_OLD).
+ * @param max_len the most bytes the caller will write.
+ *
+ * @return a pointer to max_len bytes to fill in, or NULL on error.
+ */
+MONGO_EXPORT char *bson_append_binary_begin( bson *b, const char *name, char type, size_t max_len );
+
+/**
+ * Finish a binary field started with bson_append_binary_begin( ).
+ *
+ * @param b the bson to append to.
+ * @param len the bytes actually written, at most max_len.
+ */
+MONGO_EXPORT void bson_append_binary_end( bson *b, size_t len );
+
 /**
  * Append a bson_bool_t to a bson.
  *
@@ -209,6 +209,7 @@ VOID CALLBACK New_DllLoadNotification(
 	}
 	else {
 		// unload
+		invalidate_address_classes();
 		if (!is_valid_address_range((ULONG_PTR)NotificationData->Unloaded.DllBase, 0x1000)) {
 			// if this unload actually caused removal of the DLL instead of a reference counter decrement,
 			// then we need to loop through our hooks and unmark the hooks eliminated by this removal
@@ -595,6 +596,8 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 		}
 
 		hkcu_init();
+		reg_key_cache_init();
+		export_cache_init();
 
 		// initialize the log file
 		if (!g_config.tlsdump)
@@ -0,0 +1,191 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "code_sig.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CODE_SIG_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// skipping by less than this on average loses to the vector search
+#define MIN_MEAN_SKIP 8
+
+// bytes too common in code to make a selective anchor
+static int common_code_byte(unsigned char b)
+{
+	return b == 0x00 || b == 0xff || b == 0xcc || b == 0x90 || b == 0x8b || b == 0x89 ||
+		b == 0x48 || b == 0x24 || b == 0x0f || b == 0xc0 || b == 0x45;
+}
+
+static int matches(const code_sig_t *s, const unsigned char *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->len; i++)
+		if ((p[i] & s->mask[i]) != s->bytes[i])
+			return 0;
+	return 1;
+}
+
+int code_sig_compile(code_sig_t *s, const unsigned char *bytes, const unsigned char *mask, unsigned int len)
+{
+	unsigned int i, x, total = 0;
+	int anchor = -1;
+
+	if (len == 0 || len > CODE_SIG_MAX_LEN)
+		return 0;
+
+	memset(s, 0, sizeof(*s));
+	s->len = len;
+	for (i = 0; i < len; i++) {
+		s->mask[i] = mask ? mask[i] : 0xff;
+		s->bytes[i] = bytes[i] & s->mask[i];
+		if (s->mask[i] == 0xff && (anchor < 0 || (common_code_byte(s->bytes[anchor]) && !common_code_byte(s->bytes[i]))))
+			anchor = i;
+	}
+
+	// the shift for a code byte is how far the signature's last byte is
+	// from the last earlier position that byte could match
+	memset(s->skip, len, sizeof(s->skip));
+	for (i = 0; i + 1 < len; i++)
+		for (x = 0; x < 256; x++)
+			if ((x & s->mask[i]) == s->bytes[i])
+				s->skip[x] = (unsigned char)(len - 1 - i);
+	for (x = 0; x < 256; x++)
+		total += s->skip[x];
+
+	if (anchor >= 0 && total < MIN_MEAN_SKIP * 256) {
+		s->anchor = anchor;
+		s->anchored = 1;
+	}
+	return 1;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int code_sig_parse(code_sig_t *s, const char *text)
+{
+	unsigned char bytes[CODE_SIG_MAX_LEN], mask[CODE_SIG_MAX_LEN];
+	unsigned int len = 0;
+
+	while (*text) {
+		if (*text == ' ') {
+			text++;
+			continue;
+		}
+		if (len == CODE_SIG_MAX_LEN || !text[1])
+			return 0;
+		if (text[0] == '?' && text[1] == '?') {
+			bytes[len] = 0;
+			mask[len] = 0;
+		}
+		else {
+			int hi = hex_digit(text[0]), lo = hex_digit(text[1]);
+			if (hi < 0 || lo < 0)
+				return 0;
+			bytes[len] = (unsigned char)(hi << 4 | lo);
+			mask[len] = 0xff;
+		}
+		len++;
+		text += 2;
+	}
+	return code_sig_compile(s, bytes, mask, len);
+}
+
+#ifdef CODE_SIG_SSE2
+static unsigned int lowest_bit(unsigned int m)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, m);
+	return i;
+#else
+	return __builtin_ctz(m);
+#endif
+}
+#endif
+
+// the first match starting at p up to last inclusive
+static const unsigned char *find_anchored(const code_sig_t *s, const unsigned char *p, const unsigned char *last)
+{
+	unsigned char a = s->bytes[s->anchor];
+
+#ifdef CODE_SIG_SSE2
+	__m128i va = _mm_set1_epi8((char)a);
+	// all 16 candidates in a block lie at or before last, so every byte
+	// read (the anchor of the last of them included) is in bounds
+	for (; last - p >= 15; p += 16) {
+		unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + s->anchor)), va));
+		while (m) {
+			const unsigned char *q = p + lowest_bit(m);
+			if (matches(s, q))
+				return q;
+			m &= m - 1;
+		}
+	}
+#endif
+	for (; p <= last; p++)
+		if (p[s->anchor] == a && matches(s, p))
+			return p;
+	return NULL;
+}
+
+const unsigned char *code_sig_find(const code_sig_t *s, const unsigned char *start, const unsigned char *end)
+{
+	const unsigned char *p = start, *last;
+
+	if (start == NULL || end < start || (size_t)(end - start) < s->len)
+		return NULL;
+	last = end - s->len;
+
+	if (s->anchored)
+		return find_anchored(s, p, last);
+
+	while (p <= last) {
+		if (matches(s, p))
+			return p;
+		p += s->skip[p[s->len - 1]];
+	}
+	return NULL;
+}
+
+const unsigned char *code_sig_find_last(const code_sig_t *s, const unsigned char *start, const unsigned char *end)
+{
+	const unsigned char *p, *found = NULL;
+
+	// the windows searched backwards are a page or so, not worth a table
+	// of their own
+	for (p = start; (p = code_sig_find(s, p, end)) != NULL; p++)
+		found = p;
+	return found;
+}
@@ -0,0 +1,56 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Masked byte signatures for the finders in misc.c that locate unexported
+// functions in jscript, mshtml and ntdll by the code around them. A byte
+// of the code matches a signature byte if it is equal under that byte's
+// mask, so a mask of 0 is a wildcard and 0xf8 matches any register in an
+// opcode like b8+r. Compiling a signature builds a Horspool skip table over
+// the masked bytes. Signatures long and specific enough for that table to
+// skip well are searched with it; short or mostly wildcarded ones (a call
+// opcode followed by a relative address to check) instead look for one of
+// their exact bytes with SSE2, 16 positions at a time. No Windows
+// dependencies.
+
+#define CODE_SIG_MAX_LEN 32
+
+typedef struct _code_sig_t {
+	unsigned char bytes[CODE_SIG_MAX_LEN];	// already masked
+	unsigned char mask[CODE_SIG_MAX_LEN];
+	unsigned int len;
+	unsigned int anchor;		// offset of the exact byte the vector search looks for
+	int anchored;				// search that way rather than by the skip table
+	unsigned char skip[256];	// by the code byte under the signature's last byte
+} code_sig_t;
+
+// mask may be NULL for all bytes exact; returns 0 if len is 0 or over
+// CODE_SIG_MAX_LEN
+int code_sig_compile(code_sig_t *s, const unsigned char *bytes, const unsigned char *mask, unsigned int len);
+
+// from text such as "e8 ?? ?? ?? ??", hex bytes and ?? wildcards separated
+// by spaces; returns 0 if it doesn't parse or is too long
+int code_sig_parse(code_sig_t *s, const char *text);
+
+// the first match lying wholly within [start, end), or NULL
+const unsigned char *code_sig_find(const code_sig_t *s, const unsigned char *start, const unsigned char *end);
+
+// the last match lying wholly within [start, end), or NULL
+const unsigned char *code_sig_find_last(const code_sig_t *s, const unsigned char *start, const unsigned char *end);
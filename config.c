@@ -186,6 +186,36 @@ void parse_config_line(char* line)
 		else if (!strcmp(key, "large-buffer-max")) {
 			large_buffer_log_max = (unsigned int)strtoul(value, NULL, 10);
 		}
+		else if (!strcmp(key, "blob-threshold")) {
+			log_blob_threshold = (unsigned int)strtoul(value, NULL, 10);
+		}
+		else if (!strcmp(key, "dedup-window")) {
+			log_dedup_window = (unsigned int)strtoul(value, NULL, 10);
+		}
+		else if (!strcmp(key, "dedup-latency")) {
+			log_dedup_latency = (unsigned int)strtoul(value, NULL, 10);
+		}
+		else if (!strcmp(key, "adaptive-logging")) {
+			log_adaptive = value[0] == '1';
+		}
+		else if (!strcmp(key, "adaptive-critical")) {
+			unsigned int x = 0;
+			char *p2;
+			p = value;
+			while (p && x < EXCLUSION_MAX) {
+				p2 = strchr(p, ':');
+				if (p2) {
+					*p2 = '\0';
+				}
+				g_config.adaptive_critical[x++] = strdup(p);
+				if (p2 == NULL)
+					break;
+				p = p2 + 1;
+			}
+		}
+		else if (!strcmp(key, "compact-logging")) {
+			log_compact = value[0] == '1';
+		}
 		else if (!stricmp(key, "log-exceptions")) {
 			g_config.log_exceptions = atoi(value);
 			if (g_config.log_exceptions)
@@ -1019,11 +1049,40 @@ void parse_config_line(char* line)
 				g_config.api_rate_cap = 2;
 			}
 		}
+		else if (!stricmp(key, "hook-stats")) {
+			g_config.hook_stats = value[0] == '1';
+			if (g_config.hook_stats)
+				DebugOutput("Per-hook profiling counters enabled.\n");
+		}
 		else if (!stricmp(key, "api-rate-cap")) {
 			g_config.api_rate_cap = (unsigned int)strtoul(value, NULL, 10);
 			if (g_config.api_rate_cap)
 				DebugOutput("API spam prevention enabled (%d).\n", g_config.api_rate_cap);
 		}
+		else if (!stricmp(key, "api-rate-budget")) {
+			// Name,rate[,burst] entries separated by colons
+			unsigned int x = 0;
+			char *p2, *p3;
+			p = value;
+			while (p && x < EXCLUSION_MAX) {
+				p2 = strchr(p, ':');
+				if (p2) {
+					*p2 = '\0';
+				}
+				p3 = strchr(p, ',');
+				if (p3) {
+					*p3++ = '\0';
+					g_config.api_rate_budgets[x][0] = (unsigned int)strtoul(p3, &p3, 10);
+					g_config.api_rate_budgets[x][1] = *p3 == ',' ? (unsigned int)strtoul(p3 + 1, NULL, 10) : g_config.api_rate_budgets[x][0];
+					g_config.api_rate_budget_names[x] = strdup(p);
+					DebugOutput("API rate budget for %s: %u calls/s, burst %u.\n", p, g_config.api_rate_budgets[x][0], g_config.api_rate_budgets[x][1]);
+					x++;
+				}
+				if (p2 == NULL)
+					break;
+				p = p2 + 1;
+			}
+		}
 		else if (!stricmp(key, "dump-crypto")) {
 			g_config.dump_crypto = value[0] == '1';
 			if (g_config.dump_crypto)
@@ -105,6 +105,18 @@ struct _g_config {
 	// Disable api hooks that spam
 	unsigned int api_rate_cap;
 
+	// Per-API budgets overriding the one api_rate_cap sets: calls a second
+	// and burst, with a rate of 0 exempting the API
+	char *api_rate_budget_names[EXCLUSION_MAX];
+	unsigned int api_rate_budgets[EXCLUSION_MAX][2];
+
+	// Categories and APIs adaptive logging never reduces to counts, on top
+	// of the built-in ones
+	char *adaptive_critical[EXCLUSION_MAX];
+
+	// Per-hook call, log and cycle counters, reported at exit
+	unsigned int hook_stats;
+
 	// server ip and port
 	//unsigned int host_ip;
 	//unsigned short host_port;
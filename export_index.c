@@ -0,0 +1,200 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "export_index.h"
+
+#define MAX_FORWARDS 4
+
+static unsigned int rd16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned int rd32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static unsigned int name_hash(const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+// the name in the image at rva and its length, or NULL if it runs off the
+// end of the image
+static const char *image_string(const export_index_t *x, unsigned int rva, size_t *len)
+{
+	const char *s;
+
+	if (rva == 0 || rva >= x->size)
+		return NULL;
+	s = (const char *)x->base + rva;
+	*len = strnlen(s, x->size - rva);
+	return *len < x->size - rva ? s : NULL;
+}
+
+int export_index_build(export_index_t *x, const unsigned char *base, size_t size)
+{
+	const unsigned char *nt, *dir;
+	unsigned int e_lfanew, magic, dd, i;
+
+	memset(x, 0, sizeof(*x));
+	x->base = base;
+	x->size = size;
+
+	if (size < 0x40 || base[0] != 'M' || base[1] != 'Z')
+		return 0;
+	e_lfanew = rd32(base + 0x3c);
+	if (e_lfanew > size || size - e_lfanew < 0x18 + 0x70 + 8 || memcmp(base + e_lfanew, "PE\0\0", 4))
+		return 0;
+	nt = base + e_lfanew;
+	magic = rd16(nt + 0x18);
+	// the export entry of the data directories
+	if (magic == 0x10b)
+		dd = 0x18 + 0x60;
+	else if (magic == 0x20b)
+		dd = 0x18 + 0x70;
+	else
+		return 0;
+	if (rd32(nt + (magic == 0x10b ? 0x74 : 0x84)) < 1)
+		return 0;
+
+	x->dir_rva = rd32(nt + dd);
+	x->dir_size = rd32(nt + dd + 4);
+	if (x->dir_rva == 0 || x->dir_rva > size - 40 || x->dir_size > size - x->dir_rva)
+		return 0;
+	dir = base + x->dir_rva;
+
+	x->ordinal_base = rd32(dir + 16);
+	x->nfunctions = rd32(dir + 20);
+	x->nnames = rd32(dir + 24);
+	if (x->nfunctions > size / 4 || rd32(dir + 28) > size - x->nfunctions * 4)
+		return 0;
+	x->functions = base + rd32(dir + 28);
+	if (x->nnames > size / 4 || rd32(dir + 32) > size - x->nnames * 4 || rd32(dir + 36) > size - x->nnames * 2)
+		x->nnames = 0;
+	x->names = base + rd32(dir + 32);
+	x->ordinals = base + rd32(dir + 36);
+
+	for (x->nslots = 16; x->nslots < x->nnames * 2; x->nslots *= 2);
+	x->slots = calloc(x->nslots, sizeof(unsigned int));
+	if (x->slots == NULL)
+		return 0;
+
+	for (i = 0; i < x->nnames; i++) {
+		size_t len;
+		const char *name = image_string(x, rd32(x->names + i * 4), &len);
+		unsigned int s;
+		if (name == NULL)
+			continue;
+		// the first of any duplicate names wins
+		for (s = name_hash(name, len) & (x->nslots - 1); x->slots[s]; s = (s + 1) & (x->nslots - 1));
+		x->slots[s] = i + 1;
+	}
+	return 1;
+}
+
+void export_index_free(export_index_t *x)
+{
+	free(x->slots);
+	x->slots = NULL;
+}
+
+static unsigned int function_rva(const export_index_t *x, unsigned int slot, int *forwarded)
+{
+	unsigned int rva;
+
+	if (slot >= x->nfunctions)
+		return 0;
+	rva = rd32(x->functions + slot * 4);
+	if (rva >= x->size)
+		return 0;
+	if (forwarded)
+		*forwarded = rva >= x->dir_rva && rva < x->dir_rva + x->dir_size;
+	return rva;
+}
+
+static unsigned int lookup_n(const export_index_t *x, const char *name, size_t len, int *forwarded)
+{
+	unsigned int s;
+
+	if (x->slots == NULL)
+		return 0;
+	for (s = name_hash(name, len) & (x->nslots - 1); x->slots[s]; s = (s + 1) & (x->nslots - 1)) {
+		unsigned int i = x->slots[s] - 1;
+		size_t elen;
+		const char *ename = image_string(x, rd32(x->names + i * 4), &elen);
+		if (ename && elen == len && !memcmp(ename, name, len))
+			return function_rva(x, rd16(x->ordinals + i * 2), forwarded);
+	}
+	return 0;
+}
+
+unsigned int export_index_lookup(const export_index_t *x, const char *name, int *forwarded)
+{
+	return lookup_n(x, name, strlen(name), forwarded);
+}
+
+unsigned int export_index_lookup_ordinal(const export_index_t *x, unsigned int ordinal, int *forwarded)
+{
+	if (ordinal < x->ordinal_base)
+		return 0;
+	return function_rva(x, ordinal - x->ordinal_base, forwarded);
+}
+
+const void *export_index_resolve(const export_index_t *x, const char *name, export_module_t module, void *ctx, int *unresolved)
+{
+	size_t len = strlen(name);
+	unsigned int depth, ordinal = 0;
+
+	*unresolved = 0;
+	for (depth = 0; depth <= MAX_FORWARDS; depth++) {
+		int forwarded = 0;
+		unsigned int rva = ordinal ? export_index_lookup_ordinal(x, ordinal, &forwarded) : lookup_n(x, name, len, &forwarded);
+		const char *fwd, *dot;
+		size_t fwdlen;
+
+		if (rva == 0)
+			return NULL;
+		if (!forwarded)
+			return x->base + rva;
+
+		// "MODULE.Name" or "MODULE.#ordinal"
+		fwd = image_string(x, rva, &fwdlen);
+		dot = fwd ? memchr(fwd, '.', fwdlen) : NULL;
+		if (dot == NULL || module == NULL || (x = module(ctx, fwd, dot - fwd)) == NULL)
+			break;
+		name = dot + 1;
+		len = fwdlen - (name - fwd);
+		ordinal = 0;
+		if (*name == '#') {
+			ordinal = (unsigned int)strtoul(name + 1, NULL, 10);
+			if (ordinal == 0)
+				break;
+		}
+	}
+	*unresolved = 1;
+	return NULL;
+}
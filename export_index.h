@@ -0,0 +1,62 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// An index over the export directory of a mapped module, built once by
+// parsing the directory directly: a hash table from export name to its
+// slot in the name table, so every hook on the module resolves its address
+// with one hashed probe rather than a GetProcAddress call each. Forwarded
+// exports ("OTHER.Name" or "OTHER.#ordinal") are followed through the
+// indexes of the modules they point to, via a callback. Every offset read
+// from the image is checked against its size. No Windows dependencies.
+
+typedef struct _export_index_t {
+	const unsigned char *base;
+	size_t size;
+	unsigned int dir_rva;		// the export directory, holding forwarders too
+	unsigned int dir_size;
+	unsigned int ordinal_base;
+	unsigned int nfunctions;
+	unsigned int nnames;
+	const unsigned char *functions;	// rvas, by ordinal - ordinal_base
+	const unsigned char *names;		// name rvas
+	const unsigned char *ordinals;	// 16-bit function slots, by name
+	unsigned int *slots;		// name slot + 1, 0 for free
+	unsigned int nslots;
+} export_index_t;
+
+// finds the index of the module a forwarder names (the part before the
+// dot, without ".dll"), or returns NULL
+typedef const export_index_t *(*export_module_t)(void *ctx, const char *module, size_t len);
+
+// returns 0 if the image has no usable export directory or the table
+// couldn't be allocated
+int export_index_build(export_index_t *x, const unsigned char *base, size_t size);
+void export_index_free(export_index_t *x);
+
+// the rva of an export, 0 if there isn't one; if it's forwarded the rva is
+// that of the forwarder string and *forwarded is set
+unsigned int export_index_lookup(const export_index_t *x, const char *name, int *forwarded);
+unsigned int export_index_lookup_ordinal(const export_index_t *x, unsigned int ordinal, int *forwarded);
+
+// the address of an export, following forwarders through module() up to a
+// few modules deep; NULL if it isn't there or a forwarder can't be followed
+// (*unresolved is set then)
+const void *export_index_resolve(const export_index_t *x, const char *name, export_module_t module, void *ctx, int *unresolved);
@@ -0,0 +1,46 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "frame_walk.h"
+
+#define WORD sizeof(size_t)
+
+unsigned int frame_walk(size_t sp, size_t fp, size_t stack_low, size_t stack_high, size_t *frames, unsigned int max)
+{
+	unsigned int count = 0;
+
+	if (stack_high < stack_low + 2 * WORD)
+		return 0;
+
+	if (sp >= stack_low && sp <= stack_high - WORD) {
+		if (count < max)
+			frames[count++] = *(const size_t *)sp;
+		// the frames we were called from are all above the stack pointer
+		stack_low = sp;
+	}
+
+	while (count < max && fp >= stack_low && fp <= stack_high - 2 * WORD && !(fp & (WORD - 1))) {
+		const size_t *frame = (const size_t *)fp;
+		frames[count++] = frame[1];
+		// the caller's frame has to start past this one
+		stack_low = fp + 2 * WORD;
+		fp = frame[0];
+	}
+	return count;
+}
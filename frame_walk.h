@@ -0,0 +1,32 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Walks a chain of saved frame pointers, each frame holding the caller's
+// frame pointer followed by the return address, as 32-bit code built with
+// frame pointers lays them out. Every frame is checked against the stack
+// bounds with arithmetic alone: it has to be aligned, fit below the top of
+// the stack and lie above the frame before it, so a corrupted or looping
+// chain ends the walk rather than repeating it, and no frame is read
+// twice. No Windows dependencies; the caller guards the reads.
+
+// the return address at sp (if sp is on the stack) then those of the
+// frames from fp up; returns how many were stored in frames
+unsigned int frame_walk(size_t sp, size_t fp, size_t stack_low, size_t stack_high, size_t *frames, unsigned int max);
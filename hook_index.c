@@ -0,0 +1,190 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "hook_index.h"
+
+static unsigned short fold(unsigned short c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static unsigned int name_hash(const unsigned short *name, size_t *len)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; name[i]; i++)
+		h = (h ^ fold(name[i])) * 16777619u;
+	*len = i;
+	return h;
+}
+
+static int name_equal(const unsigned short *folded, const unsigned short *name)
+{
+	while (*folded && *folded == fold(*name)) {
+		folded++;
+		name++;
+	}
+	return *folded == 0 && *name == 0;
+}
+
+// the group for library, or HOOK_INDEX_END; *slot gets where it is or
+// would go in the table
+static unsigned int find_group(const hook_index_t *x, const unsigned short *library, unsigned int hash, unsigned int *slot)
+{
+	unsigned int s;
+
+	for (s = hash & (x->nslots - 1); x->table[s]; s = (s + 1) & (x->nslots - 1)) {
+		const hook_group_t *g = &x->groups[x->table[s] - 1];
+		if (g->hash == hash && name_equal(g->name, library))
+			break;
+	}
+	if (slot)
+		*slot = s;
+	return x->table[s] ? x->table[s] - 1 : HOOK_INDEX_END;
+}
+
+static unsigned int add_group(hook_index_t *x, const unsigned short *library)
+{
+	unsigned int s, group, hash;
+	size_t len, i;
+	hook_group_t *g;
+
+	hash = name_hash(library, &len);
+	group = find_group(x, library, hash, &s);
+	if (group != HOOK_INDEX_END)
+		return group;
+	if (x->ngroups == x->maxgroups)
+		return HOOK_INDEX_END;
+
+	g = &x->groups[x->ngroups];
+	g->name = malloc((len + 1) * sizeof(unsigned short));
+	if (g->name == NULL)
+		return HOOK_INDEX_END;
+	for (i = 0; i <= len; i++)
+		g->name[i] = fold(library[i]);
+	g->hash = hash;
+	g->first = HOOK_INDEX_END;
+	x->table[s] = ++x->ngroups;
+	return x->ngroups - 1;
+}
+
+// links hook into group, keeping table order
+static void link_hook(hook_index_t *x, unsigned int group, unsigned int hook)
+{
+	unsigned int *p = &x->groups[group].first;
+
+	while (*p != HOOK_INDEX_END && *p < hook)
+		p = &x->next[*p];
+	x->next[hook] = *p;
+	*p = hook;
+	x->group_of[hook] = group;
+}
+
+static void unlink_hook(hook_index_t *x, unsigned int hook)
+{
+	unsigned int *p;
+
+	if (x->group_of[hook] == HOOK_INDEX_END)
+		return;
+	for (p = &x->groups[x->group_of[hook]].first; *p != hook; p = &x->next[*p]);
+	*p = x->next[hook];
+	x->group_of[hook] = HOOK_INDEX_END;
+}
+
+int hook_index_build(hook_index_t *x, const unsigned short *const *libraries, unsigned int count)
+{
+	unsigned int i;
+
+	memset(x, 0, sizeof(*x));
+	// every hook could end up moved to a library of its own
+	x->maxgroups = count * 2 + 1;
+	for (x->nslots = 16; x->nslots < x->maxgroups * 2; x->nslots *= 2);
+	x->groups = calloc(x->maxgroups, sizeof(hook_group_t));
+	x->table = calloc(x->nslots, sizeof(unsigned int));
+	x->next = malloc((count + 1) * sizeof(unsigned int));
+	x->group_of = malloc((count + 1) * sizeof(unsigned int));
+	x->nhooks = count;
+	if (!x->groups || !x->table || !x->next || !x->group_of) {
+		hook_index_free(x);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		unsigned int group;
+		x->group_of[i] = HOOK_INDEX_END;
+		if (libraries[i] == NULL)
+			continue;
+		group = add_group(x, libraries[i]);
+		if (group == HOOK_INDEX_END) {
+			hook_index_free(x);
+			return 0;
+		}
+		link_hook(x, group, i);
+	}
+	return 1;
+}
+
+void hook_index_free(hook_index_t *x)
+{
+	unsigned int i;
+
+	if (x->groups)
+		for (i = 0; i < x->ngroups; i++)
+			free(x->groups[i].name);
+	free(x->groups);
+	free(x->table);
+	free(x->next);
+	free(x->group_of);
+	memset(x, 0, sizeof(*x));
+}
+
+unsigned int hook_index_first(const hook_index_t *x, const unsigned short *library)
+{
+	unsigned int group;
+	size_t len;
+
+	if (x->table == NULL)
+		return HOOK_INDEX_END;
+	group = find_group(x, library, name_hash(library, &len), NULL);
+	return group == HOOK_INDEX_END ? HOOK_INDEX_END : x->groups[group].first;
+}
+
+unsigned int hook_index_next(const hook_index_t *x, unsigned int hook)
+{
+	return x->next[hook];
+}
+
+int hook_index_move(hook_index_t *x, unsigned int hook, const unsigned short *library)
+{
+	unsigned int group;
+
+	if (x->table == NULL || hook >= x->nhooks)
+		return 0;
+	group = add_group(x, library);
+	if (group == HOOK_INDEX_END)
+		return 0;
+	if (group == x->group_of[hook])
+		return 1;
+	unlink_hook(x, hook);
+	link_hook(x, group, hook);
+	return 1;
+}
@@ -0,0 +1,62 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// The hook table grouped by library, so a DLL load only visits the hooks
+// for that DLL rather than comparing every entry's library name. Groups
+// are found by a hash of the case-folded name (case-insensitive as
+// wcsicmp), and each lists its hooks in table order, which is the order
+// they are installed in. A hook can be moved to another library, as hooks
+// are when a renamed DLL is recognised by its export directory name. No
+// Windows dependencies; names are 16-bit units and the caller serialises
+// calls.
+
+#define HOOK_INDEX_END ((unsigned int)-1)
+
+typedef struct _hook_group_t {
+	unsigned int hash;
+	unsigned short *name;		// case folded, NUL terminated
+	unsigned int first;			// hook, or HOOK_INDEX_END
+} hook_group_t;
+
+typedef struct _hook_index_t {
+	hook_group_t *groups;
+	unsigned int ngroups;
+	unsigned int maxgroups;
+	unsigned int *table;		// group + 1, 0 for free
+	unsigned int nslots;
+	unsigned int *next;			// per hook, the next in its group
+	unsigned int *group_of;		// per hook, HOOK_INDEX_END if in none
+	unsigned int nhooks;
+} hook_index_t;
+
+// libraries[i] is hook i's library, or NULL for a hook given by address;
+// returns 0 if out of memory
+int hook_index_build(hook_index_t *x, const unsigned short *const *libraries, unsigned int count);
+void hook_index_free(hook_index_t *x);
+
+// the first hook on library, then the next after hook, in table order;
+// HOOK_INDEX_END when there are no more
+unsigned int hook_index_first(const hook_index_t *x, const unsigned short *library);
+unsigned int hook_index_next(const hook_index_t *x, unsigned int hook);
+
+// moves hook to library's group; returns 0 if out of memory, leaving the
+// hook where it was
+int hook_index_move(hook_index_t *x, unsigned int hook, const unsigned short *library);
@@ -359,6 +359,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtClose,
 	if(NT_SUCCESS(ret)) {
 		remove_file_from_log_tracking(Handle);
 		file_close(Handle);
+		reg_key_cache_forget(Handle);
 	}
 	return ret;
 }
@@ -387,6 +388,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtDuplicateObject,
 		if (SourceProcessHandle == NtCurrentProcess() && (Options & DUPLICATE_CLOSE_SOURCE)) {
 			remove_file_from_log_tracking(SourceHandle);
 			file_close(SourceHandle);
+			reg_key_cache_forget(SourceHandle);
 		}
 	}
 	return ret;
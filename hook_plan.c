@@ -0,0 +1,67 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include "hook_plan.h"
+
+static int compare_patches(const void *a, const void *b)
+{
+	const hook_patch_t *x = (const hook_patch_t *)a, *y = (const hook_patch_t *)b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	// the same address from two entries: the first entry wins, as it did
+	// when they were hooked one by one
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+unsigned int hook_plan(hook_patch_t *patches, unsigned int count, size_t page_size, hook_page_run_t *runs)
+{
+	size_t mask = page_size - 1, end = 0;
+	unsigned int i, nruns = 0;
+	hook_page_run_t *run = NULL;
+
+	qsort(patches, count, sizeof(*patches), compare_patches);
+
+	for (i = 0; i < count; i++) {
+		hook_patch_t *p = &patches[i];
+		size_t first_page = p->start & ~mask;
+		size_t last_page = (p->start + p->len + mask) & ~mask;
+
+		p->skip = i > 0 && p->start < end;
+		if (p->skip) {
+			run->count++;
+			continue;
+		}
+		end = p->start + p->len;
+
+		if (run && first_page < run->base + run->size) {
+			if (last_page > run->base + run->size)
+				run->size = last_page - run->base;
+			run->count++;
+			continue;
+		}
+		run = &runs[nruns++];
+		run->base = first_page;
+		run->size = last_page - first_page;
+		run->first = i;
+		run->count = 1;
+	}
+	return nruns;
+}
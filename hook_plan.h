@@ -0,0 +1,47 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Plans the patching of a batch of hooks whose addresses are resolved and
+// trampolines built: the patches are sorted by address, any overlapping an
+// earlier one (the same function reached through two hook entries) is
+// marked to be skipped, and the rest are gathered into runs of pages, each
+// made writable once and flushed once however many patches land in it.
+// Patches whose pages overlap share a run; merely adjacent pages don't, as
+// they may belong to sections with different protections. No Windows
+// dependencies.
+
+typedef struct _hook_patch_t {
+	size_t start;			// first byte written
+	unsigned int len;		// bytes written
+	unsigned int id;		// the caller's
+	int skip;				// overlaps a patch planned before it
+} hook_patch_t;
+
+typedef struct _hook_page_run_t {
+	size_t base;			// page aligned
+	size_t size;			// a multiple of the page size
+	unsigned int first;		// its patches, in the sorted array
+	unsigned int count;
+} hook_page_run_t;
+
+// sorts patches and fills runs (which has room for count of them),
+// returning how many there are; page_size is a power of two
+unsigned int hook_plan(hook_patch_t *patches, unsigned int count, size_t page_size, hook_page_run_t *runs);
@@ -44,6 +44,7 @@ extern void AllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG Alloca
 extern void DebuggerAllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG Protect);
 extern void ProtectionHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG Protect, PULONG OldProtect);
 extern void FreeHandler(PVOID BaseAddress);
+extern void YaraInvalidate(PVOID Address, SIZE_T Size);
 extern void ProcessTrackedRegion();
 extern void DebuggerShutdown();
 extern void ProcessMessage(DWORD ProcessId, DWORD ThreadId);
@@ -457,6 +458,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtTerminateProcess,
 		Pid = GetCurrentProcessId();
 		process_shutting_down = 1;
 		LOQ_ntstatus("process", "ph", "ProcessHandle", ProcessHandle, "ExitCode", ExitStatus);
+		hook_stats_report();
 		log_free();
 		file_handle_terminate();
 	}
@@ -773,7 +775,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtWriteVirtualMemory,
 		"BufferLength", is_valid_address_range((ULONG_PTR)NumberOfBytesWritten, 4) ? *NumberOfBytesWritten : 0,
 		"StackPivoted", is_stack_pivoted() ? "yes" : "no");
 
-	if (pid != GetCurrentProcessId()) {
+	if (pid == GetCurrentProcessId() && NT_SUCCESS(ret))
+		YaraInvalidate(BaseAddress, NumberOfBytesToWrite);
+	else if (pid != GetCurrentProcessId()) {
 		if (NT_SUCCESS(ret)) {
 			if (g_config.injection)
 				WriteMemoryHandler(ProcessHandle, BaseAddress, Buffer, *NumberOfBytesWritten);
@@ -804,7 +808,9 @@ HOOKDEF(BOOL, WINAPI, WriteProcessMemory,
 	LOQ_bool("process", "ppBhs", "ProcessHandle", hProcess, "BaseAddress", lpBaseAddress,
 		"Buffer", lpNumberOfBytesWritten, lpBuffer, "BufferLength", *lpNumberOfBytesWritten, "StackPivoted", is_stack_pivoted() ? "yes" : "no");
 
-	if (pid != GetCurrentProcessId()) {
+	if (pid == GetCurrentProcessId() && ret)
+		YaraInvalidate(lpBaseAddress, nSize);
+	else if (pid != GetCurrentProcessId()) {
 		if (ret) {
 			if (g_config.injection)
 				WriteMemoryHandler(hProcess, lpBaseAddress, lpBuffer, *lpNumberOfBytesWritten);
@@ -1043,6 +1049,16 @@ HOOKDEF(NTSTATUS, WINAPI, NtFreeVirtualMemory,
 	NTSTATUS ret = Old_NtFreeVirtualMemory(ProcessHandle, BaseAddress,
 		RegionSize, FreeType);
 
+	// on success the call has written back the region it actually freed
+	if (NT_SUCCESS(ret) && GetCurrentProcessId() == our_getprocessid(ProcessHandle)) {
+		__try {
+			YaraInvalidate(*BaseAddress, *RegionSize);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			;
+		}
+	}
+
 	LOQ_ntstatus("process", "pPPh", "ProcessHandle", ProcessHandle, "BaseAddress", BaseAddress,
 		"RegionSize", RegionSize, "FreeType", FreeType);
 
@@ -34,6 +34,8 @@ HOOKDEF(LONG, WINAPI, RegOpenKeyExA,
 	HKEY saved_hkey = phkResult ? *phkResult : INVALID_HANDLE_VALUE;
 	LONG ret = Old_RegOpenKeyExA(hKey, lpSubKey, ulOptions, samDesired,
 		phkResult);
+	if (ret == ERROR_SUCCESS && phkResult)
+		reg_key_cache_forget(*phkResult);
 
 	// fake the absence of some keys
 	if (!g_config.no_stealth && (ret == ERROR_SUCCESS || ret == ERROR_ACCESS_DENIED)) {
@@ -88,6 +90,8 @@ HOOKDEF(LONG, WINAPI, RegOpenKeyExW,
 	HKEY saved_hkey = phkResult ? *phkResult : INVALID_HANDLE_VALUE;
 	LONG ret = Old_RegOpenKeyExW(hKey, lpSubKey, ulOptions, samDesired,
 		phkResult);
+	if (ret == ERROR_SUCCESS && phkResult)
+		reg_key_cache_forget(*phkResult);
 
 	// fake the absence of some keys
 	if (!g_config.no_stealth && (ret == ERROR_SUCCESS || ret == ERROR_ACCESS_DENIED)) {
@@ -148,6 +152,8 @@ HOOKDEF(LONG, WINAPI, RegCreateKeyExA,
 	ret = Old_RegCreateKeyExA(hKey, lpSubKey, Reserved, lpClass,
 		dwOptions, samDesired, lpSecurityAttributes, phkResult,
 		lpdwDisposition);
+	if (ret == ERROR_SUCCESS && phkResult)
+		reg_key_cache_forget(*phkResult);
 
 	// fake the absence of some keys
 	if (!g_config.no_stealth && ret == ERROR_SUCCESS && *lpdwDisposition == REG_OPENED_EXISTING_KEY) {
@@ -196,6 +202,8 @@ HOOKDEF(LONG, WINAPI, RegCreateKeyExW,
 	ret = Old_RegCreateKeyExW(hKey, lpSubKey, Reserved, lpClass,
 		dwOptions, samDesired, lpSecurityAttributes, phkResult,
 		lpdwDisposition);
+	if (ret == ERROR_SUCCESS && phkResult)
+		reg_key_cache_forget(*phkResult);
 
 	// fake the absence of some keys
 	if (!g_config.no_stealth && ret == ERROR_SUCCESS && *lpdwDisposition == REG_OPENED_EXISTING_KEY) {
@@ -656,6 +664,8 @@ HOOKDEF(LONG, WINAPI, RegCloseKey,
 	) {
 	LONG ret = Old_RegCloseKey(hKey);
 	LOQ_zero("registry", "p", "Handle", hKey);
+	if (ret == ERROR_SUCCESS)
+		reg_key_cache_forget(hKey);
 	return ret;
 }
 
@@ -37,6 +37,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateKey,
 	ENSURE_ULONG(Disposition);
 	ret = Old_NtCreateKey(KeyHandle, DesiredAccess, ObjectAttributes,
 		TitleIndex, Class, CreateOptions, Disposition);
+	if (NT_SUCCESS(ret) && KeyHandle)
+		reg_key_cache_forget(*KeyHandle);
 	LOQ_ntstatus("registry", "PhpoKoI", "KeyHandle", KeyHandle, "DesiredAccess", DesiredAccess,
 		"ObjectAttributesHandle", handle_from_objattr(ObjectAttributes),
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
@@ -51,6 +53,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenKey,
 	__in   POBJECT_ATTRIBUTES ObjectAttributes
 ) {
 	NTSTATUS ret = Old_NtOpenKey(KeyHandle, DesiredAccess, ObjectAttributes);
+	if (NT_SUCCESS(ret) && KeyHandle)
+		reg_key_cache_forget(*KeyHandle);
 	LOQ_ntstatus("registry", "PhpoK", "KeyHandle", KeyHandle, "DesiredAccess", DesiredAccess,
 		"ObjectAttributesHandle", handle_from_objattr(ObjectAttributes),
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
@@ -66,6 +70,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenKeyEx,
 ) {
 	NTSTATUS ret = Old_NtOpenKeyEx(KeyHandle, DesiredAccess, ObjectAttributes,
 		OpenOptions);
+	if (NT_SUCCESS(ret) && KeyHandle)
+		reg_key_cache_forget(*KeyHandle);
 	LOQ_ntstatus("registry", "PhpoK", "KeyHandle", KeyHandle, "DesiredAccess", DesiredAccess,
 		"ObjectAttributesHandle", handle_from_objattr(ObjectAttributes),
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
@@ -79,6 +85,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtRenameKey,
 ) {
 	NTSTATUS ret = Old_NtRenameKey(KeyHandle, NewName);
 	LOQ_ntstatus("registry", "po", "KeyHandle", KeyHandle, "NewName", NewName);
+	// every open handle under the key now has a different name
+	if (NT_SUCCESS(ret))
+		reg_key_cache_flush();
 	return ret;
 }
 
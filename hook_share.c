@@ -0,0 +1,182 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "hook_share.h"
+
+static unsigned short fold(unsigned short c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+unsigned int hook_share_hash(unsigned int hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+// of the size bytes at buf, taking the header's checksum as 0
+static unsigned int checksum(const void *buf, size_t size)
+{
+	hook_share_header_t h;
+
+	memcpy(&h, buf, sizeof(h));
+	h.checksum = 0;
+	return hook_share_hash(hook_share_hash(HOOK_SHARE_HASH_INIT, &h, sizeof(h)),
+		(const unsigned char *)buf + sizeof(h), size - sizeof(h));
+}
+
+int hook_share_name_matches(const hook_share_module_t *module, const unsigned short *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < HOOK_SHARE_NAME_LEN && module->name[i]; i++)
+		if (module->name[i] != fold(name[i]))
+			return 0;
+	return i < HOOK_SHARE_NAME_LEN && name[i] == 0;
+}
+
+int hook_share_add_module(hook_share_module_t *modules, unsigned int *count, const unsigned short *name, unsigned int timestamp, unsigned int image_size)
+{
+	hook_share_module_t *m;
+	unsigned int i;
+
+	for (i = 0; i < *count; i++)
+		if (modules[i].timestamp == timestamp && modules[i].image_size == image_size && hook_share_name_matches(&modules[i], name))
+			return (int)i;
+
+	if (*count >= HOOK_SHARE_MAX_MODULES || !name[0] || !image_size)
+		return -1;
+	m = &modules[*count];
+	memset(m, 0, sizeof(*m));
+	for (i = 0; name[i]; i++) {
+		if (i == HOOK_SHARE_NAME_LEN - 1)
+			return -1;
+		m->name[i] = fold(name[i]);
+	}
+	m->timestamp = timestamp;
+	m->image_size = image_size;
+	return (int)(*count)++;
+}
+
+size_t hook_share_size(unsigned int module_count, unsigned int entry_count)
+{
+	return sizeof(hook_share_header_t) + (size_t)module_count * sizeof(hook_share_module_t) + (size_t)entry_count * sizeof(hook_share_entry_t);
+}
+
+size_t hook_share_write(void *buf, size_t cap, unsigned int pointer_size, unsigned int table_hash,
+	const hook_share_module_t *modules, unsigned int module_count, const hook_share_entry_t *entries, unsigned int entry_count)
+{
+	hook_share_header_t *h = buf;
+	size_t size = hook_share_size(module_count, entry_count);
+	unsigned int i;
+
+	if (module_count > HOOK_SHARE_MAX_MODULES || size > cap || size > 0xffffffff)
+		return 0;
+	for (i = 1; i < entry_count; i++)
+		if (entries[i].hook <= entries[i-1].hook)
+			return 0;
+
+	memset(h, 0, sizeof(*h));
+	h->magic = HOOK_SHARE_MAGIC;
+	h->version = HOOK_SHARE_VERSION;
+	h->size = (unsigned int)size;
+	h->pointer_size = pointer_size;
+	h->table_hash = table_hash;
+	h->module_count = module_count;
+	h->entry_count = entry_count;
+	memcpy(h + 1, modules, module_count * sizeof(hook_share_module_t));
+	memcpy((hook_share_module_t *)(h + 1) + module_count, entries, entry_count * sizeof(hook_share_entry_t));
+	h->checksum = checksum(buf, size);
+	return size;
+}
+
+const hook_share_module_t *hook_share_module(const hook_share_header_t *plan, unsigned int module)
+{
+	return (const hook_share_module_t *)(plan + 1) + module;
+}
+
+static const hook_share_entry_t *entries_of(const hook_share_header_t *plan)
+{
+	return (const hook_share_entry_t *)hook_share_module(plan, plan->module_count);
+}
+
+static int module_valid(const hook_share_module_t *m)
+{
+	unsigned int i;
+
+	if (!m->image_size || !m->name[0])
+		return 0;
+	for (i = 0; i < HOOK_SHARE_NAME_LEN && m->name[i]; i++)
+		if (m->name[i] != fold(m->name[i]))
+			return 0;
+	return i < HOOK_SHARE_NAME_LEN;
+}
+
+const hook_share_header_t *hook_share_validate(const void *buf, size_t size, unsigned int pointer_size, unsigned int table_hash)
+{
+	const hook_share_header_t *h = buf;
+	const hook_share_entry_t *e;
+	unsigned int i;
+
+	// the counts first, so nothing past the end is read
+	if (buf == NULL || size < sizeof(*h) || h->magic != HOOK_SHARE_MAGIC || h->version != HOOK_SHARE_VERSION)
+		return NULL;
+	if (h->pointer_size != pointer_size || h->table_hash != table_hash)
+		return NULL;
+	if (h->size > size || h->module_count > HOOK_SHARE_MAX_MODULES || h->entry_count > h->size / sizeof(hook_share_entry_t) ||
+		hook_share_size(h->module_count, h->entry_count) != h->size)
+		return NULL;
+	if (checksum(buf, h->size) != h->checksum)
+		return NULL;
+
+	// then what the counts cover, as a checksum only catches accidents
+	for (i = 0; i < h->module_count; i++)
+		if (!module_valid(hook_share_module(h, i)))
+			return NULL;
+	e = entries_of(h);
+	for (i = 0; i < h->entry_count; i++) {
+		if ((i && e[i].hook <= e[i-1].hook) || e[i].module >= h->module_count || e[i].flags)
+			return NULL;
+		if (e[i].rva >= hook_share_module(h, e[i].module)->image_size || e[i].witness >= hook_share_module(h, e[i].module)->image_size)
+			return NULL;
+	}
+	return h;
+}
+
+const hook_share_entry_t *hook_share_find(const hook_share_header_t *plan, unsigned int hook)
+{
+	const hook_share_entry_t *e = entries_of(plan);
+	unsigned int lo = 0, hi = plan->entry_count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (e[mid].hook < hook)
+			lo = mid + 1;
+		else if (e[mid].hook > hook)
+			hi = mid;
+		else
+			return &e[mid];
+	}
+	return NULL;
+}
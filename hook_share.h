@@ -0,0 +1,94 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// A resolved hook plan as one process hands it to the processes it starts:
+// where the hooks that are found by scanning code rather than through the
+// exports were found, as offsets into their modules, with the modules
+// identified by name, link timestamp and image size, and with each the
+// offset of the code the scan found it through. A child whose copy of a
+// module matches checks the function is what its own scan would have taken
+// that code to lead to, then takes the offset instead of scanning again.
+// The layout is a header, the module records, then the entries sorted by
+// hook, all fixed width and position independent. A plan comes from
+// another process, which may be the sample: hook_share_validate only makes
+// it safe to read, and every offset is to be checked before it is used. No
+// Windows dependencies; names are 16-bit units.
+
+#define HOOK_SHARE_MAGIC 0x4e4c5043		// "CPLN"
+#define HOOK_SHARE_VERSION 2
+#define HOOK_SHARE_MAX_MODULES 64
+#define HOOK_SHARE_NAME_LEN 32
+
+typedef struct _hook_share_header_t {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;				// of the whole plan
+	unsigned int checksum;			// of the whole plan, with this as 0
+	unsigned int pointer_size;		// of the process that wrote it
+	unsigned int table_hash;		// of the hook table it was resolved for
+	unsigned int module_count;
+	unsigned int entry_count;
+} hook_share_header_t;
+
+typedef struct _hook_share_module_t {
+	unsigned int timestamp;
+	unsigned int image_size;
+	unsigned short name[HOOK_SHARE_NAME_LEN];	// case folded, NUL terminated
+} hook_share_module_t;
+
+typedef struct _hook_share_entry_t {
+	unsigned int hook;				// index into the hook table
+	unsigned short module;
+	unsigned short flags;			// none yet, 0
+	unsigned int rva;
+	unsigned int witness;			// of the code it was found through
+} hook_share_entry_t;
+
+// FNV-1a, for the checksum and for callers hashing their hook table
+unsigned int hook_share_hash(unsigned int hash, const void *data, size_t len);
+#define HOOK_SHARE_HASH_INIT 2166136261u
+
+// the module record for name, timestamp and image_size, added if there is
+// none yet; returns its index, or -1 if the name doesn't fit or there are
+// HOOK_SHARE_MAX_MODULES already
+int hook_share_add_module(hook_share_module_t *modules, unsigned int *count, const unsigned short *name, unsigned int timestamp, unsigned int image_size);
+
+// whether name is the module's, ignoring ASCII case
+int hook_share_name_matches(const hook_share_module_t *module, const unsigned short *name);
+
+size_t hook_share_size(unsigned int module_count, unsigned int entry_count);
+
+// writes a plan of the given modules and entries, which must be sorted by
+// hook with no hook twice; returns its size, or 0 if they aren't or it
+// doesn't fit in cap
+size_t hook_share_write(void *buf, size_t cap, unsigned int pointer_size, unsigned int table_hash,
+	const hook_share_module_t *modules, unsigned int module_count, const hook_share_entry_t *entries, unsigned int entry_count);
+
+// the plan in the size bytes at buf if it is whole and was written for the
+// same pointer size and hook table, else NULL. Every count, index, name and
+// offset is checked to be in range, so the lookups below need no checks of
+// their own
+const hook_share_header_t *hook_share_validate(const void *buf, size_t size, unsigned int pointer_size, unsigned int table_hash);
+
+const hook_share_module_t *hook_share_module(const hook_share_header_t *plan, unsigned int module);
+
+// hook's entry, or NULL if the plan has none
+const hook_share_entry_t *hook_share_find(const hook_share_header_t *plan, unsigned int hook);
@@ -0,0 +1,106 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hook_stats.h"
+
+size_t hook_stats_shard_size(unsigned int count)
+{
+	return offsetof(hook_stats_shard_t, counters) + (count ? count : 1) * sizeof(hook_counters_t);
+}
+
+void hook_stats_merge(hook_counters_t *totals, unsigned int count, const hook_stats_shard_t *shards)
+{
+	const hook_stats_shard_t *s;
+	unsigned int i;
+
+	for (s = shards; s != NULL; s = s->next) {
+		unsigned int n = s->count < count ? s->count : count;
+		for (i = 0; i < n; i++) {
+			totals[i].cycles += s->counters[i].cycles;
+			totals[i].calls += s->counters[i].calls;
+			totals[i].logged += s->counters[i].logged;
+			totals[i].limited += s->counters[i].limited;
+		}
+	}
+}
+
+typedef struct _rank_t {
+	unsigned long long cycles;
+	unsigned int calls;
+	unsigned int index;
+} rank_t;
+
+static int compare_rank(const void *a, const void *b)
+{
+	const rank_t *x = (const rank_t *)a, *y = (const rank_t *)b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	if (x->calls != y->calls)
+		return x->calls < y->calls ? 1 : -1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+unsigned int hook_stats_rank(const hook_counters_t *totals, unsigned int count, unsigned int *order)
+{
+	rank_t *ranks = malloc((count ? count : 1) * sizeof(rank_t));
+	unsigned int i, n = 0;
+
+	if (ranks == NULL)
+		return 0;
+	for (i = 0; i < count; i++) {
+		if (!totals[i].calls && !totals[i].limited)
+			continue;
+		ranks[n].cycles = totals[i].cycles;
+		ranks[n].calls = totals[i].calls;
+		ranks[n].index = i;
+		n++;
+	}
+	qsort(ranks, n, sizeof(rank_t), compare_rank);
+	for (i = 0; i < n; i++)
+		order[i] = ranks[i].index;
+	free(ranks);
+	return n;
+}
+
+unsigned int hook_stats_format(const hook_counters_t *totals, const unsigned int *order, unsigned int n,
+	const char *const *names, char *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	if (size == 0)
+		return 0;
+	buf[0] = '\0';
+	for (i = 0; i < n; i++) {
+		const hook_counters_t *c = &totals[order[i]];
+		int w = snprintf(buf + len, size - len, "%s=%u,%u,%u,%llu;", names[order[i]] ? names[order[i]] : "",
+			c->calls, c->logged, c->limited, c->cycles);
+		if (w < 0 || (size_t)w >= size - len) {
+			// only whole entries
+			buf[len] = '\0';
+			break;
+		}
+		len += w;
+	}
+	return i;
+}
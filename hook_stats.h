@@ -0,0 +1,57 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Per-hook profiling counters. Each thread counts into a shard of its own,
+// a hook_counters_t per hook, so counting never writes memory another thread
+// writes. A report adds the shards up while they may still be counting (the
+// totals are a snapshot, good to within the calls in flight), ranks the
+// hooks by the cycles spent on them and formats them as one compact string.
+// No Windows dependencies; the caller keeps the list of shards, reads the
+// cycle counter and serialises reports.
+
+typedef struct _hook_counters_t {
+	unsigned long long cycles;	// in enter_hook and the handler, up to its log call
+	unsigned int calls;			// let through to the handler
+	unsigned int logged;
+	unsigned int limited;		// refused by api-rate-cap
+	unsigned int reserved;
+} hook_counters_t;
+
+typedef struct _hook_stats_shard_t {
+	struct _hook_stats_shard_t *next;
+	unsigned int count;
+	hook_counters_t counters[1];
+} hook_stats_shard_t;
+
+size_t hook_stats_shard_size(unsigned int count);
+
+// adds the counters of every shard on the list to totals, count long
+void hook_stats_merge(hook_counters_t *totals, unsigned int count, const hook_stats_shard_t *shards);
+
+// fills order with the hooks that were called or refused at all, the most
+// cycles first; returns how many there are, or 0 if out of memory
+unsigned int hook_stats_rank(const hook_counters_t *totals, unsigned int count, unsigned int *order);
+
+// writes "name=calls,logged,limited,cycles;" for the ranked hooks into buf,
+// as many whole entries as fit in size along with the terminating NUL;
+// returns the number of entries written
+unsigned int hook_stats_format(const hook_counters_t *totals, const unsigned int *order, unsigned int n,
+	const char *const *names, char *buf, size_t size);
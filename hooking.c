@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <psapi.h>
 #include "hooking.h"
 #include "hooks.h"
+#include "log.h"
 #include "ignore.h"
 #include "unhook.h"
 #include "misc.h"
@@ -38,9 +39,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define TLS_LAST_WIN32_ERROR 0x34
 #define TLS_LAST_NTSTATUS_ERROR 0xbf4
 #endif
-#define HOOK_TIME_SAMPLE 100
-#define HOOK_RATE_LIMIT 0x100
+// api-rate-cap: each thread's bucket for a hook holds HOOK_RATE_BURST calls
+// and refills at HOOK_RATE_PER_SEC, both divided by the cap, which is about
+// what the old check let through per tick of the system time it sampled
+#define HOOK_RATE_PER_SEC 0x4000
+#define HOOK_RATE_BURST 0x100
 #define HOOK_LIMIT 0x10000
+// calls a thread lets through before adding them to the hook's shared count
+#define HOOK_COUNT_BATCH 0x40
 
 static lookup_t g_hook_info;
 lookup_t g_caller_regions;
@@ -52,6 +58,8 @@ extern ULONG_PTR base_of_dll_of_interest;
 extern BOOL BreakpointsSet;
 extern PVOID ImageBase;
 extern BOOLEAN g_dll_main_complete;
+extern hook_t *hooks;
+extern SIZE_T hooks_arraysize;
 
 void hook_init()
 {
@@ -67,11 +75,46 @@ void emit_rel(unsigned char *buf, unsigned char *source, unsigned char *target)
 // need to be very careful about what we call in here, as it can be called in the context of any hook
 // including those that hold the loader lock
 
+#define ADDR_IN_DLL_RANGE 1
+#define ADDR_INSIDE_HOOK 2
+
+// bumped whenever a module range or hook is added or a module unloaded
+static volatile LONG g_address_classes;
+
+void invalidate_address_classes(void)
+{
+	InterlockedIncrement(&g_address_classes);
+}
+
+static unsigned int classify_address(void *unused, size_t addr)
+{
+	unsigned int flags = 0;
+
+	if (is_in_dll_range((ULONG_PTR)addr))
+		flags |= ADDR_IN_DLL_RANGE;
+	if (inside_hook((PVOID)addr))
+		flags |= ADDR_INSIDE_HOOK;
+	return flags;
+}
+
+static void *hook_thread_alloc(hook_info_t *hookinfo, size_t size);
+static hook_info_t tmphookinfo;
+
+// how a return address in a backtrace is classified, through the thread's cache
+static unsigned int address_class(hook_info_t *hookinfo, ULONG_PTR addr)
+{
+	if (hookinfo->addr_cache == NULL && hookinfo != &tmphookinfo)
+		hookinfo->addr_cache = hook_thread_alloc(hookinfo, sizeof(addr_cache_t));
+	if (hookinfo->addr_cache == NULL)
+		return classify_address(NULL, addr);
+	return addr_cache_classify(hookinfo->addr_cache, addr, (unsigned int)g_address_classes, classify_address, NULL);
+}
+
 static int set_caller_info_fallback(void *_hook_info, ULONG_PTR addr)
 {
 	hook_info_t *hookinfo = _hook_info;
 
-	if (addr && !inside_hook((PVOID)addr)) {
+	if (addr && !(address_class(hookinfo, addr) & ADDR_INSIDE_HOOK)) {
 		if (!hookinfo->main_caller_retaddr) {
 			hookinfo->main_caller_retaddr = addr;
 			return 0;
@@ -127,7 +170,7 @@ static int set_caller_info(void *_hook_info, ULONG_PTR addr)
 {
 	hook_info_t *hookinfo = _hook_info;
 
-	if (!is_in_dll_range(addr) && !inside_hook((PVOID)addr)) {
+	if (!address_class(hookinfo, addr)) {
 		caller_dispatch(hookinfo, addr);
 		if (hookinfo->main_caller_retaddr == 0)
 			hookinfo->main_caller_retaddr = addr;
@@ -249,15 +292,205 @@ void api_dispatch(hook_t *h, hook_info_t *hookinfo)
 }
 
 extern BOOLEAN is_ignored_thread(DWORD tid);
-static hook_info_t tmphookinfo;
 DWORD tmphookinfo_threadid;
-FILETIME ft;
+
+// per-thread state for enter_hook, zeroed
+static void *hook_thread_alloc(hook_info_t *hookinfo, size_t size)
+{
+	lasterror_t lasterror;
+	void *p;
+
+	get_lasterrors(&lasterror);
+	// the allocation may come back through our hooks
+	hookinfo->disable_count++;
+	p = calloc(1, size);
+	hookinfo->disable_count--;
+	set_lasterrors(&lasterror);
+	return p;
+}
+
+// the thread's buffer for the registry key names get_full_key_path*() put
+// together, allocated once; NULL while the thread has the temporary hook info
+wchar_t *hook_key_name_buffer(void)
+{
+	hook_info_t *hookinfo = hook_info();
+
+	if (hookinfo->key_name == NULL && hookinfo != &tmphookinfo)
+		hookinfo->key_name = hook_thread_alloc(hookinfo, MAX_KEY_BUFLEN);
+	return hookinfo->key_name;
+}
+
+static void hook_rate_budget(hook_t *h)
+{
+	unsigned int cap = g_config.api_rate_cap < HOOK_RATE_BURST ? g_config.api_rate_cap : HOOK_RATE_BURST;
+	rate_budget_t budget;
+	unsigned int i;
+
+	budget.rate = HOOK_RATE_PER_SEC / cap;
+	budget.burst = HOOK_RATE_BURST / cap;
+	for (i = 0; i < ARRAYSIZE(g_config.api_rate_budget_names); i++) {
+		if (!g_config.api_rate_budget_names[i])
+			break;
+		if (!stricmp(h->funcname, g_config.api_rate_budget_names[i])) {
+			budget.rate = g_config.api_rate_budgets[i][0];
+			budget.burst = g_config.api_rate_budgets[i][1];
+			break;
+		}
+	}
+	if (!budget.burst)
+		budget.burst = 1;
+	// burst last, as it marks the budget as set for the other threads
+	h->rate_budget.rate = budget.rate;
+	MemoryBarrier();
+	h->rate_budget.burst = budget.burst;
+}
+
+// returns 0 if the hook has been disabled for being called too often; the
+// rate is kept per thread, and the shared count only touched once a batch
+static int hook_rate_check(hook_t *h, hook_info_t *hookinfo)
+{
+	rate_bucket_t *bucket;
+	LONG count;
+
+	if (h->hook_disabled)
+		return 0;
+	if (!h->rate_budget.burst)
+		hook_rate_budget(h);
+	if (!h->rate_budget.rate || h < hooks || h >= hooks + hooks_arraysize || hookinfo == &tmphookinfo)
+		return 1;
+
+	if (hookinfo->rate_buckets == NULL && (hookinfo->rate_buckets = hook_thread_alloc(hookinfo, hooks_arraysize * sizeof(rate_bucket_t))) == NULL)
+		return 1;
+
+	bucket = &hookinfo->rate_buckets[h - hooks];
+	if (!rate_limit_take(bucket, &h->rate_budget, raw_gettickcount())) {
+		DebugOutput("api-rate-cap: %s hook disabled due to rate.\n", h->funcname);
+		h->hook_disabled = 1;
+		return 0;
+	}
+	if (bucket->pending < HOOK_COUNT_BATCH)
+		return 1;
+
+	count = InterlockedExchangeAdd(&h->counter, (LONG)bucket->pending) + (LONG)bucket->pending;
+	bucket->pending = 0;
+	if (count > HOOK_LIMIT) {
+		DebugOutput("api-rate-cap: %s hook disabled due to count.\n", h->funcname);
+		h->hook_disabled = 1;
+		return 0;
+	}
+	return 1;
+}
+
+// hook-stats: the shards of all threads, newest first
+static hook_stats_shard_t *volatile g_stats_shards;
+
+// charges the cycles since start to h; if it was let through, its handler
+// is timed on until it logs
+static void hook_stats_count(hook_t *h, hook_info_t *hookinfo, unsigned long long start, int called)
+{
+	hook_stats_shard_t *shard = hookinfo->stats;
+	hook_counters_t *c;
+	unsigned long long now;
+
+	if (h < hooks || h >= hooks + hooks_arraysize || hookinfo == &tmphookinfo)
+		return;
+
+	if (shard == NULL) {
+		shard = hook_thread_alloc(hookinfo, hook_stats_shard_size((unsigned int)hooks_arraysize));
+		if (shard == NULL)
+			return;
+		shard->count = (unsigned int)hooks_arraysize;
+		do
+			shard->next = g_stats_shards;
+		while (InterlockedCompareExchangePointer((PVOID volatile *)&g_stats_shards, shard, shard->next) != shard->next);
+		hookinfo->stats = shard;
+	}
+
+	c = &shard->counters[h - hooks];
+	now = __rdtsc();
+	c->cycles += now - start;
+	if (called) {
+		c->calls++;
+		hookinfo->stats_hook = h;
+		hookinfo->stats_start = now;
+		hookinfo->stats_stack_pointer = hookinfo->stack_pointer;
+		hookinfo->stats_return_address = hookinfo->return_address;
+	}
+	else {
+		c->limited++;
+		// not nested in another handler, so whichever ran last has returned
+		if (!h->allow_hook_recursion)
+			hookinfo->stats_hook = NULL;
+	}
+}
+
+// called by loq() on every way out, whether or not it logged: the cycles
+// up to here go to the hook whose handler is running, if it is still
+// running. Handlers are jumped to, so there's no return through the hook
+// to stop the count on; a hook that has returned is told by its return
+// address no longer being where its caller's call put it.
+void hook_stats_done(int logged)
+{
+	hook_info_t *hookinfo = hook_info();
+	hook_t *h = hookinfo->stats_hook;
+	hook_counters_t *c;
+	BOOLEAN running = FALSE;
+
+	if (h == NULL || hookinfo->stats == NULL)
+		return;
+	hookinfo->stats_hook = NULL;
+	__try {
+		running = *(ULONG_PTR *)hookinfo->stats_stack_pointer == hookinfo->stats_return_address;
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		;
+	}
+	if (!running)
+		return;
+	c = &hookinfo->stats->counters[h - hooks];
+	if (logged)
+		c->logged++;
+	c->cycles += __rdtsc() - hookinfo->stats_start;
+}
+
+#define HOOK_STATS_SUMMARY_MAX 0x2000
+
+void hook_stats_report(void)
+{
+	hook_counters_t *totals;
+	unsigned int *order;
+	const char **names;
+	char *summary;
+	unsigned int i, ranked, listed;
+
+	if (!g_config.hook_stats || !hooks_arraysize)
+		return;
+
+	totals = calloc(hooks_arraysize, sizeof(hook_counters_t));
+	order = calloc(hooks_arraysize, sizeof(unsigned int));
+	names = calloc(hooks_arraysize, sizeof(const char *));
+	summary = malloc(HOOK_STATS_SUMMARY_MAX);
+	if (totals && order && names && summary) {
+		hook_stats_merge(totals, (unsigned int)hooks_arraysize, g_stats_shards);
+		ranked = hook_stats_rank(totals, (unsigned int)hooks_arraysize, order);
+		for (i = 0; i < hooks_arraysize; i++)
+			names[i] = hooks[i].funcname;
+		listed = hook_stats_format(totals, order, ranked, names, summary, HOOK_STATS_SUMMARY_MAX);
+		log_hook_stats(ranked, listed, summary);
+		DebugOutput("hook-stats: %u hooks called, the costliest %u reported.\n", ranked, listed);
+	}
+	free(totals);
+	free(order);
+	free(names);
+	free(summary);
+}
 
 // returns 1 if we should call our hook, 0 if we should call the original function instead
 // on x86 this is actually: hook, esp, ebp
 // on x64 this is actually: hook, rsp, rip of hook (for unwind-based stack walking)
 int WINAPI enter_hook(hook_t *h, ULONG_PTR sp, ULONG_PTR ebp_or_rip)
 {
+	unsigned long long stats_start = g_config.hook_stats ? __rdtsc() : 0;
 	hook_info_t *hookinfo;
 
 	if (h->fully_emulate)
@@ -280,29 +513,10 @@ int WINAPI enter_hook(hook_t *h, ULONG_PTR sp, ULONG_PTR ebp_or_rip)
 
 	if ((hookinfo->disable_count < 1) && (h->allow_hook_recursion || (!__called_by_hook(sp, ebp_or_rip) /*&& !is_ignored_thread(GetCurrentThreadId())*/))) {
 
-		if (g_config.api_rate_cap && h->new_func != &New_RtlDispatchException && h->new_func != &New_NtContinue && Old_GetSystemTimeAsFileTime) {
-			if (h->hook_disabled)
-				return 0;
-			h->counter++;
-			if (h->counter > HOOK_LIMIT) {
-				DebugOutput("api-rate-cap: %s hook disabled due to count.\n", h->funcname);
-				h->hook_disabled = 1;
-				return 0;
-			}
-			Old_GetSystemTimeAsFileTime(&ft);
-			if (ft.dwLowDateTime - h->hook_timer < HOOK_TIME_SAMPLE) {
-				h->rate_counter++;
-				if (h->rate_counter > HOOK_RATE_LIMIT/g_config.api_rate_cap) {
-					DebugOutput("api-rate-cap: %s hook disabled due to rate.\n", h->funcname);
-					h->rate_counter = 0;
-					h->hook_disabled = 1;
-					return 0;
-				}
-			}
-			else {
-				h->rate_counter = 0;
-				h->hook_timer = ft.dwLowDateTime;
-			}
+		if (g_config.api_rate_cap && h->new_func != &New_RtlDispatchException && h->new_func != &New_NtContinue && !hook_rate_check(h, hookinfo)) {
+			if (g_config.hook_stats)
+				hook_stats_count(h, hookinfo, stats_start, 0);
+			return 0;
 		}
 
 		hookinfo->last_hook = hookinfo->current_hook;
@@ -322,6 +536,9 @@ int WINAPI enter_hook(hook_t *h, ULONG_PTR sp, ULONG_PTR ebp_or_rip)
 
 		api_dispatch(h, hookinfo);
 
+		if (g_config.hook_stats)
+			hook_stats_count(h, hookinfo, stats_start, 1);
+
 		return 1;
 	}
 
@@ -23,6 +23,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ntapi.h"
 #include "lookup.h"
 #include "config.h"
+#include "rate_limit.h"
+#include "hook_stats.h"
+#include "addr_cache.h"
 #include <Windows.h>
 
 extern DWORD GetTimeStamp(LPVOID Address);
@@ -119,9 +122,10 @@ typedef struct _hook_t {
 
 	hook_data_t *hookdata;
 	const wchar_t *exportdirectory;
-	DWORD hook_timer;
-	unsigned int counter;
-	unsigned int rate_counter;
+	// api-rate-cap: this hook's budget, and the calls let through by all
+	// threads, added up from their own buckets every so often
+	rate_budget_t rate_budget;
+	volatile LONG counter;
 	unsigned int hook_disabled;
 } hook_t;
 
@@ -134,6 +138,14 @@ typedef struct _hook_info_t {
 	ULONG_PTR frame_pointer;
 	ULONG_PTR main_caller_retaddr;
 	ULONG_PTR parent_caller_retaddr;
+	rate_bucket_t *rate_buckets;	// api-rate-cap, one per entry of hooks
+	hook_stats_shard_t *stats;		// hook-stats
+	hook_t *stats_hook;				// whose handler is running, since stats_start
+	unsigned long long stats_start;
+	ULONG_PTR stats_stack_pointer;	// and where its return address went
+	ULONG_PTR stats_return_address;
+	addr_cache_t *addr_cache;		// return addresses seen in backtraces
+	wchar_t *key_name;				// MAX_KEY_BUFLEN, see hook_key_name_buffer
 } hook_info_t;
 
 
@@ -150,6 +162,16 @@ int ide(_DecodedInst* instruction, void *addr);
 hook_data_t *alloc_hookdata_near(void *addr);
 
 int hook_api(hook_t *h, int type);
+// hook_api() in steps, for installing many hooks at once
+int hook_api_resolve(hook_t *h, int *type, unsigned char **addr);
+void hook_api_extent(int type, unsigned char *addr, unsigned char **start, unsigned int *len);
+int hook_api_prepare(hook_t *h, int type, unsigned char *addr);
+int hook_api_commit(hook_t *h, int type, unsigned char *addr);
+// hook_api_resolve()'s scans for unexported functions as handed down from
+// the parent process and checked, and those made to hand on to children,
+// with the code each was found through (hooks.c)
+int resolved_hook_lookup(const hook_t *h, HMODULE hmod, unsigned char **addr, ULONG_PTR *witness);
+void resolved_hook_record(const hook_t *h, HMODULE hmod, unsigned char *addr, ULONG_PTR witness);
 
 hook_info_t* hook_info();
 void hook_enable();
@@ -159,6 +181,10 @@ int addr_in_our_dll_range(void *unused, ULONG_PTR addr);
 void get_lasterrors(lasterror_t *errors);
 void set_lasterrors(lasterror_t *errors);
 int WINAPI enter_hook(hook_t *h, ULONG_PTR _ebp, ULONG_PTR retaddr);
+void hook_stats_done(int logged);
+void hook_stats_report(void);
+void invalidate_address_classes(void);
+wchar_t *hook_key_name_buffer(void);
 void emit_rel(unsigned char *buf, unsigned char *source, unsigned char *target);
 int operate_on_backtrace(ULONG_PTR retaddr, ULONG_PTR _ebp, void *extra, int(*func)(void *, ULONG_PTR));
 
@@ -21,6 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ntapi.h"
 #include <distorm.h>
 #include "hooking.h"
+#include "insn_decode.h"
+#include "frame_walk.h"
 #include "ignore.h"
 #include "unhook.h"
 #include "misc.h"
@@ -73,7 +75,8 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	while (len > 0) {
 
 		// obtain the length of this instruction
-		int length = lde(addr);
+		insn_t insn;
+		int length = insn_decode(addr, INSN_MAX_LEN, 0, &insn);
 
 		// error?
 		if(length == 0) {
@@ -605,40 +608,42 @@ static ULONG_PTR get_short_rel_target(unsigned char *buf)
 	return 0;
 }
 
-int hook_api(hook_t *h, int type)
+// table with all possible hooking types
+static const struct {
+	int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
+	int len;
+	int offset;
+} hook_types[] = {
+	/* HOOK_JMP_DIRECT */ {&hook_api_jmp_direct, 5, 0},
+	/* HOOK_NOP_JMP_DIRECT */ {&hook_api_nop_jmp_direct, 6, 0},
+	/* HOOK_HOTPATCH_JMP_DIRECT */ {&hook_api_hotpatch_jmp_direct, 7, 0},
+	/* HOOK_PUSH_RETN */ {&hook_api_push_retn, 6, 0},
+	/* HOOK_NOP_PUSH_RETN */ {&hook_api_nop_push_retn, 7, 0},
+	/* HOOK_JMP_INDIRECT */ {&hook_api_jmp_indirect, 6, 0},
+	/* HOOK_MOV_EAX_JMP_EAX */ {&hook_api_mov_eax_jmp_eax, 7, 0},
+	/* HOOK_MOV_EAX_PUSH_RETN */ {&hook_api_mov_eax_push_retn, 7, 0},
+	/* HOOK_MOV_EAX_INDIRECT_JMP_EAX */
+		{&hook_api_mov_eax_indirect_jmp_eax, 7, 0},
+	/* HOOK_MOV_EAX_INDIRECT_PUSH_RETN */
+		{&hook_api_mov_eax_indirect_push_retn, 7, 0},
+#if HOOK_ENABLE_FPU
+	/* HOOK_PUSH_FPU_RETN */ {&hook_api_push_fpu_retn, 11, 0},
+#endif
+	/* HOOK_SPECIAL_JMP */ {&hook_api_special_jmp, 7, 0},
+	/* HOOK_NATIVE_JMP_INDIRECT */ {&hook_api_native_jmp_indirect, 11, 0},
+	/* HOOK_HOTPATCH_JMP_INDIRECT */{ &hook_api_hotpatch_jmp_indirect, 8, 0},
+	/* HOOK_SAFEST */{ &hook_api_safest, 2, 5},
+};
+
+// resolves the address to hook for h and the technique to use there;
+// returns 1 if there is something to hook, 0 if there isn't (the DLL isn't
+// loaded, the function isn't there or is hooked already) or -1 on error
+int hook_api_resolve(hook_t *h, int *ptype, unsigned char **paddr)
 {
 	unsigned char *addr;
-	int ret = -1;
-	DWORD old_protect;
+	int type = *ptype;
 	BOOL delay_loaded = FALSE;
 
-	// table with all possible hooking types
-	static struct {
-		int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
-		int len;
-		int offset;
-	} hook_types[] = {
-		/* HOOK_JMP_DIRECT */ {&hook_api_jmp_direct, 5, 0},
-		/* HOOK_NOP_JMP_DIRECT */ {&hook_api_nop_jmp_direct, 6, 0},
-		/* HOOK_HOTPATCH_JMP_DIRECT */ {&hook_api_hotpatch_jmp_direct, 7, 0},
-		/* HOOK_PUSH_RETN */ {&hook_api_push_retn, 6, 0},
-		/* HOOK_NOP_PUSH_RETN */ {&hook_api_nop_push_retn, 7, 0},
-		/* HOOK_JMP_INDIRECT */ {&hook_api_jmp_indirect, 6, 0},
-		/* HOOK_MOV_EAX_JMP_EAX */ {&hook_api_mov_eax_jmp_eax, 7, 0},
-		/* HOOK_MOV_EAX_PUSH_RETN */ {&hook_api_mov_eax_push_retn, 7, 0},
-		/* HOOK_MOV_EAX_INDIRECT_JMP_EAX */
-			{&hook_api_mov_eax_indirect_jmp_eax, 7, 0},
-		/* HOOK_MOV_EAX_INDIRECT_PUSH_RETN */
-			{&hook_api_mov_eax_indirect_push_retn, 7, 0},
-#if HOOK_ENABLE_FPU
-		/* HOOK_PUSH_FPU_RETN */ {&hook_api_push_fpu_retn, 11, 0},
-#endif
-		/* HOOK_SPECIAL_JMP */ {&hook_api_special_jmp, 7, 0},
-		/* HOOK_NATIVE_JMP_INDIRECT */ {&hook_api_native_jmp_indirect, 11, 0},
-		/* HOOK_HOTPATCH_JMP_INDIRECT */{ &hook_api_hotpatch_jmp_indirect, 8, 0},
-		/* HOOK_SAFEST */{ &hook_api_safest, 2, 5},
-	};
-
 	// is this address already hooked?
 	if (h->is_hooked != 0) {
 		return 0;
@@ -652,50 +657,54 @@ int hook_api(hook_t *h, int type)
 
 	if (addr == NULL && h->library != NULL && h->funcname != NULL) {
 		HMODULE hmod = GetModuleHandleW(h->library);
+		ULONG_PTR witness = 0;
 		/* if the DLL isn't loaded, don't bother attempting anything else */
 		if (hmod == NULL)
 			return 0;
 
-		if (!strcmp(h->funcname, "RtlDispatchException")) {
-			// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
-			unsigned char *baseaddr = (unsigned char *)GetProcAddress(hmod, "KiUserExceptionDispatcher");
-			int instroff = 0;
-			while (baseaddr[instroff] != 0xe8) {
-				instroff += lde(&baseaddr[instroff]);
+		// the parent's scan for the functions found by scanning code, if it
+		// had the same image loaded and what it found checks out here
+		if (!resolved_hook_lookup(h, hmod, &addr, &witness)) {
+			if (!strcmp(h->funcname, "RtlDispatchException")) {
+				// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
+				unsigned char *baseaddr = (unsigned char *)get_export_address(hmod, "KiUserExceptionDispatcher");
+				int instroff = 0;
+				while (baseaddr[instroff] != 0xe8) {
+					instroff += lde(&baseaddr[instroff]);
+				}
+				addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
 			}
-			addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
-		}
-		else if (!strcmp(h->funcname, "ConnectEx")) {
-			addr = (unsigned char *)get_connectex_addr(hmod);
-		}
-		else if (!wcscmp(h->library, L"kernel32") && !strcmp(h->funcname, "MoveFileWithProgressTransactedW")) {
-			unsigned char *tmpaddr = (unsigned char *)GetProcAddress(hmod, "MoveFileWithProgressW");
-			if (tmpaddr[22] == 0xe8 && tmpaddr[28] == 0xc2) {
-				addr = (unsigned char *)get_near_rel_target(tmpaddr + 22);
+			else if (!strcmp(h->funcname, "ConnectEx")) {
+				addr = (unsigned char *)get_connectex_addr(hmod);
+			}
+			else if (!wcscmp(h->library, L"kernel32") && !strcmp(h->funcname, "MoveFileWithProgressTransactedW")) {
+				unsigned char *tmpaddr = (unsigned char *)get_export_address(hmod, "MoveFileWithProgressW");
+				if (tmpaddr[22] == 0xe8 && tmpaddr[28] == 0xc2) {
+					addr = (unsigned char *)get_near_rel_target(tmpaddr + 22);
+				}
+				else
+					addr = (unsigned char *)get_export_address(hmod, h->funcname);
 			}
+			else if (!strcmp(h->funcname, "JsEval"))
+				addr = (unsigned char *)get_jseval_addr(hmod, &witness);
+			else if (!strcmp(h->funcname, "COleScript_ParseScriptText"))
+				addr = (unsigned char *)get_olescript_parsescripttext_addr(hmod, &witness);
+			else if (!strcmp(h->funcname, "CDocument_write"))
+				addr = (unsigned char *)get_cdocument_write_addr(hmod, &witness);
 			else
-				addr = (unsigned char *)GetProcAddress(hmod, h->funcname);
-		}
-		else if (!strcmp(h->funcname, "JsEval")) {
-			type = HOOK_JMP_DIRECT;
-			addr = (unsigned char *)get_jseval_addr(hmod);
-		}
-		else if (!strcmp(h->funcname, "COleScript_ParseScriptText")) {
-			type = HOOK_JMP_DIRECT;
-			addr = (unsigned char *)get_olescript_parsescripttext_addr(hmod);
-		}
-		else if (!strcmp(h->funcname, "CDocument_write")) {
-			type = HOOK_JMP_DIRECT;
-			addr = (unsigned char *)get_cdocument_write_addr(hmod);
-		}
-		else
-			addr = (unsigned char *)GetProcAddress(hmod, h->funcname);
+				addr = (unsigned char *)get_export_address(hmod, h->funcname);
 
-		if (addr == NULL && h->timestamp != 0 && h->rva != 0) {
-			DWORD timestamp = GetTimeStamp(hmod);
-			if (timestamp == h->timestamp)
-				addr = (unsigned char *)hmod + h->rva;
+			if (addr == NULL && h->timestamp != 0 && h->rva != 0) {
+				DWORD timestamp = GetTimeStamp(hmod);
+				if (timestamp == h->timestamp)
+					addr = (unsigned char *)hmod + h->rva;
+			}
 		}
+		resolved_hook_record(h, hmod, addr, witness);
+
+		if (!strcmp(h->funcname, "JsEval") || !strcmp(h->funcname, "COleScript_ParseScriptText") ||
+			!strcmp(h->funcname, "CDocument_write"))
+			type = HOOK_JMP_DIRECT;
 	}
 
 	if (addr == NULL || addr == (unsigned char *)0xffbadd11) {
@@ -776,7 +785,7 @@ int hook_api(hook_t *h, int type)
 	// check if this is a valid hook type
 	if (type < 0 && type >= ARRAYSIZE(hook_types)) {
 		pipe("WARNING: Provided invalid hook type: %d", type);
-		return ret;
+		return -1;
 	}
 
 	if (delay_loaded == TRUE) {
@@ -798,47 +807,86 @@ int hook_api(hook_t *h, int type)
 		(memcmp(addr - 5, "\xcc\xcc\xcc\xcc\xcc", 5) && memcmp(addr - 5, "\x90\x90\x90\x90\x90", 5))))
 		type = HOOK_JMP_DIRECT;
 
-	// make the address writable
-	if (VirtualProtect(addr - hook_types[type].offset, hook_types[type].offset + hook_types[type].len, PAGE_EXECUTE_READWRITE, &old_protect)) {
+	*ptype = type;
+	*paddr = addr;
+	return 1;
+}
 
-		h->hookdata = alloc_hookdata_near(addr);
+// the bytes hook_api_commit() writes for a hook on addr
+void hook_api_extent(int type, unsigned char *addr, unsigned char **start, unsigned int *len)
+{
+	*start = addr - hook_types[type].offset;
+	*len = hook_types[type].offset + hook_types[type].len;
+}
 
-		if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
-			//hook_store_exception_info(h);
-			uint8_t orig[16];
-			memcpy(orig, addr, 16);
+// builds the trampolines for a hook on addr, reading the target but not
+// writing it; returns 0 or -1
+int hook_api_prepare(hook_t *h, int type, unsigned char *addr)
+{
+	h->hookdata = alloc_hookdata_near(addr);
 
-			if (h->notail)
-				hook_create_pre_tramp_notail(h);
-			else
-				hook_create_pre_tramp(h);
-
-			// insert the hook (jump from the api to the
-			// pre-trampoline)
-			ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
-
-			// Add unhook detection for our newly created hook.
-			// Ensure any changes behind our hook are also caught by
-			// making the buffersize 16.
-			unhook_detect_add_region(h, addr - hook_types[type].offset, orig, addr - hook_types[type].offset, 16);
-
-			// if successful, assign the trampoline address to *old_func
-			if (ret == 0) {
-				// This will be NULL in cases where we don't care to call the original function from our hook (NOTAIL)
-				if (h->old_func)
-					*h->old_func = h->hookdata->tramp;
-
-				// successful hook is successful
-				h->is_hooked = 1;
-				h->hook_addr = addr;
-			}
-		}
-		else {
-			pipe("WARNING:Unable to place hook on %z", h->funcname);
-		}
+	if (h->hookdata == NULL || !hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
+		pipe("WARNING:Unable to place hook on %z", h->funcname);
+		return -1;
+	}
+
+	if (h->notail)
+		hook_create_pre_tramp_notail(h);
+	else
+		hook_create_pre_tramp(h);
+	return 0;
+}
+
+// patches a prepared hook in, the target having been made writable
+int hook_api_commit(hook_t *h, int type, unsigned char *addr)
+{
+	//hook_store_exception_info(h);
+	uint8_t orig[16];
+	int ret;
+
+	memcpy(orig, addr, 16);
+
+	// insert the hook (jump from the api to the
+	// pre-trampoline)
+	ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
+
+	// Add unhook detection for our newly created hook.
+	// Ensure any changes behind our hook are also caught by
+	// making the buffersize 16.
+	unhook_detect_add_region(h, addr - hook_types[type].offset, orig, addr - hook_types[type].offset, 16);
+
+	// if successful, assign the trampoline address to *old_func
+	if (ret == 0) {
+		// This will be NULL in cases where we don't care to call the original function from our hook (NOTAIL)
+		if (h->old_func)
+			*h->old_func = h->hookdata->tramp;
+
+		// successful hook is successful
+		h->is_hooked = 1;
+		h->hook_addr = addr;
+	}
+	return ret;
+}
+
+int hook_api(hook_t *h, int type)
+{
+	unsigned char *addr, *start;
+	unsigned int len;
+	DWORD old_protect;
+	int ret = hook_api_resolve(h, &type, &addr);
+
+	if (ret <= 0)
+		return ret;
+	ret = -1;
+	hook_api_extent(type, addr, &start, &len);
+
+	// make the address writable
+	if (VirtualProtect(start, len, PAGE_EXECUTE_READWRITE, &old_protect)) {
+		if (hook_api_prepare(h, type, addr) == 0)
+			ret = hook_api_commit(h, type, addr);
 
 		// restore the old protection
-		VirtualProtect(addr - hook_types[type].offset, hook_types[type].offset + hook_types[type].len, old_protect, &old_protect);
+		VirtualProtect(start, len, old_protect, &old_protect);
 	}
 	else {
 		pipe("WARNING:Unable to change protection for hook on %z", h->funcname);
@@ -849,28 +897,17 @@ int hook_api(hook_t *h, int type)
 
 int operate_on_backtrace(ULONG_PTR _esp, ULONG_PTR _ebp, void *extra, int(*func)(void *, ULONG_PTR))
 {
+	// the return address at esp, then one per frame
+	size_t frames[HOOK_BACKTRACE_DEPTH + 1];
+	unsigned int count, i;
 	int ret = 0;
 
-	ULONG_PTR top = get_stack_top();
-	ULONG_PTR bottom = get_stack_bottom();
-
-	unsigned int count = HOOK_BACKTRACE_DEPTH;
-
 	__try
 	{
-		if (_esp >= bottom && _esp <= (top - sizeof(ULONG_PTR))) {
-			ret = func(extra, *(ULONG_PTR *)_esp);
-			if (ret)
-				return ret;
-		}
-
-		while (_ebp >= bottom && _ebp <= (top - (2 * sizeof(ULONG_PTR))) && count-- != 0)
-		{
-			// obtain the return address and the next value of ebp
-			ULONG_PTR addr = *(ULONG_PTR *)(_ebp + sizeof(ULONG_PTR));
-			_ebp = *(ULONG_PTR *)_ebp;
+		count = frame_walk(_esp, _ebp, get_stack_bottom(), get_stack_top(), frames, HOOK_BACKTRACE_DEPTH + 1);
 
-			ret = func(extra, addr);
+		for (i = 0; i < count; i++) {
+			ret = func(extra, frames[i]);
 			if (ret)
 				return ret;
 		}
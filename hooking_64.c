@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ntapi.h"
 #include <distorm.h>
 #include "hooking.h"
+#include "insn_decode.h"
 #include "ignore.h"
 #include "unhook.h"
 #include "misc.h"
@@ -58,25 +59,6 @@ int ide(_DecodedInst* instruction, void *addr)
 	return ret;
 }
 
-static _DInst *get_insn(void *addr)
-{
-	unsigned int used_instruction_count; _DInst instructions[16];
-	_CodeInfo code_info = { 0, 0, addr, 16, Decode64Bits };
-	_DecodeResult ret = distorm_decompose(&code_info, instructions, 16,
-		&used_instruction_count);
-	if (ret == DECRES_SUCCESS) {
-		_DInst *insn = malloc(sizeof(_DInst));
-		memcpy(insn, &instructions[0], sizeof(_DInst));
-		return insn;
-	}
-	return NULL;
-}
-
-static void put_insn(_DInst *insn)
-{
-	free(insn);
-}
-
 static unsigned char *emit_indirect_jmp(unsigned char *buf, ULONG_PTR addr)
 {
 	*buf++ = 0xff;
@@ -168,22 +150,21 @@ static int addr_is_in_range(ULONG_PTR addr, const unsigned char *buf, DWORD size
 	return 0;
 }
 
-static void retarget_rip_relative_displacement(unsigned char **tramp, unsigned char **addr, _DInst *insn)
+static void retarget_rip_relative_displacement(unsigned char **tramp, unsigned char **addr, const insn_t *insn)
 {
-	unsigned short length = insn->size;
-	unsigned char offset = (unsigned char)(length - insn->imm_encoded_size - sizeof(int));
+	unsigned short length = insn->len;
+	unsigned char offset = insn->flags & INSN_RIP_RELATIVE ? insn->disp : insn->imm;
 	unsigned char *newtramp = *tramp;
 	unsigned char *newaddr = *addr;
-	ULONG_PTR target;
-	int rel = *(int *)(newaddr + offset);
-	target = (ULONG_PTR)(newaddr + length + rel);
+	ULONG_PTR target = insn_target(insn, (ULONG_PTR)newaddr);
+	int rel;
 	// copy the instruction directly to the trampoline
 	while (length-- != 0) {
 		*newtramp++ = *newaddr++;
 	}
 	// now replace the displacement
 	rel = (int)(target - (ULONG_PTR)newtramp);
-	*(int *)(newtramp - insn->imm_encoded_size - sizeof(int)) = rel;
+	*(int *)(*tramp + offset) = rel;
 
 	*tramp = newtramp;
 	*addr = newaddr;
@@ -206,7 +187,7 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	const unsigned char *origaddr = addr;
 	unsigned char insnidx = 0;
 	int stoleninstrlen = 0;
-	_DInst *insn;
+	insn_t insn;
 
 	memset(&addrmap, 0, sizeof(addrmap));
 
@@ -215,10 +196,9 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	while (len > 0) {
 		int length;
 
-		insn = get_insn(addr);
-		if (insn == NULL)
-			goto error;
-		length = insn->size;
+		length = insn_decode(addr, INSN_MAX_LEN, 1, &insn);
+		if (length == 0)
+			return 0;
 
 		// how many bytes left?
 		len -= length;
@@ -233,10 +213,10 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 		// trampoline
 
 		if (addr[0] == 0xe8 || addr[0] == 0xe9 || (addr[0] == 0x0f && addr[1] >= 0x80 && addr[1] < 0x90) ||
-			(insn->flags & FLAG_RIP_RELATIVE)) {
-			retarget_rip_relative_displacement(&tramp, &addr, insn);
+			(insn.flags & INSN_RIP_RELATIVE)) {
+			retarget_rip_relative_displacement(&tramp, &addr, &insn);
 			if (addr[0] == 0xe9 && len > 0)
-				goto error;
+				return 0;
 		}
 
 		else if (addr[0] == 0xeb) {
@@ -246,7 +226,7 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 			tramp = emit_indirect_jmp(tramp, target);
 			addr += length;
 			if (len > 0)
-				goto error;
+				return 0;
 		}
 		else if (addr[0] == 0xe3 || ((addr[0] & 0xf0) == 0x70)) {
 			target = get_short_rel_target(addr);
@@ -258,7 +238,7 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 		// return instruction, indicates end of basic block as well, so we
 		// have to check if we already have enough space for our hook..
 		else if ((addr[0] == 0xc3 || addr[0] == 0xc2) && len > 0) {
-			goto error;
+			return 0;
 		}
 		else {
 			// copy the instruction directly to the trampoline
@@ -266,7 +246,6 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 				*tramp++ = *addr++;
 			}
 		}
-		put_insn(insn);
 	}
 
 	// append a jump from the trampoline to the original function
@@ -276,10 +255,6 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 
 	// return the length of this trampoline
 	return (int)(tramp - base);
-error:
-	if (insn)
-		put_insn(insn);
-	return 0;
 }
 
 // needs to be updated whenever the assembly below changes
@@ -896,20 +871,22 @@ out:
 	return addr;
 }
 
-int hook_api(hook_t *h, int type)
+// table with all possible hooking types
+static const struct {
+	int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
+	int len;
+} hook_types[] = {
+	/* HOOK_NATIVE_JMP_INDIRECT */{ &hook_api_native_jmp_indirect, 14 },
+	/* HOOK_JMP_INDIRECT */{ &hook_api_jmp_indirect, 6 },
+};
+
+// resolves the address to hook for h and the technique to use there;
+// returns 1 if there is something to hook, 0 if there isn't (the DLL isn't
+// loaded, the function isn't there or is hooked already) or -1 on error
+int hook_api_resolve(hook_t *h, int *ptype, unsigned char **paddr)
 {
-	DWORD old_protect;
-	int ret = -1;
 	unsigned char *addr;
-
-	// table with all possible hooking types
-	static struct {
-		int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
-		int len;
-	} hook_types[] = {
-		/* HOOK_NATIVE_JMP_INDIRECT */{ &hook_api_native_jmp_indirect, 14 },
-		/* HOOK_JMP_INDIRECT */{ &hook_api_jmp_indirect, 6 },
-	};
+	int type = *ptype;
 
 	// is this address already hooked?
 	if (h->is_hooked != 0) {
@@ -924,43 +901,49 @@ int hook_api(hook_t *h, int type)
 
 	if (addr == NULL && h->library != NULL && h->funcname != NULL) {
 		HMODULE hmod = GetModuleHandleW(h->library);
+		ULONG_PTR witness = 0;
 		/* if the DLL isn't loaded, don't bother attempting anything else */
 		if (hmod == NULL)
 			return 0;
 
-		if (!strcmp(h->funcname, "RtlDispatchException")) {
-			// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
-			unsigned char *baseaddr = (unsigned char *)GetProcAddress(hmod, "KiUserExceptionDispatcher");
-			int instroff = 0;
-			while (baseaddr[instroff] != 0xe8) {
-				instroff += lde(&baseaddr[instroff]);
+		// the parent's scan for the functions found by scanning code, if it
+		// had the same image loaded and what it found checks out here
+		if (!resolved_hook_lookup(h, hmod, &addr, &witness)) {
+			if (!strcmp(h->funcname, "RtlDispatchException")) {
+				// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
+				unsigned char *baseaddr = (unsigned char *)get_export_address(hmod, "KiUserExceptionDispatcher");
+				int instroff = 0;
+				while (baseaddr[instroff] != 0xe8) {
+					instroff += lde(&baseaddr[instroff]);
+				}
+				addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
 			}
-			addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
-		}
-		else if (!strcmp(h->funcname, "ConnectEx")) {
-			addr = (unsigned char *)get_connectex_addr(hmod);
-		}
-		else if (!wcscmp(h->library, L"kernel32") && !strcmp(h->funcname, "MoveFileWithProgressTransactedW")) {
-			unsigned char *tmpaddr = (unsigned char *)GetProcAddress(hmod, "MoveFileWithProgressW");
-			if (tmpaddr[18] == 0xe8 && tmpaddr[27] == 0xc3) {
-				addr = (unsigned char *)get_near_rel_target(tmpaddr + 18);
-			} else
-				addr = (unsigned char *)GetProcAddress(hmod, h->funcname);
-		}
-		else if (!strcmp(h->funcname, "JsEval"))
-			addr = (unsigned char *)get_jseval_addr(hmod);
-		else if (!strcmp(h->funcname, "COleScript_ParseScriptText"))
-			addr = (unsigned char *)get_olescript_parsescripttext_addr(hmod);
-		else if (!strcmp(h->funcname, "CDocument_write"))
-			addr = (unsigned char *)get_cdocument_write_addr(hmod);
-		else
-			addr = (unsigned char *)GetProcAddress(hmod, h->funcname);
+			else if (!strcmp(h->funcname, "ConnectEx")) {
+				addr = (unsigned char *)get_connectex_addr(hmod);
+			}
+			else if (!wcscmp(h->library, L"kernel32") && !strcmp(h->funcname, "MoveFileWithProgressTransactedW")) {
+				unsigned char *tmpaddr = (unsigned char *)get_export_address(hmod, "MoveFileWithProgressW");
+				if (tmpaddr[18] == 0xe8 && tmpaddr[27] == 0xc3) {
+					addr = (unsigned char *)get_near_rel_target(tmpaddr + 18);
+				} else
+					addr = (unsigned char *)get_export_address(hmod, h->funcname);
+			}
+			else if (!strcmp(h->funcname, "JsEval"))
+				addr = (unsigned char *)get_jseval_addr(hmod, &witness);
+			else if (!strcmp(h->funcname, "COleScript_ParseScriptText"))
+				addr = (unsigned char *)get_olescript_parsescripttext_addr(hmod, &witness);
+			else if (!strcmp(h->funcname, "CDocument_write"))
+				addr = (unsigned char *)get_cdocument_write_addr(hmod, &witness);
+			else
+				addr = (unsigned char *)get_export_address(hmod, h->funcname);
 
-		if (addr == NULL && h->timestamp != 0 && h->rva != 0) {
-			DWORD timestamp = GetTimeStamp(hmod);
-			if (timestamp == h->timestamp)
-				addr = (unsigned char *)hmod + h->rva;
+			if (addr == NULL && h->timestamp != 0 && h->rva != 0) {
+				DWORD timestamp = GetTimeStamp(hmod);
+				if (timestamp == h->timestamp)
+					addr = (unsigned char *)hmod + h->rva;
+			}
 		}
+		resolved_hook_record(h, hmod, addr, witness);
 	}
 	if (addr == NULL) {
 		// function doesn't exist in this DLL, not a critical error
@@ -1018,7 +1001,7 @@ int hook_api(hook_t *h, int type)
 	// check if this is a valid hook type
 	if (type < 0 && type >= ARRAYSIZE(hook_types)) {
 		pipe("WARNING: Provided invalid hook type: %d", type);
-		return ret;
+		return -1;
 	}
 
 	// make sure we aren't trying to hook the same address twice, as could
@@ -1026,46 +1009,85 @@ int hook_api(hook_t *h, int type)
 	if (address_already_hooked(addr))
 		return 0;
 
-	// make the address writable
-	if (VirtualProtect(addr, hook_types[type].len, PAGE_EXECUTE_READWRITE,
-		&old_protect)) {
+	*ptype = type;
+	*paddr = addr;
+	return 1;
+}
 
-		h->hookdata = alloc_hookdata_near(addr);
+// the bytes hook_api_commit() writes for a hook on addr
+void hook_api_extent(int type, unsigned char *addr, unsigned char **start, unsigned int *len)
+{
+	*start = addr;
+	*len = hook_types[type].len;
+}
 
-		if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
-			//hook_store_exception_info(h);
-			uint8_t orig[16];
-			memcpy(orig, addr, 16);
+// builds the trampolines for a hook on addr, reading the target but not
+// writing it; returns 0 or -1
+int hook_api_prepare(hook_t *h, int type, unsigned char *addr)
+{
+	h->hookdata = alloc_hookdata_near(addr);
 
-			if (h->notail)
-				hook_create_pre_tramp_notail(h);
-			else
-				hook_create_pre_tramp(h);
+	if (h->hookdata == NULL || !hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
+		pipe("WARNING:Unable to place hook on %z", h->funcname);
+		return -1;
+	}
 
-			// insert the hook (jump from the api to the
-			// pre-trampoline)
-			ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
+	if (h->notail)
+		hook_create_pre_tramp_notail(h);
+	else
+		hook_create_pre_tramp(h);
+	return 0;
+}
 
-			// Add unhook detection for our newly created hook.
-			unhook_detect_add_region(h, addr, orig, addr, hook_types[type].len);
+// patches a prepared hook in, the target having been made writable
+int hook_api_commit(hook_t *h, int type, unsigned char *addr)
+{
+	//hook_store_exception_info(h);
+	uint8_t orig[16];
+	int ret;
 
-			// if successful, assign the trampoline address to *old_func
-			if (ret == 0) {
-				// This will be NULL in cases where we don't care to call the original function from our hook (NOTAIL)
-				if (h->old_func)
-					*h->old_func = h->hookdata->tramp;
+	memcpy(orig, addr, 16);
 
-				// successful hook is successful
-				h->is_hooked = 1;
-				h->hook_addr = addr;
-			}
-		}
-		else {
-			pipe("WARNING:Unable to place hook on %z", h->funcname);
-		}
+	// insert the hook (jump from the api to the
+	// pre-trampoline)
+	ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
+
+	// Add unhook detection for our newly created hook.
+	unhook_detect_add_region(h, addr, orig, addr, hook_types[type].len);
+
+	// if successful, assign the trampoline address to *old_func
+	if (ret == 0) {
+		// This will be NULL in cases where we don't care to call the original function from our hook (NOTAIL)
+		if (h->old_func)
+			*h->old_func = h->hookdata->tramp;
+
+		// successful hook is successful
+		h->is_hooked = 1;
+		h->hook_addr = addr;
+	}
+	return ret;
+}
+
+int hook_api(hook_t *h, int type)
+{
+	unsigned char *addr, *start;
+	unsigned int len;
+	DWORD old_protect;
+	int ret = hook_api_resolve(h, &type, &addr);
+
+	if (ret <= 0)
+		return ret;
+	ret = -1;
+	hook_api_extent(type, addr, &start, &len);
+
+	// make the address writable
+	if (VirtualProtect(start, len, PAGE_EXECUTE_READWRITE,
+		&old_protect)) {
+		if (hook_api_prepare(h, type, addr) == 0)
+			ret = hook_api_commit(h, type, addr);
 
 		// restore the old protection
-		VirtualProtect(addr, hook_types[type].len, old_protect,
+		VirtualProtect(start, len, old_protect,
 			&old_protect);
 	}
 	else {
@@ -19,6 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "misc.h"
 #include "hooking.h"
 #include "hooks.h"
+#include "hook_plan.h"
+#include "hook_index.h"
+#include "hook_share.h"
 #include "pipe.h"
 
 extern char *our_process_name;
@@ -2200,32 +2203,72 @@ BOOL inside_hook(LPVOID Address)
 	return FALSE;
 }
 
+// the hooks grouped by library, so a DLL load only visits its own hooks
+static hook_index_t g_hook_index;
+
+static void build_hook_index(void)
+{
+	const unsigned short **libraries = malloc(hooks_arraysize * sizeof(*libraries));
+
+	if (libraries == NULL)
+		return;
+	for (unsigned int i = 0; i < hooks_arraysize; i++)
+		libraries[i] = (const unsigned short *)(hooks+i)->library;
+	hook_index_build(&g_hook_index, libraries, (unsigned int)hooks_arraysize);
+	free(libraries);
+}
+
+// the first hook on library, or the next one after i; the whole table is
+// scanned only if the index couldn't be built
+static unsigned int next_hook_on(const wchar_t *library, unsigned int i)
+{
+	if (g_hook_index.table) {
+		if (i == HOOK_INDEX_END)
+			return hook_index_first(&g_hook_index, (const unsigned short *)library);
+		return hook_index_next(&g_hook_index, i);
+	}
+	for (i = i == HOOK_INDEX_END ? 0 : i + 1; i < hooks_arraysize; i++)
+		if ((hooks+i)->library && !wcsicmp((hooks+i)->library, library))
+			return i;
+	return HOOK_INDEX_END;
+}
+
+static void publish_plan(void);
+
 BOOL set_hooks_dll(const wchar_t *library)
 {
 	BOOL ret = FALSE;
-	for (unsigned int i = 0; i < hooks_arraysize; i++) {
-		if (!wcsicmp((hooks+i)->library, library)) {
-			BOOL ret = TRUE;
-			if (hook_api(hooks+i, g_config.hook_type) < 0)
-				pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
-		}
+	for (unsigned int i = next_hook_on(library, HOOK_INDEX_END); i != HOOK_INDEX_END; i = next_hook_on(library, i)) {
+		ret = TRUE;
+		if (hook_api(hooks+i, g_config.hook_type) < 0)
+			pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
+	}
+	if (ret) {
+		invalidate_address_classes();
+		publish_plan();
 	}
 	return ret;
 }
 
 void set_hooks_by_export_directory(const wchar_t *exportdirectory, const wchar_t *library)
 {
-	for (unsigned int i = 0; i < hooks_arraysize; i++) {
-		if (!wcsicmp((hooks+i)->library, exportdirectory)) {
-			hook_t *hook = hooks+i;
-			hook->library = library;
-			hook->exportdirectory = exportdirectory;
-			hook->addr = NULL;
-			hook->is_hooked = 0;
-			if (hook_api(hook, g_config.hook_type) < 0)
-				pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
-		}
+	unsigned int i, next;
+
+	for (i = next_hook_on(exportdirectory, HOOK_INDEX_END); i != HOOK_INDEX_END; i = next) {
+		hook_t *hook = hooks+i;
+		// the hook leaves exportdirectory's list here
+		next = next_hook_on(exportdirectory, i);
+		hook->library = library;
+		hook->exportdirectory = exportdirectory;
+		hook->addr = NULL;
+		hook->is_hooked = 0;
+		if (g_hook_index.table && !hook_index_move(&g_hook_index, i, (const unsigned short *)library))
+			hook_index_free(&g_hook_index);
+		if (hook_api(hook, g_config.hook_type) < 0)
+			pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
 	}
+	invalidate_address_classes();
+	publish_plan();
 }
 
 extern void invalidate_regions_for_hook(const hook_t *hook);
@@ -2241,6 +2284,346 @@ void revalidate_all_hooks(void)
 	}
 }
 
+// patches a prepared hook with a protection change of its own
+static int commit_hook(hook_t *h, int type, unsigned char *addr)
+{
+	unsigned char *start;
+	unsigned int len;
+	DWORD old_protect;
+	int ret = -1;
+
+	hook_api_extent(type, addr, &start, &len);
+	if (VirtualProtect(start, len, PAGE_EXECUTE_READWRITE, &old_protect)) {
+		ret = hook_api_commit(h, type, addr);
+		VirtualProtect(start, len, old_protect, &old_protect);
+		FlushInstructionCache(GetCurrentProcess(), start, len);
+	}
+	else
+		pipe("WARNING:Unable to change protection for hook on %z", h->funcname);
+	return ret;
+}
+
+// The resolved hook plan handed down to child processes (see hook_share.h):
+// the one our parent published for the same hook table, if any, and the one
+// recorded while installing ours and as DLLs are loaded and hooked later,
+// published in a section that stays open as long as we run and is written
+// afresh after each pass that recorded something. The section is named for
+// a hash of the pid and the analysis's pipe name, so it doesn't give us
+// away by name. Later passes come from the DLL load notification, so the
+// loader lock keeps them apart.
+#define HOOK_PLAN_SECTION "Local\\%08x"
+
+// the lookups handed down: only those that scan code, as the rest cost no
+// more than a probe of the export index, each with the check a child makes
+// of what it is handed, as the sample can write a plan too
+static const struct {
+	const char *funcname;
+	BOOL (*check)(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness);
+} g_shared_lookups[] = {
+	{ "JsEval", check_jseval_addr },
+	{ "COleScript_ParseScriptText", check_olescript_parsescripttext_addr },
+	{ "CDocument_write", check_cdocument_write_addr },
+};
+
+static const hook_share_header_t *g_inherited_plan;
+static HMODULE g_inherited_bases[HOOK_SHARE_MAX_MODULES];	// modules found to match
+static hook_share_module_t *g_plan_modules;
+static hook_share_entry_t *g_plan_entries;
+static unsigned int g_plan_module_count, g_plan_entry_count, g_plan_entry_max, g_plan_table_hash;
+static BOOL g_plan_changed;
+static HANDLE g_plan_section;
+
+static void plan_section_name(char *name, DWORD pid)
+{
+	unsigned int hash = hook_share_hash(HOOK_SHARE_HASH_INIT, g_config.pipe_name, wcslen(g_config.pipe_name) * sizeof(wchar_t));
+
+	sprintf(name, HOOK_PLAN_SECTION, hook_share_hash(hash, &pid, sizeof(pid)));
+}
+
+static int shared_lookup(const hook_t *h)
+{
+	unsigned int i;
+
+	for (i = 0; h->funcname && i < ARRAYSIZE(g_shared_lookups); i++)
+		if (!strcmp(h->funcname, g_shared_lookups[i].funcname))
+			return (int)i;
+	return -1;
+}
+
+static unsigned int hook_table_hash(void)
+{
+	unsigned int hash = HOOK_SHARE_HASH_INIT, i;
+
+	for (i = 0; i < hooks_arraysize; i++) {
+		hook_t *h = hooks+i;
+		if (h->library)
+			hash = hook_share_hash(hash, h->library, (wcslen(h->library) + 1) * sizeof(wchar_t));
+		if (h->funcname)
+			hash = hook_share_hash(hash, h->funcname, strlen(h->funcname) + 1);
+		hash = hook_share_hash(hash, &h->timestamp, sizeof(h->timestamp));
+		hash = hook_share_hash(hash, &h->rva, sizeof(h->rva));
+	}
+	return hash;
+}
+
+static void load_inherited_plan(void)
+{
+	DWORD ppid = parent_process_id();
+	MEMORY_BASIC_INFORMATION mbi;
+	HANDLE section;
+	char name[64];
+	void *view, *copy;
+
+	if (!ppid)
+		return;
+	if (g_inherited_plan) {
+		free((void *)g_inherited_plan);
+		g_inherited_plan = NULL;
+		memset(g_inherited_bases, 0, sizeof(g_inherited_bases));
+	}
+	plan_section_name(name, ppid);
+	section = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if (!section)
+		return;
+	view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+	// validated and used as a private copy, as the parent can still write it
+	if (view && VirtualQuery(view, &mbi, sizeof(mbi)) && (copy = malloc(mbi.RegionSize))) {
+		memcpy(copy, view, mbi.RegionSize);
+		g_inherited_plan = hook_share_validate(copy, mbi.RegionSize, sizeof(void *), g_plan_table_hash);
+		if (g_inherited_plan)
+			DebugOutput("install_hooks: resolved hook plan of %u hooks inherited from process %u.\n", g_inherited_plan->entry_count, ppid);
+		else
+			free(copy);
+	}
+	if (view)
+		UnmapViewOfFile(view);
+	CloseHandle(section);
+}
+
+static void publish_plan(void)
+{
+	size_t size = hook_share_size(HOOK_SHARE_MAX_MODULES, g_plan_entry_max);
+	char name[64];
+	void *view;
+
+	// nothing new scanned for, so nothing new worth handing down
+	if (!g_plan_changed || !g_plan_entry_count)
+		return;
+	g_plan_changed = FALSE;
+	if (!g_plan_section) {
+		plan_section_name(name, GetCurrentProcessId());
+		g_plan_section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+		// someone else's: stop recording rather than write into it
+		if (!g_plan_section || GetLastError() == ERROR_ALREADY_EXISTS) {
+			if (g_plan_section)
+				CloseHandle(g_plan_section);
+			g_plan_section = NULL;
+			free(g_plan_modules);
+			free(g_plan_entries);
+			g_plan_modules = NULL;
+			g_plan_entries = NULL;
+			return;
+		}
+	}
+	// a child reading it partway through sees a bad checksum and scans
+	view = MapViewOfFile(g_plan_section, FILE_MAP_WRITE, 0, 0, size);
+	if (view) {
+		hook_share_write(view, size, sizeof(void *), g_plan_table_hash, g_plan_modules, g_plan_module_count, g_plan_entries, g_plan_entry_count);
+		UnmapViewOfFile(view);
+	}
+}
+
+static BOOL module_identity(HMODULE hmod, unsigned int *timestamp, unsigned int *image_size)
+{
+	__try {
+		*timestamp = GetTimeStamp(hmod);
+		*image_size = get_image_size((ULONG_PTR)hmod);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		return FALSE;
+	}
+	return *image_size != 0;
+}
+
+int resolved_hook_lookup(const hook_t *h, HMODULE hmod, unsigned char **addr, ULONG_PTR *witness)
+{
+	const hook_share_entry_t *e;
+	const hook_share_module_t *m;
+	unsigned int timestamp, image_size;
+	int lookup;
+	BOOL checked = FALSE;
+
+	if (h < hooks || h >= hooks + hooks_arraysize || (lookup = shared_lookup(h)) < 0)
+		return 0;
+	// the parent may have loaded and scanned the module since we last looked
+	e = g_inherited_plan ? hook_share_find(g_inherited_plan, (unsigned int)(h - hooks)) : NULL;
+	if (!e) {
+		load_inherited_plan();
+		if (!g_inherited_plan || !(e = hook_share_find(g_inherited_plan, (unsigned int)(h - hooks))))
+			return 0;
+	}
+	if (g_inherited_bases[e->module] != hmod) {
+		m = hook_share_module(g_inherited_plan, e->module);
+		if (!hook_share_name_matches(m, (const unsigned short *)h->library) || !module_identity(hmod, &timestamp, &image_size) ||
+			timestamp != m->timestamp || image_size != m->image_size)
+			return 0;
+		g_inherited_bases[e->module] = hmod;
+	}
+	__try {
+		checked = g_shared_lookups[lookup].check(hmod, (ULONG_PTR)hmod + e->rva, (ULONG_PTR)hmod + e->witness);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		;
+	}
+	if (!checked) {
+		DebugOutput("install_hooks: inherited address of %s doesn't check out, scanning for it.\n", h->funcname);
+		return 0;
+	}
+	*addr = (unsigned char *)hmod + e->rva;
+	*witness = (ULONG_PTR)hmod + e->witness;
+	return 1;
+}
+
+void resolved_hook_record(const hook_t *h, HMODULE hmod, unsigned char *addr, ULONG_PTR witness)
+{
+	hook_share_entry_t *e;
+	unsigned int i, n, timestamp, image_size;
+	int module;
+
+	if (!g_plan_entries || h < hooks || h >= hooks + hooks_arraysize || !addr || !witness || shared_lookup(h) < 0)
+		return;
+	i = (unsigned int)(h - hooks);
+	if (!module_identity(hmod, &timestamp, &image_size))
+		return;
+	if (addr < (unsigned char *)hmod || addr >= (unsigned char *)hmod + image_size ||
+		witness < (ULONG_PTR)hmod || witness >= (ULONG_PTR)hmod + image_size)
+		return;
+	module = hook_share_add_module(g_plan_modules, &g_plan_module_count, (const unsigned short *)h->library, timestamp, image_size);
+	if (module < 0)
+		return;
+	// kept sorted by hook, a hook hooked again replacing its entry
+	for (n = 0; n < g_plan_entry_count && g_plan_entries[n].hook < i; n++);
+	if (n == g_plan_entry_count || g_plan_entries[n].hook != i) {
+		if (g_plan_entry_count == g_plan_entry_max)
+			return;
+		memmove(&g_plan_entries[n + 1], &g_plan_entries[n], (g_plan_entry_count - n) * sizeof(hook_share_entry_t));
+		g_plan_entry_count++;
+	}
+	e = &g_plan_entries[n];
+	e->hook = i;
+	e->module = (unsigned short)module;
+	e->flags = 0;
+	e->rva = (unsigned int)(addr - (unsigned char *)hmod);
+	e->witness = (unsigned int)(witness - (ULONG_PTR)hmod);
+	g_plan_changed = TRUE;
+}
+
+// Installs the hook set in two passes: every hook is resolved and has its
+// trampolines built without the targets being touched, then the patches go
+// in a run of pages at a time, each run made writable once and flushed once
+// (see hook_plan.h). A function reached through two entries is hooked by
+// the first, as hooking them one by one would.
+static void install_hooks(BOOL skip_wait_for_single_object)
+{
+	hook_patch_t *patches = calloc(hooks_arraysize, sizeof(hook_patch_t));
+	hook_page_run_t *runs = calloc(hooks_arraysize, sizeof(hook_page_run_t));
+	unsigned char **addrs = calloc(hooks_arraysize, sizeof(unsigned char *));
+	int *types = calloc(hooks_arraysize, sizeof(int));
+	unsigned int i, j, n = 0, nruns;
+	SYSTEM_INFO si;
+
+	if (!patches || !runs || !addrs || !types) {
+		for (i = 0; i < hooks_arraysize; i++) {
+			if (skip_wait_for_single_object && !stricmp((hooks+i)->funcname, "NtWaitForSingleObject"))
+				continue;
+			if (hook_api(hooks+i, g_config.hook_type) < 0)
+				pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
+		}
+		goto out;
+	}
+
+	// the parent's lookups for what it has loaded as we have, and ours
+	// recorded for our children
+	g_plan_table_hash = hook_table_hash();
+	load_inherited_plan();
+	for (i = 0; i < hooks_arraysize; i++)
+		if (shared_lookup(hooks+i) >= 0)
+			g_plan_entry_max++;
+	g_plan_modules = calloc(HOOK_SHARE_MAX_MODULES, sizeof(hook_share_module_t));
+	g_plan_entries = calloc(g_plan_entry_max ? g_plan_entry_max : 1, sizeof(hook_share_entry_t));
+	if (!g_plan_modules || !g_plan_entries) {
+		free(g_plan_modules);
+		free(g_plan_entries);
+		g_plan_modules = NULL;
+		g_plan_entries = NULL;
+	}
+
+	for (i = 0; i < hooks_arraysize; i++) {
+		unsigned char *start;
+		unsigned int len;
+		int ret;
+
+		if (skip_wait_for_single_object && !stricmp((hooks+i)->funcname, "NtWaitForSingleObject"))
+			continue;
+		types[i] = g_config.hook_type;
+		ret = hook_api_resolve(hooks+i, &types[i], &addrs[i]);
+		if (ret < 0)
+			pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
+		if (ret <= 0)
+			continue;
+		hook_api_extent(types[i], addrs[i], &start, &len);
+		patches[n].start = (size_t)start;
+		patches[n].len = len;
+		patches[n].id = i;
+		n++;
+	}
+
+	publish_plan();
+
+	GetSystemInfo(&si);
+	nruns = hook_plan(patches, n, si.dwPageSize, runs);
+
+	for (i = 0; i < n; i++) {
+		unsigned int id = patches[i].id;
+		if (!patches[i].skip && hook_api_prepare(hooks+id, types[id], addrs[id]) < 0) {
+			patches[i].skip = 1;
+			pipe("WARNING:Unable to hook %z", (hooks+id)->funcname);
+		}
+	}
+
+	for (i = 0; i < nruns; i++) {
+		hook_page_run_t *run = &runs[i];
+		DWORD old_protect;
+		BOOL writable = VirtualProtect((PVOID)run->base, run->size, PAGE_EXECUTE_READWRITE, &old_protect);
+
+		for (j = run->first; j < run->first + run->count; j++) {
+			unsigned int id = patches[j].id;
+			int ret;
+			if (patches[j].skip)
+				continue;
+			// if the run can't be made writable as a whole, try each on its own
+			if (writable)
+				ret = hook_api_commit(hooks+id, types[id], addrs[id]);
+			else
+				ret = commit_hook(hooks+id, types[id], addrs[id]);
+			if (ret < 0)
+				pipe("WARNING:Unable to hook %z", (hooks+id)->funcname);
+		}
+
+		if (writable) {
+			VirtualProtect((PVOID)run->base, run->size, old_protect, &old_protect);
+			FlushInstructionCache(GetCurrentProcess(), (PVOID)run->base, run->size);
+		}
+	}
+
+out:
+	invalidate_address_classes();
+	free(patches);
+	free(runs);
+	free(addrs);
+	free(types);
+}
+
 PVOID g_dll_notify_cookie;
 
 extern _LdrRegisterDllNotification pLdrRegisterDllNotification;
@@ -2346,6 +2729,8 @@ void set_hooks()
 	// The hooks contain executable code as well, so they have to be RWX
 	VirtualProtect(hooks, hooks_size, PAGE_EXECUTE_READWRITE, &old_protect);
 
+	build_hook_index();
+
 	memset(&threadInfo, 0, sizeof(threadInfo));
 	threadInfo.dwSize = sizeof(threadInfo);
 
@@ -2365,19 +2750,11 @@ void set_hooks()
 		}
 	} while (Thread32Next(hSnapShot, &threadInfo));
 
-	for (i = 0; i < hooks_arraysize; i++) {
 #ifndef _WIN64
-		if ((OSVersion.dwMajorVersion == 6 && OSVersion.dwMinorVersion > 1) || OSVersion.dwMajorVersion > 6) {
-			if (Wow64Process == FALSE) {
-				if (!stricmp((hooks+i)->funcname, "NtWaitForSingleObject"))
-					continue;
-			}
-		}
+	install_hooks(((OSVersion.dwMajorVersion == 6 && OSVersion.dwMinorVersion > 1) || OSVersion.dwMajorVersion > 6) && Wow64Process == FALSE);
+#else
+	install_hooks(FALSE);
 #endif
-		//DebugOutput("set_hooks: Hooking %s", (hooks+i)->funcname);
-		if (hook_api(hooks+i, g_config.hook_type) < 0)
-			pipe("WARNING:Unable to hook %z", (hooks+i)->funcname);
-	}
 
 	for (i = 0; i < num_suspended_threads; i++) {
 		ResumeThread(suspended_threads[i]);
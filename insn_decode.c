@@ -0,0 +1,313 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "insn_decode.h"
+
+#define M	0x01	// ModRM
+#define I8	0x02
+#define I16	0x04
+#define IZ	0x08	// 16 or 32 bits by operand size
+#define AM	0x10	// an address, sized by address size
+#define REL	0x20	// the immediate is a branch offset
+#define NX	0x40	// invalid in 64-bit mode
+#define BAD	0x80
+#define J8	(REL|I8)
+#define JZ	(REL|IZ)
+#define GRP	0x100	// needs a look at its ModRM byte, see special_form()
+#define REGS	0x200	// the ModRM byte only names registers, whatever its mod
+
+static const unsigned short one_byte[256] = {
+	M, M, M, M, I8, IZ, NX, NX, M, M, M, M, I8, IZ, NX, 0,
+	M, M, M, M, I8, IZ, NX, NX, M, M, M, M, I8, IZ, NX, NX,
+	M, M, M, M, I8, IZ, 0, NX, M, M, M, M, I8, IZ, 0, NX,
+	M, M, M, M, I8, IZ, 0, NX, M, M, M, M, I8, IZ, 0, NX,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	NX, NX, M|NX|GRP, M, 0, 0, 0, 0, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+	J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8, J8,
+	M|I8, M|IZ, M|I8|NX, M|I8, M, M, M, M, M, M, M, M, M|GRP, M|GRP, M|GRP, M|GRP,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, IZ|I16|NX, 0, 0, 0, 0, 0,
+	AM, AM, AM, AM, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+	M|I8, M|I8, I16, 0, M|NX|GRP, M|NX|GRP, M|I8|GRP, M|IZ|GRP, I16|I8, 0, I16, 0, 0, I8, NX, 0,
+	M, M, M, M, I8|NX, I8|NX, NX, 0, M, M, M, M, M, M, M, M,
+	J8, J8, J8, J8, I8, I8, I8, I8, JZ, JZ, IZ|I16|NX, J8, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, M|GRP, M|GRP, 0, 0, 0, 0, 0, 0, M|GRP, M|GRP,
+};
+
+// 0f xx
+static const unsigned short two_byte[256] = {
+	M, M, M, M, BAD, 0, 0, 0, 0, 0, BAD, 0, BAD, M, 0, M|I8,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M|GRP, M|GRP, M|GRP, M|GRP, BAD, BAD, BAD, BAD, M, M, M, M, M, M, M, M,
+	0, 0, 0, 0, 0, 0, BAD, 0, 0, BAD, 0, BAD, BAD, BAD, BAD, BAD,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M|GRP, M, BAD, BAD, M, M, M, M,
+	JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ, JZ,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	0, 0, 0, M, M|I8, M, BAD, BAD, 0, 0, 0, M, M|I8, M, M, M,
+	M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+	M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+// prefixes, and what they change
+#define P_LEGACY	1
+#define P_OPSIZE	2
+#define P_ADDRSIZE	3
+#define P_REPNE		4
+#define P_REX		5
+
+static const unsigned char prefixes[256] = {
+	[0x26] = P_LEGACY, [0x2e] = P_LEGACY, [0x36] = P_LEGACY, [0x3e] = P_LEGACY,
+	[0x40] = P_REX, [0x41] = P_REX, [0x42] = P_REX, [0x43] = P_REX, [0x44] = P_REX, [0x45] = P_REX, [0x46] = P_REX, [0x47] = P_REX,
+	[0x48] = P_REX, [0x49] = P_REX, [0x4a] = P_REX, [0x4b] = P_REX, [0x4c] = P_REX, [0x4d] = P_REX, [0x4e] = P_REX, [0x4f] = P_REX,
+	[0x64] = P_LEGACY, [0x65] = P_LEGACY, [0x66] = P_OPSIZE, [0x67] = P_ADDRSIZE,
+	[0xf0] = P_LEGACY, [0xf2] = P_REPNE, [0xf3] = P_LEGACY,
+};
+
+// the displacement a ModRM byte with 32 or 64-bit addressing brings, and
+// whether a SIB byte follows (whose base may add a displacement of its own)
+#define MODRM_SIB	0x10
+#define MODRM_RIP	0x20
+
+static unsigned char modrm32(unsigned char modrm)
+{
+	unsigned int mod = modrm >> 6, rm = modrm & 7;
+
+	if (mod == 3)
+		return 0;
+	return (rm == 4 ? MODRM_SIB : 0) | (mod == 1 ? 1 : mod == 2 ? 4 : rm == 5 ? 4 | MODRM_RIP : 0);
+}
+
+// the part of the 0f map with VEX forms: SSE, vzeroupper and vzeroall
+static int vex_0f_opcode(unsigned char op)
+{
+	return (op >= 0x10 && op <= 0x17) || (op >= 0x28 && op <= 0x2f) || (op >= 0x50 && op <= 0x7f) ||
+		op == 0xae || op == 0xc2 || (op >= 0xc4 && op <= 0xc6) || op >= 0xd0;
+}
+
+// the opcodes marked GRP, whose ModRM byte changes what follows or makes
+// the encoding invalid (of interest so that a trampoline isn't built over
+// data); returns the flags to decode the rest with, or BAD
+static unsigned int special_form(unsigned int map, unsigned char op, unsigned char modrm, int opsize16, int repne, unsigned int flags)
+{
+	unsigned int reg = (modrm >> 3) & 7, mem = modrm < 0xc0;
+
+	if (map == 1) {
+		// mov to and from control and debug registers only take registers
+		if (op != 0x78)
+			return flags | REGS;
+		// sse4a's extrq and insertq with immediates likewise, followed by
+		// two bytes
+		if (opsize16 || repne)
+			return flags | REGS | I16;
+		return flags;
+	}
+
+	switch (op) {
+	case 0x62:	// bound
+	case 0x8d:	// lea
+	case 0xc4:	// les
+	case 0xc5:	// lds
+		return mem ? flags : BAD;
+	case 0x8c:
+	case 0x8e:
+		return reg > 5 ? BAD : flags;
+	case 0x8f:
+		return reg ? BAD : flags;
+	case 0xc6:
+	case 0xc7:
+		// xabort and xbegin
+		if (modrm == 0xf8)
+			return op == 0xc7 ? flags | REL : flags;
+		return reg ? BAD : flags;
+	case 0xf6:
+	case 0xf7:
+		// test takes an immediate, the rest of the group doesn't
+		if (reg < 2)
+			return flags | (op == 0xf6 ? I8 : IZ);
+		return flags;
+	case 0xfe:
+		return reg > 1 ? BAD : flags;
+	case 0xff:
+		return reg == 7 || (!mem && (reg == 3 || reg == 5)) ? BAD : flags;
+	}
+	return flags;
+}
+
+unsigned int insn_decode(const unsigned char *code, size_t avail, int x64, insn_t *insn)
+{
+	unsigned int i = 0, flags, imm_size = 0, disp_size = 0;
+	int opsize16 = 0, addr16 = 0, repne = 0, rex_w = 0;
+	unsigned int map = 0;	// one byte, 0f, 0f38 or 0f3a
+	unsigned char op;
+
+	if (avail > INSN_MAX_LEN)
+		avail = INSN_MAX_LEN;
+	insn->flags = 0;
+	insn->disp = insn->disp_size = 0;
+	insn->rel = 0;
+
+	// a REX prefix only counts right before the opcode
+	for (;; i++) {
+		unsigned int prefix;
+		if (i >= avail)
+			return 0;
+		prefix = prefixes[code[i]];
+		if (!prefix || (prefix == P_REX && !x64))
+			break;
+		rex_w = prefix == P_REX && (code[i] & 8);
+		if (prefix == P_OPSIZE)
+			opsize16 = 1;
+		else if (prefix == P_ADDRSIZE)
+			addr16 = 1;
+		else if (prefix == P_REPNE)
+			repne = 1;
+	}
+	insn->opcode = (unsigned char)i;
+	op = code[i++];
+
+	if (op == 0x0f) {
+		if (i >= avail)
+			return 0;
+		op = code[i++];
+		map = 1;
+		flags = two_byte[op];
+		if (op == 0x38 || op == 0x3a) {
+			map = op == 0x38 ? 2 : 3;
+			flags = op == 0x38 ? M : M | I8;
+			if (i >= avail)
+				return 0;
+			op = code[i++];
+		}
+	}
+	else if ((op == 0xc4 || op == 0xc5) && i < avail && (x64 || code[i] >= 0xc0)) {
+		// VEX: the opcode map comes from the prefix, 0f for the short form
+		map = 1;
+		if (op == 0xc4) {
+			map = code[i] & 0x1f;
+			i++;
+		}
+		i++;
+		if (i >= avail)
+			return 0;
+		op = code[i++];
+		if (map == 1)
+			flags = !vex_0f_opcode(op) ? BAD : op == 0x77 ? 0 : M | (two_byte[op] & I8);
+		else if (map == 2)
+			flags = M;
+		else if (map == 3)
+			flags = M | I8;
+		else
+			return 0;
+	}
+	else {
+		flags = one_byte[op];
+		if (x64 && (flags & NX))
+			return 0;
+		if (x64 && (op & 0xf8) == 0xb8 && rex_w)
+			imm_size = 8;
+	}
+	if (flags & BAD)
+		return 0;
+
+	if (flags & M) {
+		unsigned char modrm;
+		if (i >= avail)
+			return 0;
+		modrm = code[i++];
+		insn->flags |= INSN_MODRM;
+		if (flags & GRP) {
+			flags = special_form(map, op, modrm, opsize16, repne, flags);
+			if (flags & BAD)
+				return 0;
+			if (flags & REGS)
+				modrm |= 0xc0;
+		}
+
+		if (modrm < 0xc0) {
+			if (!x64 && addr16) {
+				if (modrm >= 0x40)
+					disp_size = modrm >= 0x80 ? 2 : 1;
+				else if ((modrm & 7) == 6)
+					disp_size = 2;
+			}
+			else {
+				unsigned int form = modrm32(modrm);
+				if (form & MODRM_SIB) {
+					if (i >= avail)
+						return 0;
+					if (modrm < 0x40 && (code[i] & 7) == 5)
+						form |= 4;
+					i++;
+				}
+				disp_size = form & 0xf;
+				if (x64 && (form & MODRM_RIP))
+					insn->flags |= INSN_RIP_RELATIVE;
+			}
+		}
+		insn->disp = (unsigned char)i;
+		insn->disp_size = (unsigned char)disp_size;
+		i += disp_size;
+	}
+
+	if (!imm_size && (flags & (I8 | I16 | IZ | AM))) {
+		if (flags & I8)
+			imm_size += 1;
+		if (flags & I16)
+			imm_size += 2;
+		// REX.W takes precedence over an operand size prefix
+		if (flags & IZ)
+			imm_size += opsize16 && !rex_w ? 2 : 4;
+		if (flags & AM)
+			imm_size += x64 ? (addr16 ? 4 : 8) : (addr16 ? 2 : 4);
+	}
+	insn->imm = (unsigned char)i;
+	insn->imm_size = (unsigned char)imm_size;
+	i += imm_size;
+	if (i > avail)
+		return 0;
+
+	if (insn->flags & INSN_RIP_RELATIVE)
+		insn->rel = *(const int *)&code[insn->disp];
+	else if (flags & REL) {
+		insn->flags |= INSN_REL_BRANCH;
+		if (imm_size == 1)
+			insn->rel = (signed char)code[insn->imm];
+		else if (imm_size == 2)
+			insn->rel = *(const short *)&code[insn->imm];
+		else
+			insn->rel = *(const int *)&code[insn->imm];
+	}
+
+	insn->len = (unsigned char)i;
+	return i;
+}
+
+size_t insn_target(const insn_t *insn, size_t addr)
+{
+	if (!(insn->flags & (INSN_RIP_RELATIVE | INSN_REL_BRANCH)))
+		return 0;
+	return addr + insn->len + (ptrdiff_t)insn->rel;
+}
@@ -0,0 +1,56 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Length decoding of x86 and x64 instructions, for copying a function's
+// first instructions into a hook trampoline. It finds where an
+// instruction's ModRM displacement and immediates are, and which of them
+// are relative to the instruction pointer, without the operand and
+// mnemonic decoding a full disassembler does. Covers the one, two and
+// three byte opcode maps, x87, 3DNow! and VEX encoded instructions. EVEX
+// and XOP aren't decoded. No Windows dependencies.
+
+#define INSN_MAX_LEN 15
+
+// has a ModRM byte
+#define INSN_MODRM			0x01
+// the displacement is relative to the next instruction (x64)
+#define INSN_RIP_RELATIVE	0x02
+// the immediate is a branch offset relative to the next instruction
+#define INSN_REL_BRANCH		0x04
+
+typedef struct _insn_t {
+	unsigned char len;
+	unsigned char opcode;		// offset of the opcode, after any prefixes
+	unsigned char disp;			// offset of the ModRM displacement
+	unsigned char disp_size;	// 0, 1, 2 or 4
+	unsigned char imm;			// offset of the immediates
+	unsigned char imm_size;		// 0 to 8 bytes, both of enter's included
+	unsigned int flags;
+	int rel;					// the RIP-relative displacement or branch offset
+} insn_t;
+
+// decodes the instruction at code, reading at most avail bytes; returns
+// its length, or 0 if it isn't a valid instruction or is cut off
+unsigned int insn_decode(const unsigned char *code, size_t avail, int x64, insn_t *insn);
+
+// what a RIP-relative operand or a relative branch of the instruction at
+// addr refers to, or 0 if it has neither
+size_t insn_target(const insn_t *insn, size_t addr);
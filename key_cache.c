@@ -0,0 +1,91 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "key_cache.h"
+
+static key_cache_entry_t *slot_for(key_cache_t *c, uintptr_t handle)
+{
+	// handle values are multiples of 4
+	uint32_t h = (uint32_t)(handle >> 2) * 0x9e3779b1u;
+	return &c->slots[h >> 23 & (KEY_CACHE_SLOTS - 1)];
+}
+
+void key_cache_init(key_cache_t *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+int key_cache_lookup(key_cache_t *c, uintptr_t handle, unsigned short *out, unsigned int maxlen, unsigned int now)
+{
+	key_cache_entry_t *e = slot_for(c, handle);
+
+	if (!handle || e->handle != handle || e->len > maxlen) {
+		c->misses++;
+		return -1;
+	}
+	if (now - e->stored > KEY_CACHE_MAX_AGE) {
+		e->handle = 0;
+		c->misses++;
+		return -1;
+	}
+	memcpy(out, e->name, e->len);
+	c->hits++;
+	return (int)e->len;
+}
+
+void key_cache_store(key_cache_t *c, uintptr_t handle, const unsigned short *name, unsigned int len, unsigned int now)
+{
+	key_cache_entry_t *e = slot_for(c, handle);
+	unsigned short *copy;
+
+	if (!handle || len > KEY_CACHE_MAX_NAME * sizeof(unsigned short))
+		return;
+
+	// reuse the slot's buffer when the new name fits
+	if (e->name && e->len >= len)
+		copy = e->name;
+	else {
+		copy = malloc(len ? len : 1);
+		if (copy == NULL)
+			return;
+		free(e->name);
+	}
+	memcpy(copy, name, len);
+	e->name = copy;
+	e->len = len;
+	e->stored = now;
+	e->handle = handle;
+}
+
+void key_cache_remove(key_cache_t *c, uintptr_t handle)
+{
+	key_cache_entry_t *e = slot_for(c, handle);
+
+	if (handle && e->handle == handle)
+		e->handle = 0;
+}
+
+void key_cache_clear(key_cache_t *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+		c->slots[i].handle = 0;
+}
@@ -0,0 +1,62 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Direct-mapped cache of registry key handle -> key name as returned by
+// NtQueryKey(KeyNameInformation), so that logging the same HKEY again does
+// not cost a syscall. No Windows dependencies so it can be tested on the
+// build host; names are 16-bit units and callers provide their own locking.
+
+#define KEY_CACHE_SLOTS 512
+// longer names are not cached
+#define KEY_CACHE_MAX_NAME 1024
+// ms a cached name is trusted before NtQueryKey is asked again, which bounds
+// how long a name stays stale when a handle is closed and reopened where the
+// hooks don't see it
+#define KEY_CACHE_MAX_AGE 2000
+
+typedef struct _key_cache_entry_t {
+	uintptr_t handle;		// 0 for an empty slot
+	unsigned int len;		// name length in bytes
+	unsigned int stored;	// tick count when cached
+	unsigned short *name;
+} key_cache_entry_t;
+
+typedef struct _key_cache_t {
+	key_cache_entry_t slots[KEY_CACHE_SLOTS];
+	unsigned int hits;
+	unsigned int misses;
+} key_cache_t;
+
+void key_cache_init(key_cache_t *c);
+
+// copies the cached name of handle into out (room for maxlen bytes) and
+// returns its length in bytes, or returns -1 if it isn't cached or was
+// cached more than KEY_CACHE_MAX_AGE ms before now (and is dropped)
+int key_cache_lookup(key_cache_t *c, uintptr_t handle, unsigned short *out, unsigned int maxlen, unsigned int now);
+
+void key_cache_store(key_cache_t *c, uintptr_t handle, const unsigned short *name, unsigned int len, unsigned int now);
+
+// drops the entry for handle: the handle was closed, or has just been
+// returned by an open and so names a different key than any cached one
+void key_cache_remove(key_cache_t *c, uintptr_t handle);
+
+// drops everything, e.g. after a key has been renamed
+void key_cache_clear(key_cache_t *c);
@@ -23,6 +23,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hooking.h"
 #include "misc.h"
 #include "utf8.h"
+#include "utf8_encode.h"
+#include "log_fmt.h"
+#include "log_dedup.h"
+#include "log_buffer.h"
+#include "log_throttle.h"
+#include "log_compact.h"
+#include "blob_store.h"
 #include "log.h"
 #include "bson.h"
 #include "pipe.h"
@@ -37,6 +44,22 @@ extern char* GetResultsPath(char* FolderName);
 size_t buffer_log_max = BUFFER_LOG_MAX;
 size_t large_buffer_log_max = LARGE_BUFFER_LOG_MAX;
 #define BUFFER_REGVAL_MAX 512
+// buffers longer than this go in full to the blob stream rather than
+// truncated into the record; 0 keeps them all in the records
+size_t log_blob_threshold = 0;
+#define BLOB_STREAM_LIMIT (512ULL * 1024 * 1024)
+// pending records per thread for folding repeats that aren't back to back,
+// and the most ms one is held back; 0 (or 1) only folds back to back
+// repeats in the whole stream, as loq() always has
+unsigned int log_dedup_window = 0;
+unsigned int log_dedup_latency = 1000;
+// count rather than log the hottest APIs while the log buffer is backed up;
+// off unless adaptive-logging=1
+unsigned int log_adaptive = 0;
+#define THROTTLE_PERIOD 1000
+#define THROTTLE_HOT_CALLS 200
+// pack API records positionally (see log_compact.h) rather than as verbose bson
+unsigned int log_compact = 0;
 
 CRITICAL_SECTION g_mutex;
 CRITICAL_SECTION g_writing_log_buffer_mutex;
@@ -44,18 +67,44 @@ static SOCKET g_sock;
 static HANDLE g_debug_log_handle;
 static unsigned int g_starttick;
 
-static char *g_buffer;
-static volatile int g_idx;
+// filled by the hooked threads while the log thread writes out the other half
+static log_buffer_t g_logbuf;
 static DWORD last_api_logged;
 static BOOLEAN special_api_triggered;
 static BOOLEAN delete_last_log;
 HANDLE g_log_handle;
 
-// current to-be-logged API call
+// current to-be-logged API call, built in a block kept from call to call
 static bson g_bson[1];
+static bson_arena g_bson_arena = { NULL, 4096, 64 * 1024, 0 };
 static char g_istr[4];
 
-static char logtbl_explained[256] = {0};
+// per log index: whether the index has been explained to the analyzer, its
+// compiled format and its API name
+#define LOG_TABLE_MAX 1024
+static char logtbl_explained[LOG_TABLE_MAX] = {0};
+static log_fmt_t *logtbl_fmt[LOG_TABLE_MAX];
+static const char *logtbl_name[LOG_TABLE_MAX];
+
+static log_throttle_t g_throttle;
+
+// large buffers logged out of band, only touched under g_mutex
+static blob_store_t g_blobs;
+static HANDLE g_blob_handle = INVALID_HANDLE_VALUE;
+
+// the compacted record, grown to the largest one seen
+static unsigned char *g_compact;
+static unsigned int g_compact_size;
+// category names sent so far in compact mode, referred to by their position
+#define LOG_CATEGORY_MAX 64
+static const char *g_categories[LOG_CATEGORY_MAX];
+static unsigned int g_ncategories;
+// set while g_bson holds a record under construction
+static BOOLEAN g_building_record;
+
+// scratch for the registry key arguments, only touched under g_mutex
+#define KEYBUF_SIZE (sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN)
+static PKEY_NAME_INFORMATION g_keybuf;
 
 #define LOG_ID_PROCESS 0
 #define LOG_ID_THREAD 1
@@ -66,8 +115,10 @@ static char logtbl_explained[256] = {0};
 #define LOG_ID_ANOMALY_HOOKMOD 6
 #define LOG_ID_ANOMALY_PROCNAME 7
 #define LOG_ID_ENVIRON 8
+#define LOG_ID_THROTTLED 9
+#define LOG_ID_HOOK_STATS 10
 // must be one larger than the largest log ID
-#define LOG_ID_PREDEFINED_MAX 9
+#define LOG_ID_PREDEFINED_MAX 11
 
 volatile LONG g_log_index = 20;  // index must start after the special IDs (see defines)
 
@@ -81,52 +132,100 @@ static HANDLE g_log_flush;
 
 extern int process_shutting_down;
 
+// only one thread writes to the log handle at a time
+static CRITICAL_SECTION g_sending_log_mutex;
+static HANDLE g_log_write_event;
+
+// a write failing this many times in a row means the log is gone
+#define LOG_WRITE_RETRIES 4
+static BOOLEAN g_log_broken;
+
+static BOOL log_write(const char *buf, DWORD len, DWORD *written)
+{
+	OVERLAPPED ov;
+
+	if (g_sock == DEBUG_SOCKET) {
+		if (g_debug_log_handle != INVALID_HANDLE_VALUE)
+			return WriteFile(g_debug_log_handle, buf, len, written, NULL);
+		// some non-admin debug case
+		*written = len;
+		return TRUE;
+	}
+	if (g_log_handle == INVALID_HANDLE_VALUE || g_log_broken) {
+		*written = len;
+		return TRUE;
+	}
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = g_log_write_event;
+	if (!WriteFile(g_log_handle, buf, len, NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	return GetOverlappedResult(g_log_handle, &ov, written, TRUE);
+}
+
+// writes out everything buffered so far; the buffer lock is only held to
+// take the next run of bytes and to account for what got written, so the
+// hooked threads carry on filling the other buffer meanwhile
 static void _send_log(void)
 {
-	EnterCriticalSection(&g_writing_log_buffer_mutex);
-	while (g_idx > 0) {
-		int written = -1;
+	unsigned int failures = 0;
+	size_t dropped = 0;
+	DWORD error = 0;
 
-		if (g_sock == DEBUG_SOCKET) {
-			if (g_debug_log_handle != INVALID_HANDLE_VALUE) {
-				WriteFile(g_debug_log_handle, g_buffer, g_idx, &written, NULL);
-			}
-			else {
-				// some non-admin debug case
-				written = g_idx;
-			}
-		}
-		else {
-			if (g_log_handle == INVALID_HANDLE_VALUE) {
-				g_idx = 0;
+	EnterCriticalSection(&g_sending_log_mutex);
+	while (1) {
+		const char *data;
+		size_t len;
+		DWORD written = 0;
+
+		EnterCriticalSection(&g_writing_log_buffer_mutex);
+		data = log_buffer_next(&g_logbuf, &len);
+		LeaveCriticalSection(&g_writing_log_buffer_mutex);
+		if (!len)
+			break;
+
+		if (!log_write(data, (DWORD)len, &written)) {
+			// back off in case the pipe is only busy, but rather than spin
+			// here with the lock held, give up on a log that keeps failing
+			// and drop what's buffered along with anything logged later
+			if (++failures < LOG_WRITE_RETRIES) {
+				raw_sleep(10 << failures);
 				continue;
 			}
-			else {
-				WriteFile(g_log_handle, g_buffer, g_idx, &written, NULL);
-			}
-		}
-
-		if (written < 0)
-			continue;
-
-		// if this call didn't write the entire buffer, then we have to move
-		// around some stuff in the buffer
-		if (written < g_idx) {
-			memmove(g_buffer, g_buffer + written, g_idx - written);
+			error = GetLastError();
+			g_log_broken = TRUE;
+			written = (DWORD)len;
+			dropped += len;
 		}
+		failures = 0;
 
-		// subtract the amount of written bytes from the index
-		g_idx -= written;
+		// a short write carries on from where it stopped next time round
+		EnterCriticalSection(&g_writing_log_buffer_mutex);
+		log_buffer_sent(&g_logbuf, written);
+		LeaveCriticalSection(&g_writing_log_buffer_mutex);
 	}
-	LeaveCriticalSection(&g_writing_log_buffer_mutex);
+	LeaveCriticalSection(&g_sending_log_mutex);
+
+	// pipe() flushes the log, so only once we're done with it
+	if (dropped)
+		pipe("WARNING:Unable to write to the log (error %d), dropped %d bytes and any further logging", error, (int)dropped);
 }
 
+static log_dedup_t g_dedup;
+
 static DWORD WINAPI _log_thread(LPVOID param)
 {
 	hook_disable();
 
 	while (1) {
 		WaitForSingleObject(g_log_flush, 500);
+		// a record held back for folding goes out within the latency bound
+		// even if its thread never logs again
+		if (g_dedup.latency) {
+			EnterCriticalSection(&g_mutex);
+			log_dedup_expire(&g_dedup, raw_gettickcount());
+			LeaveCriticalSection(&g_mutex);
+		}
 		_send_log();
 	}
 }
@@ -145,22 +244,30 @@ static DWORD WINAPI _logwatcher_thread(LPVOID param)
 
 extern BOOLEAN g_dll_main_complete;
 
-static lastlog_t lastlog;
-
 static void log_raw_direct(const char *buf, size_t length) {
 	size_t copiedlen = 0;
-	size_t copylen;
+	BOOLEAN wake = FALSE;
+
+	if (!g_logbuf.size)
+		return;
 
 	while (copiedlen != length) {
 		EnterCriticalSection(&g_writing_log_buffer_mutex);
-		copylen = min(length - copiedlen, (size_t)(BUFFERSIZE - g_idx));
-		memcpy(&g_buffer[g_idx], &buf[copiedlen], copylen);
-		g_idx += (int)copylen;
-		copiedlen += copylen;
+		copiedlen += log_buffer_put(&g_logbuf, &buf[copiedlen], length - copiedlen);
+		wake = g_logbuf.fill_len >= g_logbuf.size / 2;
 		LeaveCriticalSection(&g_writing_log_buffer_mutex);
-		if (copiedlen != length && g_buffer)
+		// both buffers are full: wait our turn to write, as the log thread
+		// won't have started if we're still in DllMain
+		if (copiedlen != length)
 			_send_log();
 	}
+	if (wake && g_log_thread_handle)
+		SetEvent(g_log_flush);
+}
+
+static void log_dedup_emit(void *ctx, const unsigned char *buf, unsigned int len)
+{
+	log_raw_direct((const char *)buf, len);
 }
 
 void log_flush()
@@ -187,14 +294,13 @@ void log_flush()
 
 	// ok to nest these
 	EnterCriticalSection(&g_mutex);
-	if (lastlog.buf) {
-		log_raw_direct(lastlog.buf, lastlog.len);
-		free(lastlog.buf);
-		lastlog.buf = NULL;
-	}
+	if (log_adaptive && g_logbuf.size && !g_building_record)
+		log_throttle_flush(&g_throttle, log_throttle_emit, NULL);
+	if (g_dedup.emit)
+		log_dedup_flush(&g_dedup);
 	LeaveCriticalSection(&g_mutex);
 
-	if (g_buffer)
+	if (g_logbuf.size)
 		_send_log();
 }
 
@@ -247,42 +353,43 @@ static void log_ptr(void *value)
 		log_int32((int)(ULONG_PTR)value);
 }
 
+// Strings are transcoded straight into g_bson in a single pass: room for
+// the longest possible encoding is reserved and the field length is filled
+// in afterwards, so there is no temporary copy and no allocation.
 static void log_string(const char *str, int length)
 {
-	int ret;
-	char *utf8s;
-	int utf8len;
+	unsigned char *out;
 
 	if (str == NULL) {
 		bson_append_string_n( g_bson, g_istr, "", 0 );
 		return;
 	}
-	utf8s = utf8_string(str, length);
-	utf8len = * (int *) utf8s;
-	ret = bson_append_binary( g_bson, g_istr, BSON_BIN_BINARY, utf8s+4, utf8len );
-	if (ret == BSON_ERROR) {
+	if (length == -1)
+		length = (int)strlen(str);
+	out = (unsigned char *)bson_append_binary_begin( g_bson, g_istr, BSON_BIN_BINARY, UTF8_MAX_ENCODED_LENGTH(length) );
+	if (out == NULL) {
 		bson_append_string_n(g_bson, g_istr, "", 0);
+		return;
 	}
-	free(utf8s);
+	bson_append_binary_end(g_bson, utf8_encode_ascii(out, str, length));
 }
 
 static void log_wstring(const wchar_t *str, int length)
 {
-	int ret;
-	char *utf8s;
-	int utf8len;
+	unsigned char *out;
 
 	if (str == NULL) {
 		bson_append_string_n( g_bson, g_istr, "", 0 );
 		return;
 	}
-	utf8s = utf8_wstring(str, length);
-	utf8len = * (int *) utf8s;
-	ret = bson_append_binary( g_bson, g_istr, BSON_BIN_BINARY, utf8s+4, utf8len );
-	if (ret == BSON_ERROR) {
+	if (length == -1)
+		length = lstrlenW(str);
+	out = (unsigned char *)bson_append_binary_begin( g_bson, g_istr, BSON_BIN_BINARY, UTF8_MAX_ENCODED_LENGTH(length) );
+	if (out == NULL) {
 		bson_append_string_n(g_bson, g_istr, "", 0);
+		return;
 	}
-	free(utf8s);
+	bson_append_binary_end(g_bson, utf8_encode_utf16(out, (const unsigned short *)str, length));
 }
 
 static void log_argv(int argc, const char ** argv) {
@@ -310,9 +417,294 @@ static void log_wargv(int argc, const wchar_t ** argv) {
 	bson_append_finish_array( g_bson );
 }
 
+// a blob copied out of the sample by log_blob, room for its header first,
+// waiting to be written to the blob stream
+typedef struct _blob_pending_t {
+	struct _blob_pending_t *next;
+	size_t len;
+	unsigned long long offset;		// of its bytes in the stream
+	char data[1];
+} blob_pending_t;
+
+// queued in stream order under g_mutex, written out by blob_flush
+static blob_pending_t *g_blob_pending, **g_blob_pending_tail = &g_blob_pending;
+static blob_pending_t *g_blob_staged;
+// keeps the queue in order while it is written out
+static CRITICAL_SECTION g_blob_write_mutex;
+
+// called by blob_store_put with the header and then the bytes of the blob
+// log_blob staged, which are already in place after the header
+static int blob_write(void *ctx, const void *data, size_t len)
+{
+	if (data != g_blob_staged->data + BLOB_HEADER_SIZE) {
+		memcpy(g_blob_staged->data, data, len);
+		return 1;
+	}
+	*g_blob_pending_tail = g_blob_staged;
+	g_blob_pending_tail = &g_blob_staged->next;
+	g_blob_staged = NULL;
+	return 1;
+}
+
+// writes out the blobs queued so far; never called under g_mutex, so the
+// hooked threads don't wait on the blob file
+static void blob_flush(void)
+{
+	blob_pending_t *blob, *next;
+	BOOLEAN failed = FALSE;
+	unsigned long long lost_offset = 0;
+	int error = 0, lost = 0;
+
+	EnterCriticalSection(&g_blob_write_mutex);
+	EnterCriticalSection(&g_mutex);
+	blob = g_blob_pending;
+	g_blob_pending = NULL;
+	g_blob_pending_tail = &g_blob_pending;
+	LeaveCriticalSection(&g_mutex);
+
+	for (; blob; blob = next) {
+		const char *p = blob->data;
+		size_t len = blob->len;
+		DWORD written;
+
+		next = blob->next;
+		while (!failed && len) {
+			if (!WriteFile(g_blob_handle, p, (DWORD)min(len, 0x1000000), &written, NULL) || !written) {
+				failed = TRUE;
+				error = GetLastError();
+				lost_offset = blob->offset;
+			}
+			p += written;
+			len -= written;
+		}
+		if (failed)
+			lost++;
+		free(blob);
+	}
+	LeaveCriticalSection(&g_blob_write_mutex);
+
+	// the offsets of anything after a failed write would be wrong, and the
+	// records already logged refer to blobs that aren't in the stream
+	if (failed) {
+		EnterCriticalSection(&g_mutex);
+		g_blobs.failed = 1;
+		LeaveCriticalSection(&g_mutex);
+		pipe("WARNING:Unable to write to the blob stream (error %d): the %d blobs referred to from offset 0x%x on are lost, logging large buffers in the records from now on",
+			error, lost, (unsigned int)lost_offset);
+	}
+}
+
+static BOOLEAN g_blob_stream_tried;
+
+// blobs\<pid>.bin in the results, created with the first blob
+static BOOLEAN open_blob_stream(void)
+{
+	char pid[8];
+	char *filename;
+
+	if (g_blob_stream_tried)
+		return g_blobs.slots != NULL;
+	g_blob_stream_tried = TRUE;
+
+	filename = GetResultsPath("blobs");
+	if (!filename)
+		return FALSE;
+	num_to_string(pid, sizeof(pid), GetCurrentProcessId());
+	strcat(filename, "\\");
+	strcat(filename, pid);
+	strcat(filename, ".bin");
+	g_blob_handle = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	free(filename);
+	if (g_blob_handle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!blob_store_init(&g_blobs, BLOB_STREAM_LIMIT, blob_write, NULL)) {
+		CloseHandle(g_blob_handle);
+		g_blob_handle = INVALID_HANDLE_VALUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// A large buffer of the record being logged, copied out of the sample and
+// hashed by blob_stage before loq() takes g_mutex, so the lock isn't held
+// for the length of a buffer that may run to BLOB_STREAM_LIMIT
+#define BLOB_STAGE_MAX 4
+
+typedef struct _blob_stage_t {
+	const char *buf;
+	size_t length;
+	unsigned long long hash;
+	blob_pending_t *blob;
+} blob_stage_t;
+
+// those of the record being built, for log_blob
+static blob_stage_t *g_blob_stages;
+static unsigned int g_blob_stage_count;
+
+static void blob_stage_one(blob_stage_t *stages, unsigned int *count, const char *buf, size_t length)
+{
+	blob_stage_t *stage = &stages[*count];
+	blob_pending_t *blob;
+	BOOLEAN copied = FALSE;
+
+	if (*count == BLOB_STAGE_MAX || buf == NULL || length <= log_blob_threshold || length > BLOB_STREAM_LIMIT)
+		return;
+	blob = (blob_pending_t *)malloc(sizeof(blob_pending_t) + BLOB_HEADER_SIZE + length);
+	if (blob == NULL)
+		return;
+	__try {
+		memcpy(blob->data + BLOB_HEADER_SIZE, buf, length);
+		copied = TRUE;
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		;
+	}
+	if (!copied) {
+		free(blob);
+		return;
+	}
+	blob->next = NULL;
+	blob->len = BLOB_HEADER_SIZE + length;
+	stage->buf = buf;
+	stage->length = length;
+	stage->hash = blob_hash(blob->data + BLOB_HEADER_SIZE, length);
+	stage->blob = blob;
+	(*count)++;
+}
+
+// walks the arguments as loq() does, staging the buffers log_blob may be
+// given; returns how many it staged
+static unsigned int blob_stage(blob_stage_t *stages, int index, const char *fmt, va_list args)
+{
+	const log_fmt_t *desc = index < LOG_TABLE_MAX ? logtbl_fmt[index] : NULL;
+	log_fmt_t *compiled = NULL;
+	unsigned int count = 0, n;
+
+	// g_mutex isn't held, but this only saves copying for nothing
+	if ((g_blob_stream_tried && g_blobs.slots == NULL) || g_blobs.failed)
+		return 0;
+	if (desc == NULL) {
+		compiled = malloc(log_fmt_size(log_fmt_count(fmt)));
+		if (compiled == NULL)
+			return 0;
+		log_fmt_compile(fmt, compiled);
+		desc = compiled;
+	}
+
+	for (n = 0; n < desc->count && count < BLOB_STAGE_MAX; n++) {
+		char key = desc->args[n].type;
+
+		(void) va_arg(args, const char *);
+		if (key == 'b' || key == 'c') {
+			size_t len = va_arg(args, size_t);
+			const char *s = va_arg(args, const char *);
+			blob_stage_one(stages, &count, s, len);
+		}
+		else if (key == 'B' || key == 'C') {
+			DWORD *len = va_arg(args, DWORD *);
+			const char *s = va_arg(args, const char *);
+			DWORD length = 0;
+			__try {
+				if (len)
+					length = *len;
+			}
+			__except (EXCEPTION_EXECUTE_HANDLER) {
+				;
+			}
+			blob_stage_one(stages, &count, s, length);
+		}
+		else if (key == 'r' || key == 'R') {
+			unsigned long type, size;
+			const char *data;
+			type = va_arg(args, unsigned long);
+			size = va_arg(args, unsigned long);
+			data = va_arg(args, const char *);
+			// strings and numbers are logged as such, not as buffers
+			if (type != REG_NONE && type != REG_SZ && type != REG_EXPAND_SZ && type != REG_DWORD && type != REG_DWORD_BIG_ENDIAN)
+				blob_stage_one(stages, &count, data, size);
+		}
+		else if (key == 'S' || key == 'U' || key == 'a' || key == 'A') {
+			(void) va_arg(args, int);
+			(void) va_arg(args, void *);
+		}
+		else if (key == 'e' || key == 'E' || key == 'k' || key == 'v' || key == 'V') {
+			(void) va_arg(args, HKEY);
+			(void) va_arg(args, void *);
+		}
+		else if (key == 'i' || key == 'h')
+			(void) va_arg(args, int);
+		else if (key == 'x')
+			(void) va_arg(args, LARGE_INTEGER);
+		else if (key == 's' || key == 'f' || key == 'u' || key == 'F' || key == 'I' || key == 'H' || key == 'l' || key == 'p' ||
+			key == 'L' || key == 'P' || key == 'X' || key == 'K' || key == 'o' || key == 'O')
+			(void) va_arg(args, void *);
+		else
+			break;
+	}
+
+	free(compiled);
+	return count;
+}
+
+// frees what log_blob didn't take
+static void blob_unstage(blob_stage_t *stages, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		free(stages[i].blob);
+}
+
+// logs a large buffer as a reference to its copy in the blob stream;
+// FALSE to log it in the record as usual. The copy is the one staged for
+// it, so what was hashed is what gets written, and is left for blob_flush
+// to write; a buffer that wasn't staged goes in the record
+static BOOLEAN log_blob(const char *buf, size_t length)
+{
+	blob_stage_t *stage = NULL;
+	blob_pending_t *blob;
+	blob_ref_t ref;
+	unsigned int i;
+	int ret;
+
+	if (!log_blob_threshold || buf == NULL || length <= log_blob_threshold)
+		return FALSE;
+	if (!open_blob_stream() || g_blobs.failed)
+		return FALSE;
+	for (i = 0; i < g_blob_stage_count && stage == NULL; i++)
+		if (g_blob_stages[i].blob && g_blob_stages[i].buf == buf && g_blob_stages[i].length == length)
+			stage = &g_blob_stages[i];
+	if (stage == NULL)
+		return FALSE;
+
+	blob = stage->blob;
+	stage->blob = NULL;
+	g_blob_staged = blob;
+	ret = blob_store_put_hashed(&g_blobs, blob->data + BLOB_HEADER_SIZE, length, stage->hash, &ref);
+	// still staged if it was already in the stream or couldn't be stored
+	if (g_blob_staged) {
+		free(g_blob_staged);
+		g_blob_staged = NULL;
+	}
+	else
+		blob->offset = ref.offset;
+	if (ret < 0)
+		return FALSE;
+
+	bson_append_start_object(g_bson, g_istr);
+	bson_append_long(g_bson, "hash", (long long)ref.hash);
+	bson_append_int(g_bson, "length", ref.length);
+	bson_append_long(g_bson, "offset", (long long)ref.offset);
+	bson_append_finish_object(g_bson);
+	return TRUE;
+}
+
 static void log_buffer(const char *buf, size_t length) {
 	size_t trunclength = min(length, buffer_log_max);
 
+	if (log_blob(buf, length))
+		return;
+
 	if (buf == NULL) {
 		trunclength = 0;
 	}
@@ -323,6 +715,9 @@ static void log_buffer(const char *buf, size_t length) {
 static void log_large_buffer(const char *buf, size_t length) {
 	size_t trunclength = min(length, large_buffer_log_max);
 
+	if (log_blob(buf, length))
+		return;
+
 	if (buf == NULL) {
 		trunclength = 0;
 	}
@@ -343,42 +738,180 @@ DWORD get_last_api(void)
 	return last_api_logged;
 }
 
+// never reduced to counts however backed up the log is, along with any
+// categories or APIs named in adaptive-critical
+static const char *critical_categories[] = { "process", "threading", "services", "hooking", "__notification__" };
+static const char *critical_apis[] = {
+	"NtWriteFile", "NtDeleteFile", "NtSetInformationFile", "NtSetValueKey", "NtDeleteValueKey",
+	"RegSetValueExA", "RegSetValueExW", "RegDeleteValueA", "RegDeleteValueW",
+};
+
+static BOOLEAN is_critical_api(const char *category, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(critical_categories); i++)
+		if (!strcmp(category, critical_categories[i]))
+			return TRUE;
+	for (i = 0; i < ARRAYSIZE(critical_apis); i++)
+		if (!strcmp(name, critical_apis[i]))
+			return TRUE;
+	for (i = 0; i < ARRAYSIZE(g_config.adaptive_critical); i++) {
+		if (!g_config.adaptive_critical[i])
+			break;
+		if (!stricmp(name, g_config.adaptive_critical[i]) || !strcmp(category, g_config.adaptive_critical[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static unsigned int log_fill_permille(void)
+{
+	return (unsigned int)(log_buffer_pending(&g_logbuf) * 1000 / (2 * g_logbuf.size));
+}
+
+// called from within loq() and from log_flush(), so the nested loq()'s
+// hook_enable() mustn't turn hooks back on for the caller
+static void log_throttle_emit(void *ctx, unsigned int index, unsigned int suppressed)
+{
+	DWORD last_api = last_api_logged;
+	hook_info_t *hookinfo = hook_info();
+	int disable_count = hookinfo->disable_count;
+
+	loq(LOG_ID_THROTTLED, "__notification__", "__throttled__", 1, 0, "sii",
+		"FunctionName", logtbl_name[index] ? logtbl_name[index] : "",
+		"Index", index,
+		"Calls", suppressed);
+	hookinfo->disable_count = disable_count;
+	// an aggregate record mustn't interrupt NtReadFile accumulation
+	last_api_logged = last_api;
+}
+
+// the id a category is referred to by in compact mode, sending the name the
+// first time it is seen; -1 to log the name itself
+static int category_id(const char *category)
+{
+	unsigned int i;
+	bson b[1];
+
+	for (i = 0; i < g_ncategories; i++)
+		if (g_categories[i] == category || !strcmp(g_categories[i], category))
+			return i;
+	if (g_ncategories == LOG_CATEGORY_MAX)
+		return -1;
+
+	g_categories[g_ncategories] = category;
+	bson_init(b);
+	bson_append_string(b, "type", "category");
+	bson_append_int(b, "id", g_ncategories);
+	bson_append_string(b, "name", category);
+	bson_finish(b);
+	log_raw_direct(bson_data(b), bson_size(b));
+	bson_destroy(b);
+	return g_ncategories++;
+}
+
+// compacts g_bson into g_compact, returning its length or -1 to send it as is
+static int compact_record(unsigned int *repeat_offset)
+{
+	unsigned int needed = bson_size(g_bson) + LOG_COMPACT_OVERHEAD;
+
+	if (needed > g_compact_size) {
+		unsigned char *p = realloc(g_compact, needed);
+		if (p == NULL)
+			return -1;
+		g_compact = p;
+		g_compact_size = needed;
+	}
+	return log_compact_encode((const unsigned char *)bson_data(g_bson), g_compact, g_compact_size, repeat_offset);
+}
+
 void loq(int index, const char *category, const char *name,
 	int is_success, ULONG_PTR return_value, const char *fmt, ...)
 {
 	va_list args;
-	const char * fmtbak = fmt;
-	int argnum = 2;
-	int count = 1; char key = 0;
+	log_fmt_t *desc;
+	const log_arg_t *arg;
+	unsigned int n;
+	char key;
 	unsigned int repeat_offset = 0;
 	unsigned int compare_offset = 0;
 	lasterror_t lasterror;
 	hook_info_t *hookinfo;
+	blob_stage_t stages[BLOB_STAGE_MAX];
+	unsigned int nstages = 0;
 
-	if (index >= LOG_ID_PREDEFINED_MAX && g_config.suspend_logging)
+	if (index >= LOG_ID_PREDEFINED_MAX && g_config.suspend_logging) {
+		if (g_config.hook_stats)
+			hook_stats_done(0);
 		return;
+	}
 
 	get_lasterrors(&lasterror);
 
 	hook_disable();
 
+	// buffers bound for the blob stream are copied and hashed before the
+	// lock is taken
+	if (log_blob_threshold) {
+		va_start(args, fmt);
+		nstages = blob_stage(stages, index, fmt, args);
+		va_end(args);
+	}
+
 	EnterCriticalSection(&g_mutex);
 
 	if (!special_api_triggered)
 		last_api_logged = API_OTHER;
 	else {
 		special_api_triggered = FALSE;
-		if (delete_last_log) {
-			free(lastlog.buf);
-			lastlog.buf = NULL;
+		if (delete_last_log && g_dedup.emit)
+			log_dedup_drop_last(&g_dedup);
+	}
+
+	desc = index < LOG_TABLE_MAX ? logtbl_fmt[index] : NULL;
+	if (desc == NULL) {
+		desc = malloc(log_fmt_size(log_fmt_count(fmt)));
+		if (desc == NULL) {
+			LeaveCriticalSection(&g_mutex);
+			blob_unstage(stages, nstages);
+			if (g_config.hook_stats && index >= LOG_ID_PREDEFINED_MAX)
+				hook_stats_done(0);
+			hook_enable();
+			set_lasterrors(&lasterror);
+			return;
+		}
+		log_fmt_compile(fmt, desc);
+		if (index < LOG_TABLE_MAX) {
+			logtbl_fmt[index] = desc;
+			logtbl_name[index] = name;
+			if (is_critical_api(category, name))
+				log_throttle_set_critical(&g_throttle, index);
+		}
+	}
+
+	if (log_adaptive && g_logbuf.size && !g_building_record && index >= LOG_ID_PREDEFINED_MAX && index < LOG_TABLE_MAX) {
+		unsigned int now = raw_gettickcount();
+		log_throttle_tick(&g_throttle, now, log_throttle_emit, NULL);
+		if (!log_throttle_check(&g_throttle, index, log_fill_permille(), now)) {
+			// only counted, goes out in the next aggregate record
+			LeaveCriticalSection(&g_mutex);
+			blob_unstage(stages, nstages);
+			if (g_config.hook_stats)
+				hook_stats_done(0);
+			hook_enable();
+			set_lasterrors(&lasterror);
+			return;
 		}
 	}
 
-	if (logtbl_explained[index] == 0) {
+	if (index >= LOG_TABLE_MAX || logtbl_explained[index] == 0) {
 		const char * pname;
 		bson b[1];
+		int category_index = log_compact ? category_id(category) : -1;
 
-		logtbl_explained[index] = 1;
+		if (index < LOG_TABLE_MAX)
+			logtbl_explained[index] = 1;
 
 		va_start(args, fmt);
 
@@ -386,28 +919,21 @@ void loq(int index, const char *category, const char *name,
 		bson_append_int( b, "I", index );
 		bson_append_string( b, "name", name );
 		bson_append_string( b, "type", "info" );
-		bson_append_string( b, "category", category );
+		if (category_index >= 0)
+			bson_append_int( b, "category", category_index );
+		else
+			bson_append_string( b, "category", category );
 
 		bson_append_start_array( b, "args" );
 		bson_append_string( b, "0", "is_success" );
 		bson_append_string( b, "1", "retval" );
 
-		while (--count != 0 || *fmt != 0) {
-			// we have to find the next format specifier
-			if (count == 0) {
-				// end of format
-				if (*fmt == 0) break;
-
-				// set the count, possibly with a repeated format specifier
-				count = *fmt >= '2' && *fmt <= '9' ? *fmt++ - '0' : 1;
-
-				// the next format specifier
-				key = *fmt++;
-			}
+		for (n = 0; n < desc->count; n++) {
+			arg = &desc->args[n];
+			key = arg->type;
 
 			pname = va_arg(args, const char *);
-			num_to_string(g_istr, 4, argnum);
-			argnum++;
+			memcpy(g_istr, arg->key, sizeof(g_istr));
 
 			//on certain formats, we need to tell cuckoo about them for nicer display / matching
 			if (key == 'p' || key == 'P' || key == 'h' || key == 'H') {
@@ -516,11 +1042,12 @@ void loq(int index, const char *category, const char *name,
 		va_end(args);
 	}
 
-	fmt = fmtbak;
 	va_start(args, fmt);
-	count = 1; key = 0; argnum = 2;
 
-	bson_init( g_bson );
+	g_blob_stages = stages;
+	g_blob_stage_count = nstages;
+	bson_init_arena( g_bson, &g_bson_arena );
+	g_building_record = TRUE;
 	bson_append_int( g_bson, "I", index );
 	hookinfo = hook_info();
 	bson_append_ptr(g_bson, "C", hookinfo->return_address);
@@ -542,23 +1069,13 @@ void loq(int index, const char *category, const char *name,
 	bson_append_ptr( g_bson, "1", return_value );
 
 
-	while (--count != 0 || *fmt != 0) {
+	for (n = 0; n < desc->count; n++) {
+		arg = &desc->args[n];
+		key = arg->type;
 
-		// we have to find the next format specifier
-		if (count == 0) {
-			// end of format
-			if (*fmt == 0) break;
-
-			// set the count, possibly with a repeated format specifier
-			count = *fmt >= '2' && *fmt <= '9' ? *fmt++ - '0' : 1;
-
-			// the next format specifier
-			key = *fmt++;
-		}
 		// pop the key and omit it
 		(void) va_arg(args, const char *);
-		num_to_string(g_istr, 4, argnum);
-		argnum++;
+		memcpy(g_istr, arg->key, sizeof(g_istr));
 
 		// log the value
 		if (key == 's') {
@@ -679,55 +1196,50 @@ void loq(int index, const char *category, const char *name,
 		else if (key == 'e') {
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_full_key_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			// without the buffer the key still takes its place, as an empty string
+			if (g_keybuf)
+				log_wstring(get_full_key_pathA(reg, s, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'E') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_full_key_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			if (g_keybuf)
+				log_wstring(get_full_key_pathW(reg, s, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'K') {
 			OBJECT_ATTRIBUTES *obj = va_arg(args, OBJECT_ATTRIBUTES *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_key_path(obj, keybuf, allocsize), -1);
-			free(keybuf);
+			if (g_keybuf)
+				log_wstring(get_key_path(obj, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'k') {
 			HKEY reg = va_arg(args, HKEY);
 			const PUNICODE_STRING s = va_arg(args, const PUNICODE_STRING);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_full_keyvalue_pathUS(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			if (g_keybuf)
+				log_wstring(get_full_keyvalue_pathUS(reg, s, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'v') {
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_full_keyvalue_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			if (g_keybuf)
+				log_wstring(get_full_keyvalue_pathA(reg, s, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'V') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-
-			log_wstring(get_full_keyvalue_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			if (g_keybuf)
+				log_wstring(get_full_keyvalue_pathW(reg, s, g_keybuf, KEYBUF_SIZE), -1);
+			else
+				log_string("", 0);
 		}
 		else if (key == 'o') {
 			UNICODE_STRING *str = va_arg(args, UNICODE_STRING *);
@@ -772,6 +1284,7 @@ void loq(int index, const char *category, const char *name,
 			unsigned long type = va_arg(args, unsigned long);
 			unsigned long size = va_arg(args, unsigned long);
 			unsigned char *data = va_arg(args, unsigned char *);
+			unsigned long full_size = size;
 
 			if (size > BUFFER_REGVAL_MAX)
 				size = BUFFER_REGVAL_MAX;
@@ -901,8 +1414,10 @@ void loq(int index, const char *category, const char *name,
 			}
 			else {
 buffer_log:
-				bson_append_binary(g_bson, g_istr, BSON_BIN_BINARY,
-					(const char *) data, size);
+				// binary values past the threshold go whole to the blob stream
+				if (!log_blob((const char *)data, full_size))
+					bson_append_binary(g_bson, g_istr, BSON_BIN_BINARY,
+						(const char *) data, size);
 			}
 
 			// bson_append_finish_object( g_bson );
@@ -914,44 +1429,54 @@ buffer_log:
 	bson_append_finish_array( g_bson );
 	bson_finish( g_bson );
 
-	if (index == LOG_ID_PROCESS || index == LOG_ID_THREAD || index == LOG_ID_ENVIRON) {
+	if (index == LOG_ID_PROCESS || index == LOG_ID_THREAD || index == LOG_ID_ENVIRON || g_dedup.emit == NULL) {
 		// don't hold back any of our critical notifications -- these *must* be flushed in log_init()
 		log_raw_direct(bson_data(g_bson), bson_size(g_bson));
 	}
 	else {
-		if (lastlog.buf) {
-			unsigned int our_len = bson_size(g_bson) - compare_offset;
-			if (lastlog.compare_len == our_len && !memcmp(lastlog.compare_ptr, bson_data(g_bson) + compare_offset, our_len)) {
-				// we're about to log a duplicate of the last log message, just increment the previous log's repeated count
-				(*lastlog.repeated_ptr)++;
-			}
-			else {
-				// flush logs once we're done seeing duplicates of a particular API
-				if (g_config.force_flush == 1)
-					log_flush();
-				else {
-					log_raw_direct(lastlog.buf, lastlog.len);
-					free(lastlog.buf);
-					lastlog.buf = NULL;
-				}
-			}
-		}
-		if (lastlog.buf == NULL) {
-			lastlog.len = bson_size(g_bson);
-			lastlog.buf = malloc(lastlog.len);
-			memcpy(lastlog.buf, bson_data(g_bson), lastlog.len);
-			lastlog.compare_len = lastlog.len - compare_offset;
-			lastlog.compare_ptr = lastlog.buf + compare_offset;
-			lastlog.repeated_ptr = (int *)(lastlog.buf + repeat_offset);
+		// a repeat of a record still held back for this thread (with a window
+		// of 1, of the record just before it) only bumps its repeated count;
+		// anything held back too long goes out first
+		const unsigned char *record = (const unsigned char *)bson_data(g_bson);
+		int record_size = bson_size(g_bson);
+		unsigned int emitted = g_dedup.emitted;
+		unsigned int now = raw_gettickcount();
+		unsigned int compact_repeat_offset;
+		int compact_size;
+
+		if (log_compact && index >= LOG_ID_PREDEFINED_MAX && (compact_size = compact_record(&compact_repeat_offset)) > 0 && compact_repeat_offset) {
+			// the repeat count is still followed by everything that is compared
+			record = g_compact;
+			record_size = compact_size;
+			repeat_offset = compact_repeat_offset;
+			compare_offset = repeat_offset + 4;
 		}
+		log_dedup_expire(&g_dedup, now);
+		log_dedup_add(&g_dedup, GetCurrentThreadId(), index, record, record_size,
+			compare_offset, repeat_offset, now);
+		// flush logs once we're done seeing duplicates of a particular API
+		if (g_config.force_flush == 1 && g_dedup.emitted != emitted)
+			_send_log();
 	}
 
-	bson_destroy( g_bson );
+	bson_arena_release( g_bson, &g_bson_arena );
+	g_building_record = FALSE;
+	g_blob_stages = NULL;
+	g_blob_stage_count = 0;
+	if (index >= LOG_TABLE_MAX)
+		free(desc);
 	LeaveCriticalSection(&g_mutex);
+	blob_unstage(stages, nstages);
+
+	if (g_blob_pending)
+		blob_flush();
 
 	if (g_config.force_flush == 2)
 		log_flush();
 
+	if (g_config.hook_stats && index >= LOG_ID_PREDEFINED_MAX)
+		hook_stats_done(1);
+
 	hook_enable();
 
 	set_lasterrors(&lasterror);
@@ -1173,22 +1698,44 @@ void log_hook_restoration(const hook_t *h)
 		"UnhookType", "restored");
 }
 
+// hooks ranked by the cycles spent on them, as hook_stats_format() lists them
+void log_hook_stats(unsigned int hooks, unsigned int listed, const char *summary)
+{
+	loq(LOG_ID_HOOK_STATS, "__notification__", "__hookstats__", 1, 0, "iis",
+		"Hooks", hooks,
+		"Listed", listed,
+		"Summary", summary);
+}
+
 
 DWORD g_log_thread_id;
 DWORD g_logwatcher_thread_id;
 
 void log_init(int debug)
 {
-	g_buffer = calloc(1, BUFFERSIZE);
+	InitializeCriticalSection(&g_sending_log_mutex);
+	InitializeCriticalSection(&g_blob_write_mutex);
+	g_log_write_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!log_buffer_init(&g_logbuf, BUFFERSIZE / 2)) {
+		pipe("CRITICAL:Error allocating the log buffers!");
+		return;
+	}
+
+	log_dedup_init(&g_dedup, log_dedup_window, log_dedup_latency, log_dedup_emit, NULL);
+	log_throttle_init(&g_throttle, THROTTLE_PERIOD, THROTTLE_HOT_CALLS, raw_gettickcount());
 
 	g_log_flush = CreateEvent(NULL, FALSE, FALSE, NULL);
 
+	g_keybuf = malloc(KEYBUF_SIZE);
+	if (g_keybuf == NULL)
+		pipe("WARNING:Unable to allocate the key name buffer, registry key names will be logged empty");
+
 	if (debug != 0) {
 		g_sock = DEBUG_SOCKET;
 	}
 	else {
 		g_sock = INVALID_SOCKET;
-		g_log_handle = CreateFileA(g_config.logserver, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		g_log_handle = CreateFileA(g_config.logserver, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 		if (g_log_handle == INVALID_HANDLE_VALUE) {
 			pipe("CRITICAL:Error initializing logging!");
 			return;
@@ -1216,16 +1763,33 @@ void log_init(int debug)
 	log_environ();
 	// flushing here so host can create files / keep timestamps
 	log_flush();
+
+	// doesn't start until DllMain returns: until then, writers finding both
+	// buffers full write them out themselves
+	g_log_thread_handle = CreateThread(NULL, 0, _log_thread, NULL, 0, &g_log_thread_id);
 }
 
 void log_free()
 {
 	log_flush();
+	// the log thread may be partway through a write
+	EnterCriticalSection(&g_sending_log_mutex);
 	if (g_sock == DEBUG_SOCKET) {
 		g_sock = INVALID_SOCKET;
 	}
 	else {
 		CloseHandle(g_log_handle);
-		g_log_handle = INVALID_HANDLE_VALUE;
+	}
+	g_log_handle = INVALID_HANDLE_VALUE;
+	LeaveCriticalSection(&g_sending_log_mutex);
+	if (g_blob_handle != INVALID_HANDLE_VALUE) {
+		blob_flush();
+		EnterCriticalSection(&g_blob_write_mutex);
+		EnterCriticalSection(&g_mutex);
+		CloseHandle(g_blob_handle);
+		g_blob_handle = INVALID_HANDLE_VALUE;
+		blob_store_free(&g_blobs);
+		LeaveCriticalSection(&g_mutex);
+		LeaveCriticalSection(&g_blob_write_mutex);
 	}
 }
@@ -75,6 +75,7 @@ void log_hook_anomaly(const char *subcategory, int success,
 void log_hook_modification(const hook_t *h, const char *origbytes, const char *newbytes, unsigned int len);
 void log_hook_removal(const hook_t *h);
 void log_hook_restoration(const hook_t *h);
+void log_hook_stats(unsigned int hooks, unsigned int listed, const char *summary);
 void log_procname_anomaly(PUNICODE_STRING InitialName, PUNICODE_STRING InitialPath, PUNICODE_STRING CurrentName, PUNICODE_STRING CurrentPath);
 
 void log_init(int debug);
@@ -102,6 +103,11 @@ DWORD get_last_api(void);
 
 extern size_t buffer_log_max;
 extern size_t large_buffer_log_max;
+extern size_t log_blob_threshold;
+extern unsigned int log_dedup_window;
+extern unsigned int log_dedup_latency;
+extern unsigned int log_adaptive;
+extern unsigned int log_compact;
 
 #define _LOQ(eval, cat, fmt, ...) \
 do { \
@@ -154,11 +160,3 @@ do { \
 
 #define is_aligned(POINTER, BYTE_COUNT) \
     (((uintptr_t)(const void *)(POINTER)) % (BYTE_COUNT) == 0)
-
-typedef struct _lastlog_t {
-	unsigned char *buf;
-	unsigned int len;
-	unsigned int compare_len;
-	int *repeated_ptr;
-	unsigned char *compare_ptr;
-} lastlog_t;
\ No newline at end of file
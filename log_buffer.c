@@ -0,0 +1,80 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "log_buffer.h"
+
+int log_buffer_init(log_buffer_t *b, size_t size)
+{
+	memset(b, 0, sizeof(*b));
+	b->bufs[0] = malloc(size);
+	b->bufs[1] = malloc(size);
+	if (b->bufs[0] == NULL || b->bufs[1] == NULL) {
+		log_buffer_free(b);
+		return 0;
+	}
+	b->size = size;
+	return 1;
+}
+
+void log_buffer_free(log_buffer_t *b)
+{
+	free(b->bufs[0]);
+	free(b->bufs[1]);
+	memset(b, 0, sizeof(*b));
+}
+
+size_t log_buffer_put(log_buffer_t *b, const char *data, size_t len)
+{
+	size_t copylen = b->size - b->fill_len;
+
+	// records go in whole unless they couldn't fit in any buffer
+	if (len > copylen && len <= b->size)
+		return 0;
+	if (copylen > len)
+		copylen = len;
+	memcpy(b->bufs[b->fill] + b->fill_len, data, copylen);
+	b->fill_len += copylen;
+	return copylen;
+}
+
+const char *log_buffer_next(log_buffer_t *b, size_t *len)
+{
+	if (b->send_off == b->send_len && b->fill_len) {
+		b->send_len = b->fill_len;
+		b->send_off = 0;
+		b->fill ^= 1;
+		b->fill_len = 0;
+	}
+	*len = b->send_len - b->send_off;
+	return b->bufs[b->fill ^ 1] + b->send_off;
+}
+
+void log_buffer_sent(log_buffer_t *b, size_t n)
+{
+	b->send_off += n;
+	if (b->send_off >= b->send_len)
+		b->send_off = b->send_len = 0;
+}
+
+size_t log_buffer_pending(const log_buffer_t *b)
+{
+	return b->fill_len + b->send_len - b->send_off;
+}
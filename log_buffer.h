@@ -0,0 +1,55 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Two log buffers: hooked threads append to one while the sender writes the
+// other out, and they swap once the sender has written everything it took.
+// A short write just moves the send offset on, so nothing is ever moved
+// around in the buffers. Writers stall only when both buffers are full.
+// No Windows dependencies; the caller serialises every call here, but not
+// the write itself: the sender's bytes stay put until log_buffer_sent()
+// accounts for all of them.
+
+typedef struct _log_buffer_t {
+	char *bufs[2];
+	size_t size;				// of each buffer
+	unsigned int fill;			// the buffer being appended to
+	size_t fill_len;
+	size_t send_len;			// bytes taken by the sender
+	size_t send_off;			// of which this many are written
+} log_buffer_t;
+
+// returns 0 if the buffers couldn't be allocated
+int log_buffer_init(log_buffer_t *b, size_t size);
+void log_buffer_free(log_buffer_t *b);
+
+// appends data and returns its length, or returns 0 if it doesn't fit in
+// the space left; data larger than a whole buffer goes in a piece at a time
+size_t log_buffer_put(log_buffer_t *b, const char *data, size_t len);
+
+// the bytes the sender is to write next, taking over the buffer being filled
+// if the previous one has been written; *len is 0 if there's nothing to send
+const char *log_buffer_next(log_buffer_t *b, size_t *len);
+
+// accounts for n bytes of the last log_buffer_next() having been written
+void log_buffer_sent(log_buffer_t *b, size_t n);
+
+// bytes not written yet
+size_t log_buffer_pending(const log_buffer_t *b);
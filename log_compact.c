@@ -0,0 +1,251 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include <stdint.h>
+#include "log_compact.h"
+
+// the keys of the record header and of the "info" records
+const char *log_compact_keys[] = { "I", "C", "R", "P", "T", "t", "r", "args", "name", "type", "category" };
+const unsigned int log_compact_nkeys = sizeof(log_compact_keys) / sizeof(log_compact_keys[0]);
+
+typedef struct _compact_out_t {
+	unsigned char *p;
+	unsigned char *end;
+	int overflow;
+} compact_out_t;
+
+static void put_byte(compact_out_t *o, unsigned char c)
+{
+	if (o->p < o->end)
+		*o->p++ = c;
+	else
+		o->overflow = 1;
+}
+
+static void put_bytes(compact_out_t *o, const unsigned char *p, size_t len)
+{
+	if ((size_t)(o->end - o->p) >= len) {
+		memcpy(o->p, p, len);
+		o->p += len;
+	}
+	else
+		o->overflow = 1;
+}
+
+static void put_varint(compact_out_t *o, uint64_t v)
+{
+	while (v >= 0x80) {
+		put_byte(o, (unsigned char)(v | 0x80));
+		v >>= 7;
+	}
+	put_byte(o, (unsigned char)v);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int key_is_position(const char *key, unsigned int pos)
+{
+	char buf[12];
+	int i = sizeof(buf) - 1;
+
+	buf[i] = 0;
+	do {
+		buf[--i] = '0' + pos % 10;
+		pos /= 10;
+	} while (pos);
+	return !strcmp(key, &buf[i]);
+}
+
+static int key_index(const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < log_compact_nkeys; i++)
+		if (!strcmp(key, log_compact_keys[i]))
+			return i;
+	return -1;
+}
+
+// compacts the elements of the document at doc; returns 0 on anything it
+// can't represent
+static int encode_elements(compact_out_t *o, const unsigned char *doc, const unsigned char *doc_end, int is_array, int top,
+	unsigned char *base, unsigned int *repeat_offset)
+{
+	const unsigned char *p = doc + 4;
+	unsigned int pos = 0;
+
+	while (p < doc_end && *p) {
+		unsigned char type = *p++;
+		const char *key = (const char *)p;
+		size_t keylen = strnlen(key, doc_end - p);
+		int dict;
+
+		if (type > LOG_COMPACT_TYPE_MASK || p + keylen >= doc_end)
+			return 0;
+		p += keylen + 1;
+
+		if (is_array && key_is_position(key, pos))
+			put_byte(o, type | LOG_COMPACT_KEY_POSITION);
+		else if (!is_array && (dict = key_index(key)) >= 0) {
+			put_byte(o, type | LOG_COMPACT_KEY_DICT);
+			put_byte(o, (unsigned char)dict);
+		}
+		else {
+			put_byte(o, type);
+			put_bytes(o, (const unsigned char *)key, keylen + 1);
+		}
+		pos++;
+
+		switch (type) {
+		case 0x10:	// int32
+			if (p + 4 > doc_end)
+				return 0;
+			if (top && !strcmp(key, "r")) {
+				if (repeat_offset && !o->overflow)
+					*repeat_offset = (unsigned int)(o->p - base);
+				put_bytes(o, p, 4);
+			}
+			else
+				put_varint(o, zigzag((int32_t)get32(p)));
+			p += 4;
+			break;
+		case 0x12:	// int64
+		case 0x09:	// date
+			if (p + 8 > doc_end)
+				return 0;
+			put_varint(o, zigzag((int64_t)get64(p)));
+			p += 8;
+			break;
+		case 0x01:	// double
+			if (p + 8 > doc_end)
+				return 0;
+			put_bytes(o, p, 8);
+			p += 8;
+			break;
+		case 0x02: {	// string
+			uint32_t len;
+			if (p + 4 > doc_end)
+				return 0;
+			len = get32(p);
+			if (len < 1 || len > (size_t)(doc_end - p - 4) || p[4 + len - 1])
+				return 0;
+			put_varint(o, len - 1);
+			put_bytes(o, p + 4, len - 1);
+			p += 4 + len;
+			break;
+		}
+		case 0x05: {	// binary
+			uint32_t len;
+			if (p + 5 > doc_end)
+				return 0;
+			len = get32(p);
+			// the old binary subtype repeats the length inside the data
+			if (len > (size_t)(doc_end - p - 5) || p[4] == 0x02)
+				return 0;
+			put_varint(o, len);
+			put_byte(o, p[4]);
+			put_bytes(o, p + 5, len);
+			p += 5 + len;
+			break;
+		}
+		case 0x03:	// document
+		case 0x04: {	// array
+			uint32_t len;
+			if (p + 5 > doc_end)
+				return 0;
+			len = get32(p);
+			if (len < 5 || len > (size_t)(doc_end - p) || p[len - 1])
+				return 0;
+			if (!encode_elements(o, p, p + len - 1, type == 0x04, 0, base, repeat_offset))
+				return 0;
+			put_byte(o, 0);
+			p += len;
+			break;
+		}
+		case 0x08:	// bool
+			if (p + 1 > doc_end)
+				return 0;
+			put_byte(o, *p++);
+			break;
+		case 0x07:	// oid
+			if (p + 12 > doc_end)
+				return 0;
+			put_bytes(o, p, 12);
+			p += 12;
+			break;
+		case 0x0a:	// null
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int log_compact_encode(const unsigned char *doc, unsigned char *out, size_t outmax, unsigned int *repeat_offset)
+{
+	compact_out_t o;
+	uint32_t doclen = get32(doc);
+	unsigned int payload, total;
+
+	if (doclen < 5 || outmax < 13)
+		return -1;
+	if (repeat_offset)
+		*repeat_offset = 0;
+
+	// document length, then "c" as binary of the compact subtype
+	o.p = out + 12;
+	o.end = out + outmax;
+	o.overflow = 0;
+	if (!encode_elements(&o, doc, doc + doclen - 1, 0, 1, out, repeat_offset) || o.overflow)
+		return -1;
+	payload = (unsigned int)(o.p - (out + 12));
+	put_byte(&o, 0);
+	if (o.overflow)
+		return -1;
+	total = (unsigned int)(o.p - out);
+
+	out[0] = (unsigned char)total;
+	out[1] = (unsigned char)(total >> 8);
+	out[2] = (unsigned char)(total >> 16);
+	out[3] = (unsigned char)(total >> 24);
+	out[4] = 0x05;
+	out[5] = 'c';
+	out[6] = 0;
+	out[7] = (unsigned char)payload;
+	out[8] = (unsigned char)(payload >> 8);
+	out[9] = (unsigned char)(payload >> 16);
+	out[10] = (unsigned char)(payload >> 24);
+	out[11] = LOG_COMPACT_SUBTYPE;
+	return (int)total;
+}
@@ -0,0 +1,55 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Compact form of a loq() record: the record's BSON document is repacked as
+// a single binary field "c" (of subtype LOG_COMPACT_SUBTYPE) holding its
+// elements positionally. Array keys ("0", "1", ...) and the header keys are
+// implied rather than spelled out, integers are zigzag varints and lengths
+// are varints, so only the values themselves take space. The repeat count
+// "r" stays a plain 32-bit integer so that repeats can still be counted in
+// place. Decoding it gives back the original document byte for byte.
+//
+// An element is a tag byte: the BSON type in the low 5 bits, plus
+// LOG_COMPACT_KEY_POSITION if the key is the element's position in its
+// array, or LOG_COMPACT_KEY_DICT followed by an index into
+// log_compact_keys[], or else the key as a C string. Then the value:
+// int32/int64/date as zigzag varints (the top level "r" as 4 raw bytes),
+// doubles as 8 raw bytes, strings as a varint length and the bytes without
+// the NUL, binary as a varint length, the subtype and the bytes, bools as a
+// byte, oids as 12 bytes, null as nothing, and documents and arrays as their
+// elements followed by a 0 byte.
+
+#define LOG_COMPACT_SUBTYPE 0x80
+#define LOG_COMPACT_KEY_POSITION 0x80
+#define LOG_COMPACT_KEY_DICT 0x40
+#define LOG_COMPACT_TYPE_MASK 0x1f
+
+// the most a record can grow by when compacted
+#define LOG_COMPACT_OVERHEAD 16
+
+extern const char *log_compact_keys[];
+extern const unsigned int log_compact_nkeys;
+
+// compacts the BSON document doc into out (room for outmax bytes) and
+// returns its length, or -1 if it holds something that can't be compacted
+// or doesn't fit. *repeat_offset gets the offset of the repeat count in
+// out, or 0 if the record has none.
+int log_compact_encode(const unsigned char *doc, unsigned char *out, size_t outmax, unsigned int *repeat_offset);
@@ -0,0 +1,212 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "log_dedup.h"
+
+static unsigned int record_hash(unsigned int index, const unsigned char *p, unsigned int len)
+{
+	unsigned int h = 2166136261u ^ index;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+void log_dedup_init(log_dedup_t *d, unsigned int window, unsigned int latency, log_dedup_emit_t emit, void *ctx)
+{
+	memset(d, 0, sizeof(*d));
+	if (window < 1)
+		window = 1;
+	if (window > LOG_DEDUP_MAX_WINDOW)
+		window = LOG_DEDUP_MAX_WINDOW;
+	d->window = window;
+	d->latency = latency;
+	d->emit = emit;
+	d->ctx = ctx;
+}
+
+// removes entry n from w, keeping its buffer around for reuse
+static void remove_entry(log_dedup_window_t *w, unsigned int n)
+{
+	unsigned char *buf = w->entries[n].buf;
+	unsigned int cap = w->entries[n].cap;
+
+	memmove(&w->entries[n], &w->entries[n + 1], (w->used - n - 1) * sizeof(w->entries[0]));
+	w->used--;
+	w->entries[w->used].buf = buf;
+	w->entries[w->used].cap = cap;
+}
+
+static void emit_oldest(log_dedup_t *d, log_dedup_window_t *w)
+{
+	d->emit(d->ctx, w->entries[0].buf, w->entries[0].len);
+	d->emitted++;
+	remove_entry(w, 0);
+}
+
+// emits pending records oldest first across all threads, while they are
+// older than max_age (or all of them, for max_age 0)
+static void emit_older(log_dedup_t *d, unsigned int now, unsigned int max_age)
+{
+	while (1) {
+		log_dedup_window_t *oldest = NULL;
+		unsigned int i;
+
+		for (i = 0; i < LOG_DEDUP_THREADS; i++) {
+			log_dedup_window_t *w = &d->threads[i];
+			if (!w->used || (max_age && now - w->entries[0].first_tick < max_age))
+				continue;
+			if (oldest == NULL || (int)(w->entries[0].seq - oldest->entries[0].seq) < 0)
+				oldest = w;
+		}
+		if (oldest == NULL)
+			return;
+		emit_oldest(d, oldest);
+	}
+}
+
+void log_dedup_expire(log_dedup_t *d, unsigned int now)
+{
+	if (d->latency)
+		emit_older(d, now, d->latency);
+}
+
+void log_dedup_flush(log_dedup_t *d)
+{
+	emit_older(d, 0, 0);
+	d->last_window = NULL;
+}
+
+static log_dedup_window_t *thread_window(log_dedup_t *d, unsigned int thread_id)
+{
+	log_dedup_window_t *w = NULL;
+	unsigned int i;
+
+	for (i = 0; i < LOG_DEDUP_THREADS; i++) {
+		log_dedup_window_t *t = &d->threads[i];
+		if (t->used && t->thread_id == thread_id)
+			return t;
+		// otherwise an empty window, or the one used longest ago
+		if (w == NULL || (w->used && (!t->used || (int)(t->last_seq - w->last_seq) < 0)))
+			w = t;
+	}
+	while (w->used)
+		emit_oldest(d, w);
+	w->thread_id = thread_id;
+	return w;
+}
+
+void log_dedup_add(log_dedup_t *d, unsigned int thread_id, unsigned int index, const unsigned char *buf, unsigned int len,
+	unsigned int compare_offset, unsigned int repeat_offset, unsigned int now)
+{
+	// with a window of 1 the stream itself is the window
+	log_dedup_window_t *w = thread_window(d, d->window > 1 ? thread_id : 0);
+	unsigned int compare_len = len - compare_offset;
+	unsigned int hash = record_hash(index, buf + compare_offset, compare_len);
+	log_dedup_entry_t *e;
+	unsigned int n;
+
+	d->records++;
+	d->last_window = w;
+	w->last_seq = ++d->seq;
+
+	for (n = 0; n < w->used; n++) {
+		e = &w->entries[n];
+		if (e->hash == hash && e->index == index && e->len - e->compare_offset == compare_len &&
+			!memcmp(e->buf + e->compare_offset, buf + compare_offset, compare_len)) {
+			int repeated;
+			memcpy(&repeated, e->buf + e->repeat_offset, sizeof(repeated));
+			repeated++;
+			memcpy(e->buf + e->repeat_offset, &repeated, sizeof(repeated));
+			d->last_seq = e->seq;
+			d->last_was_repeat = 1;
+			return;
+		}
+	}
+
+	if (w->used == d->window)
+		emit_oldest(d, w);
+
+	e = &w->entries[w->used];
+	if (e->cap < len) {
+		unsigned char *bigger = malloc(len);
+		if (bigger == NULL) {
+			// can't hold it back, so pass it straight through
+			d->emit(d->ctx, buf, len);
+			d->emitted++;
+			d->last_window = NULL;
+			return;
+		}
+		free(e->buf);
+		e->buf = bigger;
+		e->cap = len;
+	}
+	memcpy(e->buf, buf, len);
+	e->len = len;
+	e->index = index;
+	e->compare_offset = compare_offset;
+	e->repeat_offset = repeat_offset;
+	e->hash = hash;
+	e->first_tick = now;
+	e->seq = w->last_seq;
+	w->used++;
+
+	d->last_seq = e->seq;
+	d->last_was_repeat = 0;
+}
+
+void log_dedup_drop_last(log_dedup_t *d)
+{
+	log_dedup_window_t *w = d->last_window;
+	unsigned int n;
+
+	if (w == NULL)
+		return;
+	d->last_window = NULL;
+
+	for (n = 0; n < w->used; n++) {
+		log_dedup_entry_t *e = &w->entries[n];
+		if (e->seq != d->last_seq)
+			continue;
+		if (d->last_was_repeat) {
+			int repeated;
+			memcpy(&repeated, e->buf + e->repeat_offset, sizeof(repeated));
+			repeated--;
+			memcpy(e->buf + e->repeat_offset, &repeated, sizeof(repeated));
+		}
+		else
+			remove_entry(w, n);
+		return;
+	}
+}
+
+void log_dedup_free(log_dedup_t *d)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < LOG_DEDUP_THREADS; i++)
+		for (n = 0; n < LOG_DEDUP_MAX_WINDOW; n++) {
+			free(d->threads[i].entries[n].buf);
+			d->threads[i].entries[n].buf = NULL;
+			d->threads[i].entries[n].cap = 0;
+		}
+}
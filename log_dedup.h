@@ -0,0 +1,87 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stddef.h>
+
+// Folds repeated log records that are not back to back (polling loops such as
+// GetTickCount/Sleep/GetCursorPos interleave two or three calls) into single
+// records carrying a repeat count. Each thread gets a small window of pending
+// records; a record matching one of them only bumps that record's count.
+// Records leave in the order they were first seen, when pushed out of a full
+// window, when older than the latency bound, or on flush. A window of 1 is
+// shared by all threads: only a repeat of the record just before it in the
+// stream folds, whichever thread logged it. No Windows dependencies; the
+// caller serialises access.
+
+#define LOG_DEDUP_MAX_WINDOW 32
+#define LOG_DEDUP_THREADS 8
+
+typedef void (*log_dedup_emit_t)(void *ctx, const unsigned char *buf, unsigned int len);
+
+typedef struct _log_dedup_entry_t {
+	unsigned char *buf;
+	unsigned int len;
+	unsigned int cap;
+	unsigned int index;				// log index, compared along with the bytes
+	unsigned int compare_offset;	// compared bytes run from here to the end
+	unsigned int repeat_offset;		// the int holding the repeat count
+	unsigned int hash;
+	unsigned int first_tick;
+	unsigned int seq;
+} log_dedup_entry_t;
+
+typedef struct _log_dedup_window_t {
+	unsigned int thread_id;
+	unsigned int used;				// pending entries, oldest first
+	unsigned int last_seq;			// for picking a window to recycle
+	log_dedup_entry_t entries[LOG_DEDUP_MAX_WINDOW];
+} log_dedup_window_t;
+
+typedef struct _log_dedup_t {
+	unsigned int window;			// pending records per thread, 1 for plain consecutive folding
+	unsigned int latency;			// most ms a record is held back, 0 for no bound
+	log_dedup_emit_t emit;
+	void *ctx;
+	unsigned int seq;
+	// the record touched by the last add, for log_dedup_drop_last()
+	log_dedup_window_t *last_window;
+	unsigned int last_seq;
+	int last_was_repeat;
+	unsigned int records;
+	unsigned int emitted;
+	log_dedup_window_t threads[LOG_DEDUP_THREADS];
+} log_dedup_t;
+
+void log_dedup_init(log_dedup_t *d, unsigned int window, unsigned int latency, log_dedup_emit_t emit, void *ctx);
+
+// takes a copy of the record unless it repeats a pending one
+void log_dedup_add(log_dedup_t *d, unsigned int thread_id, unsigned int index, const unsigned char *buf, unsigned int len,
+	unsigned int compare_offset, unsigned int repeat_offset, unsigned int now);
+
+// emits the records first seen latency ms or more before now
+void log_dedup_expire(log_dedup_t *d, unsigned int now);
+
+// emits every pending record
+void log_dedup_flush(log_dedup_t *d);
+
+// takes back the last add: un-counts the repeat, or discards the record if it
+// hasn't been emitted yet
+void log_dedup_drop_last(log_dedup_t *d);
+
+void log_dedup_free(log_dedup_t *d);
@@ -0,0 +1,68 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "log_fmt.h"
+
+// arguments 0 and 1 are is_success and the return value
+#define FIRST_ARG_KEY 2
+
+// the same walk loq() used to make over the format on every call: an
+// optional repeat count of 2-9 followed by the specifier
+#define FOR_EACH_SPECIFIER(fmt, key, count) \
+	for (; *fmt && (count = *fmt >= '2' && *fmt <= '9' ? *fmt++ - '0' : 1, key = *fmt) != 0; fmt++)
+
+unsigned int log_fmt_count(const char *fmt)
+{
+	unsigned int ret = 0;
+	int count;
+	char key;
+
+	FOR_EACH_SPECIFIER(fmt, key, count)
+		ret += count;
+	return ret;
+}
+
+size_t log_fmt_size(unsigned int count)
+{
+	return offsetof(log_fmt_t, args) + (count ? count : 1) * sizeof(log_arg_t);
+}
+
+void log_fmt_compile(const char *fmt, log_fmt_t *desc)
+{
+	unsigned int n = 0;
+	int count;
+	char key;
+
+	FOR_EACH_SPECIFIER(fmt, key, count) {
+		while (count--) {
+			log_arg_t *arg = &desc->args[n];
+			unsigned int num = n + FIRST_ARG_KEY, i = 0;
+
+			memset(arg, 0, sizeof(*arg));
+			arg->type = key;
+			if (num >= 100)
+				arg->key[i++] = '0' + (num / 100) % 10;
+			if (num >= 10)
+				arg->key[i++] = '0' + (num / 10) % 10;
+			arg->key[i] = '0' + num % 10;
+			n++;
+		}
+	}
+	desc->count = n;
+}
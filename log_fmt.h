@@ -0,0 +1,44 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+// A loq() format string compiled into one entry per logged argument, with
+// repeat counts ("3s") expanded and the bson array key of each argument
+// ("2", "3", ...) precomputed, so that logging a call walks an array rather
+// than parsing the format. The format of a given log index never changes,
+// so it is compiled once, the first time the index is logged.
+
+typedef struct _log_arg_t {
+	char type;			// format specifier
+	char key[4];		// bson array index of the argument
+} log_arg_t;
+
+typedef struct _log_fmt_t {
+	unsigned int count;
+	log_arg_t args[1];
+} log_fmt_t;
+
+// the number of arguments fmt describes
+unsigned int log_fmt_count(const char *fmt);
+
+// bytes needed for the descriptor of a format describing count arguments
+size_t log_fmt_size(unsigned int count);
+
+// fills in desc, which must be log_fmt_size(log_fmt_count(fmt)) bytes
+void log_fmt_compile(const char *fmt, log_fmt_t *desc);
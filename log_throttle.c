@@ -0,0 +1,130 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "log_throttle.h"
+
+void log_throttle_init(log_throttle_t *t, unsigned int period, unsigned int hot, unsigned int now)
+{
+	memset(t, 0, sizeof(*t));
+	t->period = period ? period : 1000;
+	t->hot = hot ? hot : 1;
+	t->high = 750;
+	t->low = 500;
+	t->severe = 900;
+	t->period_start = now;
+}
+
+void log_throttle_set_critical(log_throttle_t *t, unsigned int index)
+{
+	if (index < LOG_THROTTLE_MAX)
+		t->apis[index].critical = 1;
+}
+
+// The level goes up as soon as a watermark is passed, but only comes down
+// once the fill level has stayed below the exit mark (the high watermark for
+// severe, the low one for throttling) for a whole period, so that hot APIs
+// aren't let loose the moment counting them has drained the buffer a bit.
+static void update_level(log_throttle_t *t, unsigned int fill, unsigned int now)
+{
+	unsigned int exit_mark;
+
+	if (fill >= t->severe)
+		t->level = 2;
+	else if (fill >= t->high && !t->level)
+		t->level = 1;
+
+	exit_mark = t->level == 2 ? t->high : t->low;
+	if (!t->level || fill >= exit_mark) {
+		t->calm = 0;
+		return;
+	}
+	if (!t->calm) {
+		t->calm = 1;
+		t->calm_start = now;
+	}
+	else if (now - t->calm_start >= t->period) {
+		t->level--;
+		t->calm = 0;
+	}
+}
+
+int log_throttle_check(log_throttle_t *t, unsigned int index, unsigned int fill, unsigned int now)
+{
+	log_throttle_api_t *a;
+	unsigned int hot;
+
+	if (index >= LOG_THROTTLE_MAX)
+		return 1;
+
+	update_level(t, fill, now);
+	a = &t->apis[index];
+	a->calls++;
+
+	if (a->critical || !t->level) {
+		t->logged++;
+		return 1;
+	}
+
+	// the rate of the last period, or of this one if it's already higher
+	hot = t->level == 2 ? (t->hot + 7) / 8 : t->hot;
+	if (a->rate < hot && a->calls < hot) {
+		t->logged++;
+		return 1;
+	}
+
+	a->suppressed++;
+	t->counted++;
+	return 0;
+}
+
+static void emit_counts(log_throttle_t *t, log_throttle_emit_t emit, void *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_THROTTLE_MAX; i++) {
+		unsigned int suppressed = t->apis[i].suppressed;
+		if (!suppressed)
+			continue;
+		// cleared first, as emitting may log and so land back here
+		t->apis[i].suppressed = 0;
+		emit(ctx, i, suppressed);
+	}
+}
+
+int log_throttle_tick(log_throttle_t *t, unsigned int now, log_throttle_emit_t emit, void *ctx)
+{
+	unsigned int i;
+
+	if (now - t->period_start < t->period)
+		return 0;
+
+	for (i = 0; i < LOG_THROTTLE_MAX; i++) {
+		t->apis[i].rate = t->apis[i].calls;
+		t->apis[i].calls = 0;
+	}
+	t->period_start = now;
+	emit_counts(t, emit, ctx);
+	return 1;
+}
+
+void log_throttle_flush(log_throttle_t *t, log_throttle_emit_t emit, void *ctx)
+{
+	emit_counts(t, emit, ctx);
+}
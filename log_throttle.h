@@ -0,0 +1,68 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Keeps logging from falling behind when the log buffer fills faster than it
+// can be written out. Once the fill level passes a high watermark, calls to
+// the hottest APIs are only counted, and the counts go out as one aggregate
+// record per API each period; full logging resumes once the fill level has
+// stayed below a low watermark for a period. Past a severe watermark the bar
+// for "hot" drops.
+// APIs marked critical are always logged in full. No Windows dependencies;
+// the caller serialises access.
+
+#define LOG_THROTTLE_MAX 1024
+
+typedef struct _log_throttle_api_t {
+	unsigned int calls;			// in the current period
+	unsigned int rate;			// calls in the last full period
+	unsigned int suppressed;	// counted only, since the last aggregate
+	unsigned char critical;
+} log_throttle_api_t;
+
+typedef struct _log_throttle_t {
+	unsigned int period;		// ms between aggregates
+	unsigned int hot;			// calls per period that make an API hot
+	unsigned int high;			// fill levels, per mille
+	unsigned int low;
+	unsigned int severe;
+	unsigned int level;			// 0 logging everything, 1 hot APIs counted, 2 severe
+	unsigned int calm;			// whether the fill level is below the level's exit mark,
+	unsigned int calm_start;	// and since when
+	unsigned int period_start;
+	unsigned int logged;
+	unsigned int counted;
+	log_throttle_api_t apis[LOG_THROTTLE_MAX];
+} log_throttle_t;
+
+typedef void (*log_throttle_emit_t)(void *ctx, unsigned int index, unsigned int suppressed);
+
+void log_throttle_init(log_throttle_t *t, unsigned int period, unsigned int hot, unsigned int now);
+
+void log_throttle_set_critical(log_throttle_t *t, unsigned int index);
+
+// returns 1 if the call should be logged in full, or 0 if it has only been
+// counted; fill is how full the log buffer is, per mille
+int log_throttle_check(log_throttle_t *t, unsigned int index, unsigned int fill, unsigned int now);
+
+// once per period: emits the counts of calls not logged and starts the next
+// period; returns 1 if a period ended
+int log_throttle_tick(log_throttle_t *t, unsigned int now, log_throttle_emit_t emit, void *ctx);
+
+// emits all outstanding counts
+void log_throttle_flush(log_throttle_t *t, log_throttle_emit_t emit, void *ctx);
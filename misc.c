@@ -27,6 +27,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "pipe.h"
 #include "config.h"
+#include "key_cache.h"
+#include "export_index.h"
+#include "code_sig.h"
 
 extern char *our_process_name;
 extern void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
@@ -709,6 +712,7 @@ void add_dll_range(ULONG_PTR start, ULONG_PTR end)
 	dll_ranges[tmp_loaded_dlls].end = end;
 
 	loaded_dlls++;
+	invalidate_address_classes();
 }
 
 BOOL is_in_dll_range(ULONG_PTR addr)
@@ -1144,6 +1148,66 @@ static void copy_encoded_unicode_string(wchar_t *out, const wchar_t *in, unsigne
 	out[newlen / sizeof(wchar_t)] = L'\0';
 }
 
+static wchar_t key_name_char(const char *ain, const wchar_t *win, unsigned int i)
+{
+	return ain ? (wchar_t)(unsigned short)ain[i] : win[i];
+}
+
+/* The key name given to a hook, ANSI or wide, is copied into the thread's
+   key name buffer (allocated once, see hook_key_name_buffer) with duplicate
+   backslashes folded, as the registry APIs use them without error. count is
+   in characters, NULs in it are spelled out; -1 reads up to the terminator.
+*/
+static wchar_t *full_key_path(HKEY registry, const char *ain, const wchar_t *win, int count, PKEY_NAME_INFORMATION keybuf, unsigned int len)
+{
+	OBJECT_ATTRIBUTES objattr;
+	UNICODE_STRING keystr;
+	unsigned int maxchars = MAX_KEY_BUFLEN / sizeof(wchar_t) - 1;
+	unsigned int i, idx = 0;
+	wchar_t *name, *allocated = NULL;
+	wchar_t *ret;
+
+	// only the temporary hook info of a thread being set up has none
+	name = hook_key_name_buffer();
+	if (name == NULL)
+		name = allocated = malloc(MAX_KEY_BUFLEN);
+	if (name == NULL) {
+		keybuf->KeyName[0] = 0;
+		keybuf->KeyNameLength = 0;
+		return keybuf->KeyName;
+	}
+
+	for (i = 0; (ain || win) && (count < 0 || i < (unsigned int)count) && idx < maxchars; i++) {
+		wchar_t c = key_name_char(ain, win, i);
+
+		if (c == L'\0') {
+			if (count < 0 || idx + 4 > maxchars)
+				break;
+			name[idx++] = L'\\';
+			name[idx++] = L'x';
+			name[idx++] = L'0';
+			name[idx++] = L'0';
+			continue;
+		}
+		name[idx++] = c;
+		if (c == L'\\') {
+			while ((count < 0 || i + 1 < (unsigned int)count) && key_name_char(ain, win, i + 1) == L'\\')
+				i++;
+		}
+	}
+
+	memset(&objattr, 0, sizeof(objattr));
+	keystr.Buffer = name;
+	keystr.Length = (USHORT)(idx * sizeof(wchar_t));
+	keystr.MaximumLength = MAX_KEY_BUFLEN;
+	objattr.ObjectName = &keystr;
+	objattr.RootDirectory = registry;
+
+	ret = get_key_path(&objattr, keybuf, len);
+	free(allocated);
+	return ret;
+}
+
 wchar_t *get_full_keyvalue_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
 	if (in && in[0] != '\0')
@@ -1160,79 +1224,170 @@ wchar_t *get_full_keyvalue_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INF
 }
 wchar_t *get_full_keyvalue_pathUS(HKEY registry, const PUNICODE_STRING in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
-	wchar_t *ret;
-	if (in && in->Length) {
-		unsigned int newlen = get_encoded_unicode_string_len(in->Buffer, in->Length);
-		wchar_t *incpy = malloc(newlen + (1 * sizeof(wchar_t)));
-		copy_encoded_unicode_string(incpy, in->Buffer, in->Length, newlen);
-		ret = get_full_key_pathW(registry, incpy, keybuf, len);
-		free(incpy);
-	}
-	else {
-		ret = get_full_key_pathW(registry, L"(Default)", keybuf, len);
-	}
-	return ret;
+	if (in && in->Length)
+		return full_key_path(registry, NULL, in->Buffer, in->Length / sizeof(wchar_t), keybuf, len);
+	else
+		return get_full_key_pathW(registry, L"(Default)", keybuf, len);
 }
 
 wchar_t *get_full_key_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
-	wchar_t *widein = NULL;
-	const char *p;
-	wchar_t *u;
-	unsigned int widelen = 0;
-	wchar_t *ret;
+	return full_key_path(registry, in, NULL, -1, keybuf, len);
+}
 
-	if (in) {
-		widelen = (unsigned int)((strlen(in) + 1) * sizeof(wchar_t));
-		widein = calloc(1, widelen);
-		for (u = widein, p = in; *p; p++, u++)
-			*u = (wchar_t)(unsigned short)*p;
-	}
+wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
+{
+	return full_key_path(registry, NULL, in, -1, keybuf, len);
+}
+
+static key_cache_t g_key_cache;
+static CRITICAL_SECTION g_key_cache_lock;
+static BOOL g_key_cache_ready;
 
-	ret = get_full_key_pathW(registry, widein, keybuf, len);
+/* The names of open key handles, as NtQueryKey reports them, are cached so
+   logging the same HKEY again doesn't cost a syscall each time. Entries are
+   dropped when the handle is closed, when an open hands the handle value
+   back out again in case a close went unseen, and once they're older than
+   KEY_CACHE_MAX_AGE for a close and reopen the hooks didn't see at all.
+*/
+void reg_key_cache_init(void)
+{
+	InitializeCriticalSection(&g_key_cache_lock);
+	key_cache_init(&g_key_cache);
+	g_key_cache_ready = TRUE;
+}
 
-	if (widein)
-		free(widein);
+static int reg_key_cache_lookup(HKEY key, wchar_t *out, unsigned int maxlen)
+{
+	int ret;
 
+	if (!g_key_cache_ready)
+		return -1;
+	EnterCriticalSection(&g_key_cache_lock);
+	ret = key_cache_lookup(&g_key_cache, (uintptr_t)key, (unsigned short *)out, maxlen, raw_gettickcount());
+	LeaveCriticalSection(&g_key_cache_lock);
 	return ret;
 }
 
-wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
+static void reg_key_cache_store(HKEY key, const wchar_t *name, unsigned int len)
 {
-	OBJECT_ATTRIBUTES objattr;
-	UNICODE_STRING keystr;
-	const wchar_t *p;
-	wchar_t *u;
-	wchar_t *ret;
-	unsigned short idx = 0;
+	if (!g_key_cache_ready)
+		return;
+	EnterCriticalSection(&g_key_cache_lock);
+	key_cache_store(&g_key_cache, (uintptr_t)key, (const unsigned short *)name, len, raw_gettickcount());
+	LeaveCriticalSection(&g_key_cache_lock);
+}
 
-	memset(&objattr, 0, sizeof(objattr));
+void reg_key_cache_forget(HANDLE key)
+{
+	if (!g_key_cache_ready)
+		return;
+	EnterCriticalSection(&g_key_cache_lock);
+	key_cache_remove(&g_key_cache, (uintptr_t)key);
+	LeaveCriticalSection(&g_key_cache_lock);
+}
 
-	keystr.Buffer = calloc(1, MAX_KEY_BUFLEN);
-	keystr.MaximumLength = MAX_KEY_BUFLEN;
-	objattr.ObjectName = &keystr;
+void reg_key_cache_flush(void)
+{
+	if (!g_key_cache_ready)
+		return;
+	EnterCriticalSection(&g_key_cache_lock);
+	key_cache_clear(&g_key_cache);
+	LeaveCriticalSection(&g_key_cache_lock);
+}
 
-	if (in) {
-		for (p = in, u = keystr.Buffer; *p && idx < (MAX_KEY_BUFLEN / sizeof(wchar_t) - 1); p++, u++, idx++) {
-			*u = *p;
-			// normalize duplicate backslashes in the user-provided string as the registry APIs will use them without error
-			if (*p == L'\\') {
-				while (*(p + 1) == L'\\')
-					p++;
-			}
-		}
-		keystr.Length = idx * sizeof(wchar_t);
+#define EXPORT_CACHE_MODULES 64
+
+typedef struct _export_cache_entry_t {
+	HMODULE module;
+	DWORD timestamp;
+	DWORD size;
+	export_index_t index;
+} export_cache_entry_t;
+
+static export_cache_entry_t g_export_cache[EXPORT_CACHE_MODULES];
+static unsigned int g_export_cache_next;
+static CRITICAL_SECTION g_export_cache_lock;
+static BOOL g_export_cache_ready;
+
+/* Hook addresses are looked up in an index of each module's export
+   directory, built the first time a hook is resolved in the module, rather
+   than through GetProcAddress for every hook. An entry is rebuilt if a
+   different image turns up at the same base.
+*/
+void export_cache_init(void)
+{
+	InitializeCriticalSection(&g_export_cache_lock);
+	g_export_cache_ready = TRUE;
+}
+
+// called with g_export_cache_lock held
+static const export_index_t *export_index_for(HMODULE module)
+{
+	PIMAGE_NT_HEADERS nt;
+	export_cache_entry_t *e;
+	DWORD timestamp, size;
+	unsigned int i;
+
+	if (module == NULL)
+		return NULL;
+	nt = (PIMAGE_NT_HEADERS)((PUCHAR)module + ((PIMAGE_DOS_HEADER)module)->e_lfanew);
+	timestamp = nt->FileHeader.TimeDateStamp;
+	size = nt->OptionalHeader.SizeOfImage;
+
+	for (i = 0; i < EXPORT_CACHE_MODULES; i++) {
+		e = &g_export_cache[i];
+		if (e->module == module && e->timestamp == timestamp && e->size == size)
+			return e->index.slots ? &e->index : NULL;
+	}
+
+	e = &g_export_cache[g_export_cache_next++ % EXPORT_CACHE_MODULES];
+	export_index_free(&e->index);
+	e->module = module;
+	e->timestamp = timestamp;
+	e->size = size;
+	if (!export_index_build(&e->index, (const unsigned char *)module, size))
+		return NULL;
+	return &e->index;
+}
+
+static const export_index_t *export_module(void *ctx, const char *module, size_t len)
+{
+	char name[MAX_PATH];
+
+	if (len >= sizeof(name))
+		return NULL;
+	memcpy(name, module, len);
+	name[len] = '\0';
+	return export_index_for(GetModuleHandleA(name));
+}
+
+FARPROC get_export_address(HMODULE module, const char *name)
+{
+	const export_index_t *index = NULL;
+	FARPROC addr = NULL;
+	int unresolved = 1;
+
+	if (!g_export_cache_ready)
+		return GetProcAddress(module, name);
+
+	EnterCriticalSection(&g_export_cache_lock);
+	__try {
+		index = export_index_for(module);
+		if (index)
+			addr = (FARPROC)export_index_resolve(index, name, export_module, NULL, &unresolved);
 	}
-	else {
-		keystr.Buffer[0] = L'\0';
-		keystr.Length = 0;
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		index = NULL;
+		addr = NULL;
 	}
+	LeaveCriticalSection(&g_export_cache_lock);
 
-	objattr.RootDirectory = registry;
-
-	ret = get_key_path(&objattr, keybuf, len);
-	free(keystr.Buffer);
-	return ret;
+	// forwarders to modules that aren't loaded or are api sets, and modules
+	// without a usable export directory, are left to the loader
+	if (addr == NULL && (index == NULL || unresolved))
+		addr = GetProcAddress(module, name);
+	return addr;
 }
 
 wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION keybuf, unsigned int len)
@@ -1286,9 +1441,15 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 
 	keybuf->KeyNameLength = lstrlenW(keybuf->KeyName) * sizeof(wchar_t);
 	if (!keybuf->KeyNameLength) {
-		status = pNtQueryKey(ObjectAttributes->RootDirectory, KeyNameInformation, keybuf, len, &reslen);
-		if (status < 0)
-			goto error;
+		int cached = reg_key_cache_lookup(rootkey, keybuf->KeyName, maxlen - sizeof(WCHAR));
+		if (cached >= 0)
+			keybuf->KeyNameLength = cached;
+		else {
+			status = pNtQueryKey(ObjectAttributes->RootDirectory, KeyNameInformation, keybuf, len, &reslen);
+			if (status < 0)
+				goto error;
+			reg_key_cache_store(rootkey, keybuf->KeyName, keybuf->KeyNameLength);
+		}
 	}
 
 	keybuf->KeyName[keybuf->KeyNameLength / sizeof(WCHAR)] = 0;
@@ -1600,34 +1761,45 @@ static PUCHAR get_rel_target(PUCHAR buf)
 	return buf + 5 + *(int *)&buf[1];
 }
 
+// the finders below compile their signatures on the stack each time: they
+// run once per module load, against a whole .text section
 static PUCHAR find_first_caller_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
+	code_sig_t sig;
 	PUCHAR p;
 
-	for (p = start; p < end - 5; p++) {
-		if (p[0] == 0xe8 && get_rel_target(p) == target)
+	code_sig_parse(&sig, "e8 ?? ?? ?? ??");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		if (get_rel_target(p) == target)
 			return p;
 	}
 	return NULL;
 }
 
-static PUCHAR find_first_imm_push_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
+static PUCHAR find_imm32_of_target(PUCHAR start, PUCHAR end, PUCHAR target, UCHAR opcode, UCHAR opmask)
 {
-	PUCHAR p;
+	code_sig_t sig;
+	UCHAR bytes[5], mask[5] = { opmask, 0xff, 0xff, 0xff, 0xff };
 
-	for (p = start; p < end - 5; p++) {
-		if (p[0] == 0x68 && *(DWORD *)&p[1] == (DWORD)(ULONG_PTR)target)
-			return p;
-	}
-	return NULL;
+	bytes[0] = opcode;
+	*(DWORD *)&bytes[1] = (DWORD)(ULONG_PTR)target;
+	code_sig_compile(&sig, bytes, mask, sizeof(bytes));
+	return (PUCHAR)code_sig_find(&sig, start, end);
+}
+
+static PUCHAR find_first_imm_push_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	return find_imm32_of_target(start, end, target, 0x68, 0xff);
 }
 
 static PUCHAR find_first_lea_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
+	code_sig_t sig;
 	PUCHAR p;
 
-	for (p = start; p < end - 7; p++) {
-		if (p[0] == 0x48 && p[1] == 0x8d && get_rel_target(&p[2]) == target)
+	code_sig_parse(&sig, "48 8d ?? ?? ?? ?? ??");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		if (get_rel_target(&p[2]) == target)
 			return p;
 	}
 	return NULL;
@@ -1635,20 +1807,17 @@ static PUCHAR find_first_lea_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 
 static PUCHAR find_first_mov_reg_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
-	PUCHAR p;
-
-	for (p = start; p < end - 5; p++) {
-		if (((p[0] & 0xf8) == 0xb8) && *(DWORD *)&p[1] == (DWORD)(ULONG_PTR)target)
-			return p;
-	}
-	return NULL;
-
+	return find_imm32_of_target(start, end, target, 0xb8, 0xf8);
 }
 
 static PUCHAR find_string_in_bounds(PUCHAR start, PUCHAR end, PUCHAR str, DWORD len)
 {
+	code_sig_t sig;
 	PUCHAR p;
 
+	if (code_sig_compile(&sig, str, NULL, len))
+		return (PUCHAR)code_sig_find(&sig, start, end);
+
 	for (p = start; p < end - len; p++)
 		if (!memcmp(p, str, len))
 			return p;
@@ -1657,31 +1826,55 @@ static PUCHAR find_string_in_bounds(PUCHAR start, PUCHAR end, PUCHAR str, DWORD
 
 static PUCHAR find_next_relative_call(PUCHAR start, PUCHAR end, PUCHAR target)
 {
+	code_sig_t sig;
 	PUCHAR p;
 
-	for (p = target; p < end - 5; p++) {
-		if (p[0] == 0xe8) {
-			PUCHAR resolv = get_rel_target(p);
-			if (resolv >= start && resolv < end)
-				return p;
-		}
+	code_sig_parse(&sig, "e8 ?? ?? ?? ??");
+	for (p = target; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		PUCHAR resolv = get_rel_target(p);
+		if (resolv >= start && resolv < end)
+			return p;
 	}
 	return NULL;
 }
 
 static PUCHAR find_function_prologue(PUCHAR start, PUCHAR end, PUCHAR target)
 {
-	PUCHAR p;
+	code_sig_t sig;
+	PUCHAR lo, p;
+
+	// the nearest one before target, at most a page back
+	lo = target - start > 0xfff ? target - 0xfff : start;
 #ifdef _WIN64
-	for (p = target - 5; p >(target - 0x1000) && p >= start; p--)
-		if (!memcmp(p, "\x90\x90\x90\x90\x90", 5))
-			return p + 6;
+	code_sig_parse(&sig, "90 90 90 90 90");
+	p = (PUCHAR)code_sig_find_last(&sig, lo, target);
+	return p ? p + 6 : NULL;
 #else
-	for (p = target - 5; p > (target - 0x1000) && p >= start; p--)
-		if (!memcmp(p, "\x8b\xff\x55\x8b\xec", 5))
-			return p;
+	code_sig_parse(&sig, "8b ff 55 8b ec");
+	return (PUCHAR)code_sig_find_last(&sig, lo, target);
 #endif
-	return NULL;
+}
+
+// whether p is a lea (a push, or with mov_reg a mov to a register, on x86)
+// of the address of the len bytes at str in [start, end): the reference to
+// a string that the finders below start from, checked where a plan handed
+// down says there is one
+static BOOL references_string(PUCHAR start, PUCHAR end, PUCHAR p, PUCHAR str, DWORD len, BOOL mov_reg)
+{
+	PUCHAR target;
+
+	if (p < start || end - p < 7)
+		return FALSE;
+#ifdef _WIN64
+	if (p[0] != 0x48 || p[1] != 0x8d)
+		return FALSE;
+	target = get_rel_target(&p[2]);
+#else
+	if (p[0] != 0x68 && (!mov_reg || (p[0] & 0xf8) != 0xb8))
+		return FALSE;
+	target = (PUCHAR)(ULONG_PTR)*(DWORD *)&p[1];
+#endif
+	return target >= start && target < end && (DWORD)(end - target) >= len && !memcmp(target, str, len);
 }
 
 static BOOL get_section_bounds(HMODULE mod, const char * sectionname, PUCHAR *start, PUCHAR *end)
@@ -1720,7 +1913,9 @@ ULONG_PTR get_connectex_addr(HMODULE mod)
 	return *(ULONG_PTR *)(p + 16);
 }
 
-ULONG_PTR get_jseval_addr(HMODULE mod)
+// the function referencing "eval code", found through the first reference
+// to it, which goes in witness for check_jseval_addr
+ULONG_PTR get_jseval_addr(HMODULE mod, ULONG_PTR *witness)
 {
 	PUCHAR start, end;
 	PUCHAR p;
@@ -1737,10 +1932,25 @@ ULONG_PTR get_jseval_addr(HMODULE mod)
 #endif
 	if (p == NULL)
 		return 0;
+	*witness = (ULONG_PTR)p;
 	p = find_function_prologue(start, end, p);
+	if (p == NULL)
+		*witness = 0;
 	return (ULONG_PTR)p;
 }
 
+// whether addr is the function get_jseval_addr would take the reference at
+// witness to be in, without the scans that found them
+BOOL check_jseval_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness)
+{
+	PUCHAR start, end;
+
+	if (!addr || !get_section_bounds(mod, ".text", &start, &end) ||
+		!references_string(start, end, (PUCHAR)witness, (PUCHAR)L"eval code", 20, FALSE))
+		return FALSE;
+	return (ULONG_PTR)find_function_prologue(start, end, (PUCHAR)witness) == addr;
+}
+
 ULONG_PTR get_olescript_compile_addr(HMODULE mod)
 {
 	PUCHAR start, end;
@@ -1792,7 +2002,10 @@ PWCHAR get_dll_basename(PUNICODE_STRING library)
 	return dllname;
 }
 
-ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod)
+// the caller of the function referencing "script block", found through its
+// first call to it, which goes in witness for
+// check_olescript_parsescripttext_addr
+ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod, ULONG_PTR *witness)
 {
 	PUCHAR start, end;
 	PUCHAR p;
@@ -1818,15 +2031,104 @@ ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod)
 	p = find_first_caller_of_target(start, end, p);
 	if (p == NULL)
 		return 0;
+	*witness = (ULONG_PTR)p;
 	p = find_function_prologue(start, end, p);
+	if (p == NULL)
+		*witness = 0;
 	return (ULONG_PTR)p;
 }
 
-ULONG_PTR get_cdocument_write_addr(HMODULE mod)
+// whether addr is the function get_olescript_parsescripttext_addr would
+// take the call at witness to be in, and the function called is one that
+// references "script block", which it does within the page the prologue
+// search covers
+BOOL check_olescript_parsescripttext_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness)
+{
+	PUCHAR start, end, lim, p;
+	PUCHAR call = (PUCHAR)witness, callee;
+
+	if (!addr || !get_section_bounds(mod, ".text", &start, &end) || call < start || end - call < 5 || call[0] != 0xe8)
+		return FALSE;
+	if ((ULONG_PTR)find_function_prologue(start, end, call) != addr)
+		return FALSE;
+	callee = get_rel_target(call);
+	if (callee < start || callee >= end)
+		return FALSE;
+	lim = end - callee > 0x1000 ? callee + 0x1000 : end;
+	for (p = callee; p < lim; p++)
+		if (references_string(start, end, p, (PUCHAR)L"script block", 26, TRUE) && find_function_prologue(start, end, p) == callee)
+			return TRUE;
+	return FALSE;
+}
+
+#ifdef _WIN64
+// CDocument::write given the lea of "\r\n" followed by a call at p, in
+// writeln: writeln makes three calls, the first and third to the same
+// function, and the second is to write
+static PUCHAR cdocument_write_of_reference(PUCHAR start, PUCHAR end, PUCHAR p)
+{
+	code_sig_t call;
+	PUCHAR x;
+	PUCHAR firstfunc = NULL, secondfunc = NULL;
+	PUCHAR writelnstart = find_function_prologue(start, end, p);
+
+	if (writelnstart == NULL)
+		return NULL;
+	code_sig_parse(&call, "e8 ?? ?? ?? ??");
+	for (x = writelnstart; (x = (PUCHAR)code_sig_find(&call, x, p)) != NULL; x++) {
+		PUCHAR target = get_rel_target(x);
+		if (target >= start && target < end) {
+			if (firstfunc == NULL)
+				firstfunc = target;
+			else if (secondfunc == NULL)
+				secondfunc = target;
+			else if (target != firstfunc)
+				return NULL;
+		}
+	}
+	return secondfunc;
+}
+#else
+// CDocument::write given the push of "\r\n" followed by a call at p, in
+// writeln if a retn 8 follows shortly
+static PUCHAR cdocument_write_of_reference(PUCHAR start, PUCHAR end, PUCHAR p)
+{
+	code_sig_t retn;
+	PUCHAR retn_end = end - p > 0x82 ? p + 0x82 : end;
+	PUCHAR y;
+
+	code_sig_parse(&retn, "c2 08 00");
+	if (code_sig_find(&retn, p + 10, retn_end) == NULL)
+		return NULL;
+	// found the retn 8
+	// now scan back to find a call pointing into .text preceded immediately by some form of a push (register or indirect through ebp plus offset)
+	for (y = p; y > p - 0x80; y--) {
+		if (y[0] == 0xe8) {
+			PUCHAR target = get_rel_target(y);
+			if (target > start && target < end) {
+				// if we find it, the target of the call is CDocument::write
+				if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
+					return target;
+				else if ((*(y - 1) & 0xf8) == 0x50)
+					return target;
+			}
+		}
+	}
+	return NULL;
+}
+#endif
+
+// CDocument::write, found through the first reference to "\r\n" in
+// writeln, which goes in witness for check_cdocument_write_addr
+ULONG_PTR get_cdocument_write_addr(HMODULE mod, ULONG_PTR *witness)
 {
 	PUCHAR start, end;
-	PUCHAR p;
+	PUCHAR p, write;
 	PUCHAR newline;
+	code_sig_t sig;
+#ifndef _WIN64
+	UCHAR bytes[6];
+#endif
 
 	if (!get_section_bounds(mod, ".text", &start, &end))
 		return 0;
@@ -1835,65 +2137,48 @@ ULONG_PTR get_cdocument_write_addr(HMODULE mod)
 		return 0;
 
 #ifdef _WIN64
-	for (p = start; p < end - 10; p++) {
-		if (p[0] == 0x48 && p[1] == 0x8d && p[2] == 0x15 && (get_rel_target(&p[2]) == newline) && p[7] == 0xe8) {
-			PUCHAR x;
-			PUCHAR firstfunc = NULL, secondfunc = NULL;
-			PUCHAR writelnstart = find_function_prologue(start, end, p);
-			if (writelnstart == NULL)
-				goto next_iter;
-			// find function with 3 calls, the first and third being to the same function
-			for (x = writelnstart; x < p; x++) {
-				if (x[0] == 0xe8) {
-					PUCHAR target = get_rel_target(x);
-					if (target >= start && target < end) {
-						if (firstfunc == NULL)
-							firstfunc = target;
-						else if (secondfunc == NULL)
-							secondfunc = target;
-						else if (target != firstfunc)
-							goto next_iter;
-					}
-				}
-			}
-			if (firstfunc && secondfunc)
-				return (ULONG_PTR)secondfunc;
-		}
-next_iter:
-		;
-	}
+	code_sig_parse(&sig, "48 8d 15 ?? ?? ?? ?? e8");
 #else
 	// got the newline, now find a push of the address of it followed immediately by a relative call within short distance of a retn 8
 	// this will give us CDocument::writeln
-	for (p = start; p < end - 10; p++) {
-		if (p[0] == 0x68 && *(DWORD *)&p[1] == (DWORD)newline && p[5] == 0xe8) {
-			PUCHAR x;
-			for (x = p + 10; x < p + 0x80; x++) {
-				if (!memcmp(x, "\xc2\x08\x00", 3)) {
-					PUCHAR y;
-					// found the retn 8
-					// now scan back to find a call pointing into .text preceded immediately by some form of a push (register or indirect through ebp plus offset)
-					for (y = p; y > p - 0x80; y--) {
-						if (y[0] == 0xe8) {
-							PUCHAR target = get_rel_target(y);
-							if (target > start && target < end) {
-								// if we find it, the target of the call is CDocument::write
-								if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
-									return (ULONG_PTR)target;
-								else if ((*(y - 1) & 0xf8) == 0x50)
-									return (ULONG_PTR)target;
-							}
-						}
-					}
-				}
-			}
+	bytes[0] = 0x68;
+	*(DWORD *)&bytes[1] = (DWORD)newline;
+	bytes[5] = 0xe8;
+	code_sig_compile(&sig, bytes, NULL, 6);
+#endif
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+#ifdef _WIN64
+		if (get_rel_target(&p[2]) != newline)
+			continue;
+#endif
+		write = cdocument_write_of_reference(start, end, p);
+		if (write) {
+			*witness = (ULONG_PTR)p;
+			return (ULONG_PTR)write;
 		}
 	}
-#endif
 
 	return 0;
 }
 
+// whether addr is what get_cdocument_write_addr would take the reference to
+// "\r\n" at witness to lead to
+BOOL check_cdocument_write_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness)
+{
+	PUCHAR start, end;
+	PUCHAR p = (PUCHAR)witness;
+
+	if (!addr || !get_section_bounds(mod, ".text", &start, &end) || p < start || end - p < 8)
+		return FALSE;
+#ifdef _WIN64
+	if (p[2] != 0x15 || p[7] != 0xe8 || !references_string(start, end, p, (PUCHAR)L"\r\n", 6, FALSE))
+#else
+	if (p[5] != 0xe8 || !references_string(start, end, p, (PUCHAR)L"\r\n", 6, FALSE))
+#endif
+		return FALSE;
+	return (ULONG_PTR)cdocument_write_of_reference(start, end, p) == addr;
+}
+
 typedef struct _DLL_NOTIFICATION_STRUCT {
 	struct _DLL_NOTIFICATION_STRUCT *Next;
 	DWORD Unused;
@@ -1908,26 +2193,26 @@ void register_dll_notification_manually(PLDR_DLL_NOTIFICATION_FUNCTION notify)
 	return;
 #else
 	PUCHAR p, start, end;
+	code_sig_t sig;
 
 	if (!get_section_bounds(GetModuleHandleA("ntdll"), ".text", &start, &end))
 		return;
-	for (p = start; p < end - 30; p++){
-		if (p[0] == 0xb8 && p[5] == 0xa3 && p[10] == 0xa3 && p[15] == 0xb8 && p[20] == 0xa3 && p[25] == 0xa3) {
-			DWORD addr1, addr2;
-			PDLL_NOTIFICATION_STRUCT next, our;
-
-			addr1 = *(DWORD *)&p[1];
-			addr2 = *(DWORD *)&p[16];
-			// throw out RtlpLeakList/RtlpBusyList
-			if (addr1 == addr2 + 8)
-				continue;
-			next = ((PDLL_NOTIFICATION_STRUCT)(addr2))->Next;
-			our = (PDLL_NOTIFICATION_STRUCT)calloc(1, sizeof(DLL_NOTIFICATION_STRUCT));
-			our->Next = next;
-			our->RegistrationFptr = notify;
-			*(PDLL_NOTIFICATION_STRUCT *)(addr2) = our;
-			return;
-		}
+	code_sig_parse(&sig, "b8 ?? ?? ?? ?? a3 ?? ?? ?? ?? a3 ?? ?? ?? ?? b8 ?? ?? ?? ?? a3 ?? ?? ?? ?? a3");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		DWORD addr1, addr2;
+		PDLL_NOTIFICATION_STRUCT next, our;
+
+		addr1 = *(DWORD *)&p[1];
+		addr2 = *(DWORD *)&p[16];
+		// throw out RtlpLeakList/RtlpBusyList
+		if (addr1 == addr2 + 8)
+			continue;
+		next = ((PDLL_NOTIFICATION_STRUCT)(addr2))->Next;
+		our = (PDLL_NOTIFICATION_STRUCT)calloc(1, sizeof(DLL_NOTIFICATION_STRUCT));
+		our->Next = next;
+		our->RegistrationFptr = notify;
+		*(PDLL_NOTIFICATION_STRUCT *)(addr2) = our;
+		return;
 	}
 #endif
 }
@@ -132,6 +132,12 @@ struct {
 
 void hkcu_init(void);
 
+void reg_key_cache_init(void);
+void reg_key_cache_forget(HANDLE key);
+void reg_key_cache_flush(void);
+void export_cache_init(void);
+FARPROC get_export_address(HMODULE module, const char *name);
+
 char *ensure_absolute_ascii_path(char *out, const char *in);
 wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in);
 
@@ -191,10 +197,13 @@ void num_to_string(char *buf, unsigned int buflen, unsigned int num);
 DWORD get_image_size(ULONG_PTR base);
 
 ULONG_PTR get_connectex_addr(HMODULE mod);
-ULONG_PTR get_jseval_addr(HMODULE mod);
-ULONG_PTR get_cdocument_write_addr(HMODULE mod);
+ULONG_PTR get_jseval_addr(HMODULE mod, ULONG_PTR *witness);
+ULONG_PTR get_cdocument_write_addr(HMODULE mod, ULONG_PTR *witness);
 ULONG_PTR get_olescript_compile_addr(HMODULE mod);
-ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod);
+ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod, ULONG_PTR *witness);
+BOOL check_jseval_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness);
+BOOL check_cdocument_write_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness);
+BOOL check_olescript_parsescripttext_addr(HMODULE mod, ULONG_PTR addr, ULONG_PTR witness);
 
 BOOL is_bytes_in_buf(PCHAR buf, ULONG len, PCHAR memstr, ULONG memlen, ULONG maxsearchbytes);
 void replace_string_in_buf(PCHAR buf, ULONG len, PCHAR findstr, PCHAR repstr);
@@ -0,0 +1,53 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "rate_limit.h"
+
+static void refill(rate_bucket_t *b, const rate_budget_t *budget, unsigned int now)
+{
+	unsigned int burst = budget->burst < RATE_LIMIT_MAX_BURST ? budget->burst : RATE_LIMIT_MAX_BURST;
+	unsigned int full = burst * 1000;
+	unsigned long long tokens;
+
+	if (!b->used) {
+		b->used = 1;
+		b->tokens = full;
+		b->last = now;
+		return;
+	}
+	if (now == b->last)
+		return;
+	// a clock that went backwards (or a wrap) refills nothing but restarts
+	// the interval
+	tokens = b->tokens;
+	if (now - b->last < 0x80000000)
+		tokens += (unsigned long long)(now - b->last) * budget->rate;
+	b->tokens = tokens < full ? (unsigned int)tokens : full;
+	b->last = now;
+}
+
+int rate_limit_take(rate_bucket_t *b, const rate_budget_t *budget, unsigned int now)
+{
+	refill(b, budget, now);
+	if (b->tokens < 1000)
+		return 0;
+	b->tokens -= 1000;
+	b->pending++;
+	return 1;
+}
@@ -0,0 +1,46 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// A token bucket per API and thread, for capping how often a hot API is let
+// through to its hook. A bucket holds up to burst calls and refills at rate
+// calls a second, so calls spread out over time always get through while a
+// tight loop drains it. Time is in ms from a cheap, coarse clock such as the
+// tick count; refills are kept to the thousandth of a call so that slow
+// rates still accumulate across ticks. A bucket belongs to one thread, so
+// nothing here is atomic; pending counts the calls taken since the caller
+// last folded them into whatever total it shares between threads. No
+// Windows dependencies.
+
+#define RATE_LIMIT_MAX_BURST (1 << 20)
+
+typedef struct _rate_budget_t {
+	unsigned int rate;		// calls a second
+	unsigned int burst;		// calls the bucket holds, 0 for not set yet
+} rate_budget_t;
+
+typedef struct _rate_bucket_t {
+	unsigned int tokens;	// thousandths of a call
+	unsigned int last;		// ms, when last refilled
+	unsigned int pending;	// calls taken and not yet folded into a total
+	unsigned int used;		// the bucket has been filled once
+} rate_bucket_t;
+
+// returns 1 if a call may go through, taking a token for it, or 0 if the
+// bucket is empty
+int rate_limit_take(rate_bucket_t *b, const rate_budget_t *budget, unsigned int now);
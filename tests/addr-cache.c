@@ -0,0 +1,176 @@
+// Replays backtraces shaped like those walked on hooked calls (a few
+// frames in our hook trampolines and system DLLs, then the program's own
+// call sites, the hot ones far more often) through the return address
+// cache, classifying as set_caller_info() does: in a module range, inside
+// a hook. Checks every answer against classifying directly, also across
+// a module load bumping the generation and with addresses fighting over a
+// slot, then times the two.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../addr_cache.h"
+
+#define ADDR_IN_DLL_RANGE 1
+#define ADDR_INSIDE_HOOK 2
+
+#define MAX_DLLS 100
+#define HOOKS 457
+#define HOOK_DATA_SIZE 512		// about sizeof(hook_data_t)
+
+static size_t dll_start[MAX_DLLS], dll_end[MAX_DLLS];
+static unsigned int loaded_dlls;
+static size_t hook_data[HOOKS];
+static unsigned long classified;
+
+// misc.c's is_in_dll_range() and hooks.c's inside_hook()
+static unsigned int classify(void *ctx, size_t addr)
+{
+	unsigned int flags = 0, i;
+
+	classified++;
+	for (i = 0; i < loaded_dlls; i++)
+		if (addr >= dll_start[i] && addr < dll_end[i]) {
+			flags |= ADDR_IN_DLL_RANGE;
+			break;
+		}
+	for (i = 0; i < HOOKS; i++)
+		if (addr >= hook_data[i] && addr < hook_data[i] + HOOK_DATA_SIZE) {
+			flags |= ADDR_INSIDE_HOOK;
+			break;
+		}
+	return flags;
+}
+
+#define SITES 400
+#define TRACES 20000
+#define MAX_DEPTH 24
+
+static size_t sites[SITES];		// the program's call sites, hottest first
+static size_t traces[TRACES][MAX_DEPTH];
+static unsigned int depths[TRACES];
+
+static size_t random_in(size_t start, size_t size)
+{
+	return start + ((size_t)rand() * 4099 + rand()) % size;
+}
+
+static void make_process(void)
+{
+	unsigned int i, t, d;
+
+	// system DLLs high up, 64KB aligned, the program at 0x400000 and a heap
+	// region of unpacked code
+	for (loaded_dlls = 0; loaded_dlls < 60; loaded_dlls++) {
+		dll_start[loaded_dlls] = 0x70000000 + loaded_dlls * 0x200000;
+		dll_end[loaded_dlls] = dll_start[loaded_dlls] + 0x10000 + (rand() % 24) * 0x10000;
+	}
+	for (i = 0; i < HOOKS; i++)
+		hook_data[i] = 0x10000000 + i * 0x1000;
+	for (i = 0; i < SITES; i++)
+		sites[i] = i % 4 ? random_in(0x401000, 0x80000) : random_in(0x2a00000, 0x20000);
+
+	for (t = 0; t < TRACES; t++) {
+		unsigned int hook = rand() % 40;		// the hot hooks
+		d = 0;
+		traces[t][d++] = hook_data[hook] + 0x150;
+		// through a system DLL or two, from a handful of places in each
+		while (d < 3 || (d < 6 && rand() % 2)) {
+			unsigned int dll = rand() % 8;
+			traces[t][d++] = dll_start[dll] + 0x1000 + (rand() % 12) * 0x37;
+		}
+		// the program's frames, skewed towards the hot sites
+		while (d < MAX_DEPTH && (d < 8 || rand() % 4)) {
+			unsigned int r = rand() % SITES;
+			traces[t][d++] = sites[(unsigned long long)r * r * r / SITES / SITES];
+		}
+		depths[t] = d;
+	}
+}
+
+int main()
+{
+	static addr_cache_t cache;
+	unsigned int failures = 0, t, d, i, generation = 0, rounds = 20;
+	unsigned long frames = 0, sum_direct = 0, sum_cached = 0;
+	clock_t t0;
+	double t_direct, t_cached;
+
+	srand(46);
+	make_process();
+
+	for (t = 0; t < TRACES; t++)
+		for (d = 0; d < depths[t]; d++) {
+			unsigned int want = classify(NULL, traces[t][d]);
+			if (addr_cache_classify(&cache, traces[t][d], generation, classify, NULL) != want) {
+				printf("  trace %u frame %u: wrong class\n", t, d);
+				failures++;
+			}
+			frames++;
+		}
+	printf("%u traces, %lu frames: hit rate %.1f%%\n", TRACES, frames, 100.0 * cache.hits / (cache.hits + cache.misses));
+
+	// a module loading over some of the heap sites changes their class,
+	// which only a new generation picks up
+	addr_cache_classify(&cache, sites[0], generation, classify, NULL);
+	dll_start[loaded_dlls] = 0x2a00000;
+	dll_end[loaded_dlls] = 0x2a20000;
+	loaded_dlls++;
+	if (addr_cache_classify(&cache, sites[0], generation, classify, NULL) != 0) {
+		printf("  entry changed without a new generation\n");
+		failures++;
+	}
+	generation++;
+	for (i = 0; i < SITES; i++)
+		if (addr_cache_classify(&cache, sites[i], generation, classify, NULL) != classify(NULL, sites[i])) {
+			printf("  site %u: stale after a new generation\n", i);
+			failures++;
+		}
+	loaded_dlls--;
+	generation++;
+
+	// addresses sharing a slot evict each other but never get each other's class
+	{
+		size_t a = 0x401234, b;
+		unsigned int n = 0;
+		addr_cache_classify(&cache, a, generation, classify, NULL);
+		for (b = 0x10000000; n < 20 && b < 0x10000000 + HOOKS * 0x1000; b += 8) {
+			addr_cache_classify(&cache, b, generation, classify, NULL);
+			if (addr_cache_classify(&cache, a, generation, classify, NULL) != 0 ||
+				addr_cache_classify(&cache, b, generation, classify, NULL) != classify(NULL, b)) {
+				printf("  slot sharing mixed up 0x%zx and 0x%zx\n", a, b);
+				failures++;
+				break;
+			}
+			n++;
+		}
+	}
+
+	// benchmark: every frame of every trace, as set_caller_info() would see
+	// them (it stops early once it has two callers, which only helps both)
+	classified = 0;
+	t0 = clock();
+	for (i = 0; i < rounds; i++)
+		for (t = 0; t < TRACES; t++)
+			for (d = 0; d < depths[t]; d++)
+				sum_direct += classify(NULL, traces[t][d]);
+	t_direct = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+
+	memset(&cache, 0, sizeof(cache));
+	classified = 0;
+	t0 = clock();
+	for (i = 0; i < rounds; i++)
+		for (t = 0; t < TRACES; t++)
+			for (d = 0; d < depths[t]; d++)
+				sum_cached += addr_cache_classify(&cache, traces[t][d], generation, classify, NULL);
+	t_cached = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+
+	if (sum_direct != sum_cached)
+		failures++;
+	printf("direct: %.1f ns/frame, cached: %.1f ns/frame (%.1fx), %lu of %lu frames classified\n",
+		t_direct * 1e9 / (frames * rounds), t_cached * 1e9 / (frames * rounds), t_direct / t_cached,
+		classified, frames * rounds);
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,143 @@
+// Spills a run of buffers shaped like what the network and crypto hooks log
+// (mostly distinct, many sent again and again) into a blob store writing to
+// memory, checks every reference leads back to the same bytes in the
+// stream, that repeats are written once and that the stream limit and a
+// failed write are honoured, and compares the bytes written with inlining
+// every buffer in full.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../blob_store.h"
+
+typedef struct _stream_t {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	int fail_after;
+} stream_t;
+
+static int stream_write(void *ctx, const void *data, size_t len)
+{
+	stream_t *s = (stream_t *)ctx;
+
+	if (s->fail_after >= 0 && s->fail_after-- == 0)
+		return 0;
+	if (s->len + len > s->size) {
+		s->size = (s->len + len) * 2;
+		s->data = realloc(s->data, s->size);
+	}
+	memcpy(s->data + s->len, data, len);
+	s->len += len;
+	return 1;
+}
+
+static unsigned int check_ref(const stream_t *st, const blob_ref_t *ref, const unsigned char *buf, size_t len)
+{
+	const unsigned char *h;
+	unsigned long long hash = 0;
+	unsigned int length = 0;
+	int i;
+
+	if (ref->length != len || ref->offset < BLOB_HEADER_SIZE || ref->offset + len > st->len)
+		return 1;
+	h = st->data + ref->offset - BLOB_HEADER_SIZE;
+	for (i = 7; i >= 0; i--)
+		hash = hash << 8 | h[i];
+	for (i = 3; i >= 0; i--)
+		length = length << 8 | h[8 + i];
+	if (hash != ref->hash || hash != blob_hash(buf, len) || length != len)
+		return 1;
+	return memcmp(st->data + ref->offset, buf, len) != 0;
+}
+
+#define BUFFERS 20000
+#define MAXLEN (64 * 1024)
+
+int main()
+{
+	static unsigned char buf[MAXLEN];
+	stream_t st = { NULL, 0, 0, -1 };
+	blob_store_t s;
+	blob_ref_t ref, first;
+	static char seen[BUFFERS];
+	unsigned int failures = 0, distinct = 0, n, i;
+	unsigned long long inlined = 0;
+	clock_t t0;
+	double t;
+
+	srand(40);
+	if (!blob_store_init(&s, 1ULL << 40, stream_write, &st))
+		return 1;
+
+	t0 = clock();
+	for (n = 0; n < BUFFERS; n++) {
+		// a third are the same few buffers again (beacons, keys, headers)
+		unsigned int seed = n % 3 ? n : n % 50;
+		size_t len = 2048 + seed * 7919 % (MAXLEN - 2048);
+		if (!seen[seed]++)
+			distinct++;
+		for (i = 0; i < len; i++)
+			buf[i] = (unsigned char)(seed * 31 + i * 7 + (i >> 8));
+		inlined += len;
+		if (blob_store_put(&s, buf, len, &ref) < 0 || check_ref(&st, &ref, buf, len)) {
+			if (failures++ < 5)
+				printf("  buffer %u: bad reference\n", n);
+		}
+	}
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("%u buffers, %llu bytes: %u written, %u repeats, stream %llu bytes (%.0f%% of inlining them), %.0f MB/s\n",
+		BUFFERS, inlined, s.written, s.duplicates, s.size, 100.0 * s.size / inlined, inlined / t / (1 << 20));
+	if (s.written + s.duplicates != BUFFERS || s.size != st.len || s.written != distinct)
+		failures++;
+
+	// buffers differing in one byte or only in length are told apart
+	memset(buf, 'x', 4096);
+	blob_store_put(&s, buf, 4096, &first);
+	blob_store_put(&s, buf, 4095, &ref);
+	if (ref.offset == first.offset || check_ref(&st, &ref, buf, 4095))
+		failures++;
+	buf[4000] = 'y';
+	blob_store_put(&s, buf, 4096, &ref);
+	if (ref.offset == first.offset || check_ref(&st, &ref, buf, 4096))
+		failures++;
+	buf[4000] = 'x';
+	if (blob_store_put(&s, buf, 4096, &ref) != 0 || ref.offset != first.offset)
+		failures++;
+	// as does a hash worked out beforehand
+	if (blob_store_put_hashed(&s, buf, 4096, blob_hash(buf, 4096), &ref) != 0 || ref.offset != first.offset)
+		failures++;
+	if (blob_store_put(&s, buf, 0, &ref) != -1)
+		failures++;
+	blob_store_free(&s);
+
+	// the limit holds, though repeats of what's in are still found
+	st.len = 0;
+	blob_store_init(&s, 3 * (BLOB_HEADER_SIZE + 1000), stream_write, &st);
+	for (n = 0; n < 5; n++) {
+		memset(buf, n, 1000);
+		if (blob_store_put(&s, buf, 1000, &ref) != (n < 3 ? 1 : -1))
+			failures++;
+	}
+	memset(buf, 1, 1000);
+	if (blob_store_put(&s, buf, 1000, &ref) != 0 || st.len != s.size || s.size != 3 * (BLOB_HEADER_SIZE + 1000))
+		failures++;
+	blob_store_free(&s);
+
+	// after a failed write nothing more goes in
+	st.len = 0;
+	st.fail_after = 3;
+	blob_store_init(&s, 1ULL << 40, stream_write, &st);
+	for (n = 0; n < 3; n++) {
+		memset(buf, n, 100);
+		if (blob_store_put(&s, buf, 100, &ref) != (n == 0 ? 1 : -1))
+			failures++;
+	}
+	if (!s.failed)
+		failures++;
+	blob_store_free(&s);
+
+	free(st.data);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
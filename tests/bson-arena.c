@@ -0,0 +1,139 @@
+// Builds a run of records shaped like loq()'s (the header fields, then an
+// args array of ints, pointers, strings and buffers, now and then a large
+// one) with bson_init/bson_destroy and with bson_init_arena/
+// bson_arena_release, checks the documents are byte-identical and compares
+// the allocations each needs and the time taken.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../bson/bson.h"
+
+static unsigned long mallocs, reallocs, frees;
+
+static void *counting_malloc(size_t size)
+{
+	mallocs++;
+	return malloc(size);
+}
+
+static void *counting_realloc(void *p, size_t size)
+{
+	reallocs++;
+	return realloc(p, size);
+}
+
+static void counting_free(void *p)
+{
+	frees++;
+	free(p);
+}
+
+#define RECORDS 200000
+
+static char big[300 * 1024];
+
+static void build(bson *b, unsigned int n)
+{
+	static const char *paths[] = {
+		"C:\\Windows\\System32\\kernel32.dll",
+		"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Winlogon",
+		"C:\\Users\\Admin\\AppData\\Local\\Temp\\a.tmp",
+	};
+	char key[4];
+	unsigned int i, args = 2 + n % 9;
+
+	bson_append_int(b, "I", 21 + n % 300);
+	bson_append_long(b, "C", 0x401000 + n);
+	bson_append_long(b, "R", 0x402000);
+	bson_append_long(b, "P", 0x403000);
+	bson_append_int(b, "T", 1234);
+	bson_append_int(b, "t", n);
+	bson_append_int(b, "r", 0);
+	bson_append_start_array(b, "args");
+	bson_append_int(b, "0", 1);
+	bson_append_long(b, "1", 0);
+	for (i = 0; i < args; i++) {
+		snprintf(key, sizeof(key), "%u", i + 2);
+		switch ((n + i) % 4) {
+		case 0:
+			bson_append_int(b, key, n * i);
+			break;
+		case 1:
+			bson_append_long(b, key, 0x7ff00000 + i);
+			break;
+		case 2:
+			bson_append_string(b, key, paths[(n + i) % 3]);
+			break;
+		default:
+			// buffers, and every so often a large one such as a dumped read
+			bson_append_binary(b, key, BSON_BIN_BINARY, big, n % 5000 == 0 ? sizeof(big) : n % 2 ? 256 : 2048);
+		}
+	}
+	bson_append_finish_array(b);
+	bson_finish(b);
+}
+
+int main()
+{
+	bson a, b;
+	bson_arena arena = { NULL, 4096, 64 * 1024, 0 };
+	unsigned int failures = 0, n;
+	unsigned long old_allocs, new_allocs;
+	unsigned long long old_sum = 0, new_sum = 0;
+	clock_t t0;
+	double t_old, t_new;
+
+	memset(big, 'b', sizeof(big));
+	bson_set_malloc_func(counting_malloc);
+	bson_set_realloc_func(counting_realloc);
+	bson_set_free_func(counting_free);
+
+	for (n = 0; n < 20000; n++) {
+		bson_init(&a);
+		build(&a, n);
+		bson_init_arena(&b, &arena);
+		build(&b, n);
+		if (bson_size(&a) != bson_size(&b) || memcmp(bson_data(&a), bson_data(&b), bson_size(&a))) {
+			if (failures++ < 5)
+				printf("  record %u differs\n", n);
+		}
+		bson_destroy(&a);
+		bson_arena_release(&b, &arena);
+	}
+	printf("20000 records identical with the arena, block now %d bytes, %d spilled past the limit\n", arena.size, arena.spills);
+	bson_arena_destroy(&arena);
+
+	mallocs = reallocs = frees = 0;
+	t0 = clock();
+	for (n = 0; n < RECORDS; n++) {
+		bson_init(&a);
+		build(&a, n);
+		old_sum += bson_size(&a);
+		bson_destroy(&a);
+	}
+	t_old = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	old_allocs = mallocs + reallocs;
+	printf("bson_init/bson_destroy:        %lu mallocs, %lu reallocs, %lu frees, %.0f ns/record\n",
+		mallocs, reallocs, frees, t_old * 1e9 / RECORDS);
+
+	mallocs = reallocs = frees = 0;
+	arena.spills = 0;
+	t0 = clock();
+	for (n = 0; n < RECORDS; n++) {
+		bson_init_arena(&b, &arena);
+		build(&b, n);
+		new_sum += bson_size(&b);
+		bson_arena_release(&b, &arena);
+	}
+	t_new = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	new_allocs = mallocs + reallocs;
+	printf("bson_init_arena/release:       %lu mallocs, %lu reallocs, %lu frees, %.0f ns/record (%d large records spilled)\n",
+		mallocs, reallocs, frees, t_new * 1e9 / RECORDS, arena.spills);
+	bson_arena_destroy(&arena);
+
+	if (old_sum != new_sum || new_allocs * 100 > old_allocs)
+		failures++;
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,187 @@
+// Checks the chunked dump writer behind DumpMemoryRaw against a synthetic
+// page source with unreadable pages: output, hash and entropy must match a
+// one-shot copy of the same bytes, faulting pages are zero-filled or
+// skipped, and peak memory stays at one staging buffer however large the
+// region is.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "../CAPE/DumpStream.h"
+
+#define PAGE DUMP_STREAM_PAGE
+
+typedef struct _source_t {
+	const unsigned char *data;
+	size_t phase;			// offset of data[0] within its page
+	const unsigned char *bad;	// one flag per page
+	unsigned int reads;
+} source_t;
+
+typedef struct _sink_t {
+	unsigned char *data;
+	size_t size, capacity;
+	int fail_after;			// fail the nth write, 0 for never
+	unsigned int writes;
+} sink_t;
+
+static int read_pages(void *context, size_t offset, unsigned char *out, size_t length)
+{
+	source_t *src = context;
+	size_t first = (src->phase + offset) / PAGE, last = (src->phase + offset + length - 1) / PAGE, p;
+
+	src->reads++;
+	for (p = first; p <= last; p++)
+		if (src->bad[p])
+			return 0;
+	memcpy(out, src->data + offset, length);
+	return 1;
+}
+
+static int write_sink(void *context, const unsigned char *data, size_t length)
+{
+	sink_t *sink = context;
+
+	if (sink->fail_after && ++sink->writes >= (unsigned int)sink->fail_after)
+		return 0;
+	if (sink->data) {
+		if (sink->size + length > sink->capacity)
+			return 0;
+		memcpy(sink->data + sink->size, data, length);
+	}
+	sink->size += length;
+	return 1;
+}
+
+static double entropy(const unsigned char *buf, size_t size)
+{
+	unsigned long counts[256] = {0};
+	double e = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		counts[buf[i]]++;
+	for (i = 0; i < 256; i++)
+		if (counts[i]) {
+			double p = (double)counts[i] / size;
+			e -= p * log(p) / log(2.0);
+		}
+	return e;
+}
+
+int main()
+{
+	size_t size = 0x123456, pages, phases[] = {0, 0x10, 0xff8}, i, n;
+	unsigned char *data = malloc(size), *expect = malloc(size), *bad, staging[DUMP_STREAM_BUFFER_SIZE];
+	unsigned int failures = 0, modes;
+	DUMP_STREAM_RESULT result;
+	clock_t t0;
+
+	srand(30);
+	for (i = 0; i < size; i++)
+		data[i] = i < size / 2 ? rand() & 0xff : (i & 0x3f);
+	pages = (phases[2] + size + PAGE - 1) / PAGE;
+	bad = calloc(pages, 1);
+
+	for (n = 0; n < 3; n++) {
+		size_t phase = phases[n];
+		for (modes = 0; modes < 2; modes++) {
+			DUMP_STREAM_FAULT fault = modes ? DUMP_STREAM_SKIP : DUMP_STREAM_ZERO_FILL;
+			source_t src = {data, phase, bad, 0};
+			sink_t sink = {calloc(size, 1), 0, size, 0, 0};
+			size_t p, expect_size = 0, faults = 0;
+
+			// a few scattered unreadable pages, including the first and last
+			memset(bad, 0, pages);
+			bad[0] = bad[7] = bad[8] = bad[100] = bad[pages - 1] = 1;
+
+			for (p = 0; p < size; ) {
+				size_t page = (phase + p) / PAGE, end = (page + 1) * PAGE - phase;
+				if (end > size)
+					end = size;
+				if (!bad[page]) {
+					memcpy(expect + expect_size, data + p, end - p);
+					expect_size += end - p;
+				}
+				else {
+					faults++;
+					if (fault == DUMP_STREAM_ZERO_FILL) {
+						memset(expect + expect_size, 0, end - p);
+						expect_size += end - p;
+					}
+				}
+				p = end;
+			}
+
+			if (!DumpStream(size, phase, fault, staging, sizeof(staging), read_pages, &src, write_sink, &sink, &result)) {
+				printf("  phase 0x%zx %s: failed\n", phase, modes ? "skip" : "zero-fill");
+				failures++;
+			}
+			else if (sink.size != expect_size || result.Written != expect_size || memcmp(sink.data, expect, expect_size)
+				|| result.FaultPages != faults || result.Hash != DumpStreamHash(expect, expect_size)
+				|| fabs(result.Entropy - entropy(expect, expect_size)) > 1e-9) {
+				printf("  phase 0x%zx %s: output differs\n", phase, modes ? "skip" : "zero-fill");
+				failures++;
+			}
+			else
+				printf("phase 0x%03zx %-9s: 0x%zx bytes, %zu faulting pages, entropy %.3f, %u reads: ok\n", phase, modes ? "skip" : "zero-fill", result.Written, result.FaultPages, result.Entropy, src.reads);
+			free(sink.data);
+		}
+	}
+
+	// the hash does not depend on how the output was chunked
+	if (DumpStreamHash(data, size) == DumpStreamHash(data, size - 1)) {
+		printf("  hash ignores length\n");
+		failures++;
+	}
+
+	// a failing writer fails the dump
+	{
+		source_t src = {data, 0, bad, 0};
+		sink_t sink = {NULL, 0, 0, 3, 0};
+		memset(bad, 0, pages);
+		if (DumpStream(size, 0, DUMP_STREAM_ZERO_FILL, staging, sizeof(staging), read_pages, &src, write_sink, &sink, &result)) {
+			printf("  write error not reported\n");
+			failures++;
+		}
+	}
+
+	// nothing readable at all
+	{
+		source_t src = {data, 0, bad, 0};
+		sink_t sink = {NULL, 0, 0, 0, 0};
+		memset(bad, 1, pages);
+		if (DumpStream(size, 0, DUMP_STREAM_ZERO_FILL, staging, sizeof(staging), read_pages, &src, write_sink, &sink, &result)) {
+			printf("  unreadable region reported as dumped\n");
+			failures++;
+		}
+	}
+
+	// throughput over a large region with a sink that discards, memory use
+	// stays at the staging buffer
+	{
+		size_t big = 64 << 20;
+		unsigned char *region = malloc(big), *flags = calloc(big / PAGE, 1);
+		source_t src = {region, 0, flags, 0};
+		sink_t sink = {NULL, 0, 0, 0, 0};
+		double t;
+
+		for (i = 0; i < big; i++)
+			region[i] = (unsigned char)(i * 2654435761u >> 13);
+		t0 = clock();
+		DumpStream(big, 0, DUMP_STREAM_ZERO_FILL, staging, sizeof(staging), read_pages, &src, write_sink, &sink, &result);
+		t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		printf("streamed 64MB: %.1f MB/s through a 0x%x byte buffer, hash 0x%016llx\n", 64 / t, DUMP_STREAM_BUFFER_SIZE, (unsigned long long)result.Hash);
+		if (result.Hash != DumpStreamHash(region, big))
+			failures++;
+		free(region);
+		free(flags);
+	}
+
+	free(data);
+	free(expect);
+	free(bad);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,382 @@
+// Maps PE files from disk the way the loader lays them out and checks the
+// export index against a plain walk of the export directory for every
+// name and ordinal (and for names that aren't there), follows forwarders
+// between modules, and compares the cost of resolving a hook set through
+// the index with the loader's binary search of the name table. Two DLLs,
+// one PE32 and one PE32+, are written out first so there is always
+// something to check, and the two fixture DLLs in export-index/, linked by
+// lld-link, are checked export by export; any further DLLs given on the
+// command line or found in a wine or Windows tree are checked too.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include "../export_index.h"
+
+static unsigned int rd16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+static unsigned int rd32(const unsigned char *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24); }
+static void wr16(unsigned char *p, unsigned int v) { p[0] = v; p[1] = v >> 8; }
+static void wr32(unsigned char *p, unsigned int v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+
+// the file's headers and sections copied to their rvas; NULL if it isn't a PE
+static unsigned char *map_image(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned char *file, *image = NULL;
+	unsigned int e_lfanew, nsec, i, sec, headers;
+	long len;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	file = malloc(len);
+	if (len < 0x200 || fread(file, 1, len, f) != (size_t)len || file[0] != 'M' || file[1] != 'Z')
+		goto out;
+	e_lfanew = rd32(file + 0x3c);
+	if (e_lfanew > (unsigned int)len - 0x108 || memcmp(file + e_lfanew, "PE\0\0", 4))
+		goto out;
+	*size = rd32(file + e_lfanew + 0x18 + 56);
+	headers = rd32(file + e_lfanew + 0x18 + 60);
+	if (*size > 0x10000000 || headers > *size || headers > (unsigned int)len)
+		goto out;
+	image = calloc(1, *size);
+	memcpy(image, file, headers);
+	nsec = rd16(file + e_lfanew + 6);
+	sec = e_lfanew + 0x18 + rd16(file + e_lfanew + 0x14);
+	for (i = 0; i < nsec && sec + 40 <= (unsigned int)len; i++, sec += 40) {
+		unsigned int va = rd32(file + sec + 12), raw = rd32(file + sec + 16), ptr = rd32(file + sec + 20);
+		if (raw > *size - va || va > *size)
+			raw = va > *size ? 0 : *size - va;
+		if (ptr > (unsigned int)len || raw > (unsigned int)len - ptr)
+			raw = ptr > (unsigned int)len ? 0 : (unsigned int)len - ptr;
+		memcpy(image + va, file + ptr, raw);
+	}
+out:
+	free(file);
+	fclose(f);
+	return image;
+}
+
+// the export directory walked name by name, as a reference
+static unsigned int walk_lookup(const unsigned char *base, size_t size, const char *name, int *forwarded)
+{
+	unsigned int e_lfanew = rd32(base + 0x3c), magic = rd16(base + e_lfanew + 0x18);
+	const unsigned char *dd = base + e_lfanew + 0x18 + (magic == 0x10b ? 0x60 : 0x70);
+	unsigned int dir_rva = rd32(dd), dir_size = rd32(dd + 4), i;
+	const unsigned char *dir = base + dir_rva;
+
+	for (i = 0; i < rd32(dir + 24); i++) {
+		unsigned int name_rva = rd32(base + rd32(dir + 32) + i * 4);
+		if (name_rva < size && !strncmp((const char *)base + name_rva, name, size - name_rva)) {
+			unsigned int slot = rd16(base + rd32(dir + 36) + i * 2);
+			unsigned int rva = slot < rd32(dir + 20) ? rd32(base + rd32(dir + 28) + slot * 4) : 0;
+			*forwarded = rva >= dir_rva && rva < dir_rva + dir_size;
+			return rva < size ? rva : 0;
+		}
+	}
+	return 0;
+}
+
+// the loader's binary search of the sorted name table
+static unsigned int bsearch_lookup(const export_index_t *x, const char *name)
+{
+	int lo = 0, hi = (int)x->nnames - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		int c = strcmp(name, (const char *)x->base + rd32(x->names + mid * 4));
+		if (c == 0)
+			return rd32(x->functions + rd16(x->ordinals + mid * 2) * 4);
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
+
+static void func_name(char *buf, size_t len, unsigned int i)
+{
+	snprintf(buf, len, i % 3 ? "Nt%sFunction%u" : "Rtl%sCall%u", i % 2 ? "Query" : "Set", i);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// writes a DLL exporting nfuncs functions, names for all but every tenth,
+// every seventh forwarded to the same function of target (by ordinal for
+// every 21st, and to a module that isn't loaded for the even ones of the
+// rest); sections sit at rvas other than their file offsets
+static void write_dll(const char *path, int pe32plus, unsigned int nfuncs, const char *target)
+{
+	static unsigned char file[0x100000];
+	static char names[20000][32];
+	static char *sorted[20000];
+	unsigned int e_lfanew = 0x80, opt = e_lfanew + 0x18, optsize = pe32plus ? 0xf0 : 0xe0;
+	unsigned int sec = opt + optsize, text_rva = 0x1000, text_raw = 0x400, edata_rva = 0x40000;
+	unsigned int edata_raw = 0x600, nnames = 0, i, p;
+	unsigned int functions, namestab, ordinals;
+	FILE *f;
+
+	memset(file, 0, sizeof(file));
+	file[0] = 'M';
+	file[1] = 'Z';
+	wr32(file + 0x3c, e_lfanew);
+	memcpy(file + e_lfanew, "PE\0\0", 4);
+	wr16(file + e_lfanew + 4, pe32plus ? 0x8664 : 0x14c);
+	wr16(file + e_lfanew + 6, 2);
+	wr16(file + e_lfanew + 0x14, optsize);
+	wr16(file + opt, pe32plus ? 0x20b : 0x10b);
+	wr32(file + opt + 56, 0x100000);			// SizeOfImage
+	wr32(file + opt + 60, 0x400);				// SizeOfHeaders
+	wr32(file + opt + (pe32plus ? 108 : 92), 16);
+
+	memcpy(file + sec, ".text", 5);
+	wr32(file + sec + 8, 0x200);
+	wr32(file + sec + 12, text_rva);
+	wr32(file + sec + 16, 0x200);
+	wr32(file + sec + 20, text_raw);
+	memcpy(file + sec + 40, ".edata", 6);
+	wr32(file + sec + 40 + 12, edata_rva);
+	wr32(file + sec + 40 + 20, edata_raw);
+
+	for (i = 0; i < nfuncs; i++) {
+		if (i % 10 == 9)
+			continue;
+		func_name(names[nnames], sizeof(names[0]), i);
+		sorted[nnames] = names[nnames];
+		nnames++;
+	}
+	qsort(sorted, nnames, sizeof(char *), compare_names);
+
+	// directory, then the three tables, then the strings
+	p = edata_raw + 40;
+	functions = p;
+	p += nfuncs * 4;
+	namestab = p;
+	p += nnames * 4;
+	ordinals = p;
+	p += nnames * 2;
+#define RVA(off) ((off) - edata_raw + edata_rva)
+	strcpy((char *)file + p, path);
+	wr32(file + edata_raw + 12, RVA(p));
+	p += (unsigned int)strlen(path) + 1;
+	wr32(file + edata_raw + 16, 5);			// ordinal base
+	wr32(file + edata_raw + 20, nfuncs);
+	wr32(file + edata_raw + 24, nnames);
+	wr32(file + edata_raw + 28, RVA(functions));
+	wr32(file + edata_raw + 32, RVA(namestab));
+	wr32(file + edata_raw + 36, RVA(ordinals));
+
+	for (i = 0; i < nfuncs; i++) {
+		if (target && i % 7 == 3) {
+			char fn[32];
+			func_name(fn, sizeof(fn), i);
+			wr32(file + functions + i * 4, RVA(p));
+			if (i % 21 == 3)
+				p += sprintf((char *)file + p, "%s.#%u", target, 5 + i) + 1;
+			else
+				p += sprintf((char *)file + p, "%s.%s", i % 2 ? target : "MISSING", fn) + 1;
+		}
+		else
+			wr32(file + functions + i * 4, text_rva + i * 16);
+	}
+	for (i = 0; i < nnames; i++) {
+		unsigned int fn = (unsigned int)strtoul(strpbrk(sorted[i], "0123456789"), NULL, 10);
+		wr32(file + namestab + i * 4, RVA(p));
+		p += sprintf((char *)file + p, "%s", sorted[i]) + 1;
+		wr16(file + ordinals + i * 2, fn);
+	}
+	wr32(file + opt + (pe32plus ? 112 : 96), edata_rva);
+	wr32(file + opt + (pe32plus ? 116 : 100), RVA(p) - edata_rva);
+	wr32(file + sec + 40 + 8, p - edata_raw);
+	wr32(file + sec + 40 + 16, p - edata_raw);
+#undef RVA
+
+	f = fopen(path, "wb");
+	fwrite(file, 1, p, f);
+	fclose(f);
+}
+
+static unsigned int check_module(const char *path, export_index_t *x, unsigned int *checked)
+{
+	size_t size;
+	unsigned char *image = map_image(path, &size);
+	unsigned int i, failures = 0;
+	char missing[64];
+
+	if (image == NULL || !export_index_build(x, image, size)) {
+		free(image);
+		return 0;
+	}
+	for (i = 0; i < x->nnames; i++) {
+		unsigned int name_rva = rd32(x->names + i * 4);
+		const char *name;
+		int fwd_a = 0, fwd_b = 0;
+		if (name_rva >= size)
+			continue;
+		name = (const char *)image + name_rva;
+		if (export_index_lookup(x, name, &fwd_a) != walk_lookup(image, size, name, &fwd_b) || fwd_a != fwd_b) {
+			if (failures++ < 5)
+				printf("  %s: %s differs\n", path, name);
+		}
+		snprintf(missing, sizeof(missing), "%.40sX", name);
+		if (export_index_lookup(x, missing, &fwd_a) != walk_lookup(image, size, missing, &fwd_b))
+			failures++;
+		(*checked)++;
+	}
+	for (i = 0; i < x->nfunctions; i++) {
+		int fwd;
+		unsigned int rva = rd32(x->functions + i * 4);
+		if (export_index_lookup_ordinal(x, x->ordinal_base + i, &fwd) != (rva < size ? rva : 0))
+			failures++;
+	}
+	if (export_index_lookup_ordinal(x, x->ordinal_base + x->nfunctions, NULL) != 0)
+		failures++;
+	return failures;
+}
+
+static export_index_t other;
+
+static const export_index_t *find_module(void *ctx, const char *module, size_t len)
+{
+	(void)ctx;
+	return len == 5 && !strncmp(module, "OTHER", 5) ? &other : NULL;
+}
+
+static const export_index_t *find_fixture(void *ctx, const char *module, size_t len)
+{
+	return len == 7 && !strncmp(module, "fixture", 7) ? (const export_index_t *)ctx : NULL;
+}
+
+// the fixture's exports as export-index/fixture.def lays them out, and its
+// code and data where the linker put them
+static unsigned int check_fixture(const char *path, const unsigned char *add_code, unsigned int *checked)
+{
+	export_index_t x;
+	unsigned int failures, add, sub, counter, hidden;
+	int forwarded, unresolved;
+
+	memset(&x, 0, sizeof(x));
+	failures = check_module(path, &x, checked);
+	if (x.slots == NULL) {
+		printf("  %s: not indexed\n", path);
+		return failures + 1;
+	}
+	add = export_index_lookup(&x, "FixtureAdd", &forwarded);
+	sub = export_index_lookup(&x, "FixtureSub", NULL);
+	counter = export_index_lookup(&x, "FixtureCounter", NULL);
+	hidden = export_index_lookup_ordinal(&x, 9, NULL);
+	if (x.ordinal_base != 7 || x.nfunctions != 9 || x.nnames != 7)
+		failures++;
+	if (!add || forwarded || memcmp(x.base + add, add_code, 4) || export_index_lookup(&x, "FixtureAlias", NULL) != add)
+		failures++;
+	if (!sub || export_index_lookup_ordinal(&x, 7, NULL) != sub || export_index_lookup_ordinal(&x, 8, NULL) != 0)
+		failures++;
+	// the one without a name is only there by ordinal
+	if (!hidden || hidden == add || hidden == sub || export_index_lookup(&x, "FixtureHidden", NULL) != 0)
+		failures++;
+	if (!counter || rd32(x.base + counter) != 42)
+		failures++;
+	if (export_index_resolve(&x, "ForwardByName", find_fixture, &x, &unresolved) != x.base + sub || unresolved ||
+		export_index_resolve(&x, "ForwardByOrdinal", find_fixture, &x, &unresolved) != x.base + sub || unresolved)
+		failures++;
+	if (export_index_resolve(&x, "ForwardMissing", find_fixture, &x, &unresolved) != NULL || !unresolved)
+		failures++;
+	export_index_free(&x);
+	free((void *)x.base);
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *patterns[] = {
+		"/usr/lib/wine/*/*.dll", "/usr/lib/x86_64-linux-gnu/wine/*/*.dll", "/usr/lib/i386-linux-gnu/wine/*/*.dll",
+		"/mnt/c/Windows/System32/*.dll",
+	};
+	export_index_t synth, x;
+	unsigned int failures = 0, checked = 0, files = 0, i, n, resolved = 0, unresolved_count = 0;
+	unsigned long long sum_index = 0, sum_bsearch = 0;
+	static char hookset[1000][32];
+	char name[32];
+	clock_t t0;
+	double t_index, t_bsearch;
+	glob_t g;
+
+	write_dll("export-index-other.dll", 0, 2000, NULL);
+	write_dll("export-index-synth.dll", 1, 3000, "OTHER");
+	failures += check_module("export-index-other.dll", &other, &checked);
+	failures += check_module("export-index-synth.dll", &synth, &checked);
+	if (other.nnames != 1800 || synth.nnames != 2700)
+		failures++;
+	// lea eax, [rcx+rdx] and mov eax, [esp+4]
+	failures += check_fixture("export-index/fixture64.dll", (const unsigned char *)"\x8d\x04\x11\xc3", &checked);
+	failures += check_fixture("export-index/fixture32.dll", (const unsigned char *)"\x8b\x44\x24\x04", &checked);
+
+	for (i = 1; i < (unsigned int)argc; i++, files++) {
+		failures += check_module(argv[i], &x, &checked);
+		export_index_free(&x);
+	}
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		if (glob(patterns[i], 0, NULL, &g) == 0) {
+			for (n = 0; n < g.gl_pathc && files < 400; n++, files++) {
+				failures += check_module(g.gl_pathv[n], &x, &checked);
+				export_index_free(&x);
+			}
+			globfree(&g);
+		}
+	}
+	printf("%u names checked against the directory walk in %u files\n", checked, files + 4);
+
+	// forwarders into the other module, by name and by ordinal, which has
+	// the first 2000 functions, and to a module that isn't there
+	for (i = 0; i < 3000; i++) {
+		int forwarded, unresolved, in_other = i < 2000 && (i % 21 == 3 || i % 10 != 9);
+		const void *addr, *want = synth.base + 0x1000 + i * 16;
+		if (i % 10 == 9)
+			continue;
+		func_name(name, sizeof(name), i);
+		export_index_lookup(&synth, name, &forwarded);
+		addr = export_index_resolve(&synth, name, find_module, NULL, &unresolved);
+		if (forwarded && (i % 21 == 3 || i % 2))
+			want = in_other ? other.base + 0x1000 + i * 16 : NULL;
+		if (forwarded != (i % 7 == 3) || addr != (forwarded && i % 21 != 3 && i % 2 == 0 ? NULL : want) ||
+			unresolved != (forwarded && i % 21 != 3 && i % 2 == 0))
+			failures++;
+		resolved += addr != NULL;
+		unresolved_count += unresolved;
+	}
+	printf("%u resolved through the index, %u forwarders left to the loader\n", resolved, unresolved_count);
+
+	// a hook set's worth of lookups, a third of them for functions the
+	// module doesn't have
+	for (i = 0; i < 1000; i++)
+		func_name(hookset[i], sizeof(hookset[i]), i * 3);
+	t0 = clock();
+	for (n = 0; n < 300; n++)
+		for (i = 0; i < 1000; i++)
+			sum_index += export_index_lookup(&synth, hookset[i], NULL);
+	t_index = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	t0 = clock();
+	for (n = 0; n < 300; n++)
+		for (i = 0; i < 1000; i++)
+			sum_bsearch += bsearch_lookup(&synth, hookset[i]);
+	t_bsearch = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	if (sum_index != sum_bsearch)
+		failures++;
+	printf("binary search: %.0f ns/lookup, index: %.0f ns/lookup\n", t_bsearch * 1e9 / 300000, t_index * 1e9 / 300000);
+
+	export_index_free(&synth);
+	export_index_free(&other);
+	free((void *)synth.base);
+	free((void *)other.base);
+	remove("export-index-other.dll");
+	remove("export-index-synth.dll");
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,21 @@
+# the x86 export index fixture, see fixture.def
+	.text
+	.globl _FixtureAdd
+_FixtureAdd:
+	movl 4(%esp), %eax
+	addl 8(%esp), %eax
+	ret
+	.globl _FixtureSub
+_FixtureSub:
+	movl 4(%esp), %eax
+	subl 8(%esp), %eax
+	ret
+	.globl _FixtureHidden
+_FixtureHidden:
+	xorl %eax, %eax
+	ret
+
+	.data
+	.globl _FixtureCounter
+_FixtureCounter:
+	.long 42
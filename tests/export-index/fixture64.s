@@ -0,0 +1,20 @@
+# the x64 export index fixture, see fixture.def
+	.text
+	.globl FixtureAdd
+FixtureAdd:
+	leal (%rcx,%rdx), %eax
+	ret
+	.globl FixtureSub
+FixtureSub:
+	movl %ecx, %eax
+	subl %edx, %eax
+	ret
+	.globl FixtureHidden
+FixtureHidden:
+	xorl %eax, %eax
+	ret
+
+	.data
+	.globl FixtureCounter
+FixtureCounter:
+	.long 42
@@ -0,0 +1,167 @@
+// Walks synthetic frame pointer chains on a fake stack the way the x86
+// operate_on_backtrace() does: well formed ones of various depths, then
+// chains that loop back on themselves, point into the middle of a frame
+// or off the stack, are misaligned or start below the stack pointer.
+// Well formed chains must give the same return addresses as the walk
+// hooking_32.c used to do; broken ones must end at the first bad frame
+// instead of being followed to the depth limit. Then times the two.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../frame_walk.h"
+
+#define DEPTH 80			// HOOK_BACKTRACE_DEPTH
+#define STACK_WORDS 16384
+
+static size_t stack[STACK_WORDS];
+static size_t low, high;		// the thread's stack limits
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("  " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+// hooking_32.c's walk as it was, with the callback storing the addresses
+static unsigned int old_walk(size_t _esp, size_t _ebp, size_t *out)
+{
+	unsigned int count = DEPTH, n = 0;
+
+	if (_esp >= low && _esp <= high - sizeof(size_t))
+		out[n++] = *(size_t *)_esp;
+	while (_ebp >= low && _ebp <= high - 2 * sizeof(size_t) && count-- != 0) {
+		size_t addr = *(size_t *)(_ebp + sizeof(size_t));
+		_ebp = *(size_t *)_ebp;
+		out[n++] = addr;
+	}
+	return n;
+}
+
+// frames of random sizes upwards from word sp, the last one's saved frame
+// pointer 0 as a thread's first frame has; returns the first frame
+static size_t build_chain(unsigned int sp, unsigned int frames, size_t *fps)
+{
+	unsigned int w = sp + 2 + rand() % 8, i;
+
+	stack[sp] = 0x401000 + rand() % 0x1000;
+	for (i = 0; i < frames; i++) {
+		unsigned int next = w + 2 + rand() % 24;
+		fps[i] = (size_t)&stack[w];
+		stack[w] = i + 1 < frames ? (size_t)&stack[next] : 0;
+		stack[w + 1] = 0x70000000 + (size_t)rand() * 16;
+		w = next;
+	}
+	return fps[0];
+}
+
+static size_t walk(size_t sp, size_t fp, size_t *out)
+{
+	return frame_walk(sp, fp, low, high, out, DEPTH + 1);
+}
+
+int main()
+{
+	size_t fps[400], want[400], got[400];
+	size_t sp = (size_t)&stack[100];
+	unsigned int depth, n, m, i, shorter = 0;
+	size_t fp;
+
+	low = (size_t)&stack[0];
+	high = (size_t)&stack[STACK_WORDS];
+	srand(49);
+
+	// well formed chains, shallower and deeper than the limit
+	for (depth = 1; depth <= 300; depth += depth < 20 ? 1 : 17) {
+		fp = build_chain(100, depth, fps);
+		n = old_walk(sp, fp, want);
+		m = walk(sp, fp, got);
+		CHECK(n == m && !memcmp(want, got, n * sizeof(size_t)), "depth %u: %u frames, the old walk %u", depth, m, n);
+		CHECK(m == (depth < DEPTH ? depth + 1 : DEPTH + 1), "depth %u: %u frames", depth, m);
+	}
+	printf("well formed chains of 1 to 300 frames: same return addresses as before\n");
+
+	// a frame pointing back at itself, then at an earlier frame
+	fp = build_chain(100, 10, fps);
+	stack[(fps[4] - low) / sizeof(size_t)] = fps[4];
+	n = old_walk(sp, fp, want);
+	m = walk(sp, fp, got);
+	CHECK(m == 6 && !memcmp(got, want, m * sizeof(size_t)), "self loop: %u frames", m);
+	printf("frame pointing at itself: the old walk reports %u frames, now %u\n", n, m);
+
+	fp = build_chain(100, 10, fps);
+	stack[(fps[7] - low) / sizeof(size_t)] = fps[2];
+	n = old_walk(sp, fp, want);
+	m = walk(sp, fp, got);
+	CHECK(m == 9 && !memcmp(got, want, m * sizeof(size_t)), "loop to an earlier frame: %u frames", m);
+	printf("frame pointing back three frames: the old walk reports %u frames, now %u\n", n, m);
+
+	// into the middle of the frame before: overlapping, so not a caller
+	fp = build_chain(100, 10, fps);
+	stack[(fps[5] - low) / sizeof(size_t)] = fps[5] + sizeof(size_t);
+	m = walk(sp, fp, got);
+	CHECK(m == 7, "overlapping frame: %u frames", m);
+
+	// off either end of the stack, and at its very top
+	fp = build_chain(100, 10, fps);
+	stack[(fps[3] - low) / sizeof(size_t)] = high + 0x1000;
+	CHECK(walk(sp, fp, got) == 5, "frame above the stack");
+	stack[(fps[3] - low) / sizeof(size_t)] = 0x10000;
+	CHECK(walk(sp, fp, got) == 5, "frame below the stack");
+	stack[(fps[3] - low) / sizeof(size_t)] = high - sizeof(size_t);
+	CHECK(walk(sp, fp, got) == 5, "frame straddling the top of the stack");
+	stack[(fps[3] - low) / sizeof(size_t)] = high - 2 * sizeof(size_t);
+	stack[STACK_WORDS - 2] = 0;
+	CHECK(walk(sp, fp, got) == 6, "frame right at the top of the stack");
+
+	// misaligned
+	stack[(fps[3] - low) / sizeof(size_t)] = fps[4] + 1;
+	CHECK(walk(sp, fp, got) == 5, "misaligned frame");
+
+	// a frame pointer below the stack pointer isn't one of our callers'
+	CHECK(walk(sp, (size_t)&stack[50], got) == 1, "frame below the stack pointer");
+	// nor is a null one, but the return address at sp still counts
+	CHECK(walk(sp, 0, got) == 1 && got[0] == stack[100], "no frame pointer");
+	// a stack pointer off the stack leaves just the chain
+	fp = build_chain(100, 10, fps);
+	CHECK(walk(0x10000, fp, got) == 10 && got[0] == stack[(fps[0] - low) / sizeof(size_t) + 1], "stack pointer off the stack");
+	// and limits that make no sense give nothing
+	CHECK(frame_walk(sp, fp, high, low, got, DEPTH + 1) == 0, "inverted stack limits");
+	CHECK(frame_walk(sp, fp, low, high, got, 3) == 3, "walk past max");
+
+	// random corruption: whatever the walk reports is the start of what the
+	// old one did, cut short where the chain goes bad
+	for (i = 0; i < 20000; i++) {
+		unsigned int k, bad;
+		fp = build_chain(100, 5 + rand() % 60, fps);
+		for (k = 0; k < 3; k++) {
+			bad = 100 + rand() % 1500;
+			stack[bad] = rand() % 4 ? (size_t)&stack[100 + rand() % 1500] + (rand() % 2 ? 0 : rand() % 8) : (size_t)rand();
+		}
+		n = old_walk(sp, fp, want);
+		m = walk(sp, fp, got);
+		CHECK(m <= n && !memcmp(got, want, m * sizeof(size_t)), "corrupted chain %u: %u frames, the old walk %u", i, m, n);
+		shorter += m < n;
+	}
+	printf("20000 randomly corrupted chains: the walk a prefix of the old one, %u cut short\n", shorter);
+
+	{
+		clock_t t0;
+		double t_old, t_new;
+		unsigned long sum_old = 0, sum_new = 0;
+		unsigned int rounds = 200000;
+
+		fp = build_chain(100, 10, fps);
+		stack[(fps[9] - low) / sizeof(size_t)] = fps[9];	// a loop at the end
+		t0 = clock();
+		for (i = 0; i < rounds; i++)
+			sum_old += old_walk(sp, fp, want);
+		t_old = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		t0 = clock();
+		for (i = 0; i < rounds; i++)
+			sum_new += walk(sp, fp, got);
+		t_new = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		printf("10 frames ending in a loop: the old walk %.0f ns and %lu frames, now %.0f ns and %lu frames\n",
+			t_old * 1e9 / rounds, sum_old / rounds, t_new * 1e9 / rounds, sum_new / rounds);
+	}
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,185 @@
+// Builds the hook index over the libraries of full_hooks[] (pulled out of
+// the HOOK* entries in ../hooks.c), then replays a simulated load sequence
+// of 300 DLLs, in whatever case the loader reports them, checking that
+// each load visits exactly the hooks the wcsicmp scan of the whole table
+// finds, in table order, including after hooks have been moved to a
+// renamed DLL. Benchmarks the two over the sequence.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "../hook_index.h"
+
+#define MAX_HOOKS 4096
+#define NAME_MAX_UNITS 64
+
+static unsigned short libs[MAX_HOOKS][NAME_MAX_UNITS];
+static const unsigned short *libptrs[MAX_HOOKS];
+static unsigned int nhooks;
+
+static void widen(unsigned short *out, const char *s)
+{
+	while ((*out++ = (unsigned char)*s++));
+}
+
+// the library of each HOOK*(library, function...) in full_hooks[]
+static void collect(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *src, *p, *end;
+	long size;
+
+	if (!f)
+		return;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	src = calloc(size + 1, 1);
+	if (fread(src, 1, size, f) != (size_t)size)
+		size = 0;
+	fclose(f);
+
+	p = strstr(src, "hook_t full_hooks[] = {");
+	end = p ? strstr(p, "\n};") : NULL;
+	for (; p && p < end && (p = strstr(p, "\tHOOK")) != NULL && p < end && nhooks < MAX_HOOKS; p++) {
+		char lib[NAME_MAX_UNITS];
+		char *q = strchr(p, '('), *c = q ? strchr(q, ',') : NULL;
+		if (!q || !c || c - q - 1 >= NAME_MAX_UNITS || c - q < 2)
+			continue;
+		memcpy(lib, q + 1, c - q - 1);
+		lib[c - q - 1] = 0;
+		widen(libs[nhooks], lib);
+		libptrs[nhooks] = libs[nhooks];
+		nhooks++;
+	}
+	free(src);
+}
+
+static int wcsicmp16(const unsigned short *a, const unsigned short *b)
+{
+	while (*a && tolower(*a) == tolower(*b)) {
+		a++;
+		b++;
+	}
+	return tolower(*a) - tolower(*b);
+}
+
+#define LOADS 300
+
+static unsigned short loads[LOADS][NAME_MAX_UNITS];
+
+// a .NET/Office/browser-like sequence: the hooked system DLLs in the
+// loader's mixed case, and many more DLLs that have no hooks at all
+static void make_loads(void)
+{
+	static const char *unhooked[] = { "mscorlib.ni", "clrjit", "System.ni", "mso20win32client", "chrome_elf",
+		"d3d11", "dxgi", "uxtheme", "dwmapi", "propsys", "windows.storage", "msvcp140", "vcruntime140", "ucrtbase" };
+	unsigned int i, j;
+
+	for (i = 0; i < LOADS; i++) {
+		char name[NAME_MAX_UNITS];
+		if (i % 3 == 0) {
+			const unsigned short *lib = libptrs[rand() % nhooks];
+			for (j = 0; lib[j]; j++)
+				name[j] = (char)(rand() % 2 ? toupper(lib[j]) : lib[j]);
+			name[j] = 0;
+		}
+		else
+			snprintf(name, sizeof(name), "%s%s", unhooked[rand() % 14], i % 5 ? "" : "_1");
+		widen(loads[i], name);
+	}
+}
+
+static unsigned int check_load(const hook_index_t *x, const unsigned short *name)
+{
+	unsigned int i, h = hook_index_first(x, name);
+
+	for (i = 0; i < nhooks; i++) {
+		if (wcsicmp16(libptrs[i], name))
+			continue;
+		if (h != i)
+			return 1;
+		h = hook_index_next(x, h);
+	}
+	return h != HOOK_INDEX_END;
+}
+
+int main()
+{
+	hook_index_t x;
+	unsigned int failures = 0, i, n, rounds = 200, visited_scan = 0, visited_index = 0;
+	unsigned short renamed[NAME_MAX_UNITS], original[NAME_MAX_UNITS];
+	clock_t t0;
+	double t_scan, t_index;
+
+	collect("../hooks.c");
+	if (nhooks < 300) {
+		printf("only %u hooks found\n", nhooks);
+		return 1;
+	}
+	// an entry given by address only
+	libptrs[nhooks++] = NULL;
+	srand(43);
+	make_loads();
+
+	if (!hook_index_build(&x, libptrs, nhooks))
+		return 1;
+	printf("%u hooks over %u libraries\n", nhooks, x.ngroups);
+	libptrs[--nhooks] = NULL;
+
+	for (i = 0; i < LOADS; i++)
+		failures += check_load(&x, loads[i]);
+
+	// a copy of kernel32 under another name is recognised by its export
+	// directory name and its hooks move to the new name, in the same order
+	widen(original, "kernel32");
+	widen(renamed, "Evil_Copy");
+	for (i = hook_index_first(&x, original), n = 0; i != HOOK_INDEX_END; n++) {
+		unsigned int next = hook_index_next(&x, i);
+		if (!hook_index_move(&x, i, renamed))
+			failures++;
+		libptrs[i] = renamed;
+		i = next;
+	}
+	widen(renamed, "EVIL_copy");
+	if (n == 0 || hook_index_first(&x, original) != HOOK_INDEX_END || check_load(&x, renamed))
+		failures++;
+	// and back again, under a third case
+	widen(original, "Kernel32");
+	for (i = hook_index_first(&x, renamed); i != HOOK_INDEX_END; ) {
+		unsigned int next = hook_index_next(&x, i);
+		hook_index_move(&x, i, original);
+		libptrs[i] = libs[i];
+		i = next;
+	}
+	for (i = 0; i < LOADS; i++)
+		failures += check_load(&x, loads[i]);
+	printf("%u loads, %u kernel32 hooks moved to a renamed copy and back: same hooks as the table scan\n", LOADS, n);
+
+	t0 = clock();
+	for (n = 0; n < rounds; n++)
+		for (i = 0; i < LOADS; i++) {
+			unsigned int j;
+			for (j = 0; j < nhooks; j++)
+				if (!wcsicmp16(libptrs[j], loads[i]))
+					visited_scan += j;
+		}
+	t_scan = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	t0 = clock();
+	for (n = 0; n < rounds; n++)
+		for (i = 0; i < LOADS; i++) {
+			unsigned int j;
+			for (j = hook_index_first(&x, loads[i]); j != HOOK_INDEX_END; j = hook_index_next(&x, j))
+				visited_index += j;
+		}
+	t_index = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	if (visited_scan != visited_index)
+		failures++;
+	printf("table scan: %.1f us/load, index: %.2f us/load (%.0fx)\n",
+		t_scan * 1e6 / rounds / LOADS, t_index * 1e6 / rounds / LOADS, t_scan / t_index);
+
+	hook_index_free(&x);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
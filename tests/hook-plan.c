@@ -0,0 +1,171 @@
+// Plans the patching of hook sets over synthetic module images (sections
+// of different protections, exports packed into the code pages, hotpatch
+// prologues writing before the function, functions reached through two
+// hook entries, patches straddling a page boundary) and applies each plan
+// to a simulated address space: every write must land in a page made
+// writable by its run, every function must be patched exactly once by its
+// first entry, and each run changes protection once. Reports the
+// protection changes saved against patching hook by hook.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hook_plan.h"
+
+#define PAGE 4096
+#define MODULES 12
+#define PAGES_PER_MODULE 256
+#define SPACE (MODULES * PAGES_PER_MODULE)
+#define HOOKS 1100
+
+// per page: 1 for code, 0 for data; a section boundary between code and
+// data pages must never be covered by one run
+static unsigned char code_page[SPACE];
+static unsigned char writable[SPACE];
+
+static hook_patch_t patches[HOOKS];
+static hook_page_run_t runs[HOOKS];
+static size_t func[HOOKS];
+
+static void make_modules(void)
+{
+	unsigned int m, p;
+
+	for (m = 0; m < MODULES; m++)
+		for (p = 0; p < PAGES_PER_MODULE; p++)
+			// header page, code, then data sections with a code section between
+			code_page[m * PAGES_PER_MODULE + p] = p > 0 && (p < 160 || (p >= 200 && p < 220));
+}
+
+// hooked functions cluster: the native API stubs are packed 32 bytes apart
+// in one module, and the rest sit in a few hot pages of each module
+static size_t random_function(void)
+{
+	for (;;) {
+		size_t page, addr;
+		if (rand() % 5 < 2) {
+			addr = PAGE + (rand() % (16 * PAGE / 32)) * 32;
+			return addr;
+		}
+		page = (rand() % MODULES) * PAGES_PER_MODULE + 8 + (rand() % 24) * 6;
+		addr = page * PAGE + (rand() % (PAGE / 16)) * 16;
+		// the patch may run over into the next page, but only if it is code
+		if (code_page[page] && (addr % PAGE < PAGE - 16 || code_page[page + 1]))
+			return addr;
+	}
+}
+
+static unsigned int plan_and_apply(unsigned int seed, unsigned int *nruns_out)
+{
+	unsigned int i, j, n, nruns, failures = 0;
+	size_t kept_end = 0;
+
+	srand(seed);
+	for (i = 0; i < HOOKS; i++) {
+		patches[i].id = i;
+		// one in ten is a second entry for a function already in the set
+		if (i > 0 && rand() % 10 == 0) {
+			j = rand() % i;
+			func[i] = func[j];
+			patches[i].start = patches[j].start;
+			patches[i].len = patches[j].len;
+			continue;
+		}
+		func[i] = random_function();
+		// jmp direct, hotpatch (into the padding before the function), indirect
+		switch (rand() % 3) {
+		case 0:
+		direct:
+			patches[i].start = func[i];
+			patches[i].len = 5;
+			break;
+		case 1:
+			if (func[i] % PAGE == 0 && !code_page[func[i] / PAGE - 1])
+				goto direct;
+			patches[i].start = func[i] - 5;
+			patches[i].len = 7;
+			break;
+		default:
+			patches[i].start = func[i];
+			patches[i].len = 14;
+		}
+	}
+
+	nruns = hook_plan(patches, HOOKS, PAGE, runs);
+	*nruns_out = nruns;
+
+	for (i = 0, n = 0; i < nruns; i++) {
+		hook_page_run_t *r = &runs[i];
+		size_t p;
+
+		if (r->base % PAGE || r->size % PAGE || !r->size || r->first != n)
+			failures++;
+		if (i > 0 && r->base < runs[i - 1].base + runs[i - 1].size)
+			failures++;
+		// one protection change, over code pages only
+		for (p = r->base / PAGE; p < (r->base + r->size) / PAGE; p++) {
+			if (!code_page[p] || writable[p])
+				failures++;
+			writable[p] = 1;
+		}
+		for (j = r->first; j < r->first + r->count; j++, n++) {
+			hook_patch_t *h = &patches[j];
+			size_t b;
+			if (h->skip)
+				continue;
+			// kept patches come in address order and never overlap
+			if (h->start < kept_end)
+				failures++;
+			kept_end = h->start + h->len;
+			for (b = h->start; b < h->start + h->len; b++)
+				if (!writable[b / PAGE])
+					failures++;
+		}
+		for (p = r->base / PAGE; p < (r->base + r->size) / PAGE; p++)
+			writable[p] = 0;
+	}
+	if (n != HOOKS)
+		failures++;
+
+	// every skipped entry overlaps a patch that was kept, and a function
+	// reached through two entries is patched by the first
+	for (i = 0; i < HOOKS; i++) {
+		hook_patch_t *h = &patches[i];
+		int found = 0;
+		for (j = 0; j < HOOKS; j++) {
+			hook_patch_t *k = &patches[j];
+			if (j == i || k->skip || k->start >= h->start + h->len || h->start >= k->start + k->len)
+				continue;
+			found = 1;
+			if (!h->skip || (k->start == h->start && k->id > h->id))
+				failures++;
+		}
+		if (h->skip && !found)
+			failures++;
+	}
+	return failures;
+}
+
+int main()
+{
+	unsigned int failures = 0, seed, nruns, total_runs = 0, skipped = 0, i;
+	hook_patch_t one = { 0x1000 * 5 + PAGE - 2, 5, 0, 0 };
+
+	make_modules();
+	for (seed = 1; seed <= 50; seed++) {
+		failures += plan_and_apply(seed, &nruns);
+		total_runs += nruns;
+		for (i = 0; i < HOOKS; i++)
+			skipped += patches[i].skip;
+	}
+	printf("50 hook sets of %u over %u modules: %u protection changes on average for %u patches (%.1f%%), %u duplicate entries skipped\n",
+		HOOKS, MODULES, total_runs / 50, HOOKS - skipped / 50, 100.0 * total_runs / (HOOKS * 50 - skipped), skipped / 50);
+
+	// a patch straddling two pages makes them one run
+	if (hook_plan(&one, 1, PAGE, runs) != 1 || runs[0].base != 0x5000 || runs[0].size != 2 * PAGE)
+		failures++;
+	if (hook_plan(patches, 0, PAGE, runs) != 0)
+		failures++;
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,217 @@
+// Builds a plan as install_hooks() records one, though over a whole hook
+// table and the libraries it hooks rather than only the scanned-for few,
+// and reads it back as a child does: every entry found with its module,
+// offset and witness, none for hooks left out. Then checks the plan is refused for another pointer size or
+// hook table, and when cut short, with any byte changed, or (checksum and
+// all) with counts, names, indexes, offsets or order out of range. Then
+// times validating a plan and looking up every hook in it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../hook_share.h"
+
+#define HOOKS 600
+#define LIBS 12
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("  " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+static const char *lib_names[LIBS] = {
+	"ntdll", "kernel32", "KernelBase", "advapi32", "user32", "ws2_32",
+	"wininet", "ole32", "oleaut32", "crypt32", "ADVPACK", "jscript"
+};
+static unsigned short libs[LIBS][HOOK_SHARE_NAME_LEN];
+
+static hook_share_module_t modules[HOOK_SHARE_MAX_MODULES];
+static unsigned int module_count;
+static hook_share_entry_t entries[HOOKS];
+static unsigned int entry_count;
+static volatile unsigned int g_sink;
+
+static void to_units(unsigned short *dst, const char *src)
+{
+	while ((*dst++ = (unsigned char)*src++) != 0);
+}
+
+// what install_hooks() records: hooks skipped now and then, everything
+// else an offset into its library and the code before it
+static void record(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LIBS; i++)
+		to_units(libs[i], lib_names[i]);
+	for (i = 0; i < HOOKS; i++) {
+		unsigned int lib = i * LIBS / HOOKS, size = 0x100000 + lib * 0x30000;
+		int module;
+		if (i % 13 == 5)
+			continue;
+		module = hook_share_add_module(modules, &module_count, libs[lib], 0x5f000000 + lib, size);
+		CHECK(module == (int)lib, "hook %u: module %d, expected %u", i, module, lib);
+		entries[entry_count].hook = i;
+		entries[entry_count].module = (unsigned short)module;
+		entries[entry_count].flags = 0;
+		entries[entry_count].rva = 0x1000 + (i * 0x2c3) % (size - 0x1000);
+		entries[entry_count].witness = entries[entry_count].rva - 0x40 * (i % 7);
+		entry_count++;
+	}
+}
+
+static void check_round_trip(void *buf, size_t size)
+{
+	const hook_share_header_t *plan = hook_share_validate(buf, size, 8, 0x1234);
+	unsigned int i, found = 0;
+
+	CHECK(plan != NULL, "plan refused");
+	if (!plan)
+		return;
+	for (i = 0; i < HOOKS + 10; i++) {
+		const hook_share_entry_t *e = hook_share_find(plan, i);
+		if (i >= HOOKS || i % 13 == 5) {
+			CHECK(e == NULL, "hook %u: entry for a hook never recorded", i);
+			continue;
+		}
+		if (!e) {
+			CHECK(0, "hook %u: no entry", i);
+			continue;
+		}
+		found++;
+		CHECK(!memcmp(e, &entries[found - 1], sizeof(*e)), "hook %u: entry differs", i);
+		CHECK(hook_share_name_matches(hook_share_module(plan, e->module), libs[e->module]), "hook %u: module name", i);
+	}
+	printf("%u hooks over %u modules in %zu bytes: every entry read back\n", found, plan->module_count, size);
+}
+
+// a plan changed and its checksum redone, as only a writer meaning harm
+// would send it
+static void reseal(unsigned char *plan, size_t size)
+{
+	hook_share_header_t *h = (hook_share_header_t *)plan;
+
+	h->checksum = 0;
+	h->checksum = hook_share_hash(HOOK_SHARE_HASH_INIT, plan, size);
+}
+
+int main()
+{
+	static unsigned char buf[1 << 16], bad[1 << 16];
+	size_t size, at;
+	unsigned int i, bit, rejected = 0, tries = 0;
+
+	record();
+	CHECK(hook_share_add_module(modules, &module_count, libs[0], 0x5f000000, 0x100000) == 0, "the same module added twice");
+	{
+		unsigned short loud[HOOK_SHARE_NAME_LEN], long_name[HOOK_SHARE_NAME_LEN + 4];
+		to_units(loud, "NTDLL");
+		CHECK(hook_share_name_matches(&modules[0], loud), "module names differ only in case");
+		CHECK(!hook_share_name_matches(&modules[0], libs[1]), "ntdll matched kernel32");
+		to_units(long_name, "a_module_name_thirty_two_long_xx");
+		CHECK(hook_share_add_module(modules, &module_count, long_name, 1, 1) < 0, "a name too long taken");
+	}
+
+	size = hook_share_write(buf, sizeof(buf), 8, 0x1234, modules, module_count, entries, entry_count);
+	CHECK(size == hook_share_size(module_count, entry_count), "wrote %zu bytes", size);
+	check_round_trip(buf, size);
+	// a section's view is rounded up to a page
+	check_round_trip(buf, sizeof(buf));
+
+	CHECK(hook_share_write(buf, size - 1, 8, 0x1234, modules, module_count, entries, entry_count) == 0, "wrote past the end");
+	{
+		hook_share_entry_t swapped[2] = { entries[1], entries[0] };
+		CHECK(hook_share_write(bad, sizeof(bad), 8, 0x1234, modules, module_count, swapped, 2) == 0, "wrote unsorted entries");
+	}
+	size = hook_share_write(buf, sizeof(buf), 8, 0x1234, modules, module_count, entries, entry_count);
+
+	// another process's kind of plan
+	CHECK(!hook_share_validate(buf, size, 4, 0x1234), "a 64-bit plan taken by a 32-bit process");
+	CHECK(!hook_share_validate(buf, size, 8, 0x1235), "a plan taken for another hook table");
+	CHECK(!hook_share_validate(NULL, 0, 8, 0x1234), "no plan taken");
+
+	// cut short anywhere
+	for (at = 0; at < size; at++)
+		CHECK(!hook_share_validate(buf, at, 8, 0x1234), "plan cut to %zu bytes taken", at);
+
+	// any one bit changed
+	for (at = 0; at < size; at++)
+		for (bit = 0; bit < 8; bit++) {
+			memcpy(bad, buf, size);
+			bad[at] ^= 1 << bit;
+			tries++;
+			rejected += !hook_share_validate(bad, size, 8, 0x1234);
+		}
+	CHECK(rejected == tries, "%u of %u single bit changes refused", rejected, tries);
+	printf("cut short at every length, %u single bit changes: all refused\n", tries);
+
+	// well formed as far as the checksum goes but out of range
+	{
+		size_t mods = sizeof(hook_share_header_t), ents = mods + module_count * sizeof(hook_share_module_t);
+		size_t e = sizeof(hook_share_entry_t);
+		struct { const char *what; size_t offset; unsigned int value, width; } cases[] = {
+			{ "module count past the max", offsetof(hook_share_header_t, module_count), HOOK_SHARE_MAX_MODULES + 1, 4 },
+			{ "entry count past the end", offsetof(hook_share_header_t, entry_count), 0x10000000, 4 },
+			{ "size past the end", offsetof(hook_share_header_t, size), 0x7fffffff, 4 },
+			{ "unterminated module name", mods + offsetof(hook_share_module_t, name), 0x00610061, 4 },
+			{ "empty module name", mods + offsetof(hook_share_module_t, name), 0, 2 },
+			{ "module name not folded", mods + offsetof(hook_share_module_t, name), 'N', 2 },
+			{ "empty module", mods + offsetof(hook_share_module_t, image_size), 0, 4 },
+			{ "module index past the modules", ents + 5 * e + offsetof(hook_share_entry_t, module), LIBS, 2 },
+			{ "offset past the image", ents + 7 * e + offsetof(hook_share_entry_t, rva), 0x100000, 4 },
+			{ "witness past the image", ents + 3 * e + offsetof(hook_share_entry_t, witness), 0x100000, 4 },
+			{ "unknown flag", ents + 9 * e + offsetof(hook_share_entry_t, flags), 1, 2 },
+			{ "hooks out of order", ents + 20 * e + offsetof(hook_share_entry_t, hook), 2, 4 },
+			{ "a hook twice", ents + 20 * e + offsetof(hook_share_entry_t, hook), 21, 4 },
+		};
+		unsigned int n;
+
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+			memcpy(bad, buf, size);
+			memcpy(bad + cases[i].offset, &cases[i].value, cases[i].width);
+			// the unterminated name fills every unit
+			if (i == 3)
+				for (n = 0; n < HOOK_SHARE_NAME_LEN; n++)
+					((hook_share_module_t *)(bad + mods))->name[n] = 'a';
+			reseal(bad, size);
+			CHECK(!hook_share_validate(bad, size, 8, 0x1234), "%s taken", cases[i].what);
+		}
+		// and the forging itself is sound: an in-range change is taken
+		memcpy(bad, buf, size);
+		n = 0x2000;
+		memcpy(bad + ents + 7 * e + offsetof(hook_share_entry_t, rva), &n, 4);
+		reseal(bad, size);
+		CHECK(hook_share_validate(bad, size, 8, 0x1234) != NULL, "an in-range change refused");
+		printf("%u forged plans with fields out of range: all refused\n", i);
+	}
+
+	// a child's startup: validate the plan once, then look up every hook
+	{
+		unsigned int rounds = 20000, sum = 0;
+		const hook_share_header_t *plan;
+		clock_t t0;
+		double t_validate, t_find;
+
+		t0 = clock();
+		for (i = 0; i < rounds; i++)
+			sum += hook_share_validate(buf, size, 8, 0x1234) != NULL;
+		t_validate = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		CHECK(sum == rounds, "plan refused while timing");
+
+		plan = hook_share_validate(buf, size, 8, 0x1234);
+		t0 = clock();
+		for (i = 0; i < rounds; i++) {
+			unsigned int h;
+			for (h = 0; h < HOOKS; h++) {
+				const hook_share_entry_t *e = hook_share_find(plan, h);
+				sum += e ? e->rva : 0;
+			}
+		}
+		t_find = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		g_sink = sum;
+		printf("validating a %zu byte plan: %.1f us, looking up %u hooks: %.1f us (%.1f ns each)\n",
+			size, t_validate * 1e6 / rounds, HOOKS, t_find * 1e6 / rounds, t_find * 1e9 / rounds / HOOKS);
+	}
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
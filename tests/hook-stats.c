@@ -0,0 +1,226 @@
+// Counts calls on several threads into shards of their own, as enter_hook()
+// and loq() do with hook-stats on, then checks the merged totals against a
+// serial count, the ranking by cycles and the summary string (parsed back,
+// and cut to whole entries when it doesn't fit). Then times a stand-in for
+// enter_hook() without the counters, with them compiled in but off, and on.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <x86intrin.h>
+#include "../hook_stats.h"
+
+#define HOOKS 500
+#define THREADS 6
+#define CALLS 200000
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("  " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+static hook_stats_shard_t *volatile g_shards;
+static char *names[HOOKS];
+
+// what thread t does on its n'th call: a skewed choice of hook, most calls
+// going to a few, with fixed costs so the totals can be worked out
+static unsigned int call_hook(unsigned int t, unsigned int n)
+{
+	unsigned int x = (n * 2654435761u) ^ (t * 40503u);
+	return (x % 7 ? x % 23 : x % (HOOKS - 50)) + 10;
+}
+
+static void call_effects(unsigned int t, unsigned int n, unsigned int *cycles, int *logged, int *limited)
+{
+	unsigned int hook = call_hook(t, n);
+	*limited = hook % 11 == 0 && n % 3 == 0;
+	*logged = !*limited && n % 5 != 0;
+	*cycles = 100 + hook * 7 + (n % 13);
+}
+
+static void *count_thread(void *arg)
+{
+	unsigned int t = (unsigned int)(size_t)arg, n;
+	hook_stats_shard_t *shard = calloc(1, hook_stats_shard_size(HOOKS));
+
+	shard->count = HOOKS;
+	do
+		shard->next = g_shards;
+	while (!__sync_bool_compare_and_swap(&g_shards, shard->next, shard));
+
+	for (n = 0; n < CALLS; n++) {
+		hook_counters_t *c = &shard->counters[call_hook(t, n)];
+		unsigned int cycles;
+		int logged, limited;
+		call_effects(t, n, &cycles, &logged, &limited);
+		c->cycles += cycles;
+		if (limited) {
+			c->limited++;
+			continue;
+		}
+		c->calls++;
+		if (logged)
+			c->logged++;
+	}
+	return NULL;
+}
+
+static void check_merge(void)
+{
+	static hook_counters_t totals[HOOKS], want[HOOKS];
+	static unsigned int order[HOOKS];
+	pthread_t threads[THREADS];
+	unsigned int t, n, i, ranked, seen = 0, shards = 0;
+	hook_stats_shard_t *s;
+
+	for (t = 0; t < THREADS; t++)
+		pthread_create(&threads[t], NULL, count_thread, (void *)(size_t)t);
+	for (t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	for (t = 0; t < THREADS; t++)
+		for (n = 0; n < CALLS; n++) {
+			hook_counters_t *c = &want[call_hook(t, n)];
+			unsigned int cycles;
+			int logged, limited;
+			call_effects(t, n, &cycles, &logged, &limited);
+			c->cycles += cycles;
+			c->limited += limited;
+			c->calls += !limited;
+			c->logged += logged;
+		}
+
+	for (s = g_shards; s; s = s->next)
+		shards++;
+	CHECK(shards == THREADS, "%u shards on the list", shards);
+
+	hook_stats_merge(totals, HOOKS, g_shards);
+	for (i = 0; i < HOOKS; i++) {
+		CHECK(!memcmp(&totals[i], &want[i], sizeof(hook_counters_t)), "hook %u: merged totals differ", i);
+		seen += want[i].calls || want[i].limited;
+	}
+
+	ranked = hook_stats_rank(totals, HOOKS, order);
+	CHECK(ranked == seen, "%u hooks ranked, %u were called", ranked, seen);
+	for (i = 1; i < ranked; i++) {
+		const hook_counters_t *a = &totals[order[i-1]], *b = &totals[order[i]];
+		CHECK(a->cycles > b->cycles || (a->cycles == b->cycles && (a->calls > b->calls ||
+			(a->calls == b->calls && order[i-1] < order[i]))), "rank %u out of order", i);
+	}
+	printf("%u threads x %u calls over %u hooks: merged shards match, %u hooks ranked\n", THREADS, CALLS, HOOKS, ranked);
+
+	// the summary parses back to the totals in rank order
+	{
+		static char buf[1 << 16], cut[1 << 16];
+		unsigned int listed = hook_stats_format(totals, order, ranked, (const char *const *)names, buf, sizeof(buf));
+		char *p = buf, name[32];
+		unsigned int calls, logged, limited, k;
+		unsigned long long cycles;
+		int len;
+
+		CHECK(listed == ranked, "%u of %u listed", listed, ranked);
+		for (i = 0; i < listed; i++) {
+			const hook_counters_t *c = &totals[order[i]];
+			if (sscanf(p, "%31[^=]=%u,%u,%u,%llu;%n", name, &calls, &logged, &limited, &cycles, &len) != 5) {
+				CHECK(0, "entry %u doesn't parse", i);
+				break;
+			}
+			CHECK(!strcmp(name, names[order[i]]) && calls == c->calls && logged == c->logged &&
+				limited == c->limited && cycles == c->cycles, "entry %u: %s", i, name);
+			p += len;
+		}
+		CHECK(*p == '\0', "trailing text after the entries");
+		printf("summary of %u hooks: %zu bytes, costliest %.40s...\n", listed, strlen(buf), buf);
+
+		// cut short: whole entries only, and the same ones
+		for (k = 0; k < 3000; k += 7) {
+			unsigned int got = hook_stats_format(totals, order, ranked, (const char *const *)names, cut, k);
+			size_t l = k ? strlen(cut) : 0;
+			unsigned int entries = 0;
+			for (p = cut; k && *p; p++)
+				entries += *p == ';';
+			CHECK(!k || (l < k && !memcmp(cut, buf, l) && (l == 0 || cut[l-1] == ';') && entries == got &&
+				(got == listed || l + (strchr(buf + l, ';') - (buf + l)) + 2 > k)), "cut to %u bytes", k);
+		}
+	}
+}
+
+// a stand-in for enter_hook(): the thread's hook_info lookup and the
+// fields it sets, with the counting as hooking.c does it
+typedef struct _info_t {
+	void *current_hook;
+	unsigned long sp, ret, fp;
+	hook_stats_shard_t *stats;
+	unsigned int stats_hook;
+	unsigned long long stats_start;
+} info_t;
+
+// as g_config.hook_stats, a plain global
+unsigned int g_hook_stats;
+
+__attribute__((noinline)) static int enter_plain(info_t *info, unsigned int hook, unsigned long sp)
+{
+	info->current_hook = names[hook];
+	info->sp = sp;
+	info->ret = sp ^ 0x1234;
+	info->fp = sp + 8;
+	return 1;
+}
+
+__attribute__((noinline)) static int enter_counted(info_t *info, unsigned int hook, unsigned long sp)
+{
+	unsigned long long start = g_hook_stats ? __rdtsc() : 0;
+
+	info->current_hook = names[hook];
+	info->sp = sp;
+	info->ret = sp ^ 0x1234;
+	info->fp = sp + 8;
+	if (g_hook_stats) {
+		hook_counters_t *c = &info->stats->counters[hook];
+		unsigned long long now = __rdtsc();
+		c->cycles += now - start;
+		c->calls++;
+		info->stats_hook = hook;
+		info->stats_start = now;
+	}
+	return 1;
+}
+
+static double bench(int (*fn)(info_t *, unsigned int, unsigned long), info_t *info)
+{
+	struct timespec t0, t1;
+	unsigned int n, sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < 20000000; n++)
+		sum += fn(info, n % HOOKS, n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / sum;
+}
+
+int main()
+{
+	info_t info;
+	double plain, off, on;
+	unsigned int i;
+
+	for (i = 0; i < HOOKS; i++) {
+		names[i] = malloc(16);
+		sprintf(names[i], "Api%u", i);
+	}
+
+	check_merge();
+
+	memset(&info, 0, sizeof(info));
+	info.stats = calloc(1, hook_stats_shard_size(HOOKS));
+	plain = bench(enter_plain, &info);
+	g_hook_stats = 0;
+	off = bench(enter_counted, &info);
+	g_hook_stats = 1;
+	on = bench(enter_counted, &info);
+	printf("enter_hook stand-in: %.2f ns/call without counters, %.2f ns with them off, %.2f ns on\n", plain, off, on);
+	CHECK(info.stats->counters[7].calls == 20000000 / HOOKS, "counted %u calls", info.stats->counters[7].calls);
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,299 @@
+// Cross-checks the trampoline length decoder against distorm, the full
+// disassembler hook_create_trampoline() used: instruction lengths, which
+// operands are RIP-relative and where relative operands point. The corpus
+// is the checked-in sample of function prologues in insn-decode/, then, for
+// those of the x64 shared libraries below the build machine has, the first
+// instructions of every function they export and the whole of their code,
+// read as x64 and again as x86 instructions. Then random bytes, where only
+// disagreements on instructions distorm decodes are counted, and times the
+// two.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <elf.h>
+#include "../insn_decode.h"
+#include "../distorm/include/distorm.h"
+
+static const char *libraries[] = {
+	"/lib/x86_64-linux-gnu/libc.so.6",
+	"/lib/x86_64-linux-gnu/libm.so.6",
+	"/usr/lib/x86_64-linux-gnu/libstdc++.so.6",
+	"/usr/lib/x86_64-linux-gnu/libcrypto.so.3",
+	"/usr/lib/x86_64-linux-gnu/libx265.so.199",
+	"/usr/lib/x86_64-linux-gnu/libz3.so.4",
+};
+
+#define PROLOGUE_INSNS 8
+
+// one prologue per line in hex, read from the directory the tests run in
+#define CORPUS "insn-decode/prologues.txt"
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { if (failures < 400) { printf("  " __VA_ARGS__); printf("\n"); } failures++; } } while (0)
+
+typedef struct _library_t {
+	unsigned char *image;
+	size_t size;
+	unsigned char *text;
+	size_t text_size;
+	size_t *functions;		// offsets into the image
+	unsigned int nfunctions;
+} library_t;
+
+static int load(const char *path, library_t *lib)
+{
+	FILE *f = fopen(path, "rb");
+	Elf64_Ehdr *eh;
+	Elf64_Shdr *sh;
+	unsigned int i;
+
+	memset(lib, 0, sizeof(*lib));
+	if (!f)
+		return 0;
+	fseek(f, 0, SEEK_END);
+	lib->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	lib->image = malloc(lib->size);
+	if (fread(lib->image, 1, lib->size, f) != lib->size) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	eh = (Elf64_Ehdr *)lib->image;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64)
+		return 0;
+	sh = (Elf64_Shdr *)(lib->image + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		const char *name = (const char *)lib->image + sh[eh->e_shstrndx].sh_offset + sh[i].sh_name;
+		if (!strcmp(name, ".text")) {
+			lib->text = lib->image + sh[i].sh_offset;
+			lib->text_size = sh[i].sh_size;
+		}
+	}
+	// exported functions, by file offset of the section they're in
+	for (i = 0; i < eh->e_shnum; i++) {
+		Elf64_Sym *sym;
+		size_t n, count;
+		if (sh[i].sh_type != SHT_DYNSYM && sh[i].sh_type != SHT_SYMTAB)
+			continue;
+		sym = (Elf64_Sym *)(lib->image + sh[i].sh_offset);
+		count = sh[i].sh_size / sizeof(Elf64_Sym);
+		lib->functions = realloc(lib->functions, (lib->nfunctions + count) * sizeof(size_t));
+		for (n = 0; n < count; n++) {
+			Elf64_Shdr *in;
+			if (ELF64_ST_TYPE(sym[n].st_info) != STT_FUNC || !sym[n].st_size || !sym[n].st_shndx || sym[n].st_shndx >= eh->e_shnum)
+				continue;
+			in = &sh[sym[n].st_shndx];
+			if (sym[n].st_value < in->sh_addr || sym[n].st_value + sym[n].st_size > in->sh_addr + in->sh_size)
+				continue;
+			lib->functions[lib->nfunctions++] = in->sh_offset + sym[n].st_value - in->sh_addr;
+		}
+	}
+	return lib->text != NULL;
+}
+
+typedef struct _tally_t {
+	unsigned long insns, rip, branches, distorm_only, ours_only, known;
+} tally_t;
+
+// where distorm is known to part from the processor manuals: it folds
+// wait into the x87 instruction after it, decodes ud1 without its ModRM
+// byte and getsec with a byte too many, takes VEX prefixes on opcodes
+// without VEX forms, and reads pextrw's ModRM as a register whatever its mod
+static int known_difference(const unsigned char *code, int x64)
+{
+	unsigned int i = 0;
+
+	while (i < 14 && (code[i] == 0x66 || code[i] == 0x67 || code[i] == 0xf0 || code[i] == 0xf2 || code[i] == 0xf3 ||
+		code[i] == 0x26 || code[i] == 0x2e || code[i] == 0x36 || code[i] == 0x3e || code[i] == 0x64 || code[i] == 0x65 ||
+		(x64 && (code[i] & 0xf0) == 0x40)))
+		i++;
+	if (code[i] == 0x9b)
+		return 1;
+	if (code[i] == 0x0f && (code[i+1] == 0xb9 || code[i+1] == 0x37 || code[i+1] == 0xc5))
+		return 1;
+	if ((code[i] == 0xc4 || code[i] == 0xc5) && (x64 || code[i+1] >= 0xc0))
+		return 1;
+	return 0;
+}
+
+// compares one instruction; returns the length to step over
+static unsigned int compare(const unsigned char *code, size_t avail, int x64, tally_t *t, int strict, const char *where)
+{
+	_DInst di;
+	unsigned int used = 0, len;
+	_CodeInfo ci = { 0x10000000, 0, code, avail > 15 ? 15 : (int)avail, x64 ? Decode64Bits : Decode32Bits, DF_NONE };
+	insn_t insn;
+	int distorm_ok;
+
+	if (distorm_decompose(&ci, &di, 1, &used) == DECRES_INPUTERR || used != 1)
+		return 1;
+	distorm_ok = di.flags != FLAG_NOT_DECODABLE;
+	len = insn_decode(code, avail, x64, &insn);
+
+	if (!distorm_ok) {
+		// distorm turns down some instructions real processors run, and
+		// returns lone prefixes as instructions of their own
+		t->ours_only += len != 0;
+		return len ? len : 1;
+	}
+	if (len != di.size && known_difference(code, x64)) {
+		t->known++;
+		return di.size;
+	}
+	if (!len) {
+		t->distorm_only++;
+		CHECK(!strict, "%s: %s undecoded, distorm: %u bytes %02x %02x %02x %02x %02x", where, x64 ? "x64" : "x86",
+			di.size, code[0], code[1], code[2], code[3], code[4]);
+		return di.size;
+	}
+	t->insns++;
+	CHECK(len == di.size, "%s: %s %u bytes, distorm %u: %02x %02x %02x %02x %02x %02x", where, x64 ? "x64" : "x86",
+		len, di.size, code[0], code[1], code[2], code[3], code[4], code[5]);
+	if (len != di.size)
+		return di.size;
+	CHECK(!(insn.flags & INSN_RIP_RELATIVE) == !(di.flags & FLAG_RIP_RELATIVE), "%s: RIP-relative differs: %02x %02x %02x %02x",
+		where, code[0], code[1], code[2], code[3]);
+	if (di.flags & FLAG_RIP_RELATIVE) {
+		t->rip++;
+		CHECK(insn.rel == (int)di.disp && insn.disp_size == 4, "%s: RIP-relative displacement differs", where);
+	}
+	if (di.ops[0].type == O_PC) {
+		size_t want = (size_t)INSTRUCTION_GET_TARGET(&di), got = insn_target(&insn, 0x10000000);
+		if (!x64) {
+			want &= 0xffffffff;
+			got &= 0xffffffff;
+		}
+		t->branches++;
+		CHECK((insn.flags & INSN_REL_BRANCH) && got == want, "%s: branch target %zx, distorm %zx", where, got, want);
+	}
+	return len;
+}
+
+// the checked-in prologues: as x64 they must all agree, and as x86 they're
+// swept as the libraries' code is; returns how many there were
+static unsigned int check_corpus(tally_t *prologues, tally_t *sweep32)
+{
+	FILE *f = fopen(CORPUS, "r");
+	char line[512];
+	unsigned char code[256 + 16];
+	unsigned int count = 0, len, i;
+	size_t off;
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		for (len = 0; len < 256 && sscanf(line + 2 * len, "%2hhx", &code[len]) == 1; len++);
+		if (!len)
+			continue;
+		// what follows the prologue is never read as part of it
+		memset(code + len, 0xcc, sizeof(code) - len);
+		count++;
+		for (off = 0, i = 0; i < PROLOGUE_INSNS && off < len; i++)
+			off += compare(code + off, len - off, 1, prologues, 1, CORPUS);
+		for (off = 0; off < len; )
+			off += compare(code + off, len - off, 0, sweep32, 0, CORPUS);
+	}
+	fclose(f);
+	return count;
+}
+
+int main()
+{
+	static library_t libs[sizeof(libraries) / sizeof(libraries[0])];
+	tally_t corpus, prologues, sweep64, sweep32, random64, random32;
+	unsigned int l, nlibs = 0, i, n;
+	unsigned long functions = 0;
+	size_t off, bytes = 0;
+
+	memset(&prologues, 0, sizeof(tally_t));
+	corpus = sweep64 = sweep32 = random64 = random32 = prologues;
+
+	n = check_corpus(&corpus, &sweep32);
+	CHECK(n, "%s is missing or empty", CORPUS);
+	printf("%s: %u functions, %lu prologue instructions, %lu RIP-relative, %lu branches agree\n", CORPUS, n,
+		corpus.insns, corpus.rip, corpus.branches);
+
+	for (l = 0; l < sizeof(libraries) / sizeof(libraries[0]); l++) {
+		library_t *lib = &libs[nlibs];
+		if (!load(libraries[l], lib)) {
+			printf("%s not found, skipped\n", libraries[l]);
+			continue;
+		}
+		nlibs++;
+		for (i = 0; i < lib->nfunctions; i++) {
+			const unsigned char *p = lib->image + lib->functions[i];
+			for (n = 0; n < PROLOGUE_INSNS && p < lib->image + lib->size; n++)
+				p += compare(p, lib->image + lib->size - p, 1, &prologues, 1, libraries[l]);
+		}
+		functions += lib->nfunctions;
+		for (off = 0; off < lib->text_size; )
+			off += compare(lib->text + off, lib->text_size - off, 1, &sweep64, 1, libraries[l]);
+		for (off = 0; off < lib->text_size; )
+			off += compare(lib->text + off, lib->text_size - off, 0, &sweep32, 0, libraries[l]);
+		bytes += lib->text_size;
+	}
+	printf("%u libraries, %lu functions: %lu prologue instructions, %lu RIP-relative, %lu branches agree, %lu only we decode (endbr64, which distorm predates)\n",
+		nlibs, functions, prologues.insns, prologues.rip, prologues.branches, prologues.ours_only);
+	printf("x64 sweep of %zu bytes: %lu instructions, %lu RIP-relative, %lu branches agree, %lu known differences, %lu only we decode\n",
+		bytes, sweep64.insns, sweep64.rip, sweep64.branches, sweep64.known, sweep64.ours_only);
+	printf("x86 sweep: %lu instructions, %lu branches agree, %lu known differences, %lu only distorm decodes, %lu only we do\n",
+		sweep32.insns, sweep32.branches, sweep32.known, sweep32.distorm_only, sweep32.ours_only);
+	if (!nlibs)
+		printf("none of the x64 libraries found, only %s was checked\n", CORPUS);
+
+	// benchmark: what the trampoline code needs of each instruction, over
+	// the first library's code, distorm called as get_insn() did: asked for
+	// up to 16 instructions from 16 bytes, of which the first is used
+	if (nlibs) {
+		library_t *lib = &libs[0];
+		size_t limit = lib->text_size > (4 << 20) ? 4 << 20 : lib->text_size;
+		unsigned long count = 0, sum_distorm = 0, sum_ours = 0;
+		clock_t t0 = clock();
+		double t_distorm, t_ours;
+
+		for (off = 0; off < limit; count++) {
+			_DInst di[16];
+			unsigned int used;
+			_CodeInfo ci = { 0, 0, lib->text + off, limit - off > 16 ? 16 : (int)(limit - off), Decode64Bits, DF_NONE };
+			distorm_decompose(&ci, di, 16, &used);
+			sum_distorm += di[0].size + ((di[0].flags & FLAG_RIP_RELATIVE) != 0);
+			off += di[0].size ? di[0].size : 1;
+		}
+		t_distorm = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+
+		t0 = clock();
+		for (off = 0; off < limit; ) {
+			insn_t insn;
+			unsigned int len = insn_decode(lib->text + off, limit - off, 1, &insn);
+			sum_ours += len + ((insn.flags & INSN_RIP_RELATIVE) != 0);
+			off += len ? len : 1;
+		}
+		t_ours = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+		printf("%lu instructions: distorm %.1f ns each, length decoding %.1f ns (%.1fx)\n",
+			count, t_distorm * 1e9 / count, t_ours * 1e9 / count, t_distorm / t_ours);
+	}
+
+	{
+		unsigned char buf[4096 + 16];
+		srand(48);
+		for (n = 0; n < 200; n++) {
+			for (i = 0; i < sizeof(buf); i++)
+				buf[i] = rand() % 3 ? (unsigned char)rand() : (unsigned char)"\x0f\x66\x48\x41\xc4\xc5\x8b\x89\xe8\xf6"[rand() % 10];
+			for (off = 0; off < 4096; )
+				off += compare(buf + off, sizeof(buf) - off, 1, &random64, 0, "random");
+			for (off = 0; off < 4096; )
+				off += compare(buf + off, sizeof(buf) - off, 0, &random32, 0, "random");
+		}
+		printf("random bytes: x64 %lu instructions agree, %lu distorm alone decodes, %lu only we do; x86 %lu, %lu, %lu\n",
+			random64.insns, random64.distorm_only, random64.ours_only, random32.insns, random32.distorm_only, random32.ours_only);
+	}
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,290 @@
+// Writer threads log bursts of records through the double buffer while a
+// sender thread drains it into a slow consumer that takes at most 64KB per
+// write (a stand-in for the pipe to the result server). Checks every
+// writer's records arrive whole and in order, then compares how long the
+// writers are stalled against the single buffer that was written out, and
+// memmoved on short writes, while the writer held the lock.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../log_buffer.h"
+
+#define WRITERS 2
+#define RECORD 200
+#define RECORDS_PER_WRITER 40000
+#define BURST 1200
+#define BURST_GAP_US 8000
+#define BUFFERSIZE (1024 * 1024)
+#define CONSUMER_MBPS 100
+#define CONSUMER_CHUNK 65536
+
+static char *sink;
+static size_t sink_len;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sender_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int done;
+static int use_double;
+
+// the old design
+static char *g_buffer;
+static size_t g_idx;
+
+static log_buffer_t g_logbuf;
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_us(double us)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(us / 1e6);
+	ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+	nanosleep(&ts, NULL);
+}
+
+// takes a short bite and as long as the bandwidth says
+static size_t slow_write(const char *buf, size_t len)
+{
+	size_t n = len < CONSUMER_CHUNK ? len : CONSUMER_CHUNK;
+
+	memcpy(sink + sink_len, buf, n);
+	sink_len += n;
+	sleep_us(n / (double)CONSUMER_MBPS);
+	return n;
+}
+
+static void old_send_log(void)
+{
+	// called with the lock held, as _send_log() did
+	while (g_idx > 0) {
+		size_t written = slow_write(g_buffer, g_idx);
+		if (written < g_idx)
+			memmove(g_buffer, g_buffer + written, g_idx - written);
+		g_idx -= written;
+	}
+}
+
+static void old_log_raw(const char *buf, size_t length)
+{
+	size_t copied = 0;
+
+	while (copied != length) {
+		size_t n;
+		pthread_mutex_lock(&lock);
+		n = length - copied < BUFFERSIZE - g_idx ? length - copied : BUFFERSIZE - g_idx;
+		memcpy(g_buffer + g_idx, buf + copied, n);
+		g_idx += n;
+		copied += n;
+		pthread_mutex_unlock(&lock);
+		if (copied != length) {
+			pthread_mutex_lock(&lock);
+			old_send_log();
+			pthread_mutex_unlock(&lock);
+		}
+	}
+}
+
+// what _send_log() does now, from the sender thread or a writer that found
+// both buffers full
+static void send_log(void)
+{
+	pthread_mutex_lock(&sender_lock);
+	while (1) {
+		const char *data;
+		size_t len, written;
+
+		pthread_mutex_lock(&lock);
+		data = log_buffer_next(&g_logbuf, &len);
+		pthread_mutex_unlock(&lock);
+		if (!len)
+			break;
+		written = slow_write(data, len);
+		pthread_mutex_lock(&lock);
+		log_buffer_sent(&g_logbuf, written);
+		pthread_mutex_unlock(&lock);
+	}
+	pthread_mutex_unlock(&sender_lock);
+}
+
+static void new_log_raw(const char *buf, size_t length)
+{
+	size_t copied = 0;
+
+	while (copied != length) {
+		pthread_mutex_lock(&lock);
+		copied += log_buffer_put(&g_logbuf, buf + copied, length - copied);
+		pthread_mutex_unlock(&lock);
+		if (copied != length)
+			send_log();
+	}
+}
+
+static void *sender_thread(void *arg)
+{
+	while (!done) {
+		sleep_us(1000);
+		send_log();
+	}
+	return NULL;
+}
+
+typedef struct {
+	int id;
+	double stalled, worst;
+} writer_t;
+
+static void *writer_thread(void *arg)
+{
+	writer_t *w = arg;
+	char rec[RECORD];
+	unsigned int i;
+
+	memset(rec, 'x', sizeof(rec));
+	for (i = 0; i < RECORDS_PER_WRITER; i++) {
+		double t0, t;
+		memcpy(rec, &w->id, 4);
+		memcpy(rec + 4, &i, 4);
+		t0 = now_us();
+		if (use_double)
+			new_log_raw(rec, RECORD);
+		else
+			old_log_raw(rec, RECORD);
+		t = now_us() - t0;
+		w->stalled += t;
+		if (t > w->worst)
+			w->worst = t;
+		if (i % BURST == BURST - 1)
+			sleep_us(BURST_GAP_US);
+	}
+	return NULL;
+}
+
+static unsigned int run(int double_buffered, double *stalled, double *worst, double *elapsed)
+{
+	pthread_t writers[WRITERS], sender;
+	writer_t w[WRITERS];
+	unsigned int next[WRITERS] = { 0 }, failures = 0, i;
+	size_t off;
+	double t0 = now_us();
+
+	use_double = double_buffered;
+	done = 0;
+	sink_len = 0;
+	if (double_buffered) {
+		log_buffer_init(&g_logbuf, BUFFERSIZE / 2);
+		pthread_create(&sender, NULL, sender_thread, NULL);
+	}
+	else {
+		g_buffer = malloc(BUFFERSIZE);
+		g_idx = 0;
+	}
+
+	for (i = 0; i < WRITERS; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].id = i;
+		pthread_create(&writers[i], NULL, writer_thread, &w[i]);
+	}
+	*stalled = *worst = 0;
+	for (i = 0; i < WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+		*stalled += w[i].stalled;
+		if (w[i].worst > *worst)
+			*worst = w[i].worst;
+	}
+
+	// log_flush()
+	if (double_buffered) {
+		done = 1;
+		pthread_join(sender, NULL);
+		send_log();
+		if (log_buffer_pending(&g_logbuf))
+			failures++;
+		log_buffer_free(&g_logbuf);
+	}
+	else {
+		pthread_mutex_lock(&lock);
+		old_send_log();
+		pthread_mutex_unlock(&lock);
+		free(g_buffer);
+	}
+	*elapsed = now_us() - t0;
+
+	if (sink_len != (size_t)WRITERS * RECORDS_PER_WRITER * RECORD) {
+		printf("  %zu of %zu bytes delivered\n", sink_len, (size_t)WRITERS * RECORDS_PER_WRITER * RECORD);
+		failures++;
+	}
+	// the old writers could lose the lock halfway through a record, letting
+	// another writer's record land in the middle of it
+	for (off = 0; double_buffered && off + RECORD <= sink_len; off += RECORD) {
+		int id;
+		unsigned int seq;
+		memcpy(&id, sink + off, 4);
+		memcpy(&seq, sink + off + 4, 4);
+		if (id < 0 || id >= WRITERS || seq != next[id]++ || sink[off + RECORD - 1] != 'x') {
+			printf("  record at %zu out of order\n", off);
+			failures++;
+			break;
+		}
+	}
+	return failures;
+}
+
+int main()
+{
+	unsigned int failures = 0;
+	double stalled, worst, elapsed;
+
+	sink = malloc((size_t)WRITERS * RECORDS_PER_WRITER * RECORD + CONSUMER_CHUNK);
+
+	// the buffer on its own: random puts against random short writes
+	{
+		static char in[1 << 20], out[1 << 20];
+		log_buffer_t b;
+		size_t in_len = 0, out_len = 0;
+		unsigned int i;
+
+		srand(36);
+		for (i = 0; i < sizeof(in); i++)
+			in[i] = (char)rand();
+		log_buffer_init(&b, 4096);
+		while (out_len < sizeof(in)) {
+			size_t len;
+			const char *data;
+			if (in_len < sizeof(in) && rand() % 2) {
+				size_t want = rand() % 3000;
+				if (want > sizeof(in) - in_len)
+					want = sizeof(in) - in_len;
+				in_len += log_buffer_put(&b, in + in_len, want);
+			}
+			data = log_buffer_next(&b, &len);
+			if (len && rand() % 2) {
+				size_t n = rand() % len + 1;
+				memcpy(out + out_len, data, n);
+				out_len += n;
+				log_buffer_sent(&b, n);
+			}
+		}
+		if (memcmp(in, out, sizeof(in)) || log_buffer_pending(&b)) {
+			printf("  random puts and writes: stream differs\n");
+			failures++;
+		}
+		log_buffer_free(&b);
+	}
+
+	failures += run(0, &stalled, &worst, &elapsed);
+	printf("single buffer, written under the lock: writers stalled %7.1f ms in all, worst %6.2f ms, %.0f ms to deliver\n",
+		stalled / 1e3, worst / 1e3, elapsed / 1e3);
+	failures += run(1, &stalled, &worst, &elapsed);
+	printf("double buffer, separate sender:        writers stalled %7.1f ms in all, worst %6.2f ms, %.0f ms to deliver\n",
+		stalled / 1e3, worst / 1e3, elapsed / 1e3);
+
+	free(sink);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,355 @@
+// Compacts records shaped like loq()'s (the header fields, then an args
+// array of ints, pointers, strings and buffers) and the "info" records that
+// describe them, decodes them again with the reference decoder below (the
+// one the result server needs) and checks they come back byte-identical,
+// that the repeat count can still be bumped in place, and how much smaller
+// the compact records are.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "../bson/bson.h"
+#include "../log_compact.h"
+
+typedef struct _dec_t {
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned char *out;
+	int bad;
+} dec_t;
+
+static unsigned char get(dec_t *d)
+{
+	if (d->p >= d->end) {
+		d->bad = 1;
+		return 0;
+	}
+	return *d->p++;
+}
+
+static uint64_t get_varint(dec_t *d)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
+	unsigned char c;
+
+	do {
+		c = get(d);
+		v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while ((c & 0x80) && shift < 64);
+	return v;
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void emit(dec_t *d, const void *p, size_t len)
+{
+	memcpy(d->out, p, len);
+	d->out += len;
+}
+
+static void emit32(dec_t *d, uint32_t v)
+{
+	unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+	emit(d, b, 4);
+}
+
+static void emit64(dec_t *d, uint64_t v)
+{
+	emit32(d, (uint32_t)v);
+	emit32(d, (uint32_t)(v >> 32));
+}
+
+static void copy(dec_t *d, size_t len)
+{
+	if ((size_t)(d->end - d->p) < len) {
+		d->bad = 1;
+		return;
+	}
+	emit(d, d->p, len);
+	d->p += len;
+}
+
+// writes the elements up to the 0 terminator (or the end at the top level)
+// as a bson document
+static void decode_elements(dec_t *d, int top)
+{
+	unsigned char *start = d->out;
+	unsigned int pos = 0;
+
+	d->out += 4;
+	while (!d->bad && d->p < d->end) {
+		unsigned char tag = get(d), type = tag & LOG_COMPACT_TYPE_MASK;
+		int is_r = 0;
+
+		if (!tag)
+			break;
+		*d->out++ = type;
+		if (tag & LOG_COMPACT_KEY_POSITION)
+			d->out += sprintf((char *)d->out, "%u", pos) + 1;
+		else if (tag & LOG_COMPACT_KEY_DICT) {
+			unsigned char k = get(d);
+			if (k >= log_compact_nkeys) {
+				d->bad = 1;
+				break;
+			}
+			is_r = top && !strcmp(log_compact_keys[k], "r");
+			d->out += sprintf((char *)d->out, "%s", log_compact_keys[k]) + 1;
+		}
+		else {
+			size_t len = strnlen((const char *)d->p, d->end - d->p);
+			copy(d, len + 1);
+			is_r = top && !strcmp((char *)d->out - 2, "r");
+		}
+		pos++;
+
+		switch (type) {
+		case 0x10:
+			if (is_r)
+				copy(d, 4);
+			else
+				emit32(d, (uint32_t)unzigzag(get_varint(d)));
+			break;
+		case 0x12:
+		case 0x09:
+			emit64(d, (uint64_t)unzigzag(get_varint(d)));
+			break;
+		case 0x01:
+		case 0x07:
+			copy(d, type == 0x01 ? 8 : 12);
+			break;
+		case 0x02: {
+			uint32_t len = (uint32_t)get_varint(d);
+			emit32(d, len + 1);
+			copy(d, len);
+			*d->out++ = 0;
+			break;
+		}
+		case 0x05: {
+			uint32_t len = (uint32_t)get_varint(d);
+			emit32(d, len);
+			*d->out++ = get(d);
+			copy(d, len);
+			break;
+		}
+		case 0x03:
+		case 0x04:
+			decode_elements(d, 0);
+			break;
+		case 0x08:
+			*d->out++ = get(d);
+			break;
+		case 0x0a:
+			break;
+		default:
+			d->bad = 1;
+		}
+	}
+	*d->out++ = 0;
+	start[0] = (unsigned char)(d->out - start);
+	start[1] = (unsigned char)((d->out - start) >> 8);
+	start[2] = (unsigned char)((d->out - start) >> 16);
+	start[3] = (unsigned char)((d->out - start) >> 24);
+}
+
+// returns the length of the bson document written to out, or -1
+static int log_compact_decode(const unsigned char *rec, int len, unsigned char *out)
+{
+	dec_t d;
+
+	if (len < 13 || rec[4] != 0x05 || rec[5] != 'c' || rec[6] || rec[11] != LOG_COMPACT_SUBTYPE)
+		return -1;
+	d.p = rec + 12;
+	d.end = d.p + (rec[7] | rec[8] << 8 | rec[9] << 16 | rec[10] << 24);
+	d.out = out;
+	d.bad = d.end > rec + len;
+	if (!d.bad)
+		decode_elements(&d, 1);
+	return d.bad || d.p != d.end ? -1 : (int)(d.out - out);
+}
+
+static char big[64 * 1024];
+
+static const char *paths[] = {
+	"C:\\Windows\\System32\\kernel32.dll",
+	"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Winlogon",
+	"C:\\Users\\Admin\\AppData\\Local\\Temp\\a.tmp",
+	"",
+};
+
+// the same layout loq() builds
+static void build(bson *b, unsigned int n)
+{
+	char key[4];
+	unsigned int i, args = n % 11;
+
+	bson_init(b);
+	bson_append_int(b, "I", 21 + n % 300);
+	if (n % 2) {
+		bson_append_long(b, "C", 0x7ff612341000LL + n);
+		bson_append_long(b, "R", 0x7ff612342000LL);
+		bson_append_long(b, "P", 0x7ff612343000LL);
+	}
+	else {
+		bson_append_int(b, "C", 0x401000 + n);
+		bson_append_int(b, "R", (int)0x80402000);
+		bson_append_int(b, "P", 0x403000);
+	}
+	bson_append_int(b, "T", 1234);
+	bson_append_int(b, "t", n * 7);
+	bson_append_int(b, "r", 0);
+	bson_append_start_array(b, "args");
+	bson_append_int(b, "0", n % 3 != 0);
+	bson_append_long(b, "1", n % 5 ? 0 : -1073741790);
+	for (i = 0; i < args; i++) {
+		snprintf(key, sizeof(key), "%u", i + 2);
+		switch ((n + i) % 5) {
+		case 0:
+			bson_append_int(b, key, (int)(n * i) - 50);
+			break;
+		case 1:
+			bson_append_long(b, key, 0x7ff00000 + i);
+			break;
+		case 2:
+			bson_append_string(b, key, paths[(n + i) % 4]);
+			break;
+		case 3:
+			bson_append_binary(b, key, BSON_BIN_BINARY, big, n % 97 == 0 ? 40000 : n % 3 * 64);
+			break;
+		default:
+			// 'a' arguments log a nested array of strings
+			bson_append_start_array(b, key);
+			bson_append_string(b, "0", paths[0]);
+			bson_append_string(b, "1", paths[2]);
+			bson_append_finish_array(b);
+		}
+	}
+	bson_append_finish_array(b);
+	bson_finish(b);
+}
+
+// an "explain" record, as loq() sends once per api
+static void build_info(bson *b, unsigned int n)
+{
+	bson_init(b);
+	bson_append_int(b, "I", 21 + n);
+	bson_append_string(b, "name", "NtCreateFile");
+	bson_append_string(b, "type", "info");
+	bson_append_string(b, "category", "filesystem");
+	bson_append_start_array(b, "args");
+	bson_append_string(b, "0", "is_success");
+	bson_append_string(b, "1", "retval");
+	bson_append_string(b, "2", "FileHandle");
+	bson_append_string(b, "3", "DesiredAccess");
+	bson_append_string(b, "4", "FileName");
+	bson_append_finish_array(b);
+	bson_finish(b);
+}
+
+static unsigned int round_trip(bson *b, unsigned int n, size_t *verbose, size_t *compact)
+{
+	static unsigned char enc[128 * 1024], dec[128 * 1024];
+	unsigned int repeat_offset;
+	int len, declen;
+
+	len = log_compact_encode((const unsigned char *)bson_data(b), enc, sizeof(enc), &repeat_offset);
+	if (len < 0 || len > bson_size(b) + LOG_COMPACT_OVERHEAD) {
+		printf("  record %u: encoded to %d bytes from %d\n", n, len, bson_size(b));
+		return 1;
+	}
+	declen = log_compact_decode(enc, len, dec);
+	if (declen != bson_size(b) || memcmp(dec, bson_data(b), declen)) {
+		printf("  record %u: decodes to %d bytes, not the %d encoded\n", n, declen, bson_size(b));
+		return 1;
+	}
+	*verbose += bson_size(b);
+	*compact += len;
+
+	// a repeat count bumped in the compact record decodes as that count
+	if (repeat_offset) {
+		bson_iterator it;
+		bson r;
+		enc[repeat_offset] = 5;
+		declen = log_compact_decode(enc, len, dec);
+		bson_init_finished_data(&r, (char *)dec, 0);
+		if (declen < 0 || bson_find(&it, &r, "r") != BSON_INT || bson_iterator_int(&it) != 5) {
+			printf("  record %u: repeat count lost\n", n);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	static unsigned char enc[128 * 1024];
+	unsigned int failures = 0, n, repeat_offset;
+	size_t verbose = 0, compact = 0, small_verbose = 0, small_compact = 0;
+	unsigned long long sum = 0;
+	clock_t t0;
+	double t;
+	bson b;
+
+	memset(big, 'b', sizeof(big));
+
+	for (n = 0; n < 20000; n++) {
+		size_t v = verbose, c = compact;
+		build(&b, n);
+		failures += round_trip(&b, n, &verbose, &compact);
+		if (bson_size(&b) < 256) {
+			small_verbose += verbose - v;
+			small_compact += compact - c;
+		}
+		bson_destroy(&b);
+	}
+	for (n = 0; n < 100; n++) {
+		build_info(&b, n);
+		failures += round_trip(&b, n, &verbose, &compact);
+		bson_destroy(&b);
+	}
+	printf("20100 records round-trip: %zu bytes verbose, %zu compact (%.0f%%), records under 256 bytes %.0f%%\n",
+		verbose, compact, 100.0 * compact / verbose, 100.0 * small_compact / small_verbose);
+
+	// what the encoder can't represent it leaves to the verbose path
+	bson_init(&b);
+	bson_append_int(&b, "I", 21);
+	bson_append_binary(&b, "old", BSON_BIN_BINARY_OLD, "x", 1);
+	bson_finish(&b);
+	if (log_compact_encode((const unsigned char *)bson_data(&b), enc, sizeof(enc), &repeat_offset) != -1)
+		failures++;
+	bson_destroy(&b);
+
+	build(&b, 97);
+	if (log_compact_encode((const unsigned char *)bson_data(&b), enc, 1024, &repeat_offset) != -1)
+		failures++;
+	bson_destroy(&b);
+
+	// no record field "r" outside the top level is taken for the count
+	bson_init(&b);
+	bson_append_int(&b, "I", 21);
+	bson_append_start_object(&b, "x");
+	bson_append_int(&b, "r", -3);
+	bson_append_finish_object(&b);
+	bson_finish(&b);
+	failures += round_trip(&b, 0, &verbose, &compact);
+	if (log_compact_encode((const unsigned char *)bson_data(&b), enc, sizeof(enc), &repeat_offset) < 0 || repeat_offset)
+		failures++;
+	bson_destroy(&b);
+
+	t0 = clock();
+	for (n = 0; n < 200000; n++) {
+		build(&b, n % 96 + 1);
+		sum += log_compact_encode((const unsigned char *)bson_data(&b), enc, sizeof(enc), &repeat_offset);
+		bson_destroy(&b);
+	}
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("build + encode: %.0f ns/record (%llu)\n", t * 1e9 / 200000, sum);
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
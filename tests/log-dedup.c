@@ -0,0 +1,312 @@
+// Replays traces shaped like the API logs of polling malware (GetTickCount/
+// Sleep, GetCursorPos, RegQueryValue loops, interleaved over a few threads
+// with unrelated calls) through the repeat folding window. Checks that every
+// call is accounted for by the emitted records and their repeat counts, that
+// each thread's records keep their first-seen order, that nothing is held
+// back longer than the latency bound, and that a window of 1 gives exactly
+// the old back-to-back folding of the whole stream, threads interleaved;
+// then reports how much each window saves.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log_dedup.h"
+
+// a record: first tick, thread, repeat count, then the compared bytes
+#define REPEAT_OFFSET 8
+#define COMPARE_OFFSET 12
+#define MAX_EVENTS 200000
+#define MAX_KINDS 64
+
+typedef struct {
+	unsigned int tick;
+	unsigned int thread;
+	unsigned int index;
+	unsigned int kind;
+} event_t;
+
+static event_t events[MAX_EVENTS];
+static unsigned int nevents;
+static char payloads[MAX_KINDS][48];
+
+static unsigned int now, failures, emitted_records, max_delay, flushing;
+static unsigned int counts[4][MAX_KINDS], last_tick[4];
+static unsigned char *stream;
+static size_t stream_len;
+
+static void add_event(unsigned int tick, unsigned int thread, unsigned int kind)
+{
+	if (nevents == MAX_EVENTS)
+		return;
+	events[nevents].tick = tick;
+	events[nevents].thread = thread;
+	events[nevents].index = kind % 7;
+	events[nevents].kind = kind;
+	nevents++;
+}
+
+static unsigned int make_record(unsigned char *buf, const event_t *e)
+{
+	unsigned int len = (unsigned int)strlen(payloads[e->kind]);
+	int zero = 0;
+
+	memcpy(buf, &e->tick, 4);
+	memcpy(buf + 4, &e->thread, 4);
+	memcpy(buf + REPEAT_OFFSET, &zero, 4);
+	memcpy(buf + COMPARE_OFFSET, payloads[e->kind], len);
+	return COMPARE_OFFSET + len;
+}
+
+static void on_emit(void *ctx, const unsigned char *buf, unsigned int len)
+{
+	unsigned int tick, thread, kind;
+	int repeated;
+
+	memcpy(&tick, buf, 4);
+	memcpy(&thread, buf + 4, 4);
+	memcpy(&repeated, buf + REPEAT_OFFSET, 4);
+	for (kind = 0; kind < MAX_KINDS; kind++)
+		if (strlen(payloads[kind]) == len - COMPARE_OFFSET && !memcmp(payloads[kind], buf + COMPARE_OFFSET, len - COMPARE_OFFSET))
+			break;
+	if (kind == MAX_KINDS || thread >= 4) {
+		failures++;
+		return;
+	}
+	counts[thread][kind] += 1 + repeated;
+	if (tick < last_tick[thread]) {
+		if (failures++ < 5)
+			printf("  thread %u: record from %u emitted after one from %u\n", thread, tick, last_tick[thread]);
+	}
+	last_tick[thread] = tick;
+	if (!flushing && now - tick > max_delay)
+		max_delay = now - tick;
+	emitted_records++;
+
+	if (ctx) {
+		stream = realloc(stream, stream_len + len);
+		memcpy(stream + stream_len, buf, len);
+		stream_len += len;
+	}
+}
+
+// replays the trace; returns the number of records emitted
+static unsigned int replay(unsigned int window, unsigned int latency, int keep_stream)
+{
+	static unsigned int expected[4][MAX_KINDS];
+	log_dedup_t d;
+	unsigned char buf[128];
+	unsigned int i, t, k, max_gap = 0;
+
+	memset(expected, 0, sizeof(expected));
+	memset(counts, 0, sizeof(counts));
+	memset(last_tick, 0, sizeof(last_tick));
+	emitted_records = max_delay = flushing = 0;
+	free(stream);
+	stream = NULL;
+	stream_len = 0;
+
+	log_dedup_init(&d, window, latency, on_emit, keep_stream ? &d : NULL);
+	for (i = 0; i < nevents; i++) {
+		unsigned int len = make_record(buf, &events[i]);
+		if (i && events[i].tick - events[i-1].tick > max_gap)
+			max_gap = events[i].tick - events[i-1].tick;
+		now = events[i].tick;
+		log_dedup_expire(&d, now);
+		log_dedup_add(&d, events[i].thread, events[i].index, buf, len, COMPARE_OFFSET, REPEAT_OFFSET, now);
+		expected[events[i].thread][events[i].kind]++;
+	}
+	flushing = 1;
+	log_dedup_flush(&d);
+	log_dedup_free(&d);
+
+	// with a window of 1 threads share the window, and as in loq() the thread
+	// isn't compared, so a repeat from another thread counts against the first
+	if (window == 1)
+		for (t = 1; t < 4; t++)
+			for (k = 0; k < MAX_KINDS; k++) {
+				counts[0][k] += counts[t][k];
+				counts[t][k] = 0;
+				expected[0][k] += expected[t][k];
+				expected[t][k] = 0;
+			}
+	for (t = 0; t < 4; t++)
+		for (k = 0; k < MAX_KINDS; k++)
+			if (counts[t][k] != expected[t][k]) {
+				if (failures++ < 5)
+					printf("  window %u: thread %u kind %u counted %u of %u calls\n", window, t, k, counts[t][k], expected[t][k]);
+			}
+	if (latency && max_delay > latency + max_gap) {
+		printf("  window %u: a record was held back %u ms\n", window, max_delay);
+		failures++;
+	}
+	return emitted_records;
+}
+
+// the folding log.c did before: only an exact repeat of the previous record
+static size_t old_folding(unsigned char *out)
+{
+	unsigned char prev[128], buf[128];
+	unsigned int prev_len = 0, i;
+	size_t n = 0;
+
+	for (i = 0; i < nevents; i++) {
+		unsigned int len = make_record(buf, &events[i]);
+		if (prev_len && prev_len == len && !memcmp(prev + COMPARE_OFFSET, buf + COMPARE_OFFSET, len - COMPARE_OFFSET)) {
+			int repeated;
+			memcpy(&repeated, prev + REPEAT_OFFSET, 4);
+			repeated++;
+			memcpy(prev + REPEAT_OFFSET, &repeated, 4);
+			continue;
+		}
+		if (prev_len) {
+			memcpy(out + n, prev, prev_len);
+			n += prev_len;
+		}
+		memcpy(prev, buf, len);
+		prev_len = len;
+	}
+	memcpy(out + n, prev, prev_len);
+	return n + prev_len;
+}
+
+static void trace_tickcount_sleep(void)
+{
+	unsigned int tick = 0, i;
+
+	// GetTickCount / Sleep(10) until enough time has passed
+	for (i = 0; i < 20000; i++, tick += 5)
+		add_event(tick, 0, i % 2);
+	add_event(tick, 0, 20);
+}
+
+static void trace_cursor(void)
+{
+	unsigned int tick = 0, i;
+
+	// GetCursorPos / GetTickCount / Sleep, with the cursor moving now and then
+	for (i = 0; i < 30000; i++, tick += 3)
+		add_event(tick, 0, i % 3 == 0 ? 2 + (i / 3000) % 4 : 6 + i % 3);
+}
+
+static void trace_registry(void)
+{
+	unsigned int tick = 0, i;
+
+	// RegOpenKey / RegQueryValue x4 / RegCloseKey in a loop on one thread, a
+	// second thread polling GetTickCount, and one-off calls on a third
+	for (i = 0; i < 60000; i++, tick += 2) {
+		if (i % 10 < 6)
+			add_event(tick, 0, 10 + i % 6);
+		else if (i % 10 < 9)
+			add_event(tick, 1, 0);
+		else
+			add_event(tick, 2, 30 + rand() % 30);
+	}
+}
+
+static void trace_noise(void)
+{
+	unsigned int tick = 0, i;
+
+	// random calls over four threads: only chance repeats fold, nothing is lost
+	for (i = 0; i < 20000; i++, tick += 1 + rand() % 50)
+		add_event(tick, rand() % 4, 16 + rand() % 48);
+}
+
+int main()
+{
+	static unsigned char old_stream[MAX_EVENTS * 64];
+	void (*traces[])(void) = { trace_tickcount_sleep, trace_cursor, trace_registry, trace_noise };
+	const char *names[] = { "GetTickCount/Sleep", "GetCursorPos", "registry polling", "unrelated calls" };
+	unsigned int i, k;
+	size_t old_len;
+
+	for (k = 0; k < MAX_KINDS; k++)
+		snprintf(payloads[k], sizeof(payloads[0]), "%c-args-%u%s", 'A' + k % 26, k, k % 3 ? "" : "-with-a-longer-buffer");
+
+	srand(35);
+	for (i = 0; i < 4; i++) {
+		unsigned int one, eight, many;
+
+		nevents = 0;
+		traces[i]();
+
+		one = replay(1, 0, 1);
+		// a window of 1 with no latency bound is the old behaviour byte for byte
+		old_len = old_folding(old_stream);
+		if (old_len != stream_len || memcmp(old_stream, stream, old_len)) {
+			printf("  %s: window of 1 differs from the old folding\n", names[i]);
+			failures++;
+		}
+		eight = replay(8, 1000, 0);
+		many = replay(LOG_DEDUP_MAX_WINDOW, 1000, 0);
+		printf("%-20s %6u calls: %6u records back to back, %5u with a window of 8, %5u with %u (held at most %u ms)\n",
+			names[i], nevents, one, eight, many, LOG_DEDUP_MAX_WINDOW, max_delay);
+	}
+
+	// with a window of 1, A B A C from threads 1 2 1 1 stays four records:
+	// the second A isn't a repeat of the record before it
+	{
+		static const unsigned int threads[] = { 1, 2, 1, 1 }, kinds[] = { 0, 1, 0, 2 };
+		unsigned char buf[128];
+
+		nevents = 0;
+		for (i = 0; i < 4; i++)
+			add_event(100 + i, threads[i], kinds[i]);
+		replay(1, 1000, 1);
+		old_len = old_folding(old_stream);
+		if (emitted_records != 4 || old_len != stream_len || memcmp(old_stream, stream, old_len)) {
+			printf("  A B A C across threads: %u records\n", emitted_records);
+			failures++;
+		}
+
+		// and a record held back is let go once it is latency ms old
+		{
+			log_dedup_t d;
+			event_t e = { 100, 0, 1, 1 };
+			unsigned int len = make_record(buf, &e);
+
+			memset(counts, 0, sizeof(counts));
+			memset(last_tick, 0, sizeof(last_tick));
+			log_dedup_init(&d, 1, 1000, on_emit, NULL);
+			log_dedup_add(&d, 0, 1, buf, len, COMPARE_OFFSET, REPEAT_OFFSET, 100);
+			log_dedup_expire(&d, 1099);
+			if (counts[0][1] != 0)
+				failures++;
+			log_dedup_expire(&d, 1100);
+			if (counts[0][1] != 1) {
+				printf("  window of 1: a record outlived the latency bound\n");
+				failures++;
+			}
+			log_dedup_free(&d);
+		}
+	}
+
+	// taking back the last add, as the NtReadFile accumulation does
+	{
+		log_dedup_t d;
+		unsigned char buf[128];
+		event_t e = { 100, 0, 1, 1 };
+		unsigned int len = make_record(buf, &e);
+
+		memset(counts, 0, sizeof(counts));
+		memset(last_tick, 0, sizeof(last_tick));
+		flushing = 1;
+		log_dedup_init(&d, 4, 0, on_emit, NULL);
+		log_dedup_add(&d, 0, 1, buf, len, COMPARE_OFFSET, REPEAT_OFFSET, 100);
+		log_dedup_add(&d, 0, 1, buf, len, COMPARE_OFFSET, REPEAT_OFFSET, 100);
+		log_dedup_drop_last(&d);
+		log_dedup_flush(&d);
+		if (counts[0][1] != 1)
+			failures++;
+		log_dedup_add(&d, 0, 1, buf, len, COMPARE_OFFSET, REPEAT_OFFSET, 100);
+		log_dedup_drop_last(&d);
+		log_dedup_flush(&d);
+		if (counts[0][1] != 1)
+			failures++;
+		log_dedup_free(&d);
+	}
+
+	free(stream);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,182 @@
+// Simulates hooked threads logging into a buffer drained at a fixed rate,
+// with a burst of hot polling APIs that outruns the drain, with and without
+// adaptive logging. Checks that every call is either logged or counted in
+// an aggregate record, that critical APIs are always logged in full, that
+// the watermarks keep the policy from flapping, and how long the producer
+// spends blocked on a full buffer either way.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log_throttle.h"
+
+#define APIS 64
+#define HOT_APIS 3			// GetTickCount, Sleep, GetCursorPos style
+#define CRITICAL_APIS 4		// e.g. process and file writes
+#define RECORD 300			// bytes per logged call
+#define BUFFER (2 * 8 * 1024 * 1024)
+#define DRAIN_PER_MS 40000	// bytes the consumer takes per ms
+#define SIM_MS 20000
+
+static unsigned int produced[APIS], logged[APIS], counted[APIS];
+static unsigned int aggregates;
+
+static void on_aggregate(void *ctx, unsigned int index, unsigned int suppressed)
+{
+	counted[index] += suppressed;
+	aggregates++;
+}
+
+// which API the next call goes to: a few polling APIs dominate during the
+// burst, the rest is a long tail
+static unsigned int next_api(unsigned int ms)
+{
+	int r = rand() % 1000;
+
+	if (ms >= 5000 && ms < 12000 && r < 900)
+		return r % HOT_APIS;
+	if (r < 20)
+		return HOT_APIS + r % CRITICAL_APIS;
+	return HOT_APIS + CRITICAL_APIS + rand() % (APIS - HOT_APIS - CRITICAL_APIS);
+}
+
+typedef struct {
+	unsigned int blocked_ms, transitions, max_fill, failures;
+	unsigned long calls, full;
+} result_t;
+
+static result_t simulate(int adaptive)
+{
+	log_throttle_t *t = malloc(sizeof(*t));
+	result_t res;
+	size_t fill = 0;
+	unsigned int ms, i, last_level = 0;
+
+	memset(&res, 0, sizeof(res));
+	memset(produced, 0, sizeof(produced));
+	memset(logged, 0, sizeof(logged));
+	memset(counted, 0, sizeof(counted));
+	aggregates = 0;
+	srand(37);
+
+	log_throttle_init(t, 1000, 200, 0);
+	for (i = HOT_APIS; i < HOT_APIS + CRITICAL_APIS; i++)
+		log_throttle_set_critical(t, i);
+
+	for (ms = 0; ms < SIM_MS; ms++) {
+		// 200 calls a ms during the burst, 40 otherwise
+		unsigned int calls = ms >= 5000 && ms < 12000 ? 200 : 40;
+		unsigned int before = aggregates;
+
+		if (log_throttle_tick(t, ms, on_aggregate, NULL))
+			fill += (size_t)(aggregates - before) * RECORD;
+
+		for (i = 0; i < calls; i++) {
+			unsigned int api = next_api(ms);
+			unsigned int permille = (unsigned int)(fill * 1000 / BUFFER);
+			produced[api]++;
+			res.calls++;
+			if (adaptive && !log_throttle_check(t, api, permille, ms))
+				continue;
+			if (fill + RECORD > BUFFER) {
+				// a hooked thread waits for the log to drain
+				res.blocked_ms++;
+				fill -= fill < DRAIN_PER_MS ? fill : DRAIN_PER_MS;
+			}
+			fill += RECORD;
+			logged[api]++;
+			res.full++;
+		}
+		fill -= fill < DRAIN_PER_MS ? fill : DRAIN_PER_MS;
+		if (fill * 1000 / BUFFER > res.max_fill)
+			res.max_fill = (unsigned int)(fill * 1000 / BUFFER);
+		if (t->level != last_level) {
+			res.transitions++;
+			last_level = t->level;
+		}
+	}
+	log_throttle_flush(t, on_aggregate, NULL);
+
+	for (i = 0; i < APIS; i++) {
+		if (logged[i] + counted[i] != produced[i]) {
+			printf("  api %u: %u logged + %u counted of %u calls\n", i, logged[i], counted[i], produced[i]);
+			res.failures++;
+		}
+		if (i >= HOT_APIS && i < HOT_APIS + CRITICAL_APIS && logged[i] != produced[i]) {
+			printf("  critical api %u: only %u of %u calls logged\n", i, logged[i], produced[i]);
+			res.failures++;
+		}
+	}
+	free(t);
+	return res;
+}
+
+// the policy on its own
+static unsigned int policy_tests(void)
+{
+	log_throttle_t *t = malloc(sizeof(*t));
+	unsigned int failures = 0, i, fill;
+
+	log_throttle_init(t, 1000, 10, 0);
+	log_throttle_set_critical(t, 2);
+
+	// no pressure: everything logged however hot
+	for (i = 0; i < 100; i++)
+		if (!log_throttle_check(t, 1, 100, 0))
+			failures++;
+	// high watermark: the hot API is counted, a cold and a critical one aren't
+	if (log_throttle_check(t, 1, 800, 10) || !log_throttle_check(t, 3, 800, 10) || !log_throttle_check(t, 2, 800, 10))
+		failures++;
+	// between the watermarks it stays throttled, and below the low one too
+	// until a whole period has gone by
+	if (log_throttle_check(t, 1, 600, 20) || log_throttle_check(t, 1, 400, 30) || log_throttle_check(t, 1, 400, 900))
+		failures++;
+	// back above the low watermark restarts the wait
+	if (log_throttle_check(t, 1, 550, 950) || log_throttle_check(t, 1, 400, 1100) || log_throttle_check(t, 1, 400, 2000))
+		failures++;
+	if (!log_throttle_check(t, 1, 400, 2100) || t->level != 0)
+		failures++;
+	// severe: an API with an eighth of the hot rate gets counted too
+	for (i = 0; i < 2; i++)
+		log_throttle_check(t, 4, 100, 2200);
+	if (log_throttle_check(t, 4, 950, 2200) || t->level != 2)
+		failures++;
+	fill = 800;
+	log_throttle_check(t, 5, fill, 2300);
+	log_throttle_check(t, 5, 700, 2400);
+	if (t->level != 2)
+		failures++;
+	log_throttle_check(t, 5, 700, 3400);
+	if (t->level != 1)
+		failures++;
+	// the last period's rate carries over: hot from the first call
+	log_throttle_tick(t, 3500, on_aggregate, NULL);
+	if (t->apis[1].rate < 10 || log_throttle_check(t, 1, 800, 3500))
+		failures++;
+	// indexes out of range are never throttled
+	if (!log_throttle_check(t, LOG_THROTTLE_MAX, 999, 3500))
+		failures++;
+	free(t);
+	if (failures)
+		printf("  %u policy checks failed\n", failures);
+	return failures;
+}
+
+int main()
+{
+	result_t off, on;
+	unsigned int failures = policy_tests();
+
+	off = simulate(0);
+	on = simulate(1);
+	failures += off.failures + on.failures;
+
+	printf("full logging:     %lu of %lu calls logged, producer blocked %u times, buffer up to %u.%u%%\n",
+		off.full, off.calls, off.blocked_ms, off.max_fill / 10, off.max_fill % 10);
+	printf("adaptive logging: %lu of %lu calls logged, %u aggregate records, producer blocked %u times, buffer up to %u.%u%%, %u level changes\n",
+		on.full, on.calls, aggregates, on.blocked_ms, on.max_fill / 10, on.max_fill % 10, on.transitions);
+	if (on.blocked_ms >= off.blocked_ms || on.transitions > 20)
+		failures++;
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,190 @@
+// Compiles every loq() format string used by the hooks (pulled out of the
+// LOQ_* calls in ../hook_*.c) and checks each descriptor walks the same
+// specifiers and bson keys as the parse loq() used to do on every call,
+// then benchmarks the two over the whole set.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include "../log_fmt.h"
+
+#define MAX_FORMATS 2048
+
+static char *formats[MAX_FORMATS];
+static unsigned int nformats;
+
+// the second string literal of each LOQ_xxx("category", "format", ...)
+static void collect(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *src, *p;
+	long size;
+
+	if (!f)
+		return;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	src = calloc(size + 1, 1);
+	if (fread(src, 1, size, f) != (size_t)size)
+		size = 0;
+	fclose(f);
+
+	for (p = src; (p = strstr(p, "LOQ_")) != NULL && nformats < MAX_FORMATS; p++) {
+		char *q = strchr(p, '(');
+		char *cat, *fmt, *end;
+		if (!q || q - p > 20 || memchr(p, ' ', q - p))
+			continue;
+		if (!(cat = strchr(q, '"')) || !(cat = strchr(cat + 1, '"')) || !(fmt = strchr(cat + 1, '"')))
+			continue;
+		if (!(end = strchr(fmt + 1, '"')) || memchr(cat, ')', fmt - cat))
+			continue;
+		formats[nformats] = calloc(end - fmt, 1);
+		memcpy(formats[nformats++], fmt + 1, end - fmt - 1);
+	}
+	free(src);
+}
+
+// misc.c
+static void num_to_string(char *buf, unsigned int buflen, unsigned int num)
+{
+	unsigned int dec = 1000000000;
+	unsigned int i = 0;
+
+	if (!buflen)
+		return;
+
+	while (dec) {
+		if (!i && ((num / dec) || dec == 1))
+			buf[i++] = '0' + (num / dec);
+		else if (i)
+			buf[i++] = '0' + (num / dec);
+		if (i == buflen - 1)
+			break;
+		num = num % dec;
+		dec /= 10;
+	}
+	buf[i] = '\0';
+}
+
+// the per-call parse loq() used to do; returns a checksum of what the
+// logging code saw
+static unsigned int old_walk(const char *fmt, char *keys, char (*istrs)[4])
+{
+	int argnum = 2, count = 1, n = 0;
+	unsigned int sum = 0;
+	char key = 0, g_istr[4];
+
+	while (--count != 0 || *fmt != 0) {
+		if (count == 0) {
+			if (*fmt == 0) break;
+			count = *fmt >= '2' && *fmt <= '9' ? *fmt++ - '0' : 1;
+			key = *fmt++;
+		}
+		num_to_string(g_istr, 4, argnum);
+		argnum++;
+		if (keys) {
+			keys[n] = key;
+			memcpy(istrs[n], g_istr, 4);
+		}
+		n++;
+		sum = sum * 31 + key + g_istr[0] + g_istr[1];
+	}
+	return sum;
+}
+
+static unsigned int new_walk(const log_fmt_t *desc)
+{
+	unsigned int n, sum = 0;
+	char key, g_istr[4];
+
+	for (n = 0; n < desc->count; n++) {
+		const log_arg_t *arg = &desc->args[n];
+		key = arg->type;
+		memcpy(g_istr, arg->key, sizeof(g_istr));
+		sum = sum * 31 + key + g_istr[0] + g_istr[1];
+	}
+	return sum;
+}
+
+int main()
+{
+	static log_fmt_t *descs[MAX_FORMATS];
+	char keys[128], istrs[128][4];
+	unsigned int i, n, failures = 0, args = 0, longest = 0, rounds = 2000;
+	unsigned int old_sum = 0, new_sum = 0;
+	glob_t g;
+	clock_t t0;
+	double t_old, t_new;
+
+	if (glob("../hook_*.c", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++)
+			collect(g.gl_pathv[i]);
+		globfree(&g);
+	}
+	if (nformats < 100) {
+		printf("only %u formats found\n", nformats);
+		return 1;
+	}
+
+	for (i = 0; i < nformats; i++) {
+		unsigned int count = log_fmt_count(formats[i]);
+		descs[i] = malloc(log_fmt_size(count));
+		log_fmt_compile(formats[i], descs[i]);
+
+		memset(keys, 0, sizeof(keys));
+		old_walk(formats[i], keys, istrs);
+		if (descs[i]->count != count || count > 128) {
+			printf("  \"%s\": %u arguments, counted %u\n", formats[i], descs[i]->count, count);
+			failures++;
+			continue;
+		}
+		for (n = 0; n < count; n++)
+			if (descs[i]->args[n].type != keys[n] || strcmp(descs[i]->args[n].key, istrs[n])) {
+				printf("  \"%s\": argument %u differs\n", formats[i], n);
+				failures++;
+				break;
+			}
+		args += count;
+		if (count > longest)
+			longest = count;
+	}
+	printf("%u formats from the hooks, %u arguments, longest %u: descriptors match\n", nformats, args, longest);
+
+	// repeat counts and the edge cases of the old parser
+	{
+		log_fmt_t *d = malloc(log_fmt_size(20));
+		log_fmt_compile("3s2ui9p", d);
+		if (d->count != 15 || d->args[2].type != 's' || d->args[4].type != 'u' || d->args[5].type != 'i' || strcmp(d->args[14].key, "16"))
+			failures++;
+		log_fmt_compile("", d);
+		if (d->count != 0 || log_fmt_count("") != 0 || log_fmt_count("2") != 0)
+			failures++;
+		free(d);
+	}
+
+	t0 = clock();
+	for (n = 0; n < rounds; n++)
+		for (i = 0; i < nformats; i++)
+			old_sum += old_walk(formats[i], NULL, NULL);
+	t_old = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+
+	t0 = clock();
+	for (n = 0; n < rounds; n++)
+		for (i = 0; i < nformats; i++)
+			new_sum += new_walk(descs[i]);
+	t_new = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+
+	if (old_sum != new_sum)
+		failures++;
+	printf("parse per call: %.1f ns/call, compiled: %.1f ns/call (%.1fx)\n",
+		t_old * 1e9 / rounds / nformats, t_new * 1e9 / rounds / nformats, t_old / t_new);
+
+	for (i = 0; i < nformats; i++) {
+		free(formats[i]);
+		free(descs[i]);
+	}
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,214 @@
+// Cross-checks the candidate filter used by ScanForPE/ScanForDisguisedPE
+// against a byte-by-byte reference scan over synthetic buffers with embedded,
+// disguised and stripped-header PE images, then compares throughput.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../CAPE/PEScan.h"
+
+#define PAGE_SIZE 0x1000
+
+typedef struct _bounds_t {
+	const unsigned char *end;
+	unsigned long calls;
+} bounds_t;
+
+static unsigned int rd16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+static unsigned int rd32(const unsigned char *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24); }
+static void wr16(unsigned char *p, unsigned int v) { p[0] = v; p[1] = v >> 8; }
+static void wr32(unsigned char *p, unsigned int v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+
+// IsDisguisedPEHeader + TestPERequirements, bounded instead of SEH-guarded
+static int validate_disguised(const unsigned char *dos, void *ctx)
+{
+	bounds_t *b = ctx;
+	const unsigned char *nt, *sec;
+	unsigned int e_lfanew, nsec, optsize, magic, i;
+
+	b->calls++;
+	if (dos + 0x40 > b->end)
+		return 0;
+	e_lfanew = rd32(dos + 0x3c);
+	if (!e_lfanew || e_lfanew >= 0x200 || (e_lfanew & 3))
+		return 0;
+	nt = dos + e_lfanew;
+	if (nt + 0x58 > b->end)
+		return 0;
+	magic = rd16(nt + 0x18);
+	if (magic != 0x10b && magic != 0x20b)
+		return 0;
+	nsec = rd16(nt + 6);
+	if (!nsec)
+		return 0;
+	if (!rd32(nt + 0x50) || rd32(nt + 0x50) > 0x77000000)
+		return 0;
+	optsize = rd16(nt + 0x14);
+	sec = nt + 0x18 + optsize;
+	for (i = 0; i < nsec; i++, sec += 40) {
+		if (sec + 40 > b->end)
+			return 0;
+		if (!rd32(sec + 8) && !rd32(sec + 16))
+			return 0;
+	}
+	return 1;
+}
+
+// the basic requirements tested by ScanForPE once "PE\0\0" is found
+static int validate_mz(const unsigned char *dos, void *ctx)
+{
+	bounds_t *b = ctx;
+	const unsigned char *nt = dos + rd32(dos + 0x3c);
+
+	b->calls++;
+	if (nt + 0x40 > b->end)
+		return 0;
+	return rd16(nt + 4) && rd16(nt + 0x14) && rd32(nt + 0x3c);
+}
+
+static int reference_scan(const unsigned char *buf, size_t size, size_t limit, int mode, size_t *offset)
+{
+	bounds_t b = {buf + size, 0};
+	size_t p;
+
+	for (p = 0; p < limit; p++) {
+		if (mode == PESCAN_MODE_MZ) {
+			size_t e_lfanew;
+			if (p + 0x40 > size || buf[p] != 'M' || buf[p+1] != 'Z')
+				continue;
+			e_lfanew = rd32(buf + p + 0x3c);
+			if (!e_lfanew || e_lfanew > size - p || size - p - e_lfanew < 4 || memcmp(buf + p + e_lfanew, "PE\0\0", 4))
+				continue;
+			if (!validate_mz(buf + p, &b))
+				continue;
+		}
+		else if (validate_disguised(buf + p, &b) <= 0)
+			continue;
+		*offset = p;
+		return 1;
+	}
+	return 0;
+}
+
+enum { PE_EMBEDDED, PE_DISGUISED, PE_STRIPPED, PE_OVERLAPPED, PE_KINDS };
+
+static void plant_pe(unsigned char *buf, size_t at, int kind, int is64)
+{
+	unsigned int e_lfanew = kind == PE_OVERLAPPED ? 0x20 : kind == PE_STRIPPED ? 0x40 : 0x80 + 8 * (rand() % 16);
+	unsigned int optsize = is64 ? 0xf0 : 0xe0, i;
+	unsigned char *nt = buf + at + e_lfanew, *sec;
+
+	if (kind == PE_STRIPPED)
+		memset(buf + at, 0, e_lfanew);
+	memset(nt, 0, 0x18 + optsize + 3 * 40);
+	if (kind == PE_EMBEDDED) {
+		buf[at] = 'M';
+		buf[at+1] = 'Z';
+		memcpy(nt, "PE\0\0", 4);
+	}
+	wr16(nt + 4, is64 ? 0x8664 : 0x14c);
+	wr16(nt + 6, 3);
+	wr16(nt + 0x14, optsize);
+	wr16(nt + 0x18, is64 ? 0x20b : 0x10b);
+	wr32(nt + 0x50, 0x5000);
+	wr32(nt + 0x3c, 0x400);
+	// for the overlapped case e_lfanew sits inside the optional header
+	wr32(buf + at + 0x3c, e_lfanew);
+	sec = nt + 0x18 + optsize;
+	for (i = 0; i < 3; i++, sec += 40) {
+		wr32(sec + 8, 0x1000);
+		wr32(sec + 16, 0x200);
+	}
+}
+
+static void fill_noise(unsigned char *buf, size_t size)
+{
+	size_t i;
+	for (i = 0; i < size; i++)
+		buf[i] = rand() & 0xff;
+	// sprinkle decoys: bare signatures and magics without a matching e_lfanew
+	for (i = 0; i + 2 < size; i += 97 + rand() % 512) {
+		switch (rand() % 3) {
+		case 0: buf[i] = 'M'; buf[i+1] = 'Z'; break;
+		case 1: buf[i] = 0x0b; buf[i+1] = 1 + rand() % 2; break;
+		default: memset(buf + i, 0, 2); break;
+		}
+	}
+}
+
+// walk the buffer the way DumpPEsInRange does, comparing every hit
+static int compare_walk(const unsigned char *buf, size_t size, int mode)
+{
+	size_t pos = 0;
+	int hits = 0;
+
+	while (size - pos > PAGE_SIZE) {
+		bounds_t b = {buf + size, 0};
+		size_t ref = 0, got = 0, limit = mode == PESCAN_MODE_MZ ? size - pos - 1 : size - pos - PAGE_SIZE;
+		int r1 = reference_scan(buf + pos, size - pos, limit, mode, &ref);
+		int r2 = PEScanFindCandidate(buf + pos, size - pos, limit, mode, mode == PESCAN_MODE_MZ ? validate_mz : validate_disguised, &b, &got);
+		if (r1 != r2 || (r1 && ref != got)) {
+			printf("  mismatch at base 0x%zx: reference %d/0x%zx, filter %d/0x%zx\n", pos, r1, ref, r2, got);
+			return -1;
+		}
+		if (!r1)
+			break;
+		hits++;
+		pos += got + PAGE_SIZE;
+	}
+	return hits;
+}
+
+int main()
+{
+	size_t size = 0x40000, big = 64 << 20, i, off;
+	unsigned char *buf = malloc(big);
+	int round, mode, failures = 0;
+	clock_t t0;
+	bounds_t b;
+
+	srand(1337);
+
+	for (round = 0; round < 200; round++) {
+		int planted = 0;
+		fill_noise(buf, size);
+		for (i = 0x100 + rand() % 0x3000; i + 0x1000 < size; i += 0x2000 + rand() % 0x8000) {
+			plant_pe(buf, i, (planted + round) % PE_KINDS, rand() & 1);
+			planted++;
+		}
+		for (mode = PESCAN_MODE_MZ; mode <= PESCAN_MODE_DISGUISED; mode++) {
+			int hits = compare_walk(buf, size, mode);
+			if (hits < 0)
+				failures++;
+			if (round == 0)
+				printf("%s: %d planted, %d found\n", mode == PESCAN_MODE_MZ ? "ScanForPE" : "ScanForDisguisedPE", planted, hits);
+		}
+	}
+	printf("corpus: %d mismatches over %d rounds\n", failures, round);
+
+	// throughput: a large region with a single image near the end
+	fill_noise(buf, big);
+	plant_pe(buf, big - 0x10000, PE_DISGUISED, 0);
+
+	t0 = clock();
+	reference_scan(buf, big, big - PAGE_SIZE, PESCAN_MODE_DISGUISED, &off);
+	printf("disguised, byte by byte: %.1f MB/s\n", (big >> 20) / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC));
+
+	b.end = buf + big;
+	b.calls = 0;
+	t0 = clock();
+	PEScanFindCandidate(buf, big, big - PAGE_SIZE, PESCAN_MODE_DISGUISED, validate_disguised, &b, &off);
+	printf("disguised, candidate filter: %.1f MB/s (%lu full validations)\n", (big >> 20) / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC), b.calls);
+
+	t0 = clock();
+	reference_scan(buf, big, big - 1, PESCAN_MODE_MZ, &off);
+	printf("MZ, byte by byte: %.1f MB/s\n", (big >> 20) / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC));
+
+	b.calls = 0;
+	t0 = clock();
+	PEScanFindCandidate(buf, big, big - 1, PESCAN_MODE_MZ, validate_mz, &b, &off);
+	printf("MZ, candidate filter: %.1f MB/s (%lu full validations)\n", (big >> 20) / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC), b.calls);
+
+	free(buf);
+	return failures != 0;
+}
@@ -0,0 +1,236 @@
+// Simulates the api-rate-cap token buckets against a coarse tick clock:
+// bursts, refills (also at rates below one call a tick), steady streams
+// either side of the budget and a clock going backwards, comparing what
+// gets through with the window check enter_hook() used to make. Then times
+// both with several threads hammering one hook, the old way updating the
+// shared hook_t fields and the new one per-thread buckets adding to the
+// shared count once a batch.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../rate_limit.h"
+
+#define TICK 16			// ms, as the tick count moves
+#define BATCH 0x40		// hooking.c's HOOK_COUNT_BATCH
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("  " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+// the fields enter_hook() used to update in the shared hook_t
+typedef struct _old_hook_t {
+	unsigned int hook_timer;
+	unsigned int counter;
+	unsigned int rate_counter;
+	unsigned int hook_disabled;
+} old_hook_t;
+
+// the old check, with the system time in 100ns units
+static int old_check(volatile old_hook_t *h, unsigned int time, unsigned int limit, unsigned int count_limit)
+{
+	if (h->hook_disabled)
+		return 0;
+	h->counter++;
+	if (h->counter > count_limit) {
+		h->hook_disabled = 1;
+		return 0;
+	}
+	if (time - h->hook_timer < 100) {
+		h->rate_counter++;
+		if (h->rate_counter > limit) {
+			h->rate_counter = 0;
+			h->hook_disabled = 1;
+			return 0;
+		}
+	}
+	else {
+		h->rate_counter = 0;
+		h->hook_timer = time;
+	}
+	return 1;
+}
+
+// calls a second, evenly spread, for ms; returns the calls let through
+// before the first refusal (all of them if there was none)
+static unsigned int stream(const rate_budget_t *budget, unsigned int calls_per_sec, unsigned int ms, int old)
+{
+	rate_bucket_t b;
+	old_hook_t h;
+	unsigned long long n, total = (unsigned long long)calls_per_sec * ms / 1000;
+
+	memset(&b, 0, sizeof(b));
+	memset(&h, 0, sizeof(h));
+	h.hook_timer = 0xf0000000;
+	for (n = 0; n < total; n++) {
+		unsigned int t = (unsigned int)(n * 1000 / calls_per_sec);
+		unsigned int now = 1000 + t - t % TICK;
+		if (old ? !old_check(&h, now * 10000, 0x100, 0x10000) : !rate_limit_take(&b, budget, now))
+			return (unsigned int)n;
+	}
+	return (unsigned int)total;
+}
+
+static void simulate(void)
+{
+	rate_budget_t budget = { 0x4000, 0x100 };
+	rate_budget_t slow = { 10, 3 };
+	rate_bucket_t b;
+	unsigned int i, n, now;
+
+	// a full bucket to start with, then nothing until the clock moves
+	memset(&b, 0, sizeof(b));
+	for (n = 0; rate_limit_take(&b, &budget, 5000); n++);
+	CHECK(n == 0x100, "burst: %u calls through, expected 256", n);
+	CHECK(b.pending == 0x100, "burst: %u pending", b.pending);
+	CHECK(!rate_limit_take(&b, &budget, 5000), "empty bucket let a call through");
+
+	// one tick refills 16ms worth, 262.144 calls, capped at the burst
+	for (n = 0; rate_limit_take(&b, &budget, 5000 + TICK); n++);
+	CHECK(n == 0x100, "refill after a tick: %u calls", n);
+	for (n = 0; rate_limit_take(&b, &budget, 5000 + TICK + 1); n++);
+	CHECK(n == 16, "refill after 1ms: %u calls, expected 16", n);
+
+	// 10 a second with a 16ms clock: each tick adds 0.16 of a call, which
+	// has to add up
+	memset(&b, 0, sizeof(b));
+	for (n = 0; rate_limit_take(&b, &slow, 0); n++);
+	for (now = TICK, i = 0; now <= 10000; now += TICK)
+		i += rate_limit_take(&b, &slow, now);
+	CHECK(i == 100, "slow rate: %u calls in 10s, expected 100", i);
+
+	// the clock going backwards refills nothing
+	memset(&b, 0, sizeof(b));
+	for (n = 0; rate_limit_take(&b, &slow, 100000); n++);
+	CHECK(!rate_limit_take(&b, &slow, 50000), "clock went backwards and refilled");
+	CHECK(rate_limit_take(&b, &slow, 50100) && !rate_limit_take(&b, &slow, 50100), "no refill after the clock went backwards");
+
+	// and a wrapping one carries on
+	memset(&b, 0, sizeof(b));
+	for (n = 0; rate_limit_take(&b, &slow, 0xffffff00); n++);
+	CHECK(rate_limit_take(&b, &slow, 0x100), "refill across the wrap");
+
+	// rate 0 never refills once the burst is used
+	memset(&b, 0, sizeof(b));
+	slow.rate = 0;
+	for (n = 0; n < 10 && rate_limit_take(&b, &slow, n * 1000); n++);
+	CHECK(n == 3, "rate 0: %u calls", n);
+
+	// steady streams: the old window check and the bucket agree on what's
+	// spam, give or take the tick the old check counted in
+	{
+		static const unsigned int rates[] = { 100, 1000, 10000, 15000, 20000, 40000, 100000, 1000000 };
+		printf("calls/s   old window   bucket   (calls let through in 2s)\n");
+		for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+			unsigned int o = stream(&budget, rates[i], 2000, 1), t = stream(&budget, rates[i], 2000, 0);
+			unsigned long long total = (unsigned long long)rates[i] * 2;
+			printf("%8u %12u %8u\n", rates[i], o, t);
+			if (rates[i] <= 15000)
+				CHECK(o == total && t == total, "%u calls/s stopped", rates[i]);
+			if (rates[i] >= 20000)
+				CHECK(o < total && t < total, "%u calls/s went through", rates[i]);
+		}
+	}
+}
+
+#define THREADS 4
+#define CALLS 4000000
+
+static volatile old_hook_t g_old;
+static struct {
+	volatile long counter;
+	char pad[60];
+} g_new;
+static volatile unsigned int g_clock = 1;
+static volatile long g_flushes;
+static pthread_barrier_t g_barrier;
+
+// both clocks are a call reading a shared value, moving every 1024 calls
+__attribute__((noinline)) static void system_time(unsigned int *ft, unsigned int i)
+{
+	*ft = (g_clock + (i >> 10)) * 10000;
+}
+
+__attribute__((noinline)) static unsigned int tick_count(unsigned int i)
+{
+	return g_clock + (i >> 10);
+}
+
+static void *old_thread(void *arg)
+{
+	unsigned int i, ft, through = 0;
+
+	pthread_barrier_wait(&g_barrier);
+	for (i = 0; i < CALLS; i++) {
+		// limits out of reach, so every call goes through
+		system_time(&ft, i);
+		through += old_check(&g_old, ft, 0xffffffff, 0xffffffff);
+	}
+	return (void *)(size_t)through;
+}
+
+static void *new_thread(void *arg)
+{
+	rate_budget_t budget = { 0x7fffffff, RATE_LIMIT_MAX_BURST };
+	rate_bucket_t b;
+	unsigned int i, through = 0;
+
+	memset(&b, 0, sizeof(b));
+	pthread_barrier_wait(&g_barrier);
+	for (i = 0; i < CALLS; i++) {
+		if (!rate_limit_take(&b, &budget, tick_count(i)))
+			continue;
+		through++;
+		if (b.pending >= BATCH) {
+			__sync_fetch_and_add(&g_new.counter, (long)b.pending);
+			__sync_fetch_and_add(&g_flushes, 1);
+			b.pending = 0;
+		}
+	}
+	__sync_fetch_and_add(&g_new.counter, (long)b.pending);
+	return (void *)(size_t)through;
+}
+
+static double run(void *(*fn)(void *), unsigned int *through)
+{
+	pthread_t threads[THREADS];
+	struct timespec t0, t1;
+	unsigned int i;
+	void *ret;
+
+	pthread_barrier_init(&g_barrier, NULL, THREADS);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, fn, NULL);
+	for (*through = 0, i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], &ret);
+		*through += (unsigned int)(size_t)ret;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_barrier_destroy(&g_barrier);
+	return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+int main()
+{
+	unsigned int through;
+	double t_old, t_new;
+
+	simulate();
+
+	t_old = run(old_thread, &through);
+	t_new = run(new_thread, &through);
+	CHECK(through == THREADS * CALLS, "%u calls through, expected %u", through, THREADS * CALLS);
+	CHECK(g_new.counter == (long)through, "shared count %ld, %u calls through", g_new.counter, through);
+	// the old check writes the shared line twice a call (the count, then the
+	// window count or its start); how much that costs depends on how many
+	// CPUs the threads are spread over
+	printf("%u threads on one hook, %ld CPUs: shared fields %.1f ns/call, per-thread buckets %.1f ns/call (%.1fx)\n",
+		THREADS, sysconf(_SC_NPROCESSORS_ONLN), t_old / THREADS / CALLS, t_new / THREADS / CALLS, t_old / t_new);
+	printf("writes to the shared hook_t per call: 2 before, %.4f now\n", (double)g_flushes / through);
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,131 @@
+// Replays a registry workload against the key name cache: handles are opened,
+// queried a few times each and closed again, with handle values reused the
+// way the kernel hands them out (lowest free first), some of them behind the
+// hooks' back. Every cached answer is checked against the name the handle
+// really has, and may only be stale for KEY_CACHE_MAX_AGE after an unseen
+// reopen; the hit rate gives the share of NtQueryKey calls the logger no
+// longer makes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../key_cache.h"
+
+#define HANDLES 2048
+
+static unsigned short names[HANDLES][64];
+static unsigned int lens[HANDLES];
+static int open_now[HANDLES];
+static unsigned int reopened_at[HANDLES];
+static int unseen[HANDLES];
+
+static uintptr_t handle_value(int i)
+{
+	return 0x40 + 4 * (uintptr_t)i;
+}
+
+static void make_name(int i, unsigned int serial)
+{
+	char buf[64];
+	unsigned int n, j;
+
+	n = (unsigned int)snprintf(buf, sizeof(buf), "\\REGISTRY\\MACHINE\\SOFTWARE\\Key%u", serial);
+	for (j = 0; j < n; j++)
+		names[i][j] = (unsigned char)buf[j];
+	lens[i] = n * 2;
+}
+
+int main()
+{
+	static key_cache_t cache;
+	unsigned short out[64];
+	unsigned int failures = 0, queries = 0, serial = 0, stale = 0, now = 0, i, step;
+	int n;
+
+	srand(34);
+	key_cache_init(&cache);
+
+	// basics
+	make_name(0, 1);
+	key_cache_store(&cache, handle_value(0), names[0], lens[0], 0);
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0) != (int)lens[0] || memcmp(out, names[0], lens[0]))
+		failures++;
+	if (key_cache_lookup(&cache, handle_value(0), out, lens[0] - 2, 0) != -1)
+		failures++;
+	if (key_cache_lookup(&cache, handle_value(1), out, sizeof(out), 0) != -1 || key_cache_lookup(&cache, 0, out, sizeof(out), 0) != -1)
+		failures++;
+	key_cache_remove(&cache, handle_value(0));
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0) != -1)
+		failures++;
+	key_cache_store(&cache, handle_value(0), names[0], KEY_CACHE_MAX_NAME * 2 + 2, 0);
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0) != -1)
+		failures++;
+	// trusted up to the age limit, then asked for again
+	key_cache_store(&cache, handle_value(0), names[0], lens[0], 0xfffffff0);
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0xfffffff0 + KEY_CACHE_MAX_AGE) != (int)lens[0])
+		failures++;
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0xfffffff0 + KEY_CACHE_MAX_AGE + 1) != -1 ||
+		key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0xfffffff0) != -1)
+		failures++;
+	key_cache_store(&cache, handle_value(0), names[0], lens[0], 0);
+	key_cache_clear(&cache);
+	if (key_cache_lookup(&cache, handle_value(0), out, sizeof(out), 0) != -1)
+		failures++;
+
+	// the workload, with hooks calling remove on open and close as misc.c does
+	key_cache_init(&cache);
+	for (step = 0; step < 2000000; step++) {
+		int r = rand() % 16;
+		// 10 lookups a ms
+		now = step / 10;
+		if (r == 0) {
+			for (i = 0; i < HANDLES && open_now[i]; i++);
+			if (i == HANDLES)
+				continue;
+			open_now[i] = 1;
+			make_name(i, ++serial);
+			key_cache_remove(&cache, handle_value(i));
+			unseen[i] = 0;
+		}
+		else if (r == 1) {
+			i = rand() % HANDLES;
+			if (open_now[i]) {
+				open_now[i] = 0;
+				key_cache_remove(&cache, handle_value(i));
+			}
+		}
+		else if (r == 2 && rand() % 64 == 0) {
+			// closed and the value reused by an open the hooks didn't see
+			i = rand() % 32;
+			if (!open_now[i])
+				continue;
+			make_name(i, ++serial);
+			reopened_at[i] = now;
+			unseen[i] = 1;
+		}
+		else {
+			// most keys in use are a few hot ones
+			i = rand() % (r < 12 ? 32 : HANDLES);
+			if (!open_now[i])
+				continue;
+			queries++;
+			n = key_cache_lookup(&cache, handle_value(i), out, sizeof(out), now);
+			if (n < 0)
+				key_cache_store(&cache, handle_value(i), names[i], lens[i], now);
+			else if ((unsigned int)n != lens[i] || memcmp(out, names[i], n)) {
+				if (unseen[i] && now - reopened_at[i] <= KEY_CACHE_MAX_AGE)
+					stale++;
+				else if (failures++ < 5)
+					printf("  stale name for handle %#lx\n", (unsigned long)handle_value(i));
+			}
+		}
+	}
+	printf("%u key name lookups: %u hits, %u NtQueryKey calls (%.1f%% avoided), %u stale after unseen reopens\n", queries,
+		cache.hits, cache.misses, 100.0 * cache.hits / queries, stale);
+	if (cache.hits < queries / 2)
+		failures++;
+
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+		free(cache.slots[i].name);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,644 @@
+// Checks masked signature search against a byte-by-byte scan on random
+// code-like bytes, then runs the misc.c finders both ways, the old loops
+// and the signature based ones, over synthetic .text sections laid out as
+// in x86 and x64 jscript, mshtml and ntdll: the strings they look for, the
+// push or lea of them, prologues, calls and the notification list setup.
+// The answers must agree with each other and with what was planted. Then
+// times the two, and checks that the planted answers, and nothing moved or
+// swapped, pass the checks a child makes of a parent's hook plan.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../code_sig.h"
+
+typedef unsigned char *PUCHAR;
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("  " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+static const unsigned char *naive_find(const code_sig_t *s, const unsigned char *start, const unsigned char *end, int last)
+{
+	const unsigned char *p, *found = NULL;
+	unsigned int i;
+
+	for (p = start; end - p >= (long)s->len; p++) {
+		for (i = 0; i < s->len; i++)
+			if ((p[i] & s->mask[i]) != s->bytes[i])
+				break;
+		if (i == s->len) {
+			if (!last)
+				return p;
+			found = p;
+		}
+	}
+	return found;
+}
+
+// bytes with roughly the spread of compiled code: lots of zeros, int3 and
+// nop padding, common opcodes and modrm bytes
+static unsigned char code_byte(void)
+{
+	static const unsigned char common[] = { 0x00, 0x00, 0x00, 0xcc, 0x8b, 0x89, 0x48, 0xff, 0x24, 0x45, 0x0f, 0x85, 0xc0, 0x74, 0x75, 0xe8, 0x50, 0x56, 0x5d, 0xc3 };
+	unsigned int r = rand() % 100;
+
+	return r < 60 ? common[r % sizeof(common)] : (unsigned char)rand();
+}
+
+static void check_random(void)
+{
+	static unsigned char buf[1 << 16];
+	static const unsigned char masks[] = { 0xff, 0xff, 0xff, 0xff, 0x00, 0xf8, 0xf0 };
+	unsigned int i, n, tries = 0;
+	code_sig_t s;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = code_byte();
+
+	for (n = 0; n < 20000; n++) {
+		unsigned char bytes[CODE_SIG_MAX_LEN], mask[CODE_SIG_MAX_LEN];
+		unsigned int len = 1 + rand() % (n % 4 ? 8 : CODE_SIG_MAX_LEN);
+		unsigned int a = rand() % sizeof(buf), b = rand() % sizeof(buf), from = rand() % sizeof(buf);
+		const unsigned char *start, *end;
+
+		for (i = 0; i < len; i++) {
+			mask[i] = masks[rand() % sizeof(masks)];
+			// mostly taken from the buffer so there is something to find
+			bytes[i] = n % 3 && from + len <= sizeof(buf) ? buf[from + i] : code_byte();
+		}
+		if (a > b) {
+			unsigned int t = a;
+			a = b;
+			b = t;
+		}
+		start = buf + a;
+		end = buf + b;
+		if (!code_sig_compile(&s, bytes, mask, len)) {
+			CHECK(0, "length %u didn't compile", len);
+			continue;
+		}
+		CHECK(code_sig_find(&s, start, end) == naive_find(&s, start, end, 0), "find, length %u over [%u, %u)", len, a, b);
+		CHECK(code_sig_find_last(&s, start, end) == naive_find(&s, start, end, 1), "find last, length %u over [%u, %u)", len, a, b);
+		tries++;
+	}
+	printf("%u random masked signatures: searches match a byte-by-byte scan\n", tries);
+
+	CHECK(code_sig_parse(&s, "e8 ?? ?? ?? ??") && s.len == 5 && s.mask[1] == 0 && s.bytes[0] == 0xe8, "parse");
+	CHECK(code_sig_parse(&s, "8B FF 55 8b EC") && s.len == 5 && s.bytes[1] == 0xff && s.mask[4] == 0xff, "parse upper case");
+	CHECK(!code_sig_parse(&s, "e8 ?"), "parsed a half byte");
+	CHECK(!code_sig_parse(&s, "e8 zz"), "parsed a bad digit");
+	CHECK(!code_sig_parse(&s, ""), "parsed nothing");
+	CHECK(!code_sig_parse(&s, "00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20"), "parsed 33 bytes");
+	CHECK(code_sig_parse(&s, "c2 08 00") && code_sig_find(&s, buf, buf + 2) == NULL && code_sig_find(&s, NULL, NULL) == NULL, "searched a short range");
+}
+
+static PUCHAR get_rel_target(PUCHAR buf)
+{
+	return buf + 5 + *(int *)&buf[1];
+}
+
+static void put_rel(PUCHAR site, PUCHAR target)
+{
+	*(int *)&site[1] = (int)(target - (site + 5));
+}
+
+// misc.c's finders as they were, with the _WIN64 choice made at run time
+static PUCHAR old_caller(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	PUCHAR p;
+	for (p = start; p < end - 5; p++)
+		if (p[0] == 0xe8 && get_rel_target(p) == target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR old_push(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	PUCHAR p;
+	for (p = start; p < end - 5; p++)
+		if (p[0] == 0x68 && *(unsigned int *)&p[1] == (unsigned int)(size_t)target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR old_lea(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	PUCHAR p;
+	for (p = start; p < end - 7; p++)
+		if (p[0] == 0x48 && p[1] == 0x8d && get_rel_target(&p[2]) == target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR old_mov(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	PUCHAR p;
+	for (p = start; p < end - 5; p++)
+		if (((p[0] & 0xf8) == 0xb8) && *(unsigned int *)&p[1] == (unsigned int)(size_t)target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR old_string(PUCHAR start, PUCHAR end, PUCHAR str, unsigned int len)
+{
+	PUCHAR p;
+	for (p = start; p < end - len; p++)
+		if (!memcmp(p, str, len))
+			return p;
+	return NULL;
+}
+
+static PUCHAR old_prologue(PUCHAR start, PUCHAR end, PUCHAR target, int x64)
+{
+	PUCHAR p;
+	for (p = target - 5; p > (target - 0x1000) && p >= start; p--)
+		if (x64 ? !memcmp(p, "\x90\x90\x90\x90\x90", 5) : !memcmp(p, "\x8b\xff\x55\x8b\xec", 5))
+			return x64 ? p + 6 : p;
+	return NULL;
+}
+
+static PUCHAR old_jseval(PUCHAR start, PUCHAR end, int x64)
+{
+	PUCHAR p = old_string(start, end, (PUCHAR)"e\0v\0a\0l\0 \0c\0o\0d\0e\0\0", 20);
+	if (p == NULL)
+		return NULL;
+	p = x64 ? old_lea(start, end, p) : old_push(start, end, p);
+	if (p == NULL)
+		return NULL;
+	return old_prologue(start, end, p, x64);
+}
+
+static PUCHAR old_parsescripttext(PUCHAR start, PUCHAR end, int x64)
+{
+	PUCHAR p, scriptblock = old_string(start, end, (PUCHAR)"s\0c\0r\0i\0p\0t\0 \0b\0l\0o\0c\0k\0\0", 26);
+	if (scriptblock == NULL)
+		return NULL;
+	p = x64 ? old_lea(start, end, scriptblock) : old_push(start, end, scriptblock);
+	if (p == NULL && !x64)
+		p = old_mov(start, end, scriptblock);
+	if (p == NULL || (p = old_prologue(start, end, p, x64)) == NULL || (p = old_caller(start, end, p)) == NULL)
+		return NULL;
+	return old_prologue(start, end, p, x64);
+}
+
+static PUCHAR old_cdocument_write(PUCHAR start, PUCHAR end, int x64)
+{
+	PUCHAR p, newline = old_string(start, end, (PUCHAR)"\r\0\n\0\0", 6);
+	if (newline == NULL)
+		return NULL;
+	for (p = start; p < end - 10; p++) {
+		if (x64 && p[0] == 0x48 && p[1] == 0x8d && p[2] == 0x15 && get_rel_target(&p[2]) == newline && p[7] == 0xe8) {
+			PUCHAR x, firstfunc = NULL, secondfunc = NULL, writelnstart = old_prologue(start, end, p, x64);
+			if (writelnstart == NULL)
+				goto next_iter;
+			for (x = writelnstart; x < p; x++) {
+				if (x[0] == 0xe8) {
+					PUCHAR target = get_rel_target(x);
+					if (target >= start && target < end) {
+						if (firstfunc == NULL)
+							firstfunc = target;
+						else if (secondfunc == NULL)
+							secondfunc = target;
+						else if (target != firstfunc)
+							goto next_iter;
+					}
+				}
+			}
+			if (firstfunc && secondfunc)
+				return secondfunc;
+		}
+		if (!x64 && p[0] == 0x68 && *(unsigned int *)&p[1] == (unsigned int)(size_t)newline && p[5] == 0xe8) {
+			PUCHAR x, y;
+			for (x = p + 10; x < p + 0x80; x++)
+				if (!memcmp(x, "\xc2\x08\x00", 3))
+					for (y = p; y > p - 0x80; y--)
+						if (y[0] == 0xe8) {
+							PUCHAR target = get_rel_target(y);
+							if (target > start && target < end) {
+								if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
+									return target;
+								else if ((*(y - 1) & 0xf8) == 0x50)
+									return target;
+							}
+						}
+		}
+next_iter:
+		;
+	}
+	return NULL;
+}
+
+static PUCHAR old_dll_notification(PUCHAR start, PUCHAR end)
+{
+	PUCHAR p;
+	for (p = start; p < end - 30; p++)
+		if (p[0] == 0xb8 && p[5] == 0xa3 && p[10] == 0xa3 && p[15] == 0xb8 && p[20] == 0xa3 && p[25] == 0xa3) {
+			if (*(unsigned int *)&p[1] == *(unsigned int *)&p[16] + 8)
+				continue;
+			return p;
+		}
+	return NULL;
+}
+
+// and as they are now
+static PUCHAR new_caller(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	code_sig_t sig;
+	PUCHAR p;
+	code_sig_parse(&sig, "e8 ?? ?? ?? ??");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++)
+		if (get_rel_target(p) == target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR new_imm32(PUCHAR start, PUCHAR end, PUCHAR target, unsigned char opcode, unsigned char opmask)
+{
+	code_sig_t sig;
+	unsigned char bytes[5], mask[5] = { opmask, 0xff, 0xff, 0xff, 0xff };
+	bytes[0] = opcode;
+	*(unsigned int *)&bytes[1] = (unsigned int)(size_t)target;
+	code_sig_compile(&sig, bytes, mask, sizeof(bytes));
+	return (PUCHAR)code_sig_find(&sig, start, end);
+}
+
+static PUCHAR new_lea(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	code_sig_t sig;
+	PUCHAR p;
+	code_sig_parse(&sig, "48 8d ?? ?? ?? ?? ??");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++)
+		if (get_rel_target(&p[2]) == target)
+			return p;
+	return NULL;
+}
+
+static PUCHAR new_string(PUCHAR start, PUCHAR end, PUCHAR str, unsigned int len)
+{
+	code_sig_t sig;
+	code_sig_compile(&sig, str, NULL, len);
+	return (PUCHAR)code_sig_find(&sig, start, end);
+}
+
+static PUCHAR new_prologue(PUCHAR start, PUCHAR end, PUCHAR target, int x64)
+{
+	code_sig_t sig;
+	PUCHAR lo = target - start > 0xfff ? target - 0xfff : start, p;
+	code_sig_parse(&sig, x64 ? "90 90 90 90 90" : "8b ff 55 8b ec");
+	p = (PUCHAR)code_sig_find_last(&sig, lo, target);
+	return p && x64 ? p + 6 : p;
+}
+
+static PUCHAR new_jseval(PUCHAR start, PUCHAR end, int x64)
+{
+	PUCHAR p = new_string(start, end, (PUCHAR)"e\0v\0a\0l\0 \0c\0o\0d\0e\0\0", 20);
+	if (p == NULL)
+		return NULL;
+	p = x64 ? new_lea(start, end, p) : new_imm32(start, end, p, 0x68, 0xff);
+	if (p == NULL)
+		return NULL;
+	return new_prologue(start, end, p, x64);
+}
+
+static PUCHAR new_parsescripttext(PUCHAR start, PUCHAR end, int x64)
+{
+	PUCHAR p, scriptblock = new_string(start, end, (PUCHAR)"s\0c\0r\0i\0p\0t\0 \0b\0l\0o\0c\0k\0\0", 26);
+	if (scriptblock == NULL)
+		return NULL;
+	p = x64 ? new_lea(start, end, scriptblock) : new_imm32(start, end, scriptblock, 0x68, 0xff);
+	if (p == NULL && !x64)
+		p = new_imm32(start, end, scriptblock, 0xb8, 0xf8);
+	if (p == NULL || (p = new_prologue(start, end, p, x64)) == NULL || (p = new_caller(start, end, p)) == NULL)
+		return NULL;
+	return new_prologue(start, end, p, x64);
+}
+
+static PUCHAR new_cdocument_write_of_reference(PUCHAR start, PUCHAR end, PUCHAR p, int x64)
+{
+	code_sig_t call, retn;
+	if (x64) {
+		PUCHAR x, firstfunc = NULL, secondfunc = NULL, writelnstart = new_prologue(start, end, p, x64);
+		if (writelnstart == NULL)
+			return NULL;
+		code_sig_parse(&call, "e8 ?? ?? ?? ??");
+		for (x = writelnstart; (x = (PUCHAR)code_sig_find(&call, x, p)) != NULL; x++) {
+			PUCHAR target = get_rel_target(x);
+			if (target >= start && target < end) {
+				if (firstfunc == NULL)
+					firstfunc = target;
+				else if (secondfunc == NULL)
+					secondfunc = target;
+				else if (target != firstfunc)
+					return NULL;
+			}
+		}
+		return secondfunc;
+	}
+	else {
+		PUCHAR retn_end = end - p > 0x82 ? p + 0x82 : end, y;
+		code_sig_parse(&retn, "c2 08 00");
+		if (code_sig_find(&retn, p + 10, retn_end) == NULL)
+			return NULL;
+		for (y = p; y > p - 0x80; y--)
+			if (y[0] == 0xe8) {
+				PUCHAR target = get_rel_target(y);
+				if (target > start && target < end) {
+					if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
+						return target;
+					else if ((*(y - 1) & 0xf8) == 0x50)
+						return target;
+				}
+			}
+		return NULL;
+	}
+}
+
+static PUCHAR new_cdocument_write(PUCHAR start, PUCHAR end, int x64, PUCHAR *witness)
+{
+	code_sig_t sig;
+	unsigned char bytes[6];
+	PUCHAR p, write, newline = new_string(start, end, (PUCHAR)"\r\0\n\0\0", 6);
+	if (newline == NULL)
+		return NULL;
+	if (x64)
+		code_sig_parse(&sig, "48 8d 15 ?? ?? ?? ?? e8");
+	else {
+		bytes[0] = 0x68;
+		*(unsigned int *)&bytes[1] = (unsigned int)(size_t)newline;
+		bytes[5] = 0xe8;
+		code_sig_compile(&sig, bytes, NULL, 6);
+	}
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		if (x64 && get_rel_target(&p[2]) != newline)
+			continue;
+		write = new_cdocument_write_of_reference(start, end, p, x64);
+		if (write) {
+			*witness = p;
+			return write;
+		}
+	}
+	return NULL;
+}
+
+// misc.c's checks of an address handed down in a hook plan, given the code
+// it was found through; an x86 immediate is taken back to a pointer into
+// text by its low 32 bits, as the host's pointers may be wider
+static int references_string(PUCHAR start, PUCHAR end, PUCHAR p, PUCHAR str, unsigned int len, int mov_reg, int x64)
+{
+	PUCHAR target;
+
+	if (p < start || end - p < 7)
+		return 0;
+	if (x64) {
+		if (p[0] != 0x48 || p[1] != 0x8d)
+			return 0;
+		target = get_rel_target(&p[2]);
+	}
+	else {
+		if (p[0] != 0x68 && (!mov_reg || (p[0] & 0xf8) != 0xb8))
+			return 0;
+		target = start + (unsigned int)(*(unsigned int *)&p[1] - (unsigned int)(size_t)start);
+	}
+	return target >= start && target < end && (unsigned int)(end - target) >= len && !memcmp(target, str, len);
+}
+
+static int check_jseval(PUCHAR start, PUCHAR end, PUCHAR addr, PUCHAR witness, int x64)
+{
+	if (!addr || !references_string(start, end, witness, (PUCHAR)"e\0v\0a\0l\0 \0c\0o\0d\0e\0\0", 20, 0, x64))
+		return 0;
+	return new_prologue(start, end, witness, x64) == addr;
+}
+
+static int check_parsescripttext(PUCHAR start, PUCHAR end, PUCHAR addr, PUCHAR call, int x64)
+{
+	PUCHAR lim, p, callee;
+
+	if (!addr || call < start || end - call < 5 || call[0] != 0xe8 || new_prologue(start, end, call, x64) != addr)
+		return 0;
+	callee = get_rel_target(call);
+	if (callee < start || callee >= end)
+		return 0;
+	lim = end - callee > 0x1000 ? callee + 0x1000 : end;
+	for (p = callee; p < lim; p++)
+		if (references_string(start, end, p, (PUCHAR)"s\0c\0r\0i\0p\0t\0 \0b\0l\0o\0c\0k\0\0", 26, 1, x64) &&
+			new_prologue(start, end, p, x64) == callee)
+			return 1;
+	return 0;
+}
+
+static int check_cdocument_write(PUCHAR start, PUCHAR end, PUCHAR addr, PUCHAR p, int x64)
+{
+	if (!addr || p < start || end - p < 8)
+		return 0;
+	if (x64 ? p[2] != 0x15 || p[7] != 0xe8 : p[5] != 0xe8)
+		return 0;
+	if (!references_string(start, end, p, (PUCHAR)"\r\0\n\0\0", 6, 0, x64))
+		return 0;
+	return new_cdocument_write_of_reference(start, end, p, x64) == addr;
+}
+
+static PUCHAR new_dll_notification(PUCHAR start, PUCHAR end)
+{
+	code_sig_t sig;
+	PUCHAR p;
+	code_sig_parse(&sig, "b8 ?? ?? ?? ?? a3 ?? ?? ?? ?? a3 ?? ?? ?? ?? b8 ?? ?? ?? ?? a3 ?? ?? ?? ?? a3");
+	for (p = start; (p = (PUCHAR)code_sig_find(&sig, p, end)) != NULL; p++) {
+		if (*(unsigned int *)&p[1] == *(unsigned int *)&p[16] + 8)
+			continue;
+		return p;
+	}
+	return NULL;
+}
+
+#define TEXT_SIZE (4 << 20)
+
+typedef struct _planted_t {
+	PUCHAR jseval, parsescripttext, cdocument_write, dll_notification;
+	// the code each of the first three is found through
+	PUCHAR witness[3];
+} planted_t;
+
+// a function at f: its prologue, then filler without prologues, padding or
+// calls, for the planted instructions to go in
+static void plant_function(PUCHAR f, int x64, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		f[i] = 0x40 + rand() % 8;
+	if (x64)
+		memcpy(f - 6, "\x90\x90\x90\x90\x90\xcc", 6);
+	else
+		memcpy(f, "\x8b\xff\x55\x8b\xec", 5);
+}
+
+static void make_text(PUCHAR text, int x64, planted_t *want)
+{
+	PUCHAR evalcode = text + 0x380000, scriptblock = evalcode + 0x40, newline = evalcode + 0x80;
+	PUCHAR f, g, w, p, write;
+	unsigned int i;
+
+	for (i = 0; i < TEXT_SIZE; i++)
+		text[i] = code_byte();
+
+	memcpy(evalcode, "e\0v\0a\0l\0 \0c\0o\0d\0e\0\0", 20);
+	memcpy(scriptblock, "s\0c\0r\0i\0p\0t\0 \0b\0l\0o\0c\0k\0\0", 26);
+	memcpy(newline, "\r\0\n\0\0", 6);
+
+	// JsEval: takes the address of "eval code" partway in
+	f = text + 0x100000;
+	plant_function(f, x64, 0x300);
+	p = f + 0x200;
+	if (x64) {
+		memcpy(p, "\x48\x8d\x05", 3);
+		put_rel(p + 2, evalcode);
+	}
+	else {
+		p[0] = 0x68;
+		*(unsigned int *)&p[1] = (unsigned int)(size_t)evalcode;
+	}
+	want->jseval = f;
+	want->witness[0] = p;
+
+	// COleScript::ParseScriptText: calls the function taking "script block",
+	// which on x86 loads it with a mov
+	f = text + 0x180000;
+	plant_function(f, x64, 0x200);
+	p = f + 0x100;
+	if (x64) {
+		memcpy(p, "\x48\x8d\x0d", 3);
+		put_rel(p + 2, scriptblock);
+	}
+	else {
+		p[0] = 0xbe;
+		*(unsigned int *)&p[1] = (unsigned int)(size_t)scriptblock;
+	}
+	g = text + 0x200000;
+	plant_function(g, x64, 0x200);
+	g[0x80] = 0xe8;
+	put_rel(g + 0x80, f);
+	want->parsescripttext = g;
+	want->witness[1] = g + 0x80;
+
+	// CDocument::writeln: passes "\r\n" on, calling write
+	write = text + 0x60000;
+	w = text + 0x280000;
+	plant_function(w, x64, 0x200);
+	p = w + 0x100;
+	if (x64) {
+		PUCHAR other = text + 0x70000;
+		w[0x20] = 0xe8;
+		put_rel(w + 0x20, other);
+		w[0x40] = 0xe8;
+		put_rel(w + 0x40, write);
+		memcpy(p, "\x48\x8d\x15", 3);
+		put_rel(p + 2, newline);
+		p[7] = 0xe8;
+		put_rel(p + 7, other);
+	}
+	else {
+		p[-6] = 0x56;
+		p[-5] = 0xe8;
+		put_rel(p - 5, write);
+		p[0] = 0x68;
+		*(unsigned int *)&p[1] = (unsigned int)(size_t)newline;
+		p[5] = 0xe8;
+		put_rel(p + 5, text + 0x70000);
+		memcpy(p + 0x30, "\xc2\x08\x00", 3);
+	}
+	want->cdocument_write = write;
+	want->witness[2] = p;
+
+	// ntdll's list heads being set up: RtlpLeakList/RtlpBusyList first,
+	// then the notification list
+	p = text + 0x300000;
+	for (i = 0; i < 2; i++, p += 0x100) {
+		unsigned int addr2 = 0x7ff00000 + i * 0x100, addr1 = i ? 0x7ff10000 : addr2 + 8;
+		p[0] = 0xb8;
+		*(unsigned int *)&p[1] = addr1;
+		p[5] = 0xa3;
+		p[10] = 0xa3;
+		p[15] = 0xb8;
+		*(unsigned int *)&p[16] = addr2;
+		p[20] = 0xa3;
+		p[25] = 0xa3;
+	}
+	want->dll_notification = text + 0x300100;
+}
+
+static double seconds(clock_t t0)
+{
+	return (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+}
+
+int main()
+{
+	static const char *names[] = { "JsEval", "ParseScriptText", "CDocument::write", "dll notification" };
+	PUCHAR text = malloc(TEXT_SIZE), end = text + TEXT_SIZE;
+	unsigned int rounds = 5, i, n;
+	int x64;
+
+	srand(47);
+	check_random();
+
+	for (x64 = 0; x64 < 2; x64++) {
+		planted_t want;
+		PUCHAR old_found[4], new_found[4], wanted[4], witness = NULL;
+		double t_old[4], t_new[4];
+		clock_t t0;
+
+		make_text(text, x64, &want);
+		wanted[0] = want.jseval;
+		wanted[1] = want.parsescripttext;
+		wanted[2] = want.cdocument_write;
+		wanted[3] = want.dll_notification;
+
+		for (i = 0; i < 4; i++) {
+			if (i == 3 && x64)
+				break;
+			t0 = clock();
+			for (n = 0; n < rounds; n++)
+				old_found[i] = i == 0 ? old_jseval(text, end, x64) : i == 1 ? old_parsescripttext(text, end, x64) :
+					i == 2 ? old_cdocument_write(text, end, x64) : old_dll_notification(text, end);
+			t_old[i] = seconds(t0) / rounds;
+			t0 = clock();
+			for (n = 0; n < rounds; n++)
+				new_found[i] = i == 0 ? new_jseval(text, end, x64) : i == 1 ? new_parsescripttext(text, end, x64) :
+					i == 2 ? new_cdocument_write(text, end, x64, &witness) : new_dll_notification(text, end);
+			t_new[i] = seconds(t0) / rounds;
+
+			CHECK(old_found[i] == wanted[i], "%s %s: the old finder got +0x%lx", x64 ? "x64" : "x86", names[i],
+				old_found[i] ? (unsigned long)(old_found[i] - text) : 0);
+			CHECK(new_found[i] == old_found[i], "%s %s: +0x%lx, the old finder +0x%lx", x64 ? "x64" : "x86", names[i],
+				new_found[i] ? (unsigned long)(new_found[i] - text) : 0, old_found[i] ? (unsigned long)(old_found[i] - text) : 0);
+			printf("%s %-17s at +0x%06lx: byte loops %6.2f ms, signatures %6.2f ms (%.1fx)\n", x64 ? "x64" : "x86", names[i],
+				new_found[i] ? (unsigned long)(new_found[i] - text) : 0, t_old[i] * 1e3, t_new[i] * 1e3, t_old[i] / t_new[i]);
+		}
+		CHECK(witness == want.witness[2], "%s CDocument::write: found through +0x%lx", x64 ? "x64" : "x86",
+			witness ? (unsigned long)(witness - text) : 0);
+
+		// what a child does with a plan's answers instead of scanning: the
+		// planted ones check out, anything moved or swapped doesn't
+		for (i = 0; i < 3; i++) {
+			const char *arch = x64 ? "x64" : "x86";
+			int (*check)(PUCHAR, PUCHAR, PUCHAR, PUCHAR, int) = i == 0 ? check_jseval : i == 1 ? check_parsescripttext : check_cdocument_write;
+			PUCHAR w = want.witness[i];
+
+			CHECK(check(text, end, wanted[i], w, x64), "%s %s: the planted answer didn't check out", arch, names[i]);
+			CHECK(!check(text, end, wanted[i] + 0x10, w, x64), "%s %s: a moved address checked out", arch, names[i]);
+			CHECK(!check(text, end, wanted[(i + 1) % 3], w, x64), "%s %s: another function checked out", arch, names[i]);
+			CHECK(!check(text, end, wanted[i], w + 1, x64), "%s %s: a moved witness checked out", arch, names[i]);
+			CHECK(!check(text, end, wanted[i], want.witness[(i + 1) % 3], x64), "%s %s: another's witness checked out", arch, names[i]);
+			CHECK(!check(text, end, wanted[i], text - 0x1000, x64), "%s %s: a witness outside .text checked out", arch, names[i]);
+			t0 = clock();
+			for (n = 0; n < 1000; n++)
+				check(text, end, wanted[i], w, x64);
+			printf("%s %-17s checked in %6.4f ms\n", arch, names[i], seconds(t0));
+		}
+	}
+
+	free(text);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
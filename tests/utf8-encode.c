@@ -0,0 +1,187 @@
+// Checks the vectorised ascii fast path of the utf8 encoders against a
+// plain reference encoder over ascii, latin-1, CJK, surrogate pairs (also
+// split across 16-unit blocks) and unpaired surrogates at every length and
+// alignment, then benchmarks both on typical logged strings.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../utf8_encode.h"
+
+// one code point at a time, straight from the definition
+static int ref_encode_utf16(unsigned char *out, const unsigned short *s, int len)
+{
+	unsigned char *start = out;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned int c = s[i];
+		if (c >= 0xd800 && c < 0xdc00 && i + 1 < len && s[i+1] >= 0xdc00 && s[i+1] < 0xe000)
+			c = 0x10000 + ((c - 0xd800) << 10) + (s[++i] - 0xdc00);
+		if (c < 0x80)
+			*out++ = c;
+		else if (c < 0x800) {
+			*out++ = 0xc0 | (c >> 6);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		else if (c < 0x10000) {
+			*out++ = 0xe0 | (c >> 12);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		else {
+			*out++ = 0xf0 | (c >> 18);
+			*out++ = 0x80 | ((c >> 12) & 0x3f);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+	}
+	return (int)(out - start);
+}
+
+static int ref_encode_ascii(unsigned char *out, const char *s, int len)
+{
+	unsigned char *start = out;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned short c = (unsigned short)(signed char)s[i];
+		if (c < 0x80)
+			*out++ = (unsigned char)c;
+		else {
+			*out++ = 0xe0 | (c >> 12);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+	}
+	return (int)(out - start);
+}
+
+#define MAXLEN 200
+
+static unsigned short random_unit(int kind)
+{
+	int r = rand();
+
+	if (kind == 0 || r % 4)
+		return 0x20 + r % 0x5f;
+	switch (r % 5) {
+	case 0: return 0x80 + r % 0x780;
+	case 1: return 0x800 + r % 0xd000;
+	case 2: return 0xd800 + r % 0x400;	// high surrogate
+	case 3: return 0xdc00 + r % 0x400;	// low surrogate
+	default: return 0xe000 + r % 0x2000;
+	}
+}
+
+static unsigned int check(const unsigned short *w, const char *a, int len, const char *what)
+{
+	unsigned char got[3 * MAXLEN + 16], want[3 * MAXLEN + 16];
+	int n, m, l;
+	unsigned int failures = 0;
+
+	memset(got, 0xcc, sizeof(got));
+	n = utf8_encode_utf16(got, w, len);
+	m = ref_encode_utf16(want, w, len);
+	l = len;
+	if (n != m || memcmp(got, want, n) || utf8_encoded_length_utf16(w, &l) != m || got[n] != 0xcc) {
+		printf("  %s, %d units: utf16 mismatch\n", what, len);
+		failures++;
+	}
+
+	memset(got, 0xcc, sizeof(got));
+	n = utf8_encode_ascii(got, a, len);
+	m = ref_encode_ascii(want, a, len);
+	l = len;
+	if (n != m || memcmp(got, want, n) || utf8_encoded_length_ascii(a, &l) != m || got[n] != 0xcc) {
+		printf("  %s, %d bytes: ansi mismatch\n", what, len);
+		failures++;
+	}
+	return failures;
+}
+
+int main()
+{
+	static unsigned short w[MAXLEN + 1], big_w[4096];
+	static char a[MAXLEN + 1], big_a[4096];
+	static unsigned char out[3 * 4096];
+	unsigned int failures = 0, cases = 0, i, j, len, kind;
+	clock_t t0;
+	double t;
+	int n, l;
+
+	srand(32);
+
+	for (kind = 0; kind < 2; kind++)
+		for (len = 0; len <= MAXLEN; len++)
+			for (i = 0; i < 20; i++, cases++) {
+				for (j = 0; j < len; j++) {
+					w[j] = random_unit(kind);
+					a[j] = (char)(kind ? 1 + rand() % 255 : w[j]);
+				}
+				w[len] = 0;
+				a[len] = 0;
+				failures += check(w, a, len, kind ? "mixed" : "ascii");
+			}
+
+	// a pair at every position, so some straddle a 16-unit block boundary,
+	// and a lone surrogate at the very end
+	for (len = 2; len <= 40; len++)
+		for (i = 0; i + 1 < len; i++, cases++) {
+			for (j = 0; j < len; j++) {
+				w[j] = 'a' + j % 26;
+				a[j] = (char)w[j];
+			}
+			w[i] = 0xd83d;
+			w[i+1] = 0xde00;
+			if (i + 2 < len)
+				w[len-1] = 0xd800;
+			failures += check(w, a, len, "pair");
+		}
+
+	// NUL-terminated lengths
+	for (j = 0; j < 37; j++)
+		w[j] = 'x';
+	w[37] = 0;
+	l = -1;
+	if (utf8_encoded_length_utf16(w, &l) != 37 || l != 37)
+		failures++;
+	printf("%u cases checked against the reference encoder\n", cases);
+
+	// benchmark: typical paths and registry keys, with the odd non-ascii name
+	for (i = 0; i < 4096; i++) {
+		big_w[i] = i % 700 == 699 ? 0xe9 : "C:\\Users\\Admin\\AppData\\Local\\Temp\\HKEY_LOCAL_MACHINE\\SOFTWARE\\"[i % 64];
+		big_a[i] = (char)big_w[i];
+	}
+
+	t0 = clock();
+	for (i = 0, n = 0; i < 20000; i++)
+		n += ref_encode_utf16(out, big_w, 4096) + out[i % 4096];
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("reference utf16: %.1f MB/s (%d)\n", 20000 * 8192.0 / t / (1 << 20), n);
+
+	t0 = clock();
+	for (i = 0, n = 0; i < 20000; i++) {
+		l = 4096;
+		n += utf8_encoded_length_utf16(big_w, &l) + utf8_encode_utf16(out, big_w, 4096) + out[i % 4096];
+	}
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("length + encode utf16: %.1f MB/s (%d)\n", 20000 * 8192.0 / t / (1 << 20), n);
+
+	t0 = clock();
+	for (i = 0, n = 0; i < 20000; i++)
+		n += ref_encode_ascii(out, big_a, 4096) + out[i % 4096];
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("reference ansi: %.1f MB/s (%d)\n", 20000 * 4096.0 / t / (1 << 20), n);
+
+	t0 = clock();
+	for (i = 0, n = 0; i < 20000; i++) {
+		l = 4096;
+		n += utf8_encoded_length_ascii(big_a, &l) + utf8_encode_ascii(out, big_a, 4096) + out[i % 4096];
+	}
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("length + encode ansi: %.1f MB/s (%d)\n", 20000 * 4096.0 / t / (1 << 20), n);
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
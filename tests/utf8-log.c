@@ -0,0 +1,213 @@
+// Checks that log_string/log_wstring, now transcoding straight into space
+// reserved in the bson buffer, produce documents byte-identical to the old
+// utf8_string/utf8_wstring + bson_append_binary path, and compares the
+// allocations and throughput of the two.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../bson/bson.h"
+#include "../utf8_encode.h"
+
+static unsigned long allocations;
+
+static int utf8_wcslen(const unsigned short *w)
+{
+	int len = 0;
+	while (w[len])
+		len++;
+	return len;
+}
+
+static void *counting_malloc(size_t size)
+{
+	allocations++;
+	return malloc(size);
+}
+
+// the previous utf8.c and log.c, with wide strings as 16-bit units
+static int old_utf8_do_encode(unsigned short c, unsigned char *out)
+{
+	if(c < 0x80) {
+		*out = c & 0x7F;
+		return 1;
+	}
+	else if(c < 0x800) {
+		*out = 0xc0 | ((c >> 6) & 0x1F);
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	else {
+		*out = 0xe0 | ((c >> 12) & 0x0F);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+}
+
+static int old_utf8_length(unsigned short x)
+{
+	unsigned char buf[3];
+	return old_utf8_do_encode(x, buf);
+}
+
+static char *old_utf8_string(const char *str, int length)
+{
+	int encoded_length = 0, pos = 4, i;
+	char *utf8string;
+
+	if (length == -1)
+		length = (int)strlen(str);
+	for (i = 0; i < length; i++)
+		encoded_length += old_utf8_length((signed char)str[i]);
+	utf8string = counting_malloc(encoded_length+4);
+	*((int *) utf8string) = encoded_length;
+	while (length-- != 0)
+		pos += old_utf8_do_encode((signed char)*str++, (unsigned char *) &utf8string[pos]);
+	return utf8string;
+}
+
+static char *old_utf8_wstring(const unsigned short *str, int length)
+{
+	int encoded_length = 0, pos = 4, i;
+	char *utf8string;
+
+	if (length == -1)
+		for (length = 0; str[length]; length++);
+	for (i = 0; i < length; i++)
+		encoded_length += old_utf8_length(str[i]);
+	utf8string = counting_malloc(encoded_length+4);
+	*((int *) utf8string) = encoded_length;
+	while (length-- != 0)
+		pos += old_utf8_do_encode(*str++, (unsigned char *) &utf8string[pos]);
+	return utf8string;
+}
+
+static void old_log(bson *b, const char *name, const char *s, const unsigned short *w, int length)
+{
+	char *utf8s = s ? old_utf8_string(s, length) : old_utf8_wstring(w, length);
+	if (bson_append_binary(b, name, BSON_BIN_BINARY, utf8s+4, *(int *)utf8s) == BSON_ERROR)
+		bson_append_string_n(b, name, "", 0);
+	free(utf8s);
+}
+
+// the new log.c
+static void new_log(bson *b, const char *name, const char *s, const unsigned short *w, int length)
+{
+	unsigned char *out;
+
+	if (length == -1)
+		length = s ? (int)strlen(s) : utf8_wcslen(w);
+	out = (unsigned char *)bson_append_binary_begin(b, name, BSON_BIN_BINARY, UTF8_MAX_ENCODED_LENGTH(length));
+	if (out == NULL) {
+		bson_append_string_n(b, name, "", 0);
+		return;
+	}
+	bson_append_binary_end(b, s ? utf8_encode_ascii(out, s, length) : utf8_encode_utf16(out, w, length));
+}
+
+#define STRINGS 2000
+#define MAXLEN 300
+
+static char ansi[STRINGS][MAXLEN + 1];
+static unsigned short wide[STRINGS][MAXLEN + 1];
+static int lengths[STRINGS];
+
+static void make_strings(void)
+{
+	int i, j;
+
+	for (i = 0; i < STRINGS; i++) {
+		int len = rand() % MAXLEN, kind = i % 4;
+		for (j = 0; j < len; j++) {
+			int r = rand();
+			// mostly paths and registry keys, then latin-1 and CJK; surrogates
+			// are left out as pairs are now encoded properly (see utf8-encode.c)
+			if (kind < 2 || r % 8)
+				wide[i][j] = 0x20 + r % 0x5f;
+			else if (kind == 2)
+				wide[i][j] = 0x80 + r % 0x780;
+			else if ((wide[i][j] = 0x800 + r % 0xf000) >= 0xd800)
+				wide[i][j] += 0x800;
+			ansi[i][j] = (char)(kind < 2 ? wide[i][j] : 1 + r % 255);
+		}
+		wide[i][len] = 0;
+		ansi[i][len] = 0;
+		// half the calls pass an explicit length, as log_buffer-style callers do
+		lengths[i] = i % 2 ? -1 : len;
+	}
+}
+
+typedef void (*log_fn)(bson *, const char *, const char *, const unsigned short *, int);
+
+static void build(bson *b, log_fn fn)
+{
+	int i;
+
+	bson_init(b);
+	for (i = 0; i < STRINGS; i++) {
+		fn(b, "0", ansi[i], NULL, lengths[i]);
+		fn(b, "1", NULL, wide[i], lengths[i]);
+	}
+	bson_finish(b);
+}
+
+// one small document per logged call, as the logger builds them
+static double bench(log_fn fn, int rounds, size_t *bytes)
+{
+	clock_t t0 = clock();
+	bson b;
+	int r, i;
+
+	*bytes = 0;
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < STRINGS; i++) {
+			bson_init(&b);
+			fn(&b, "0", ansi[i], NULL, lengths[i]);
+			fn(&b, "1", NULL, wide[i], lengths[i]);
+			bson_finish(&b);
+			*bytes += bson_size(&b);
+			bson_destroy(&b);
+		}
+	return (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+}
+
+int main()
+{
+	bson a, b;
+	unsigned int failures = 0;
+	unsigned long old_allocs, new_allocs;
+	size_t old_bytes, new_bytes;
+	double t_old, t_new;
+	int rounds = 50;
+
+	srand(31);
+	make_strings();
+
+	build(&a, old_log);
+	build(&b, new_log);
+	if (bson_size(&a) != bson_size(&b) || memcmp(bson_data(&a), bson_data(&b), bson_size(&a))) {
+		printf("  documents differ (%d vs %d bytes)\n", bson_size(&a), bson_size(&b));
+		failures++;
+	}
+	else
+		printf("%d ansi and %d wide strings: documents identical (%d bytes)\n", STRINGS, STRINGS, bson_size(&a));
+	bson_destroy(&a);
+	bson_destroy(&b);
+
+	allocations = 0;
+	t_old = bench(old_log, rounds, &old_bytes);
+	old_allocs = allocations;
+
+	allocations = 0;
+	t_new = bench(new_log, rounds, &new_bytes);
+	new_allocs = allocations;
+
+	printf("utf8_string + bson_append_binary: %lu temporary allocations, %.1f MB/s\n", old_allocs, old_bytes / t_old / (1 << 20));
+	printf("bson_append_binary_begin/end:     %lu temporary allocations, %.1f MB/s\n", new_allocs, new_bytes / t_new / (1 << 20));
+	if (new_allocs || new_bytes != old_bytes)
+		failures++;
+
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,138 @@
+// Checks the known-plaintext XOR PE finder used by DumpXorPE on a corpus of
+// PE headers encoded with single-byte and 2/4/8-byte rolling keys, compares
+// it with the brute-force loop over all 256 single-byte keys and benchmarks
+// the two.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../CAPE/XorScan.h"
+
+// DOS header and stub as written by the Microsoft linker
+static const unsigned char dos_header[0x80] = {
+	0x4d, 0x5a, 0x90, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00,
+	0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe8, 0x00, 0x00, 0x00,
+	0x0e, 0x1f, 0xba, 0x0e, 0x00, 0xb4, 0x09, 0xcd, 0x21, 0xb8, 0x01, 0x4c, 0xcd, 0x21, 'T', 'h',
+	'i', 's', ' ', 'p', 'r', 'o', 'g', 'r', 'a', 'm', ' ', 'c', 'a', 'n', 'n', 'o',
+	't', ' ', 'b', 'e', ' ', 'r', 'u', 'n', ' ', 'i', 'n', ' ', 'D', 'O', 'S', ' ',
+	'm', 'o', 'd', 'e', '.', 0x0d, 0x0d, 0x0a, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define IMAGE_SIZE 0x400
+
+static void make_image(unsigned char *img)
+{
+	int i;
+	for (i = 0; i < IMAGE_SIZE; i++)
+		img[i] = rand() & 0xff;
+	memcpy(img, dos_header, sizeof(dos_header));
+	memset(img + 0x80, 0, 0x68);
+	memcpy(img + 0xe8, "PE\0\0\x4c\x01\x03\x00", 8);
+}
+
+// the loop DumpXorPE used to run, extended to every offset
+static int brute_force(const unsigned char *buf, size_t size, size_t *offset, unsigned char *key)
+{
+	unsigned int k;
+	size_t p, best = size;
+
+	for (k = 1; k <= 0xff; k++) {
+		for (p = 0; p + 0x40 <= size && p < best; p++) {
+			size_t e_lfanew;
+			int i;
+			if ((buf[p] ^ k) != 'M' || (buf[p+1] ^ k) != 'Z')
+				continue;
+			for (e_lfanew = 0, i = 0; i < 4; i++)
+				e_lfanew |= (size_t)(buf[p + 0x3c + i] ^ k) << (8 * i);
+			if (!e_lfanew || e_lfanew > size - p - 4)
+				continue;
+			if ((buf[p+e_lfanew] ^ k) != 'P' || (buf[p+e_lfanew+1] ^ k) != 'E' || buf[p+e_lfanew+2] != k || buf[p+e_lfanew+3] != k)
+				continue;
+			best = p;
+			*key = k;
+		}
+	}
+	*offset = best;
+	return best < size;
+}
+
+int main()
+{
+	size_t size = 0x20000, big = 32 << 20, off, bf_off;
+	unsigned char *buf = malloc(big), img[IMAGE_SIZE], check[IMAGE_SIZE], bf_key;
+	unsigned int round, lengths[] = {1, 2, 4, 8}, failures = 0, found[4] = {0}, agree = 0;
+	XORSCAN_KEY key;
+	clock_t t0;
+	double t;
+
+	srand(4242);
+
+	for (round = 0; round < 400; round++) {
+		unsigned int len = lengths[round % 4], i;
+		size_t at = rand() % (size - IMAGE_SIZE);
+		unsigned char k[8];
+
+		for (i = 0; i < size; i++)
+			buf[i] = rand() & 0xff;
+		for (i = 0; i < len; i++)
+			k[i] = 1 + rand() % 255;
+		make_image(img);
+		// the whole buffer is encoded from its start, so the image sits at
+		// an arbitrary key phase
+		for (i = 0; i < IMAGE_SIZE; i++)
+			buf[at + i] = img[i] ^ k[(at + i) % len];
+
+		if (!XorScanFindPE(buf, size, 0, &off, &key) || off != at) {
+			printf("  round %u: %u-byte key, image at 0x%zx not found\n", round, len, at);
+			failures++;
+			continue;
+		}
+		XorScanDecode(check, buf + off, IMAGE_SIZE, &key);
+		if (memcmp(check, img, IMAGE_SIZE)) {
+			printf("  round %u: %u-byte key, wrong key derived\n", round, len);
+			failures++;
+			continue;
+		}
+		found[round % 4]++;
+
+		if (len == 1 && round < 40) {
+			if (brute_force(buf, size, &bf_off, &bf_key) && bf_off == off && bf_key == key.Bytes[0])
+				agree++;
+			else
+				failures++;
+		}
+	}
+	printf("found: %u/100 single-byte, %u/100 2-byte, %u/100 4-byte, %u/100 8-byte keys\n", found[0], found[1], found[2], found[3]);
+	printf("brute force agrees on %u/10 single-byte rounds\n", agree);
+
+	// plain images are not XOR-encoded
+	make_image(img);
+	memcpy(buf, img, IMAGE_SIZE);
+	key.Length = 0;
+	if (XorScanFindPE(buf, IMAGE_SIZE, 0, &off, &key) && off == 0) {
+		printf("  plain image reported as XOR-encoded\n");
+		failures++;
+	}
+
+	// benchmark: a large buffer with an encoded image at the very end
+	for (off = 0; off < big; off++)
+		buf[off] = rand() & 0xff;
+	for (off = 0; off < IMAGE_SIZE; off++)
+		buf[big - IMAGE_SIZE + off] = img[off] ^ 0x5a;
+
+	t0 = clock();
+	brute_force(buf, big, &bf_off, &bf_key);
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("brute force, 256 keys: %.1f MB/s (found at 0x%zx)\n", (big >> 20) / t, bf_off);
+
+	t0 = clock();
+	XorScanFindPE(buf, big, 0, &off, &key);
+	t = (double)(clock() - t0 + 1) / CLOCKS_PER_SEC;
+	printf("key recovery, 1/2/4/8-byte keys: %.1f MB/s (found at 0x%zx)\n", (big >> 20) / t, off);
+
+	free(buf);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,117 @@
+// Exercises the YaraScan clean-region cache with a stand-in scanner: repeated
+// scans of unchanged regions without hits must be answered from the cache,
+// while regions with hits, and rewritten, resized or invalidated regions,
+// must be rescanned.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../CAPE/ScanCache.h"
+
+static const char *rules[] = {"Marker_A", "Marker_B", "Marker_C"};
+static unsigned int scans;
+
+// stands in for yr_rules_scan_mem: each rule matches its own identifier
+static unsigned int stand_in_scan(const unsigned char *buf, size_t size)
+{
+	unsigned int i, count = 0;
+	scans++;
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+		size_t n = strlen(rules[i]), p;
+		for (p = 0; p + n <= size; p++)
+			if (!memcmp(buf + p, rules[i], n)) {
+				count++;
+				break;
+			}
+	}
+	return count;
+}
+
+static SCAN_CACHE cache;
+
+// mirrors the flow in YaraScan: only clean scans are stored
+static unsigned int cached_scan(const unsigned char *buf, size_t size)
+{
+	uint64_t hash = ScanCacheHash(buf, size);
+	unsigned int count;
+
+	if (ScanCacheLookup(&cache, (uintptr_t)buf, size, hash))
+		return 0;
+	count = stand_in_scan(buf, size);
+	if (!count)
+		ScanCacheStore(&cache, (uintptr_t)buf, size, hash);
+	return count;
+}
+
+static int failures;
+
+static void expect(const char *what, int cond)
+{
+	printf("%-50s %s\n", what, cond ? "ok" : "FAILED");
+	if (!cond)
+		failures++;
+}
+
+int main()
+{
+	size_t size = 1 << 20, i;
+	unsigned char *region = calloc(1, size), *regions[SCAN_CACHE_ENTRIES + 8];
+	unsigned int n, before;
+	clock_t t0;
+
+	ScanCacheInit(&cache);
+
+	n = cached_scan(region, size);
+	expect("first scan runs the scanner", scans == 1 && n == 0);
+	n = cached_scan(region, size);
+	expect("unchanged clean region answered from cache", scans == 1 && n == 0);
+
+	memcpy(region + 0x1234, "Marker_A", 8);
+	memcpy(region + 0x8000, "Marker_C", 8);
+	n = cached_scan(region, size);
+	expect("rewritten content is rescanned", scans == 2 && n == 2);
+	n = cached_scan(region, size);
+	expect("a region with hits is never cached", scans == 3 && n == 2);
+
+	region[0x1234] = 'X';
+	region[0x8000] = 'X';
+	n = cached_scan(region, size);
+	expect("... until it scans clean", scans == 4 && n == 0);
+	cached_scan(region, size);
+	expect("... and is then cached", scans == 4);
+
+	n = cached_scan(region, size / 2);
+	expect("different size is a separate entry", scans == 5 && n == 0);
+	n = cached_scan(region, size / 2);
+	expect("... and is itself cached", scans == 5);
+
+	expect("invalidation drops overlapping entries", ScanCacheInvalidate(&cache, (uintptr_t)region + 0x10, 4) == 2);
+	cached_scan(region, size);
+	expect("invalidated region is rescanned", scans == 6);
+	expect("invalidation outside the region drops nothing", ScanCacheInvalidate(&cache, (uintptr_t)region + size, 0x1000) == 0);
+
+	// LRU replacement: fill the table, keep touching the first region
+	for (i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+		regions[i] = calloc(1, 0x1000);
+		cached_scan(regions[i], 0x1000);
+		cached_scan(region, size);
+	}
+	before = scans;
+	cached_scan(region, size);
+	expect("recently used entry survives eviction", scans == before);
+	cached_scan(regions[0], 0x1000);
+	expect("least recently used entry was evicted", scans == before + 1);
+
+	// cost of a hit (hash) against a miss (stand-in scan) over 1MB
+	t0 = clock();
+	for (i = 0; i < 200; i++)
+		cached_scan(region, size);
+	printf("cached lookups: %.1f MB/s\n", 200.0 / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC));
+	t0 = clock();
+	for (i = 0; i < 5; i++)
+		stand_in_scan(region, size);
+	printf("stand-in scans: %.1f MB/s\n", 5.0 / ((double)(clock() - t0 + 1) / CLOCKS_PER_SEC));
+	printf("hits %u, misses %u, invalidations %u\n", cache.Hits, cache.Misses, cache.Invalidations);
+
+	return failures != 0;
+}
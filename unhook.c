@@ -287,6 +287,8 @@ static DWORD WINAPI _terminate_event_thread(LPVOID param)
 
 	file_handle_terminate();
 
+	hook_stats_report();
+
 	if (g_config.yarascan)
 		YaraShutdown();
 
@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <windows.h>
 #include "alloc.h"
 #include "utf8.h"
+#include "utf8_encode.h"
 
 int utf8_do_encode(unsigned short c, unsigned char *out)
 {
@@ -48,46 +49,23 @@ int utf8_length(unsigned short x)
 
 int utf8_strlen_ascii(const char *s, int len)
 {
-	int ret = 0;
-
-	if(len < 0)
-		len = (int)strlen(s);
-
-	while (len-- != 0) {
-		ret += utf8_length(*s++);
-	}
-	return ret;
+	return utf8_encoded_length_ascii(s, &len);
 }
 
 int utf8_strlen_unicode(const wchar_t *s, int len)
 {
-	int ret = 0;
-
-	if(len < 0)
-		len = lstrlenW(s);
-
-	while (len-- != 0) {
-		ret += utf8_length(*s++);
-	}
-	return ret;
+	return utf8_encoded_length_utf16((const unsigned short *)s, &len);
 }
 
 char * utf8_string(const char *str, int length)
 {
 	int encoded_length;
 	char *utf8string;
-	int pos = 4;
 
-	if (length == -1)
-		length = (int)strlen(str);
-
-	encoded_length = utf8_strlen_ascii(str, length);
+	encoded_length = utf8_encoded_length_ascii(str, &length);
 	utf8string = (char *) malloc(encoded_length+4);
 	*((int *) utf8string) = encoded_length;
-
-	while (length-- != 0) {
-		pos += utf8_do_encode(*str++, (unsigned char *) &utf8string[pos]);
-	}
+	utf8_encode_ascii((unsigned char *) &utf8string[4], str, length);
 	return utf8string;
 }
 
@@ -95,15 +73,10 @@ char * utf8_wstring(const wchar_t *str, int length)
 {
 	int encoded_length;
 	char *utf8string;
-	int pos = 4;
-	if (length == -1) length = lstrlenW(str);
-	
-	encoded_length = utf8_strlen_unicode(str, length);
+
+	encoded_length = utf8_encoded_length_utf16((const unsigned short *)str, &length);
 	utf8string = (char *) malloc(encoded_length+4);
 	*((int *) utf8string) = encoded_length;
-
-	while (length-- != 0) {
-		pos += utf8_do_encode(*str++, (unsigned char *) &utf8string[pos]);
-	}
+	utf8_encode_utf16((unsigned char *) &utf8string[4], (const unsigned short *)str, length);
 	return utf8string;
 }
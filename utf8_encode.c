@@ -0,0 +1,186 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "utf8_encode.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF8_SSE2
+#endif
+
+// Nearly everything logged is plain ascii (paths, registry keys, api names,
+// urls), so both encoders move 16 ascii units at a time and only drop to the
+// scalar encoder for the stretch holding a non-ascii unit, picking the
+// vector loop up again at the next multiple of 16 units.
+
+#define IS_HIGH_SURROGATE(c) ((c) >= 0xd800 && (c) <= 0xdbff)
+#define IS_LOW_SURROGATE(c) ((c) >= 0xdc00 && (c) <= 0xdfff)
+
+#ifdef UTF8_SSE2
+// nonzero if any of the 16 units at s is 0x80 or above
+static __inline int utf16_block_has_non_ascii(const unsigned short *s)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)s);
+	__m128i b = _mm_loadu_si128((const __m128i *)(s + 8));
+	__m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xff80));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff;
+}
+#endif
+
+int utf8_encoded_length_ascii(const char *s, int *len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	int i = 0, ret;
+
+	if (*len < 0)
+		*len = (int)strlen(s);
+
+	ret = *len;
+#ifdef UTF8_SSE2
+	for (; i + 16 <= *len; i += 16) {
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+		while (mask) {
+			ret += 2;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i < *len; i++) {
+		if (p[i] & 0x80)
+			ret += 2;
+	}
+	return ret;
+}
+
+int utf8_encoded_length_utf16(const unsigned short *s, int *len)
+{
+	int i = 0, ret;
+
+	if (*len < 0) {
+		for (i = 0; s[i]; i++);
+		*len = i;
+		i = 0;
+	}
+
+	ret = *len;
+	while (i < *len) {
+#ifdef UTF8_SSE2
+		while (i + 16 <= *len && !utf16_block_has_non_ascii(s + i))
+			i += 16;
+#endif
+		while (i < *len) {
+			unsigned short c = s[i];
+			if (c >= 0x800) {
+				if (IS_HIGH_SURROGATE(c) && i + 1 < *len && IS_LOW_SURROGATE(s[i+1])) {
+					// two units, four bytes
+					ret += 2;
+					i++;
+				}
+				else
+					ret += 2;
+			}
+			else if (c >= 0x80)
+				ret++;
+			i++;
+			if (!(i & 15))
+				break;
+		}
+	}
+	return ret;
+}
+
+int utf8_encode_ascii(unsigned char *out, const char *s, int len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned char *start = out;
+	int i = 0;
+
+	while (i < len) {
+#ifdef UTF8_SSE2
+		while (i + 16 <= len) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			if (_mm_movemask_epi8(v))
+				break;
+			_mm_storeu_si128((__m128i *)out, v);
+			out += 16;
+			i += 16;
+		}
+#endif
+		while (i < len) {
+			unsigned char c = p[i++];
+			if (c < 0x80) {
+				*out++ = c;
+			}
+			else {
+				// 0xff00 | c encoded as three bytes
+				*out++ = 0xef;
+				*out++ = 0xbc | (c >> 6);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+			if (!(i & 15))
+				break;
+		}
+	}
+	return (int)(out - start);
+}
+
+int utf8_encode_utf16(unsigned char *out, const unsigned short *s, int len)
+{
+	unsigned char *start = out;
+	int i = 0;
+
+	while (i < len) {
+#ifdef UTF8_SSE2
+		while (i + 16 <= len && !utf16_block_has_non_ascii(s + i)) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + i + 8));
+			_mm_storeu_si128((__m128i *)out, _mm_packus_epi16(a, b));
+			out += 16;
+			i += 16;
+		}
+#endif
+		while (i < len) {
+			unsigned int c = s[i++];
+			if (c < 0x80) {
+				*out++ = (unsigned char)c;
+			}
+			else if (c < 0x800) {
+				*out++ = 0xc0 | (c >> 6);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+			else if (IS_HIGH_SURROGATE(c) && i < len && IS_LOW_SURROGATE(s[i])) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (s[i++] - 0xdc00);
+				*out++ = 0xf0 | (c >> 18);
+				*out++ = 0x80 | ((c >> 12) & 0x3f);
+				*out++ = 0x80 | ((c >> 6) & 0x3f);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+			else {
+				// includes unpaired surrogates, which have no proper encoding
+				*out++ = 0xe0 | (c >> 12);
+				*out++ = 0x80 | ((c >> 6) & 0x3f);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+			if (!(i & 15))
+				break;
+		}
+	}
+	return (int)(out - start);
+}
@@ -0,0 +1,38 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2014 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Encoders behind utf8_string/utf8_wstring that write into a buffer the
+// caller supplies, so the logger can transcode straight into its bson
+// buffer. Kept free of Windows headers so they can be tested on the build
+// host; wide strings are taken as 16-bit code units.
+//
+// Surrogate pairs are encoded as one four-byte sequence; an unpaired
+// surrogate is encoded on its own as three bytes. Ansi bytes above 0x7f are
+// encoded as the sign-extended unit a signed char gives, as the logger has
+// always done.
+
+// a len of -1 means the string is NUL-terminated; *len is then set to its length
+int utf8_encoded_length_ascii(const char *s, int *len);
+int utf8_encoded_length_utf16(const unsigned short *s, int *len);
+
+// the most bytes len code units (or ansi bytes) can encode to
+#define UTF8_MAX_ENCODED_LENGTH(len) ((size_t)(len) * 3)
+
+// out must have room for the encoded length; returns the bytes written
+int utf8_encode_ascii(unsigned char *out, const char *s, int len);
+int utf8_encode_utf16(unsigned char *out, const unsigned short *s, int len);